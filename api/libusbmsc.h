@@ -24,6 +24,7 @@
 #ifndef LIBUSBMSC_H
 # define LIBUSBMSC_H
 
+#include "autoconf.h"
 #include "libusbctrl.h"
 
 /*********************************************************************************
@@ -44,6 +45,17 @@
  * SCSI stack implementation
  */
 
+/*
+ * SCSI logical block address. LBAs and capacities are 64 bits long when the
+ * storage may hold more than 2^32 blocks, 32 bits long otherwise, which
+ * lightens the data path on small targets.
+ */
+#if CONFIG_USR_LIB_MASSSTORAGE_LBA64
+typedef uint64_t usbmsc_lba_t;
+#else
+typedef uint32_t usbmsc_lba_t;
+#endif
+
 /*****************************************************
  * externally supplied implementations prototypes
  *
@@ -78,7 +90,25 @@
  *
  * \return 0 on success
  */
-mbed_error_t usbmsc_storage_backend_read(uint32_t sector_addr, uint32_t num_sectors);
+mbed_error_t usbmsc_storage_backend_read(usbmsc_lba_t sector_addr, uint32_t num_sectors);
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_BUF
+/*
+ * \brief Read data from the storage backend into a given buffer
+ *
+ * Replaces usbmsc_storage_backend_read() when the backend is given the
+ * buffer address. buf is always inside the buffer declared with
+ * usbmsc_declare(), but not necessarily at its beginning.
+ *
+ * \param sector_addr SCSI sector address where the data must be read
+ * \param num_sectors number of sectors to read
+ * \param buf         buffer to fill, of num_sectors blocks length
+ *
+ * \return 0 on success
+ */
+mbed_error_t usbmsc_storage_backend_read_buf(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                             uint8_t *buf);
+#endif
 
 /*
  * \brief Write data to the storage backend
@@ -88,7 +118,153 @@ mbed_error_t usbmsc_storage_backend_read(uint32_t sector_addr, uint32_t num_sect
  *
  * \return 0 on success
  */
-mbed_error_t usbmsc_storage_backend_write(uint32_t sector_addr, uint32_t num_sectors);
+mbed_error_t usbmsc_storage_backend_write(usbmsc_lba_t sector_addr, uint32_t num_sectors);
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_BUF
+/*
+ * \brief Write data from a given buffer to the storage backend
+ *
+ * Replaces usbmsc_storage_backend_write() when the backend is given the
+ * buffer address. buf is always inside the buffer declared with
+ * usbmsc_declare(), but not necessarily at its beginning.
+ *
+ * \param sector_addr SCSI sector address where the data must be written
+ * \param num_sectors number of sectors to write
+ * \param buf         buffer holding the data, of num_sectors blocks length
+ *
+ * \return 0 on success
+ */
+mbed_error_t usbmsc_storage_backend_write_buf(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                              uint8_t *buf);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+/*
+ * \brief Start reading data from the storage backend into a given buffer
+ *
+ * Replaces usbmsc_storage_backend_read_buf() with an asynchronous backend.
+ * The function returns as soon as the request is accepted. The backend then
+ * calls usbmsc_storage_backend_complete() once the buffer has been filled.
+ * If the request is refused (error returned), the completion must not be
+ * notified.
+ *
+ * \param sector_addr SCSI sector address where the data must be read
+ * \param num_sectors number of sectors to read
+ * \param buf         buffer to fill, of num_sectors blocks length
+ *
+ * \return 0 if the request is accepted
+ */
+mbed_error_t usbmsc_storage_backend_read_submit(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                                uint8_t *buf);
+
+/*
+ * \brief Start writing data from a given buffer to the storage backend
+ *
+ * Replaces usbmsc_storage_backend_write_buf() with an asynchronous backend.
+ * The buffer content must not be modified by the backend and is kept
+ * unchanged by the stack until the completion is notified.
+ *
+ * \param sector_addr SCSI sector address where the data must be written
+ * \param num_sectors number of sectors to write
+ * \param buf         buffer holding the data, of num_sectors blocks length
+ *
+ * \return 0 if the request is accepted
+ */
+mbed_error_t usbmsc_storage_backend_write_submit(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                                 uint8_t *buf);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_VERIFY
+/*
+ * \brief Check that sectors of the storage backend are readable
+ *
+ * Called on VERIFY commands without data comparison. The backend checks the
+ * medium (e.g. ECC status) without transferring the data to the USB MSC stack.
+ * The function is only called from the main thread, and never while a backend
+ * request is in progress.
+ *
+ * \param sector_addr SCSI sector address of the first sector to check
+ * \param num_sectors number of sectors to check
+ *
+ * \return 0 if all the sectors are readable
+ */
+mbed_error_t usbmsc_storage_backend_verify(usbmsc_lba_t sector_addr, uint32_t num_sectors);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP
+/*
+ * \brief Discard data from the storage backend
+ *
+ * Called on UNMAP commands: the host doesn't use the given sectors anymore,
+ * their content doesn't need to be kept (e.g. flash garbage collection).
+ * Reading them afterwards may return any data. The function is only called
+ * from the main thread, and never while a backend request is in progress.
+ *
+ * \param sector_addr SCSI sector address of the first discarded sector
+ * \param num_sectors number of discarded sectors
+ *
+ * \return 0 on success
+ */
+mbed_error_t usbmsc_storage_backend_discard(usbmsc_lba_t sector_addr, uint32_t num_sectors);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME_ZEROES
+/*
+ * \brief Fill sectors of the storage backend with zeros
+ *
+ * Called on WRITE SAME commands writing zeros, instead of writing zeroed
+ * buffers with the write functions above. The function is only called from
+ * the main thread, and never while a backend request is in progress.
+ *
+ * \param sector_addr SCSI sector address of the first sector to zero
+ * \param num_sectors number of sectors to zero
+ *
+ * \return 0 on success
+ */
+mbed_error_t usbmsc_storage_backend_write_zeroes(usbmsc_lba_t sector_addr, uint32_t num_sectors);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+/*
+ * \brief Map a storage backend memory area for a data phase
+ *
+ * Used by the zero-copy data path instead of the read and write functions
+ * above. The backend returns the address of a memory area which holds (read)
+ * or will receive (write) the content of the given sectors. This area is given
+ * as is to the USB driver, no data is copied by the USB MSC stack.
+ * The backend may map less sectors than requested, but at least one. The stack
+ * maps the following sectors later. At most two areas are mapped at the same
+ * time.
+ *
+ * \param sector_addr    SCSI sector address of the first sector to map
+ * \param num_sectors    number of sectors requested
+ * \param write          true if the area will receive data from the host
+ * \param buf            address of the mapped area
+ * \param mapped_sectors number of sectors effectively mapped
+ *
+ * \return 0 on success
+ */
+mbed_error_t usbmsc_storage_backend_map(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                        bool write, uint8_t **buf,
+                                        uint32_t *mapped_sectors);
+
+/*
+ * \brief Release a memory area given by usbmsc_storage_backend_map()
+ *
+ * For areas mapped for write, this commits the received data to the storage.
+ * num_sectors is 0 when the area must be released without being committed,
+ * because the command is aborted.
+ *
+ * \param sector_addr SCSI sector address of the first sector mapped
+ * \param num_sectors number of sectors to commit
+ * \param write       true if the area was mapped for write
+ * \param buf         address of the mapped area
+ *
+ * \return 0 on success
+ */
+mbed_error_t usbmsc_storage_backend_unmap(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                          bool write, uint8_t *buf);
+#endif
 
 /*
  * \brief get back the backend storage capacity
@@ -98,7 +274,21 @@ mbed_error_t usbmsc_storage_backend_write(uint32_t sector_addr, uint32_t num_sec
  *
  * \return 0 on success
  */
+#if !CONFIG_USR_LIB_MASSSTORAGE_LBA64
 mbed_error_t usbmsc_storage_backend_capacity(uint32_t *numblocks, uint32_t *blocksize);
+#else
+/*
+ * \brief get back the backend storage capacity, for storages bigger than 2^32 blocks
+ *
+ * Replaces usbmsc_storage_backend_capacity() when 64 bits LBAs are used.
+ *
+ * \param numblock number of SCSI blocks
+ * \param blocksize size of one SCSI block
+ *
+ * \return 0 on success
+ */
+mbed_error_t usbmsc_storage_backend_capacity64(uint64_t *numblocks, uint32_t *blocksize);
+#endif
 
 
 /*
@@ -133,7 +323,7 @@ void usbmsc_reset_stack(void);
   @ disjoint behaviors;
   @ complete behaviors;
   */
-mbed_error_t usbmsc_declare(uint8_t * buf, uint16_t len);
+mbed_error_t usbmsc_declare(uint8_t * buf, uint32_t len);
 
 /*@
   @ assigns GHOST_opaque_usbmsc_privates;
@@ -159,4 +349,328 @@ void usbmsc_reinit(void);
   */
 mbed_error_t usbmsc_exec_automaton(void);
 
+/*
+ * \brief size of the data chunks of the READ and WRITE commands
+ *
+ * Each chunk is read from or written to the storage backend with a single
+ * backend call, and exchanged with the host with a single USB transfer.
+ * The chunk size depends on the declared buffer length, on the data path
+ * and on the block size of the storage.
+ *
+ * \return the chunk size in bytes, or 0 if the block size is not known yet
+ *  (no READ CAPACITY received), if the buffer can't hold a single block, or
+ *  with the zero-copy data path, where chunks are mapped by the backend.
+ */
+/*@
+  @ assigns \nothing;
+  */
+uint32_t usbmsc_get_chunk_size(void);
+
+/*
+ * \brief signal a media change to the host
+ *
+ * The storage geometry returned by the backend capacity function is cached
+ * by the stack, even across Mass Storage resets. This function must be called
+ * when the media is changed (e.g. a card is swapped), so that the geometry is
+ * requested again to the backend, and a UNIT ATTENTION (MEDIUM MAY HAVE
+ * CHANGED) is reported to the host. This function can be called from an ISR.
+ */
+/*@
+  @ assigns GHOST_opaque_usbmsc_privates;
+  */
+void usbmsc_media_changed(void);
+
+/*
+ * \brief signal a media change of a single LUN to the host
+ *
+ * Same as usbmsc_media_changed(), for the given LUN only. The other LUNs
+ * keep their geometry. This function can be called from an ISR.
+ *
+ * \return MBED_ERROR_INVPARAM if lun is not lower than
+ *  CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS
+ */
+/*@
+  @ assigns GHOST_opaque_usbmsc_privates;
+  */
+mbed_error_t usbmsc_lun_media_changed(uint8_t lun);
+
+/*
+ * \brief get the LUN addressed by the host
+ *
+ * All the LUNs share the same backend functions, which call this function
+ * to select the storage to access. The returned LUN is the one of the command
+ * being executed, in [0, CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS[. When the
+ * automaton is idle, the backend may still be called for the LUN whose media
+ * was last accessed (read-ahead, gathered writes flush), and this function
+ * returns it.
+ * Always 0 when a single LUN is configured.
+ */
+/*@
+  @ assigns \nothing;
+  */
+uint8_t usbmsc_get_lun(void);
+
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+/*
+ * \brief declare the read-ahead buffer
+ *
+ * Sectors following a sequential READ stream are prefetched in this buffer
+ * while the stack is idle, and sent from it to the host. As the USB transfers
+ * are made from this buffer, it has the same constraints as the buffer given
+ * to usbmsc_declare(). It should be a multiple of the host READ size.
+ *
+ * \param buf the read-ahead buffer
+ * \param len the read-ahead buffer length in bytes
+ *
+ * \return MBED_ERROR_INVPARAM if buf is NULL or len is 0
+ */
+/*@
+  @ assigns GHOST_opaque_usbmsc_privates;
+  */
+mbed_error_t usbmsc_declare_readahead(uint8_t *buf, uint32_t len);
+
+/*
+ * \brief get back the read-ahead counters
+ *
+ * \param hits number of READ commands served (at least partially) from the
+ *  read-ahead buffer
+ * \param misses number of READ commands served from the storage backend only
+ */
+/*@
+  @ requires \valid(hits) && \valid(misses);
+  @ assigns *hits, *misses;
+  */
+void usbmsc_readahead_get_stats(uint32_t *hits, uint32_t *misses);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+/*
+ * \brief declare the write cache buffer
+ *
+ * Sectors written by the host are kept in this buffer, one cache line per
+ * sector, until they are flushed to the storage backend. The buffer is given
+ * to the backend write function, and has the same constraints as the buffer
+ * given to usbmsc_declare().
+ *
+ * \param buf the write cache buffer
+ * \param len the write cache buffer length in bytes
+ *
+ * \return MBED_ERROR_INVPARAM if buf is NULL or len is 0
+ */
+/*@
+  @ assigns GHOST_opaque_usbmsc_privates;
+  */
+mbed_error_t usbmsc_declare_write_cache(uint8_t *buf, uint32_t len);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+/*
+ * \brief drop blocks from the sector cache
+ *
+ * To be called when the application modifies the storage content by itself,
+ * from the thread executing usbmsc_exec_automaton().
+ *
+ * \param lba the first block to drop
+ * \param num_blocks the number of blocks to drop
+ */
+/*@
+  @ assigns GHOST_opaque_usbmsc_privates;
+  */
+void usbmsc_sector_cache_invalidate(usbmsc_lba_t lba, uint32_t num_blocks);
+
+/*
+ * \brief get back the sector cache counters
+ *
+ * Only the READ commands small enough to be cached are counted.
+ *
+ * \param hits number of READ commands served from the sector cache
+ * \param misses number of READ commands served from the storage backend
+ */
+/*@
+  @ requires \valid(hits) && \valid(misses);
+  @ assigns *hits, *misses;
+  */
+void usbmsc_sector_cache_get_stats(uint32_t *hits, uint32_t *misses);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+/*
+ * \brief notify the end of a request submitted to the storage backend
+ *
+ * Called by an asynchronous storage backend once the request submitted with
+ * usbmsc_storage_backend_read_submit() or usbmsc_storage_backend_write_submit()
+ * is finished. This function can be called from an ISR, or from the submit
+ * function itself if the request is executed immediately.
+ *
+ * \param status 0 if the request succeeded, the backend error otherwise
+ */
+void usbmsc_storage_backend_complete(mbed_error_t status);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+/*
+ * Runtime statistics of the stack, since its initialization or the last
+ * usbmsc_reset_stats() call.
+ */
+typedef struct {
+    uint32_t commands[256];         /* executed commands, per opcode */
+    uint64_t bytes_read;            /* data sent by successful READ commands */
+    uint64_t bytes_written;         /* data received by successful WRITE commands */
+    uint32_t backend_read_errors;   /* failed backend read, map and verify requests */
+    uint32_t backend_write_errors;  /* failed backend write, unmap, discard and
+                                       write zeroes requests */
+    uint32_t sense_keys[16];        /* CHECK CONDITION statuses, per sense key */
+    uint32_t resets;                /* Mass Storage Resets (UAS: USB resets) */
+    uint32_t dropped_queue_full;    /* commands dropped, command queue full */
+    uint32_t dropped_reset;         /* received commands dropped by a reset */
+    uint64_t usb_wait_us;           /* time waiting for data phase transfers */
+    uint64_t backend_wait_us;       /* time waiting for asynchronous backend requests */
+} usbmsc_stats_t;
+
+/*
+ * \brief get back the runtime statistics of the stack
+ *
+ * This function must be called from the thread executing
+ * usbmsc_exec_automaton(). The counters updated in ISR context (resets,
+ * dropped commands) may be one event late.
+ *
+ * \param stats the statistics
+ *
+ * \return MBED_ERROR_INVPARAM if stats is NULL
+ */
+/*@
+  @ assigns *stats;
+  */
+mbed_error_t usbmsc_get_stats(usbmsc_stats_t *stats);
+
+/*
+ * \brief clear the runtime statistics
+ */
+/*@
+  @ assigns GHOST_opaque_usbmsc_privates;
+  */
+void usbmsc_reset_stats(void);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+#define USBMSC_LATENCY_BUCKETS 32
+
+/*
+ * Intervals measured for each command. The timestamps are taken when the
+ * command is received (transport ISR), dequeued by usbmsc_exec_automaton(),
+ * when its data phase is started and when its status is sent.
+ */
+typedef enum {
+    USBMSC_LATENCY_QUEUE = 0,   /* reception to dequeue: ISR to main thread handoff */
+    USBMSC_LATENCY_SETUP,       /* dequeue to data phase start (e.g. backend read) */
+    USBMSC_LATENCY_DATA,        /* data phase start to status (USB link, backend write) */
+    USBMSC_LATENCY_TOTAL,       /* reception to status */
+    USBMSC_LATENCY_STAGES
+} usbmsc_latency_stage_t;
+
+/*
+ * Latency histograms of an opcode. Durations are in ticks of the cycle
+ * counter (sys_get_systick() PREC_CYCLE precision). hist[s][b] counts the
+ * commands whose interval s lasted between 2^b and 2^(b+1)-1 ticks (bucket 0
+ * also counts the null durations). For the commands without data phase, the
+ * setup interval lasts until the status and the data interval is null.
+ */
+typedef struct {
+    uint8_t  opcode;
+    uint32_t count;
+    uint32_t max[USBMSC_LATENCY_STAGES];
+    uint32_t hist[USBMSC_LATENCY_STAGES][USBMSC_LATENCY_BUCKETS];
+} usbmsc_latency_hist_t;
+
+/*
+ * \brief get back the latency histograms of a tracked opcode
+ *
+ * Opcodes are tracked in their order of first use, up to
+ * CONFIG_USR_LIB_MASSSTORAGE_LATENCY_OPCODES. This function must be called
+ * from the thread executing usbmsc_exec_automaton().
+ *
+ * \param idx  index of the tracked opcode, from 0
+ * \param hist histograms of the opcode
+ * \param untracked number of commands whose opcode is not tracked (may be NULL)
+ *
+ * \return MBED_ERROR_NOTFOUND if less than idx+1 opcodes are tracked
+ */
+/*@
+  @ requires \valid(hist);
+  @ assigns *hist, *untracked;
+  */
+mbed_error_t usbmsc_latency_get(uint8_t idx, usbmsc_latency_hist_t *hist,
+                                uint32_t *untracked);
+
+/*
+ * \brief clear the latency histograms
+ */
+/*@
+  @ assigns GHOST_opaque_usbmsc_privates;
+  */
+void usbmsc_latency_reset(void);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_TRACE
+/*
+ * Trace events, and content of their arguments.
+ */
+typedef enum {
+    USBMSC_TRACE_CBW = 1,           /* command received (ISR). arg8: opcode, arg16: LUN,
+                                       arg32: data length (BBB) or tag (UAS) */
+    USBMSC_TRACE_CSW,               /* status sent. arg8: CSW status, arg32: data residue */
+    USBMSC_TRACE_SENSE,             /* error reported. arg8: sense key, arg16: ASC << 8 | ASCQ */
+    USBMSC_TRACE_DATA_IN,           /* data-in chunk submitted. arg32: size */
+    USBMSC_TRACE_DATA_OUT,          /* data-out chunk requested. arg32: size */
+    USBMSC_TRACE_DATA_SENT,         /* data-in chunk sent (ISR). arg32: size */
+    USBMSC_TRACE_DATA_RECEIVED,     /* data-out chunk received (ISR). arg32: size */
+    USBMSC_TRACE_BACKEND_READ,      /* backend read submitted. arg16: sectors
+                                       (saturated), arg32: LBA (low 32 bits) */
+    USBMSC_TRACE_BACKEND_WRITE,     /* backend write submitted. same arguments */
+    USBMSC_TRACE_BACKEND_DONE,      /* backend request completed. arg32: status */
+    USBMSC_TRACE_STATE,             /* automaton state change. arg8: new state,
+                                       arg16: previous state */
+    USBMSC_TRACE_RESET,             /* transport reset (ISR) */
+    USBMSC_TRACE_DROP,              /* command dropped, queue full (ISR). arg8: opcode */
+} usbmsc_trace_event_t;
+
+/*
+ * Trace record. seq numbers the records from 1, a gap in the numbers of the
+ * records read means that records have been overwritten before being read.
+ * stamp is the low 32 bits of the cycle counter (sys_get_systick() PREC_CYCLE
+ * precision).
+ */
+typedef struct {
+    uint32_t seq;
+    uint32_t stamp;
+    uint8_t  event;
+    uint8_t  arg8;
+    uint16_t arg16;
+    uint32_t arg32;
+} usbmsc_trace_record_t;
+
+/*
+ * \brief read the trace records
+ *
+ * Copy the records still in the trace ring, oldest first, starting at the
+ * sequence number *seq (0 for the oldest one). *seq is updated with the
+ * sequence number of the next record to read, so that the trace can be
+ * streamed by successive calls. The records are copied in their binary form,
+ * which is the input of tools/usbmsc_trace.py.
+ *
+ * \param seq     sequence number of the first record to read, updated
+ * \param records records buffer
+ * \param max     size of the records buffer, in records
+ *
+ * \return the number of records copied
+ */
+/*@
+  @ requires \valid(seq);
+  @ requires \valid(records + (0 .. max-1));
+  @ assigns *seq, records[0 .. max-1];
+  */
+uint32_t usbmsc_trace_read(uint32_t *seq, usbmsc_trace_record_t *records,
+                           uint32_t max);
+#endif
+
 #endif /* LIBUSBMSC_H */
@@ -152,7 +152,7 @@ void usbmsc_reset_stack(void)
 /*@
   @ assigns \nothing;
   */
-mbed_error_t usbmsc_storage_backend_read(uint32_t sector_addr __attribute__((unused)),
+mbed_error_t usbmsc_storage_backend_read(usbmsc_lba_t sector_addr __attribute__((unused)),
                                        uint32_t num_sectors __attribute__((unused)))
 {
     mbed_error_t errcode = variable_errcode;
@@ -162,13 +162,49 @@ mbed_error_t usbmsc_storage_backend_read(uint32_t sector_addr __attribute__((unu
 /*@
   @ assigns \nothing;
   */
-mbed_error_t usbmsc_storage_backend_write(uint32_t sector_addr __attribute__((unused)),
+mbed_error_t usbmsc_storage_backend_write(usbmsc_lba_t sector_addr __attribute__((unused)),
                                         uint32_t num_sectors __attribute__((unused)))
 {
     mbed_error_t errcode = variable_errcode;
     return errcode;
 }
 
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_VERIFY
+/*@
+  @ assigns \nothing;
+  */
+mbed_error_t usbmsc_storage_backend_verify(usbmsc_lba_t sector_addr __attribute__((unused)),
+                                         uint32_t num_sectors __attribute__((unused)))
+{
+    mbed_error_t errcode = variable_errcode;
+    return errcode;
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME_ZEROES
+/*@
+  @ assigns \nothing;
+  */
+mbed_error_t usbmsc_storage_backend_write_zeroes(usbmsc_lba_t sector_addr __attribute__((unused)),
+                                               uint32_t num_sectors __attribute__((unused)))
+{
+    mbed_error_t errcode = variable_errcode;
+    return errcode;
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP
+/*@
+  @ assigns \nothing;
+  */
+mbed_error_t usbmsc_storage_backend_discard(usbmsc_lba_t sector_addr __attribute__((unused)),
+                                          uint32_t num_sectors __attribute__((unused)))
+{
+    mbed_error_t errcode = variable_errcode;
+    return errcode;
+}
+#endif
+
 /*@
   @ requires \valid(numblocks);
   @ requires \valid(blocksize);
@@ -251,9 +287,6 @@ static inline void launch_data_recv_and_exec(struct scsi_cbw *cbw)
     }
     // triggering reception
     usb_bbb_data_received(7, sizeof(struct scsi_cbw), 2);
-    scsi_context_t *ctx = scsi_get_context();
-    ctx->queue_empty = false;
-    /* @ assert scsi_ctx.queue_empty == \false ; */
     // parsing content
     usbmsc_exec_automaton();
 
@@ -293,6 +326,10 @@ static const cmd_data_t cmd_sequence[] = {
   { sizeof(cdb6_t),                         SCSI_CMD_TEST_UNIT_READY },
   { sizeof(cdb10_t),                        SCSI_CMD_WRITE_10 },
   { sizeof(cdb6_t),                         SCSI_CMD_WRITE_6 },
+  { sizeof(cdb12_t),                        SCSI_CMD_READ_12 },
+  { sizeof(cdb16_t),                        SCSI_CMD_READ_16 },
+  { sizeof(cdb12_t),                        SCSI_CMD_WRITE_12 },
+  { sizeof(cdb16_t),                        SCSI_CMD_WRITE_16 },
   { sizeof(cdb6_t),                         0x42  },
   /* invalid couples (cdb_len is 0)*/
   { 0,                                      SCSI_CMD_READ_10 },
@@ -312,6 +349,10 @@ static const cmd_data_t cmd_sequence[] = {
   { 0,                                      SCSI_CMD_TEST_UNIT_READY },
   { 0,                                      SCSI_CMD_WRITE_10 },
   { 0,                                      SCSI_CMD_WRITE_6 },
+  { 0,                                      SCSI_CMD_READ_12 },
+  { 0,                                      SCSI_CMD_READ_16 },
+  { 0,                                      SCSI_CMD_WRITE_12 },
+  { 0,                                      SCSI_CMD_WRITE_16 },
 
   /* EOT */
 };
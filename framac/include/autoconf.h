@@ -177,6 +177,7 @@
 #define CONFIG_KERNEL_USART 1
 #define CONFIG_USR_LIB_MASSSTORAGE_SCSI_DEBUG 0
 #define CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS 1
+#define CONFIG_USR_LIB_MASSSTORAGE_CMD_QUEUE_DEPTH 4
 #define CONFIG_STACKPROTFLAGS "-fstack-protector-strong"
 #define CONFIG_APP_USB_PERM_TIM_GETCYCLES 2
 #define CONFIG_DBGLEVEL 6
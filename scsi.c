@@ -44,6 +44,15 @@
 #include "scsi_resp.h"
 #include "scsi_log.h"
 #include "scsi_automaton.h"
+#include "scsi_backend.h"
+#include "scsi_wait.h"
+#include "scsi_readahead.h"
+#include "scsi_cache.h"
+#include "scsi_sector_cache.h"
+#include "scsi_gather.h"
+#include "scsi_latency.h"
+#include "scsi_stats.h"
+#include "scsi_trace.h"
 
 #include "libc/sanhandlers.h"
 
@@ -67,17 +76,28 @@ scsi_context_t scsi_ctx = {
     .direction = SCSI_DIRECTION_IDLE,
     .line_state = SCSI_TRANSMIT_LINE_READY,
     .size_to_process = 0,
+    .transfer_size = 0,
     .addr = 0,
     .error = 0,
-    .queue_empty = true,
+    .queue = { .head = 0, .tail = 0, .reset_mark = 0, .reset_seq = 0, .reset_ack = 0 },
     .global_buf = NULL,
     .global_buf_len = 0,
     .block_size = 0,
     .storage_size = 0,
-    .state = SCSI_IDLE
+    .capacity_cached = false,
+    .unit_attention = false,
+    .state = SCSI_IDLE,
+    .lun = 0,
+    .luns = { { 0 } }
 };
 
-static cdb_t queued_cdb = { 0 };
+static cdb_t cdb_queue[SCSI_CMD_QUEUE_DEPTH] = { 0 };
+/* addressed LUN of each queued command */
+static uint8_t lun_queue[SCSI_CMD_QUEUE_DEPTH] = { 0 };
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+/* reception timestamp of each queued command */
+static uint32_t recv_stamp_queue[SCSI_CMD_QUEUE_DEPTH] = { 0 };
+#endif
 #endif
 
 /*@
@@ -88,6 +108,30 @@ scsi_context_t *scsi_get_context(void) {
     return &scsi_ctx;
 };
 
+/*
+ * Fail the current command with the given sense, encoded as scsi_ctx.error.
+ */
+/*@
+  @ requires \separated(&cbw, &scsi_ctx,&GHOST_opaque_drv_privates, &bbb_ctx);
+  @ assigns scsi_ctx.error,
+            GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.state;
+  @ ensures scsi_ctx.state == SCSI_IDLE;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void scsi_error_sense(uint32_t err)
+{
+    scsi_ctx.error = err;
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    scsi_stats_sense((uint8_t)scsi_error_get_sense_key(err));
+#endif
+    scsi_trace(USBMSC_TRACE_SENSE, scsi_error_get_sense_key(err), err & 0xffff, 0);
+    /* returning status */
+    usb_bbb_send_csw(CSW_STATUS_FAILED, 0);
+    scsi_set_state(SCSI_IDLE);
+}
+
 /*@
   @ requires \separated(&cbw, &scsi_ctx,&GHOST_opaque_drv_privates, &bbb_ctx);
   @ requires sensekey < 0xff;
@@ -109,62 +153,211 @@ void scsi_error(uint16_t sensekey, uint8_t asc, uint8_t ascq)
         ((sensekey & 0xff) << 16 |
          asc << 8       |
          ascq);
-    scsi_ctx.error = err;
-    /* returning status */
-    usb_bbb_send_csw(CSW_STATUS_FAILED, 0);
-    scsi_set_state(SCSI_IDLE);
+    scsi_error_sense(err);
+}
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE || CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+/*
+ * Record the sense of a write acknowledged to the host which failed later,
+ * out of any command (flush of the write-back cache or of the gathered
+ * writes). It is reported with the next command of the LUN. Only the first
+ * error is kept until it is reported.
+ */
+/*@
+  @ requires lun < SCSI_MAX_LUNS;
+  @ requires sensekey < 0xff;
+  @ assigns scsi_ctx.luns[lun].deferred_error;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void scsi_defer_error(uint8_t lun, uint16_t sensekey, uint8_t asc, uint8_t ascq)
+{
+    log_printf("%s: LUN %d: status=%d\n", __func__, lun, sensekey);
+    if (scsi_ctx.luns[lun].deferred_error == 0) {
+        scsi_ctx.luns[lun].deferred_error = (uint32_t)
+            ((sensekey & 0xff) << 16 |
+             asc << 8       |
+             ascq);
+    }
 }
+#endif
 
 /*********************************************************************
- * Mutexes, protection against race conditions...
+ * Received commands queue
  ********************************************************************/
 
 /*
- * \brief entering a critical section
- *
- * During this critical section, any ISR is postponed to avoid any
- * race condition on variables shared in write-access between ISR and
- * main thread. See sys_lock() syscall API documentation.
- *
- * Critical sections must be as short as possible to avoid border
- * effects such as latency increase and ISR queue overloading.
+ * The received commands are passed from the USB ISR (scsi_parse_cdb()) to the
+ * main thread (usbmsc_exec_automaton()) through a single producer, single
+ * consumer ring. The producer only writes the head index and the consumer the
+ * tail index, so that no critical section is required.
+ * Each side publishes its index with a release store, once the slot content
+ * has been written (producer) or copied (consumer), and reads the index of
+ * the other side with an acquire load, before accessing the slot. A slot is
+ * then never read before being fully written, nor overwritten before being
+ * fully copied.
  */
+
 /*@
+  // FramaC logic functions on the commands queue indexes
+  logic integer queue_next(integer idx) = (idx + 1) % (2 * SCSI_CMD_QUEUE_DEPTH);
+
+  logic integer queue_count(integer head, integer tail) =
+        ((head + 2 * SCSI_CMD_QUEUE_DEPTH) - tail) % (2 * SCSI_CMD_QUEUE_DEPTH);
+  */
+
+/*@
+  @ requires idx < 2 * SCSI_CMD_QUEUE_DEPTH;
   @ assigns \nothing;
+  @ ensures \result == queue_next(idx);
   */
 #ifndef __FRAMAC__
 static inline
 #endif
-mbed_error_t enter_critical_section(void)
+uint32_t scsi_queue_next(uint32_t idx)
 {
-    uint8_t ret;
-    mbed_error_t errcode = MBED_ERROR_NONE;
+    return (idx + 1) % (2 * SCSI_CMD_QUEUE_DEPTH);
+}
 
-    /* this is a syscall requiring the kernel to lock ISR for a short time */
-    ret = sys_lock(LOCK_ENTER); /* Enter in critical section */
-    if (ret != SYS_E_DONE) {
-        log_printf("%s: Error: failed entering critical section!\n", __func__);
-        errcode = MBED_ERROR_BUSY;
-    }
-    return errcode;
+/*
+ * Number of commands between tail and head.
+ */
+/*@
+  @ requires head < 2 * SCSI_CMD_QUEUE_DEPTH;
+  @ requires tail < 2 * SCSI_CMD_QUEUE_DEPTH;
+  @ assigns \nothing;
+  @ ensures \result == queue_count(head, tail);
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+uint32_t scsi_queue_count(uint32_t head, uint32_t tail)
+{
+    return ((head + (2 * SCSI_CMD_QUEUE_DEPTH)) - tail) % (2 * SCSI_CMD_QUEUE_DEPTH);
 }
 
 /*
- * \brief leaving a critical section
- *
- * Reallow the execution of the previously postponed task ISR.
+ * Acquire load of an index written by the other side of the queue: memory
+ * accesses following it can't be executed before it.
  */
 /*@
+  @ requires \valid_read(idx);
   @ assigns \nothing;
+  @ ensures \result == *idx;
   */
 #ifndef __FRAMAC__
 static inline
 #endif
-void leave_critical_section(void)
+uint32_t scsi_queue_load_acquire(volatile uint32_t *idx)
 {
-    sys_lock(LOCK_EXIT);        /* Exit from critical section, should not
-                                   fail */
-    return;
+    uint32_t val = *idx;
+    request_data_membarrier();
+    return val;
+}
+
+/*
+ * Release store of an index read by the other side of the queue: memory
+ * accesses preceding it are visible before the new index value.
+ */
+/*@
+  @ requires \valid(idx);
+  @ assigns *idx;
+  @ ensures *idx == val;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+void scsi_queue_store_release(volatile uint32_t *idx, uint32_t val)
+{
+    request_data_membarrier();
+    set_u32_with_membarrier(idx, val);
+}
+
+/*
+ * Executed in ISR context when a Bulk-Only Mass Storage Reset is received.
+ * The commands received before this point belong to the aborted session and
+ * are dropped by the next usbmsc_reinit(), whereas the commands received
+ * after it (the host may send new CBWs before the task handles the reset) are
+ * kept.
+ */
+/*@
+  @ assigns scsi_ctx.queue.reset_mark, scsi_ctx.queue.reset_seq;
+  */
+void scsi_queue_mark_reset(void)
+{
+    set_u32_with_membarrier(&scsi_ctx.queue.reset_mark, scsi_ctx.queue.head);
+    /* reset_seq is read by the consumer before reset_mark: it is
+     * published after it */
+    request_data_membarrier();
+    set_u8_with_membarrier(&scsi_ctx.queue.reset_seq,
+                           (uint8_t)((scsi_ctx.queue.reset_seq + 1) % 256));
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    scsi_stats_reset();
+#endif
+    scsi_trace(USBMSC_TRACE_RESET, 0, 0, 0);
+}
+
+/*
+ * Dequeue the oldest received command and its addressed LUN, executed by the
+ * main thread. Returns false if the queue is empty.
+ */
+/*@
+  @ requires \valid(cdb);
+  @ requires \valid(lun);
+  @ requires scsi_ctx.queue.head < 2 * SCSI_CMD_QUEUE_DEPTH;
+  @ requires scsi_ctx.queue.tail < 2 * SCSI_CMD_QUEUE_DEPTH;
+  @ requires \separated(cdb, lun, &cdb_queue[0 .. SCSI_CMD_QUEUE_DEPTH-1], &lun_queue[0 .. SCSI_CMD_QUEUE_DEPTH-1], &scsi_ctx);
+  @ assigns scsi_ctx.queue.tail, *cdb, *lun;
+
+  @ behavior empty:
+  @    assumes scsi_ctx.queue.head == scsi_ctx.queue.tail;
+  @    ensures scsi_ctx.queue.tail == \old(scsi_ctx.queue.tail);
+  @    ensures \result == \false;
+
+  @ behavior ok:
+  @    assumes scsi_ctx.queue.head != scsi_ctx.queue.tail;
+  @    ensures scsi_ctx.queue.tail == queue_next(\old(scsi_ctx.queue.tail));
+  @    ensures \result == \true;
+
+  @ complete behaviors;
+  @ disjoint behaviors;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+bool scsi_queue_pop(cdb_t *cdb, uint8_t *lun)
+{
+    bool result = false;
+    uint32_t tail = scsi_ctx.queue.tail;
+    cdb_t *slot;
+
+    if (scsi_queue_load_acquire(&scsi_ctx.queue.head) == tail) {
+        goto end;
+    }
+    slot = &cdb_queue[tail % SCSI_CMD_QUEUE_DEPTH];
+#ifdef __FRAMAC__
+    /* Here, we use a local memcpy implementation. The resulting execution is the
+     * same, but accepted by framaC.
+     * We keep the libC memcpy in non-FramaC implementation for performances reasons */
+    uint8_t *local_u8_cdb = (uint8_t*)cdb;
+    uint8_t *queued_u8_cdb = (uint8_t*)slot;
+    /*@ assert \valid(queued_u8_cdb+(0..sizeof(cdb_t)-1)); */
+    /*@ assert \valid(local_u8_cdb+(0..sizeof(cdb_t)-1)); */
+
+    FC_memcpy_u8(local_u8_cdb, queued_u8_cdb, sizeof(cdb_t));
+#else
+    memcpy((void *) cdb, (void *) slot, sizeof(cdb_t));
+#endif
+    *lun = lun_queue[tail % SCSI_CMD_QUEUE_DEPTH];
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+    scsi_latency_begin(recv_stamp_queue[tail % SCSI_CMD_QUEUE_DEPTH], cdb->operation);
+#endif
+    /* the slot is given back to the producer once copied */
+    scsi_queue_store_release(&scsi_ctx.queue.tail, scsi_queue_next(tail));
+    result = true;
+end:
+    return result;
 }
 
 /********* About debugging and pretty printing **************/
@@ -303,7 +496,7 @@ bool scsi_is_ready_for_data_send(void)
  */
 /*@
   @ requires \separated(buffer + (0 .. size-1),&scsi_ctx,&cbw, &bbb_ctx,&GHOST_opaque_drv_privates);
-  @ assigns scsi_ctx.addr, scsi_ctx.direction, scsi_ctx.line_state,GHOST_opaque_drv_privates, bbb_ctx.state;
+  @ assigns scsi_ctx.addr, scsi_ctx.transfer_size, scsi_ctx.direction, scsi_ctx.line_state,GHOST_opaque_drv_privates, bbb_ctx.state;
 
   // due to FramaC call to scsi_data_vailable()
   @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.state;
@@ -345,7 +538,7 @@ static
 mbed_error_t scsi_get_data(uint8_t *buffer, uint32_t size)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-#if SCSI_DEBUG > 1
+#if SCSI_DEBUG > 1 && !CONFIG_USR_LIB_MASSSTORAGE_TRACE
     log_printf("%s: size: %d \n", __func__, size);
 #endif
     if (buffer == NULL) {
@@ -369,15 +562,26 @@ mbed_error_t scsi_get_data(uint8_t *buffer, uint32_t size)
         scsi_data_available(scsi_ctx.global_buf_len);
     }
 #else
+# if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    uint64_t wait_start = 0;
+
+    if (!scsi_is_ready_for_data_receive()) {
+        wait_start = scsi_stats_wait_start();
+    }
+# endif
     while (!scsi_is_ready_for_data_receive()) {
-        request_data_membarrier();
-        continue;
+        scsi_wait_event();
     }
+# if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    scsi_stats_wait_end(SCSI_STATS_WAIT_USB, wait_start);
+# endif
 #endif
 
     set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_RECV);
 
     set_u8_with_membarrier(&scsi_ctx.line_state, SCSI_TRANSMIT_LINE_BUSY);
+    /* size of the chunk handled by the USB layer */
+    set_u32_with_membarrier(&scsi_ctx.transfer_size, size);
     scsi_ctx.addr = 0;
     request_data_membarrier();
 
@@ -393,16 +597,19 @@ err:
  */
 /*@
   @ requires \separated(data + (0 .. size-1),&scsi_ctx,&cbw, &bbb_ctx,&GHOST_opaque_drv_privates);
-  @ assigns scsi_ctx.addr, scsi_ctx.direction, scsi_ctx.line_state,GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state;
+  @ assigns scsi_ctx.addr, scsi_ctx.transfer_size, scsi_ctx.direction, scsi_ctx.line_state,GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state;
+  @ ensures scsi_ctx.transfer_size == size;
  */
 void scsi_send_data(uint8_t *data, uint32_t size)
 {
-#if SCSI_DEBUG > 1
+#if SCSI_DEBUG > 1 && !CONFIG_USR_LIB_MASSSTORAGE_TRACE
     log_printf("%s: size: %d \n", __func__, size);
 #endif
 
     set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_SEND);
     set_u8_with_membarrier(&scsi_ctx.line_state, SCSI_TRANSMIT_LINE_BUSY);
+    /* size of the chunk handled by the USB layer, consumed by scsi_data_sent() */
+    set_u32_with_membarrier(&scsi_ctx.transfer_size, size);
     scsi_ctx.addr = 0;
 
     usb_bbb_send(data, size);
@@ -415,23 +622,17 @@ void scsi_send_data(uint8_t *data, uint32_t size)
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates,&scsi_ctx);
   @ requires \valid_read(bbb_ctx.iface.eps + (0 .. 1));
 
-  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
+  @ assigns scsi_ctx.size_to_process, scsi_ctx.line_state;
 
   @ behavior buffer_bigger_than_sizetoprocess:
   @   assumes (size < scsi_ctx.size_to_process);
   @   ensures scsi_ctx.size_to_process == (\old(scsi_ctx.size_to_process) - \old(size));
   @   ensures scsi_ctx.line_state == SCSI_TRANSMIT_LINE_READY;
-  @   ensures scsi_ctx.direction == \old(scsi_ctx.direction);
-  @   ensures GHOST_opaque_drv_privates == \old(GHOST_opaque_drv_privates);
-  @   ensures bbb_ctx.state == \old(bbb_ctx.state);
-  @   ensures scsi_ctx.state == \old(scsi_ctx.state);
 
   @ behavior size_smaller_than_buffer:
   @   assumes (size >= scsi_ctx.size_to_process);
   @   ensures scsi_ctx.size_to_process == 0;
   @   ensures scsi_ctx.line_state == SCSI_TRANSMIT_LINE_READY;
-  @   ensures scsi_ctx.direction == SCSI_DIRECTION_IDLE;
-  @   ensures scsi_ctx.state == SCSI_IDLE;
 
   @ complete behaviors;
   @ disjoint behaviors;
@@ -442,9 +643,9 @@ static
 #endif
 void scsi_data_available(uint32_t size)
 {
-#if SCSI_DEBUG > 1
+#if SCSI_DEBUG > 1 && !CONFIG_USR_LIB_MASSSTORAGE_TRACE
     /* this function is triggered, printing trigger events is done only
-     * on debug level 2 */
+     * on debug level 2, and replaced by trace events */
     log_printf("%s: %d\n", __func__, size);
 #endif
 
@@ -453,13 +654,10 @@ void scsi_data_available(uint32_t size)
     } else {
         set_u32_with_membarrier(&scsi_ctx.size_to_process, scsi_ctx.size_to_process - size);
     }
+    /* The status is not sent here: the last received chunk still has to be
+     * written to the storage backend, which may fail. The CSW is sent by the
+     * write engine once all the data are committed. */
     set_u8_with_membarrier(&scsi_ctx.line_state, SCSI_TRANSMIT_LINE_READY);
-
-    if (scsi_ctx.size_to_process == 0) {
-        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
-        set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
-        scsi_set_state(SCSI_IDLE);
-    }
 }
 
 
@@ -473,8 +671,8 @@ void scsi_data_available(uint32_t size)
   @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
 
   @ behavior size_bigger_than_buffer:
-  @   assumes (scsi_ctx.size_to_process > scsi_ctx.global_buf_len);
-  @   ensures scsi_ctx.size_to_process == (\old(scsi_ctx.size_to_process) - \old(scsi_ctx.global_buf_len));
+  @   assumes (scsi_ctx.size_to_process > scsi_ctx.transfer_size);
+  @   ensures scsi_ctx.size_to_process == (\old(scsi_ctx.size_to_process) - \old(scsi_ctx.transfer_size));
   @   ensures scsi_ctx.line_state == SCSI_TRANSMIT_LINE_READY;
   @   ensures scsi_ctx.direction == \old(scsi_ctx.direction);
   @   ensures GHOST_opaque_drv_privates == \old(GHOST_opaque_drv_privates);
@@ -482,7 +680,7 @@ void scsi_data_available(uint32_t size)
   @   ensures scsi_ctx.state == \old(scsi_ctx.state);
 
   @ behavior size_smaller_than_buffer:
-  @   assumes (scsi_ctx.size_to_process <= scsi_ctx.global_buf_len);
+  @   assumes (scsi_ctx.size_to_process <= scsi_ctx.transfer_size);
   @   ensures scsi_ctx.size_to_process == 0;
   @   ensures scsi_ctx.line_state == SCSI_TRANSMIT_LINE_READY;
   @   ensures scsi_ctx.direction == SCSI_DIRECTION_IDLE;
@@ -497,14 +695,16 @@ static
 #endif
 void scsi_data_sent(void)
 {
-#if SCSI_DEBUG > 1
+#if SCSI_DEBUG > 1 && !CONFIG_USR_LIB_MASSSTORAGE_TRACE
     /* this function is triggered, printing trigger events is done only
-     * on debug level 2 */
+     * on debug level 2, and replaced by trace events */
     log_printf("%s\n", __func__);
 #endif
 
-    if (scsi_ctx.size_to_process > scsi_ctx.global_buf_len) {
-        set_u32_with_membarrier(&scsi_ctx.size_to_process, scsi_ctx.size_to_process - scsi_ctx.global_buf_len);
+    /* the chunk which has just been sent is the one given to the last
+     * scsi_send_data() call, which may be smaller than the buffer */
+    if (scsi_ctx.size_to_process > scsi_ctx.transfer_size) {
+        set_u32_with_membarrier(&scsi_ctx.size_to_process, scsi_ctx.size_to_process - scsi_ctx.transfer_size);
     } else {
         set_u32_with_membarrier(&scsi_ctx.size_to_process, 0);
     }
@@ -518,165 +718,1236 @@ void scsi_data_sent(void)
 }
 
 
+/*
+ * Value of the WCE bit of the caching mode page, depending on the requested
+ * page control (current, changeable, default or saved values). Saved values
+ * are not supported and are returned as the default ones.
+ */
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+uint8_t scsi_get_wce(uint8_t page_control)
+{
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    if (page_control == 0) {
+        return scsi_cache_get_wce() ? 1 : 0;
+    }
+    return 1;
+#elif CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+    if (page_control == 0) {
+        return scsi_gather_get_wce() ? 1 : 0;
+    }
+    return 1;
+#else
+    (void)page_control;
+    return 0;
+#endif
+}
+
+/*
+ * Forge the MODE SENSE parameter data. The only supported mode page is the
+ * caching one, which is returned when requested alone or with all the pages.
+ * Returns the length of the parameter data.
+ */
 /*@
   @ requires \separated(&cbw, response, &bbb_ctx,&GHOST_opaque_drv_privates,&scsi_ctx);
-  @ requires \valid_read(response);
+  @ requires \valid(response);
   @ assigns *response;
   */
 #ifndef __FRAMAC__
 static
 #endif
-void scsi_forge_mode_sense_response(u_mode_parameter * response,
-                                           uint8_t mode)
+uint32_t scsi_forge_mode_sense_response(u_mode_parameter * response,
+                                        uint8_t mode, uint8_t page_code,
+                                        uint8_t page_control)
 {
+    mode_parameter_caching_t *caching;
+    uint32_t len;
+
     if (mode == SCSI_CMD_MODE_SENSE_6) {
-#ifndef __FRAMAC__
-        /* FIXME: this should be, in FramaC, also done */
-        memset(response, 0x0, sizeof(mode_parameter6_data_t));
-#endif
-        /* We only send back the mode parameter header with no data */
-        response->mode6.header.mode_data_length = 3;    /* The number of bytes that follow. */
-        response->mode6.header.medium_type = 0; /* The media type SBC. */
-        response->mode6.header.block_descriptor_length = 0;     /* A block descriptor length of zero indicates that no block descriptors */
-        /* setting shortlba */
-#if 0
-        /* FIXME: Caching is buggy right now... */
-        /* setting caching mode */
-        response->mode6.caching.SPF = 0;
-        response->mode6.caching.page_code = 0x08;
-        response->mode6.caching.page_length = 0x12;
-        response->mode6.caching.WCE = 0x1;
-        response->mode6.caching.RCD = 0x1;
-        response->mode6.caching.FSW = 0x1;
-        response->mode6.caching.DRA = 0x1;
-        response->mode6.caching.NV_DIS = 0x1;
-#endif
-    } else if (mode == SCSI_CMD_MODE_SENSE_10) {
-#ifndef __FRAMAC__
-        /* FIXME: this should be, in FramaC, also done */
-        memset(response, 0x0, sizeof(mode_parameter10_data_t));
-#endif
-        /* We only send back the mode parameter header with no data */
-        response->mode10.header.mode_data_length = 3;   /* The number of bytes that follow. */
-        response->mode10.header.medium_type = 0;        /* The media type SBC. */
-        response->mode10.header.block_descriptor_length = 0;    /* A block descriptor length of zero indicates that no block descriptors */
+        len = sizeof(mode_parameter6_header_t);
+        caching = &response->mode6.caching;
+    } else {
+        len = sizeof(mode_parameter10_header_t);
+        caching = &response->mode10.caching;
+    }
+    if (page_code == MODE_PAGE_CACHING || page_code == MODE_PAGE_ALL) {
+        caching->page_code = MODE_PAGE_CACHING;
+        caching->page_length = MODE_PAGE_CACHING_LEN;
+        caching->WCE = scsi_get_wce(page_control);
+        len += sizeof(mode_parameter_caching_t);
+    }
+    /* mode data length is the number of bytes that follow it. No block
+     * descriptor is returned, and the medium type is SBC */
+    if (mode == SCSI_CMD_MODE_SENSE_6) {
+        response->mode6.header.mode_data_length = (uint8_t)(len - 1);
+        response->mode6.header.medium_type = 0;
+        response->mode6.header.block_descriptor_length = 0;
+    } else {
+        response->mode10.header.mode_data_length = htons((uint16_t)(len - 2));
+        response->mode10.header.medium_type = 0;
+        response->mode10.header.block_descriptor_length = 0;
         response->mode10.header.longLBA = 0;
-        /* are included in the mode parameter list. */
-#if 0
-        /* FIXME: Caching is buggy right now... */
-        /* setting caching mode */
-        response->mode10.caching.SPF = 0;
-        response->mode10.caching.page_code = 0x08;
-        response->mode10.caching.page_length = 0x12;
-        response->mode10.caching.WCE = 0x1;
-        response->mode10.caching.RCD = 0x1;
-        response->mode10.caching.FSW = 0x1;
-        response->mode10.caching.DRA = 0x1;
-        response->mode10.caching.NV_DIS = 0x1;
-#endif
     }
+    return len;
 }
 
 
-/************** End of utility functions **********************/
-
-
 /*
- * SCSI automaton implementation.
- *
- * The SCSI automaton is based on two main entry points:
- * - scsi_parse_cdb, triggered by USB ISR when a SCSI command is received
- * - scsi_exec_automaton, which effectively execute the SCSI command, in
- *   main thread mode
- *
- * scsi_parse_cdb enqueue received command in the command queue. This functions
- * is as small as possible to reduce the ISR execution cost.
- * scsi_exec_automaton check for the command queue and dequeue commands to
- * execute them.
+ * Wait for the end of the current IN transfer.
  *
- * All scsi_cmd_* procedures execute a given SCSI command. These procedures
- * are executed through scsi_exec_automaton.
+ * Here, we wait for an asyncrhonous execution of a trigger setting the IN EP as ready.
+ * This trigger is scsi_data_sent(), which is executed when all the previously data
+ * configured to be send has been transmitted to the host.
+ * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
+ * this trigger, instead of waiting for its asyncrhonous execution.
  */
-
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates,&scsi_ctx);
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
+  */
 #ifndef __FRAMAC__
-/* XXX: we should use memory barriers instead of volatile here */
-extern volatile bool reset_requested;
+static inline
 #endif
+void scsi_wait_for_data_sent(void)
+{
+#ifdef __FRAMAC__
+    if (!scsi_is_ready_for_data_send()) {
+        /* previous scsi_send_data() finished to be sent by the core (this should be an async trap in nominal mode) */
+        scsi_data_sent();
+    }
+#else
+# if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    uint64_t wait_start = 0;
 
+    if (!scsi_is_ready_for_data_send()) {
+        wait_start = scsi_stats_wait_start();
+    }
+# endif
+    while (!scsi_is_ready_for_data_send()) {
+        scsi_wait_event();
+    }
+# if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    scsi_stats_wait_end(SCSI_STATS_WAIT_USB, wait_start);
+# endif
+#endif
+}
 
 /*
- * Enqueue any received SCSI command
- * this function is executed in a handler context when a command comes from USB.
+ * Wait for the end of the current OUT transfer.
+ *
+ * Here, we wait for an asyncrhonous execution of a trigger setting the OUT EP as having
+ * received data.
+ * This trigger is scsi_data_available(), which is executed when the bbb stack is triggered
+ * by the driver outep interrupt in DATA mode.
+ * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
+ * this trigger, instead of waiting for its asyncrhonous execution.
  */
-
-
 /*@
-  @ requires cdb_len <= sizeof(cdb_t);
-  @ requires \valid_read(cdb + (0 .. cdb_len-1));
-  @ requires \separated(((uint8_t*)&queued_cdb + (0 .. cdb_len-1)), &scsi_ctx, &cdb[0 .. cdb_len-1], &reset_requested);
-  @ assigns scsi_ctx.queue_empty, queued_cdb;
-
-  @ behavior reset_req:
-  @    assumes reset_requested == \true;
-  @    ensures scsi_ctx.queue_empty == \true;
-
-  @ behavior ok:
-  @    assumes reset_requested != \true;
-  @    ensures scsi_ctx.queue_empty == \false;
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates,&scsi_ctx);
+  @ assigns scsi_ctx.size_to_process, scsi_ctx.line_state;
+  @ ensures scsi_ctx.line_state == SCSI_TRANSMIT_LINE_READY;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+void scsi_wait_for_data_received(void)
+{
+#ifdef __FRAMAC__
+    if (scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY) {
+        /* emulating asynchronous trigger */
+        scsi_data_available(scsi_ctx.transfer_size);
+    }
+#else
+# if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    uint64_t wait_start = 0;
 
-  @ complete behaviors;
-  @ disjoint behaviors;
+    if (scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY) {
+        wait_start = scsi_stats_wait_start();
+    }
+# endif
+    while (scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY) {
+        scsi_wait_event();
+    }
+# if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    scsi_stats_wait_end(SCSI_STATS_WAIT_USB, wait_start);
+# endif
+#endif
+}
 
+/*
+ * Size of the data chunks used by the read and write engines.
+ *
+ * This is the biggest multiple of the block size which fits in the buffer,
+ * or in half of the buffer when the double buffered data path is used and
+ * the buffer is big enough to hold two blocks.
+ * Returns 0 if the buffer can't hold a single block.
  */
+/*@
+  @ requires scsi_ctx.block_size > 0;
+  @ assigns \nothing;
+  @ ensures \result <= scsi_ctx.global_buf_len;
+  */
 #ifndef __FRAMAC__
-static
+static inline
 #endif
-void scsi_parse_cdb(uint8_t *cdb, uint8_t cdb_len)
+uint32_t scsi_get_chunk_size(void)
 {
-    if (reset_requested == true) {
-        /* a cdb is received while the main thread as not yet cleared the reset trigger */
-        /* waiting for main thread to clear reset trigger */
-        set_bool_with_membarrier(&scsi_ctx.queue_empty, true);
-        request_data_membarrier();
-        goto err;
-    }
-    /*@ assert cdb_len ≤ sizeof(queued_cdb); */
+    uint32_t chunk_size = scsi_ctx.global_buf_len;
 
-    /* Only up to 16 bytes commands are supported: bigger commands are truncated,
-     * See cdb_t definition in scsi_cmd.h */
-#ifdef __FRAMAC__
-    /* INFO: here, we substitute the memcpy call with a local copy to
-     * validate the assign constraint. Thus, the result (fonction postconditions)
-     * is exactly the same. */
-    uint8_t *queued_gen = (uint8_t*)&queued_cdb;
-    /*@ assert \valid(queued_gen+(0..sizeof(cdb_t)-1)); */
-    /*@ assert cdb_len <= sizeof(cdb_t); */
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_DOUBLE_BUFFER
+    if ((chunk_size / 2) >= scsi_ctx.block_size) {
+        chunk_size = chunk_size / 2;
+    }
+#endif
+    return chunk_size - (chunk_size % scsi_ctx.block_size);
+}
 
-    FC_memcpy_u8(queued_gen, cdb, cdb_len);
+/*@
+  @ assigns \nothing;
+  */
+uint32_t usbmsc_get_chunk_size(void)
+{
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+    return 0;
 #else
-    memcpy((void *) &queued_cdb, (void *) cdb, cdb_len);
-    request_data_membarrier();
+    if (scsi_ctx.block_size == 0) {
+        return 0;
+    }
+    return scsi_get_chunk_size();
 #endif
-    set_bool_with_membarrier(&scsi_ctx.queue_empty, false);
-err:
-    return;
 }
 
-
+#if !CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
 /*
- * Commands implementation.
+ * Buffered read engine.
  *
- * All commands implementation check the SCSI state automaton to validate that
- * the transition is authorized, and then execute the command.
+ * Data are read from the storage backend and sent to the host chunk by chunk.
+ * When the buffer holds two chunks (double buffered data path), the next chunk
+ * is read from the backend into one half of the buffer while the current one
+ * is sent to the host from the other half, so that storage and USB accesses
+ * overlap. Otherwise, the backend read is executed once the previous chunk has
+ * been sent.
+ * With an asynchronous backend, the next chunk read is only submitted here, and
+ * its completion is waited for once the current chunk has been sent.
  */
-
-/* SCSI_CMD_INQUIRY */
-
 /*@
-  @ requires \valid_read(cdb);
-  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, cdb, &scsi_ctx);
-  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
-  @ assigns scsi_ctx.error, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state,
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires scsi_ctx.block_size > 0;
+  @ requires num_blocks > 0;
+
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_read_buffered_blocks(usbmsc_lba_t rw_lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    mbed_error_t error = MBED_ERROR_NONE;
+    uint32_t chunk_size;
+    uint32_t to_read;
+    uint32_t cur_size;
+    uint32_t next_size;
+    uint8_t *cur_buf;
+    uint8_t *next_buf;
+    uint8_t *tmp_buf;
+
+    chunk_size = scsi_get_chunk_size();
+    if (chunk_size == 0) {
+        log_printf("%s: buffer smaller than block size\n", __func__);
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+
+    to_read = num_blocks * scsi_ctx.block_size;
+    /* initialize size_to_process. This variable will be upated by the USB BBB
+     * trigger scsi_data_sent() each time a chunk has been sent */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, to_read);
+
+#if SCSI_DEBUG > 1
+    log_printf("%s: sz %u, block_size: %u | num_sectors: %u | chunk: %u\n", __func__,
+           to_read, scsi_ctx.block_size, num_blocks, chunk_size);
+#endif
+
+    cur_buf = scsi_ctx.global_buf;
+    next_buf = scsi_ctx.global_buf;
+    if (chunk_size <= scsi_ctx.global_buf_len - chunk_size) {
+        next_buf = &scsi_ctx.global_buf[chunk_size];
+    }
+
+    /* first chunk */
+    cur_size = (to_read > chunk_size) ? chunk_size : to_read;
+    error = scsi_backend_submit_read(cur_buf, rw_lba, cur_size / scsi_ctx.block_size);
+    if (error == MBED_ERROR_NONE) {
+        error = scsi_backend_wait();
+    }
+    if (error != MBED_ERROR_NONE) {
+        goto read_error;
+    }
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    scsi_cache_overlay(rw_lba, cur_buf, cur_size / scsi_ctx.block_size);
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+    if (cur_size == to_read) {
+        /* single chunk request, kept for the next READs if small enough */
+        scsi_sector_cache_fill(rw_lba, cur_buf, cur_size / scsi_ctx.block_size,
+                               scsi_ctx.block_size);
+    }
+#endif
+    to_read -= cur_size;
+    /*@ assert rw_lba + cur_size / scsi_ctx.block_size <= scsi_ctx.storage_size; */
+    rw_lba += cur_size / scsi_ctx.block_size;
+
+    /*@
+      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+      @ loop assigns cur_size, next_size, to_read, rw_lba, error, cur_buf, next_buf, tmp_buf,
+                     GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state,
+                     scsi_ctx.size_to_process, scsi_ctx.transfer_size, scsi_ctx.line_state,
+                     scsi_ctx.addr, scsi_ctx.direction, scsi_ctx.error, scsi_ctx.state;
+      */
+    while (cur_size > 0) {
+        /* send data we have just read */
+        scsi_send_data(cur_buf, cur_size);
+
+        next_size = (to_read > chunk_size) ? chunk_size : to_read;
+        if (next_size > 0 && next_buf != cur_buf) {
+            /* ping-pong: reading the next chunk while the current one is sent */
+            error = scsi_backend_submit_read(next_buf, rw_lba, next_size / scsi_ctx.block_size);
+        }
+        /* active wait for data to be sent */
+        scsi_wait_for_data_sent();
+        if (next_size > 0 && next_buf == cur_buf) {
+            /* single buffer: the buffer is free again */
+            error = scsi_backend_submit_read(next_buf, rw_lba, next_size / scsi_ctx.block_size);
+        }
+        if (next_size > 0 && error == MBED_ERROR_NONE) {
+            /* the next chunk must be in the buffer before being sent */
+            error = scsi_backend_wait();
+        }
+        if (error != MBED_ERROR_NONE) {
+            goto read_error;
+        }
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+        if (next_size > 0) {
+            scsi_cache_overlay(rw_lba, next_buf, next_size / scsi_ctx.block_size);
+        }
+#endif
+        to_read -= next_size;
+        /*@ assert rw_lba + next_size / scsi_ctx.block_size <= scsi_ctx.storage_size; */
+        rw_lba += next_size / scsi_ctx.block_size;
+
+        tmp_buf = cur_buf;
+        cur_buf = next_buf;
+        next_buf = tmp_buf;
+        cur_size = next_size;
+    }
+ end:
+    return errcode;
+
+ read_error:
+    /* the data phase is aborted, no more chunk will be sent */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, 0);
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_NOSTORAGE;
+    return errcode;
+}
+
+
+/*
+ * Buffered write engine.
+ *
+ * Data are received from the host and written to the storage backend chunk by
+ * chunk. When the buffer holds two chunks (double buffered data path), the OUT
+ * endpoint is armed for the next chunk in one half of the buffer before the
+ * current chunk, in the other half, is written to the storage backend, so that
+ * the host is not NAKed during backend writes. Otherwise, the OUT endpoint is
+ * armed again once the current chunk has been written.
+ * With an asynchronous backend, a chunk write is only submitted here, and its
+ * completion is waited for once the next chunk has been received, before its
+ * half of the buffer is reused.
+ *
+ * The CSW is sent once all the data have been written to the backend.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires scsi_ctx.block_size > 0;
+  @ requires num_blocks > 0;
+
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures scsi_ctx.state == SCSI_IDLE;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_write_buffered_blocks(usbmsc_lba_t rw_lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    mbed_error_t error;
+    uint32_t chunk_size;
+    uint32_t to_recv;
+    uint32_t cur_size;
+    uint32_t next_size;
+    uint8_t *cur_buf;
+    uint8_t *next_buf;
+    uint8_t *tmp_buf;
+
+    chunk_size = scsi_get_chunk_size();
+    if (chunk_size == 0) {
+        log_printf("%s: buffer smaller than block size\n", __func__);
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+
+    to_recv = num_blocks * scsi_ctx.block_size;
+    /* initialize size_to_process. This variable will be upated by the USB BBB
+     * trigger scsi_data_available() each time a chunk has been received */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, to_recv);
+
+#if SCSI_DEBUG > 1
+    log_printf("%s: sz %u, block_size: %u | num_sectors: %u | chunk: %u\n", __func__,
+           to_recv, scsi_ctx.block_size, num_blocks, chunk_size);
+#endif
+
+    cur_buf = scsi_ctx.global_buf;
+    next_buf = scsi_ctx.global_buf;
+    if (chunk_size <= scsi_ctx.global_buf_len - chunk_size) {
+        next_buf = &scsi_ctx.global_buf[chunk_size];
+    }
+
+    /* first chunk */
+    cur_size = (to_recv > chunk_size) ? chunk_size : to_recv;
+    scsi_get_data(cur_buf, cur_size);
+    to_recv -= cur_size;
+
+    /*@
+      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+      @ loop assigns cur_size, next_size, to_recv, rw_lba, error, cur_buf, next_buf, tmp_buf,
+                     scsi_ctx.addr, scsi_ctx.transfer_size, scsi_ctx.direction, scsi_ctx.line_state,
+                     GHOST_opaque_drv_privates, bbb_ctx.state,
+                     GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.state;
+      */
+    while (cur_size > 0) {
+        /* Wait until we have indeed received data from the USB lower layers */
+        scsi_wait_for_data_received();
+
+        next_size = (to_recv > chunk_size) ? chunk_size : to_recv;
+        if (next_buf != cur_buf) {
+            /* the previous chunk has been written from next_buf, which
+             * must be free again before receiving in it */
+            error = scsi_backend_wait();
+            if (error != MBED_ERROR_NONE) {
+                goto write_error;
+            }
+            if (next_size > 0) {
+                /* ping-pong: the host sends the next chunk while the
+                 * current one is written */
+                scsi_get_data(next_buf, next_size);
+            }
+        }
+        error = scsi_backend_submit_write(cur_buf, rw_lba, cur_size / scsi_ctx.block_size);
+        if (error == MBED_ERROR_NONE && next_buf == cur_buf) {
+            /* single buffer: the write must be finished before reusing it */
+            error = scsi_backend_wait();
+        }
+        if (error != MBED_ERROR_NONE) {
+            if (next_size > 0 && next_buf != cur_buf) {
+                /* the OUT endpoint is armed, let the current transfer finish */
+                scsi_wait_for_data_received();
+            }
+            goto write_error;
+        }
+        /*@ assert rw_lba + cur_size / scsi_ctx.block_size <= scsi_ctx.storage_size; */
+        rw_lba += cur_size / scsi_ctx.block_size;
+        if (next_size > 0 && next_buf == cur_buf) {
+            /* single buffer: the buffer is free again */
+            scsi_get_data(next_buf, next_size);
+        }
+        to_recv -= next_size;
+
+        tmp_buf = cur_buf;
+        cur_buf = next_buf;
+        next_buf = tmp_buf;
+        cur_size = next_size;
+    }
+    /* waiting for the last chunk to be written */
+    error = scsi_backend_wait();
+    if (error != MBED_ERROR_NONE) {
+        goto write_error;
+    }
+    /* all data written, returning status */
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    scsi_set_state(SCSI_IDLE);
+ end:
+    return errcode;
+
+ write_error:
+    /* the data phase is aborted, no more chunk will be received */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, 0);
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_NOSTORAGE;
+    return errcode;
+}
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+/*
+ * Cached write engine.
+ *
+ * Data are received from the host chunk by chunk and copied into the write
+ * cache. The CSW is sent once all the blocks are cached: they are written to
+ * the storage backend later, when the cache is flushed.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires scsi_ctx.block_size > 0;
+  @ requires num_blocks > 0;
+
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_write_cached_blocks(usbmsc_lba_t rw_lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t chunk_size;
+    uint32_t to_recv;
+    uint32_t cur_size;
+
+    chunk_size = scsi_get_chunk_size();
+    if (chunk_size == 0) {
+        log_printf("%s: buffer smaller than block size\n", __func__);
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+
+    to_recv = num_blocks * scsi_ctx.block_size;
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, to_recv);
+
+    /*@
+      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+      @ loop assigns cur_size, to_recv, rw_lba, errcode,
+                     scsi_ctx.addr, scsi_ctx.transfer_size, scsi_ctx.direction, scsi_ctx.line_state,
+                     GHOST_opaque_drv_privates, bbb_ctx.state,
+                     GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.state;
+      */
+    while (to_recv > 0) {
+        cur_size = (to_recv > chunk_size) ? chunk_size : to_recv;
+        scsi_get_data(scsi_ctx.global_buf, cur_size);
+        scsi_wait_for_data_received();
+        errcode = scsi_cache_write(rw_lba, scsi_ctx.global_buf,
+                                   cur_size / scsi_ctx.block_size, scsi_ctx.block_size);
+        if (errcode != MBED_ERROR_NONE) {
+            goto write_error;
+        }
+        /*@ assert rw_lba + cur_size / scsi_ctx.block_size <= scsi_ctx.storage_size; */
+        rw_lba += cur_size / scsi_ctx.block_size;
+        to_recv -= cur_size;
+    }
+    /* all data cached, returning status */
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    scsi_set_state(SCSI_IDLE);
+ end:
+    return errcode;
+
+ write_error:
+    /* the cache could not be flushed to make room for the data */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, 0);
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_NOSTORAGE;
+    return errcode;
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+/*
+ * Gathered write engine.
+ *
+ * Data are received from the host chunk by chunk and appended to the current
+ * run of contiguous blocks. The CSW is sent once all the blocks are gathered:
+ * the run is written to the storage backend later, in a single request.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires scsi_ctx.block_size > 0;
+  @ requires num_blocks > 0;
+
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_write_gathered_blocks(usbmsc_lba_t rw_lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t chunk_size;
+    uint32_t to_recv;
+    uint32_t cur_size;
+
+    chunk_size = scsi_get_chunk_size();
+    if (chunk_size == 0) {
+        log_printf("%s: buffer smaller than block size\n", __func__);
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    /* a WRITE which doesn't extend the current run flushes it */
+    if (scsi_gather_begin(rw_lba, num_blocks, scsi_ctx.block_size) != MBED_ERROR_NONE) {
+        goto write_error;
+    }
+
+    to_recv = num_blocks * scsi_ctx.block_size;
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, to_recv);
+
+    /*@
+      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+      @ loop assigns cur_size, to_recv,
+                     scsi_ctx.addr, scsi_ctx.transfer_size, scsi_ctx.direction, scsi_ctx.line_state,
+                     GHOST_opaque_drv_privates, bbb_ctx.state,
+                     GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.state;
+      */
+    while (to_recv > 0) {
+        cur_size = (to_recv > chunk_size) ? chunk_size : to_recv;
+        scsi_get_data(scsi_ctx.global_buf, cur_size);
+        scsi_wait_for_data_received();
+        if (scsi_gather_write(scsi_ctx.global_buf, cur_size / scsi_ctx.block_size) != MBED_ERROR_NONE) {
+            goto write_error;
+        }
+        to_recv -= cur_size;
+    }
+    /* all data gathered, returning status */
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    scsi_set_state(SCSI_IDLE);
+ end:
+    return errcode;
+
+ write_error:
+    /* the previous run, or the full buffer, could not be written */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, 0);
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_NOSTORAGE;
+    return errcode;
+}
+#endif
+
+#else
+/*
+ * Zero-copy read engine.
+ *
+ * The storage backend maps the memory area holding the requested sectors, which
+ * is directly given to the USB driver. Mapping the next area is executed while
+ * the current one is sent to the host.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires scsi_ctx.block_size > 0;
+  @ requires num_blocks > 0;
+
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_read_mapped_blocks(usbmsc_lba_t rw_lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    mbed_error_t error;
+    uint32_t cur_blocks = 0;
+    uint32_t next_blocks;
+    uint8_t *cur_buf = NULL;
+    uint8_t *next_buf;
+
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, num_blocks * scsi_ctx.block_size);
+
+    error = usbmsc_storage_backend_map(rw_lba, num_blocks, false, &cur_buf, &cur_blocks);
+    if (error != MBED_ERROR_NONE || cur_buf == NULL || cur_blocks == 0 || cur_blocks > num_blocks) {
+        goto read_error;
+    }
+    /*@
+      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+      @ loop assigns cur_blocks, next_blocks, num_blocks, rw_lba, error, cur_buf, next_buf,
+                     GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state,
+                     scsi_ctx.size_to_process, scsi_ctx.transfer_size, scsi_ctx.line_state,
+                     scsi_ctx.addr, scsi_ctx.direction, scsi_ctx.error, scsi_ctx.state;
+      */
+    while (cur_blocks > 0) {
+        scsi_send_data(cur_buf, cur_blocks * scsi_ctx.block_size);
+        num_blocks -= cur_blocks;
+
+        next_blocks = 0;
+        next_buf = NULL;
+        error = MBED_ERROR_NONE;
+        if (num_blocks > 0) {
+            /* mapping the next area while the current one is sent */
+            error = usbmsc_storage_backend_map(rw_lba + cur_blocks, num_blocks, false,
+                                               &next_buf, &next_blocks);
+        }
+        scsi_wait_for_data_sent();
+        usbmsc_storage_backend_unmap(rw_lba, cur_blocks, false, cur_buf);
+        if (num_blocks > 0 &&
+            (error != MBED_ERROR_NONE || next_buf == NULL || next_blocks == 0 || next_blocks > num_blocks)) {
+            goto read_error;
+        }
+        rw_lba += cur_blocks;
+        cur_buf = next_buf;
+        cur_blocks = next_blocks;
+    }
+    return errcode;
+
+ read_error:
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    scsi_stats_backend_error(false);
+#endif
+    /* the data phase is aborted, no more chunk will be sent */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, 0);
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_NOSTORAGE;
+    return errcode;
+}
+
+/*
+ * Zero-copy write engine.
+ *
+ * The storage backend maps the memory area which has to receive the sectors
+ * data, which is directly given to the USB driver. Unmapping the area commits
+ * the data to the storage. The next area is mapped and the OUT endpoint armed
+ * before the current one is committed.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires scsi_ctx.block_size > 0;
+  @ requires num_blocks > 0;
+
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures scsi_ctx.state == SCSI_IDLE;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_write_mapped_blocks(usbmsc_lba_t rw_lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    mbed_error_t error;
+    uint32_t cur_blocks = 0;
+    uint32_t next_blocks;
+    uint8_t *cur_buf = NULL;
+    uint8_t *next_buf;
+
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, num_blocks * scsi_ctx.block_size);
+
+    error = usbmsc_storage_backend_map(rw_lba, num_blocks, true, &cur_buf, &cur_blocks);
+    if (error != MBED_ERROR_NONE || cur_buf == NULL || cur_blocks == 0 || cur_blocks > num_blocks) {
+        goto write_error;
+    }
+    scsi_get_data(cur_buf, cur_blocks * scsi_ctx.block_size);
+    /*@
+      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+      @ loop assigns cur_blocks, next_blocks, num_blocks, rw_lba, error, cur_buf, next_buf,
+                     scsi_ctx.addr, scsi_ctx.transfer_size, scsi_ctx.direction, scsi_ctx.line_state,
+                     GHOST_opaque_drv_privates, bbb_ctx.state,
+                     GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.state;
+      */
+    while (cur_blocks > 0) {
+        scsi_wait_for_data_received();
+        num_blocks -= cur_blocks;
+
+        next_blocks = 0;
+        next_buf = NULL;
+        if (num_blocks > 0) {
+            /* the host sends the next chunk while the current one is committed */
+            error = usbmsc_storage_backend_map(rw_lba + cur_blocks, num_blocks, true,
+                                               &next_buf, &next_blocks);
+            if (error != MBED_ERROR_NONE || next_buf == NULL || next_blocks == 0 || next_blocks > num_blocks) {
+                usbmsc_storage_backend_unmap(rw_lba, cur_blocks, true, cur_buf);
+                goto write_error;
+            }
+            scsi_get_data(next_buf, next_blocks * scsi_ctx.block_size);
+        }
+        error = usbmsc_storage_backend_unmap(rw_lba, cur_blocks, true, cur_buf);
+        if (error != MBED_ERROR_NONE) {
+            if (next_blocks > 0) {
+                /* the OUT endpoint is armed, let the current transfer finish */
+                scsi_wait_for_data_received();
+                usbmsc_storage_backend_unmap(rw_lba + cur_blocks, 0, true, next_buf);
+            }
+            goto write_error;
+        }
+        rw_lba += cur_blocks;
+        cur_buf = next_buf;
+        cur_blocks = next_blocks;
+    }
+    /* all data written, returning status */
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    scsi_set_state(SCSI_IDLE);
+    return errcode;
+
+ write_error:
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    scsi_stats_backend_error(true);
+#endif
+    /* the data phase is aborted, no more chunk will be received */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, 0);
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_NOSTORAGE;
+    return errcode;
+}
+#endif/*!CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY*/
+
+/*
+ * Big endian 64 bits fields of 16 bytes CDBs (LBA) to host endianess.
+ */
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+uint64_t scsi_ntohll(uint64_t val)
+{
+    return ((uint64_t)ntohl((uint32_t)(val & 0xffffffff)) << 32) |
+           (uint64_t)ntohl((uint32_t)(val >> 32));
+}
+
+/*
+ * Checks executed before any READ or WRITE data phase.
+ * On failure, the error status is sent to the host.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ assigns scsi_ctx.error, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.state;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_INVPARAM);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_check_rw_blocks(usbmsc_lba_t rw_lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* check that the requested blocks are all in the storage, this also
+     * protects the LBA increments of the engines against unsigned overflow */
+    if (rw_lba > scsi_ctx.storage_size ||
+        num_blocks > scsi_ctx.storage_size - rw_lba) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+                   ASCQ_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    /* size_to_process is a 32 bits byte counter */
+    if ((uint64_t)num_blocks * (uint64_t)scsi_ctx.block_size > UINT32_MAX) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+ end:
+    return errcode;
+}
+
+/*
+ * Read engine, shared by all the READ commands.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires scsi_ctx.block_size > 0;
+
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_read_blocks(usbmsc_lba_t rw_lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode;
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    uint64_t bytes = (uint64_t)num_blocks * scsi_ctx.block_size;
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+    uint32_t ra_blocks;
+    uint8_t *ra_buf = NULL;
+#endif
+
+    errcode = scsi_check_rw_blocks(rw_lba, num_blocks);
+    if (errcode != MBED_ERROR_NONE) {
+        goto end;
+    }
+    if (num_blocks == 0) {
+        /* no data phase */
+        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+        goto end;
+    }
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+    errcode = scsi_read_mapped_blocks(rw_lba, num_blocks);
+#else
+# if CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+    /* the gathered blocks read by the host must be in the storage first */
+    if (scsi_gather_flush_range(rw_lba, num_blocks) != MBED_ERROR_NONE) {
+        scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
+# endif
+# if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+    if (scsi_sector_cache_accepts(num_blocks, scsi_ctx.block_size) &&
+        num_blocks * scsi_ctx.block_size <= scsi_get_chunk_size() &&
+        scsi_sector_cache_read(rw_lba, scsi_ctx.global_buf, num_blocks)) {
+        /* all the blocks are cached, the backend is not accessed */
+#  if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+        scsi_cache_overlay(rw_lba, scsi_ctx.global_buf, num_blocks);
+#  endif
+        set_u32_with_membarrier(&scsi_ctx.size_to_process, num_blocks * scsi_ctx.block_size);
+        scsi_send_data(scsi_ctx.global_buf, num_blocks * scsi_ctx.block_size);
+        /* the CSW is sent by scsi_data_sent() */
+        scsi_wait_for_data_sent();
+        goto end;
+    }
+# endif
+# if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+    /* the head of the request may already be in the read-ahead buffer, it
+     * is then directly sent from there */
+    ra_blocks = scsi_readahead_get(rw_lba, num_blocks, scsi_ctx.block_size, &ra_buf);
+    if (ra_blocks > 0) {
+#  if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+        scsi_cache_overlay(rw_lba, ra_buf, ra_blocks);
+#  endif
+        set_u32_with_membarrier(&scsi_ctx.size_to_process, num_blocks * scsi_ctx.block_size);
+        scsi_send_data(ra_buf, ra_blocks * scsi_ctx.block_size);
+        scsi_wait_for_data_sent();
+        if (ra_blocks == num_blocks) {
+            /* the CSW has been sent by scsi_data_sent() */
+            goto end;
+        }
+        rw_lba += ra_blocks;
+        num_blocks -= ra_blocks;
+    }
+# endif
+    errcode = scsi_read_buffered_blocks(rw_lba, num_blocks);
+#endif
+ end:
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    if (errcode == MBED_ERROR_NONE) {
+        scsi_stats_data(false, bytes);
+    }
+#endif
+    return errcode;
+}
+
+/*
+ * Write engine, shared by all the WRITE commands.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires scsi_ctx.block_size > 0;
+
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_write_blocks(usbmsc_lba_t rw_lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode;
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    uint64_t bytes = (uint64_t)num_blocks * scsi_ctx.block_size;
+#endif
+
+    errcode = scsi_check_rw_blocks(rw_lba, num_blocks);
+    if (errcode != MBED_ERROR_NONE) {
+        goto end;
+    }
+    if (num_blocks == 0) {
+        /* no data phase */
+        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+        goto end;
+    }
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+    scsi_readahead_invalidate(rw_lba, num_blocks);
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+    scsi_sector_cache_invalidate(rw_lba, num_blocks);
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+    errcode = scsi_write_mapped_blocks(rw_lba, num_blocks);
+#else
+# if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    if (scsi_cache_accepts(num_blocks, scsi_ctx.block_size)) {
+        errcode = scsi_write_cached_blocks(rw_lba, num_blocks);
+        goto end;
+    }
+    /* written through: the cached copies of these blocks are outdated */
+    scsi_cache_invalidate(rw_lba, num_blocks);
+# elif CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+    if (scsi_gather_accepts(num_blocks, scsi_ctx.block_size)) {
+        errcode = scsi_write_gathered_blocks(rw_lba, num_blocks);
+        goto end;
+    }
+    /* written through: the gathered blocks must be written first */
+    if (scsi_gather_flush() != MBED_ERROR_NONE) {
+        scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
+# endif
+    errcode = scsi_write_buffered_blocks(rw_lba, num_blocks);
+#endif
+ end:
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    if (errcode == MBED_ERROR_NONE) {
+        scsi_stats_data(true, bytes);
+    }
+#endif
+    return errcode;
+}
+
+/************** End of utility functions **********************/
+
+
+/*
+ * SCSI automaton implementation.
+ *
+ * The SCSI automaton is based on two main entry points:
+ * - scsi_parse_cdb, triggered by USB ISR when a SCSI command is received
+ * - scsi_exec_automaton, which effectively execute the SCSI command, in
+ *   main thread mode
+ *
+ * scsi_parse_cdb enqueue received command in the command queue. This functions
+ * is as small as possible to reduce the ISR execution cost.
+ * scsi_exec_automaton check for the command queue and dequeue commands to
+ * execute them.
+ *
+ * All scsi_cmd_* procedures execute a given SCSI command. These procedures
+ * are executed through scsi_exec_automaton.
+ */
+
+/*
+ * Enqueue any received SCSI command, with the LUN it is addressed to (checked
+ * against CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS by the Bulk-Only layer).
+ * this function is executed in a handler context when a command comes from USB.
+ * Commands received while a reset is being handled by the main thread are
+ * queued as well (see scsi_queue_mark_reset()).
+ */
+
+
+/*@
+  @ requires cdb_len <= sizeof(cdb_t);
+  @ requires \valid_read(cdb + (0 .. cdb_len-1));
+  @ requires scsi_ctx.queue.head < 2 * SCSI_CMD_QUEUE_DEPTH;
+  @ requires scsi_ctx.queue.tail < 2 * SCSI_CMD_QUEUE_DEPTH;
+  @ requires lun < SCSI_MAX_LUNS;
+  @ requires \separated(((uint8_t*)&cdb_queue[0] + (0 .. sizeof(cdb_queue)-1)), &lun_queue[0 .. SCSI_CMD_QUEUE_DEPTH-1], &scsi_ctx, &cdb[0 .. cdb_len-1]);
+  @ assigns scsi_ctx.queue.head, cdb_queue[0 .. SCSI_CMD_QUEUE_DEPTH-1], lun_queue[0 .. SCSI_CMD_QUEUE_DEPTH-1];
+
+  @ behavior full:
+  @    assumes queue_count(scsi_ctx.queue.head, scsi_ctx.queue.tail) >= SCSI_CMD_QUEUE_DEPTH;
+  @    ensures scsi_ctx.queue.head == \old(scsi_ctx.queue.head);
+
+  @ behavior ok:
+  @    assumes queue_count(scsi_ctx.queue.head, scsi_ctx.queue.tail) < SCSI_CMD_QUEUE_DEPTH;
+  @    ensures scsi_ctx.queue.head == queue_next(\old(scsi_ctx.queue.head));
+
+  @ complete behaviors;
+  @ disjoint behaviors;
+
+ */
+#ifndef __FRAMAC__
+static
+#endif
+void scsi_parse_cdb(uint8_t *cdb, uint8_t cdb_len, uint8_t lun)
+{
+    uint32_t head = scsi_ctx.queue.head;
+    cdb_t   *slot;
+
+    if (scsi_queue_count(head, scsi_queue_load_acquire(&scsi_ctx.queue.tail)) >= SCSI_CMD_QUEUE_DEPTH) {
+        /* With BBB, the host waits for the CSW before sending the next CBW,
+         * this should not happen */
+        log_printf("%s: command queue full, command dropped\n", __func__);
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+        scsi_stats_dropped(false, 1);
+#endif
+        scsi_trace(USBMSC_TRACE_DROP, cdb[0], 0, 0);
+        goto err;
+    }
+    slot = &cdb_queue[head % SCSI_CMD_QUEUE_DEPTH];
+    /*@ assert cdb_len ≤ sizeof(cdb_t); */
+
+    /* Only up to 16 bytes commands are supported: bigger commands are truncated,
+     * See cdb_t definition in scsi_cmd.h */
+#ifdef __FRAMAC__
+    /* INFO: here, we substitute the memcpy call with a local copy to
+     * validate the assign constraint. Thus, the result (fonction postconditions)
+     * is exactly the same. */
+    uint8_t *queued_gen = (uint8_t*)slot;
+    /*@ assert \valid(queued_gen+(0..sizeof(cdb_t)-1)); */
+    /*@ assert cdb_len <= sizeof(cdb_t); */
+
+    FC_memcpy_u8(queued_gen, cdb, cdb_len);
+#else
+    memcpy((void *) slot, (void *) cdb, cdb_len);
+#endif
+    lun_queue[head % SCSI_CMD_QUEUE_DEPTH] = lun;
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+    recv_stamp_queue[head % SCSI_CMD_QUEUE_DEPTH] = scsi_latency_now();
+#endif
+    /* the slot content must be visible before the command is published */
+    scsi_queue_store_release(&scsi_ctx.queue.head, scsi_queue_next(head));
+err:
+    return;
+}
+
+
+/*
+ * Commands implementation.
+ *
+ * All commands implementation check the SCSI state automaton to validate that
+ * the transition is authorized, and then execute the command.
+ */
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP
+/*
+ * Maximum number of block descriptors of an UNMAP parameter list, which is
+ * received in the global buffer.
+ */
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+uint32_t scsi_get_max_unmap_descriptors(void)
+{
+    uint32_t len = scsi_ctx.global_buf_len;
+
+    /* the parameter list length is a 16 bits field */
+    if (len > 0xffff) {
+        len = 0xffff;
+    }
+    if (len < sizeof(unmap_parameter_list_header_t)) {
+        return 0;
+    }
+    return (len - sizeof(unmap_parameter_list_header_t)) / sizeof(unmap_block_descriptor_t);
+}
+#endif
+
+/*
+ * Send the requested Vital Product Data page (INQUIRY with EVPD set),
+ * truncated to the allocation length.
+ * Returns MBED_ERROR_INVPARAM if the page is not supported.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_INVPARAM);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_send_vpd_page(uint8_t page_code, uint16_t alen)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    union {
+        vpd_page_header_t                 header;
+        vpd_supported_pages_t             supported;
+        vpd_block_limits_t                limits;
+        vpd_logical_block_provisioning_t  lbp;
+    } page;
+    uint32_t len;
+
+#ifndef __FRAMAC__
+    memset((void *) &page, 0x0, sizeof(page));
+#endif
+    page.header.periph_device_type = 0x0;   /* direct access block device */
+    page.header.page_code = page_code;
+
+    switch (page_code) {
+        case VPD_PAGE_SUPPORTED_PAGES:
+            /* in ascending order */
+            page.supported.pages[0] = VPD_PAGE_SUPPORTED_PAGES;
+            page.supported.pages[1] = VPD_PAGE_BLOCK_LIMITS;
+            page.supported.pages[2] = VPD_PAGE_LOGICAL_BLOCK_PROVISIONING;
+            len = sizeof(page.supported);
+            break;
+        case VPD_PAGE_BLOCK_LIMITS:
+            /* 0 fields: no limit or not reported */
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP
+            page.limits.max_unmap_lba_count = htonl(UINT32_MAX);
+            page.limits.max_unmap_block_descriptor_count =
+                htonl(scsi_get_max_unmap_descriptors());
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME
+            /* a zero WRITE SAME length is not supported, as it is not
+             * bounded */
+            page.limits.wsnz = 1;
+            page.limits.max_write_same_length =
+                scsi_ntohll(CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME_MAX_LENGTH);
+#endif
+            len = sizeof(page.limits);
+            break;
+        case VPD_PAGE_LOGICAL_BLOCK_PROVISIONING:
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP
+            /* UNMAP supported, unmapped blocks content is not specified.
+             * Thin provisioned, as LBPME is set in READ CAPACITY(16) */
+            page.lbp.lbpu = 1;
+            page.lbp.provisioning_type = 2;
+#endif
+            len = sizeof(page.lbp);
+            break;
+        default:
+            errcode = MBED_ERROR_INVPARAM;
+            goto err;
+    }
+    page.header.page_length = htons((uint16_t)(len - sizeof(vpd_page_header_t)));
+
+    if (len > alen) {
+        len = alen;
+    }
+    usb_bbb_send((uint8_t *) & page, len);
+err:
+    return errcode;
+}
+
+/* SCSI_CMD_INQUIRY */
+
+/*@
+  @ requires \valid_read(cdb);
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, cdb, &scsi_ctx);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+  @ assigns scsi_ctx.error, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state,
             bbb_ctx.state, scsi_ctx.state;
 
   @ behavior badstate:
@@ -685,113 +1956,730 @@ err:
 
   @ behavior ok:
   @    assumes current_state == SCSI_IDLE;
-  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_INVPARAM);
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_INVPARAM);
+
+
+  @ disjoint behaviors;
+  @ complete behaviors;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cmd_inquiry(scsi_state_t  current_state, cdb_t const * const cdb)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    inquiry_data_t response = { 0 };
+    cdb6_inquiry_t const * inq;
+    uint8_t next_state;
+
+    log_printf("%s:\n", __func__);
+    /* Sanity check and next state detection */
+
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_INQUIRY)) {
+        /*@ assert current_state != SCSI_IDLE; */
+        goto invalid_transition;
+    }
+
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_INQUIRY);
+    /* @ assert next_state == SCSI_IDLE; */
+    scsi_set_state(next_state);
+
+    /* effective transition execution (if needed) */
+    inq = &(cdb->payload.cdb6_inquiry);
+
+
+#if SCSI_DEBUG > 1
+    scsi_debug_dump_cmd(cdb, SCSI_CMD_INQUIRY);
+#endif
+
+    uint16_t alen = ntohs(inq->allocation_length);
+
+    /* sanitize received cmd in conformity with SCSI standard */
+    if (inq->EVPD == 0 && alen < 5) {
+        /* invalid: additional fields parameter can't be send */
+        /*@ assert is_invalid_inquiry(&(cdb->payload.cdb6_inquiry)); */
+        goto invalid_cmd;
+    }
+
+    if (inq->EVPD == 1 && alen < 4) {
+        /* invalid: additional fields parameter can't be send */
+        /*@ assert is_invalid_inquiry(&(cdb->payload.cdb6_inquiry)); */
+        goto invalid_cmd;
+    }
+
+
+    /*@ assert !is_invalid_inquiry(&(cdb->payload.cdb6_inquiry)); */
+
+    if (inq->EVPD == 1) {
+        errcode = scsi_send_vpd_page(inq->page_code, alen);
+        if (errcode != MBED_ERROR_NONE) {
+            goto invalid_field;
+        }
+        return errcode;
+    }
+    if (inq->page_code != 0) {
+        /* a page code is only meaningful with EVPD */
+        goto invalid_field;
+    }
+
+    /* Most of support bits are set to 0
+     * version is 0 because the device does not claim conformance to any
+     * standard
+     */
+    response.periph_device_type = 0x0;  /* direct access block device */
+    response.RMB = 1;           /* Removable media */
+
+    response.data_format = 2;   /* < 2 obsoletes, > 2 reserved */
+    response.additional_len = sizeof(response) - 5;     /* (36 - 5) bytes after this one remain */
+    response.additional_len = sizeof(response) - 5;     /* (36 - 5) bytes after this one remain */
+
+#ifdef __FRAMAC__
+    FC_memset_ch(response.vendor_info, 0x20, sizeof(response.vendor_info));
+    FC_memcpy_ch(response.vendor_info, CONFIG_USB_DEV_MANUFACTURER,
+           strlen(CONFIG_USB_DEV_MANUFACTURER));
+    FC_memset_ch(response.product_identification, 0x20,
+           sizeof(response.product_identification));
+    FC_memcpy_ch(response.product_identification, CONFIG_USB_DEV_PRODNAME,
+           strlen(CONFIG_USB_DEV_PRODNAME));
+    FC_memcpy_ch(response.product_revision, CONFIG_USB_DEV_REVISION,
+           strlen(CONFIG_USB_DEV_REVISION));
+#else
+    /* empty char must be set with spaces */
+    memset(response.vendor_info, 0x20, sizeof(response.vendor_info));
+    memcpy(response.vendor_info, CONFIG_USB_DEV_MANUFACTURER,
+           strlen(CONFIG_USB_DEV_MANUFACTURER));
+    /* empty char must be set with spaces */
+    memset(response.product_identification, 0x20,
+           sizeof(response.product_identification));
+    memcpy(response.product_identification, CONFIG_USB_DEV_PRODNAME,
+           strlen(CONFIG_USB_DEV_PRODNAME));
+    memcpy(response.product_revision, CONFIG_USB_DEV_REVISION,
+           strlen(CONFIG_USB_DEV_REVISION));
+#endif
+    log_printf("%s: %s\n", __func__, response.product_revision);
+
+
+    if (inq->allocation_length > 0) {
+        usb_bbb_send((uint8_t *) & response,
+                     (alen < sizeof(response)) ? alen : sizeof(response));
+    } else {
+        log_printf("allocation length is 0\n");
+    }
+    return errcode;
+
+ invalid_cmd:
+    log_printf("%s: malformed cmd\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVPARAM;
+    return errcode;
+
+ invalid_field:
+    log_printf("%s: unsupported page %x\n", __func__, inq->page_code);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB,
+               ASCQ_INVALID_FIELD_IN_CDB);
+    errcode = MBED_ERROR_INVPARAM;
+    return errcode;
+
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
+    return errcode;
+}
+
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+  @ requires \valid_read(current_cdb);
+
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.state ;
+  @ ensures \result == MBED_ERROR_NONE;
+
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cmd_prevent_allow_medium_removal(scsi_state_t current_state,
+                                                          cdb_t * current_cdb __attribute__((unused)))
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t next_state;
+
+    log_printf("%s\n", __func__);
+
+    /* no invalid transition as this CMD is allowed in both IDLE & ERROR states */
+
+    next_state = scsi_next_state(current_state, SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL);
+    scsi_set_state(next_state);
+
+    log_printf("%s: Prevent allow medium removal: %x\n", __func__,
+           current_cdb->payload.cdb10_prevent_allow_removal.prevent);
+    /* TODO: Add callback ? */
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+
+    return errcode;
+    /* effective transition execution (if needed) */
+}
+
+/*@
+  @ requires \separated(&cbw, current_cdb, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \valid_read(current_cdb);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.error, scsi_ctx.state;
+
+  @ behavior badstate:
+  @    assumes current_state != SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVSTATE;
+
+  @ behavior ok:
+  @    assumes current_state == SCSI_IDLE;
+  @    ensures scsi_ctx.state == SCSI_IDLE;
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOBACKEND);
+
+
+  @ disjoint behaviors;
+  @ complete behaviors;
+
+
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cmd_read_format_capacities(scsi_state_t current_state,
+                                                         cdb_t * current_cdb)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t next_state;
+
+
+    log_printf("%s\n", __func__);
+
+    /* Sanity check and next state detection */
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_FORMAT_CAPACITIES)) {
+        /*@ assert current_state != SCSI_IDLE; */
+        goto invalid_transition;
+    }
+
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_READ_FORMAT_CAPACITIES);
+    /* @ assert next_state == SCSI_IDLE; */
+    scsi_set_state(next_state);
+
+    cdb12_read_format_capacities_t *rfc =
+        &(current_cdb->payload.cdb12_read_format_capacities);
+
+    usbmsc_lba_t storage_size = scsi_ctx.storage_size;
+    if (storage_size == 0) {
+        /* This should not happend in a nominal way (i.e. should have been set previously */
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOBACKEND;
+        goto end;
+    }
+    /* the capacity descriptors are 32 bits wide */
+    if (storage_size - 1 > 0xfffffffe) {
+        storage_size = 0xffffffff;
+    }
+    storage_size -= 1;
+
+    capacity_list_t response = {
+        .list_header.reserved_1            = 0,
+        .list_header.reserved_2            = 0,
+        .list_header.capacity_list_length  = 8,
+        .cur_max_capacity.number_of_blocks = htonl((uint32_t)storage_size),
+        .cur_max_capacity.reserved         = 0,
+        .cur_max_capacity.descriptor_code  = FORMATTED_MEDIA,
+        .cur_max_capacity.block_length     = htonl(scsi_ctx.block_size),
+        .num_format_descriptors            = 1,
+        .formattable_descriptor.number_of_blocks =
+		htonl((uint32_t)storage_size),
+        .formattable_descriptor.reserved  = 0,
+        .formattable_descriptor.block_length = htonl(scsi_ctx.block_size)
+    };
+
+    /* we return only the current/max capacity descriptor, no formatable capacity descriptor, making the
+     * response size the following: */
+    uint32_t size =
+        sizeof(capacity_list_header_t) +
+        sizeof(curr_max_capacity_descriptor_t) + 1 +
+        sizeof(formattable_capacity_descriptor_t);
+
+    if (ntohs(rfc->allocation_length_msb) > 0) {
+        usb_bbb_send((uint8_t *) & response,
+                     (ntohs(rfc->allocation_length_msb) <
+                      size) ? rfc->allocation_length_msb : size);
+    } else {
+        log_printf("allocation length is 0\n");
+        usb_bbb_send((uint8_t *) & response, size);
+    }
+end:
+    return errcode;
+
+
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
+    return errcode;
+
+}
+
+
+/*
+ * SCSI_CMD_READ_6
+ * INFO: this command is deprecated but is implemented for retrocompatibility
+ * with older Operating Systems
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \valid_read(current_cdb);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+
+  // this assign line is the consequence of the synchronized scsi_data_sent() trigger (instead of async one)
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
+
+  @ behavior badstate:
+  @    assumes current_state != SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVSTATE;
+
+  @ behavior ok:
+  @    assumes current_state == SCSI_IDLE;
+  @    ensures scsi_ctx.state == SCSI_IDLE;
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+
+
+  @ disjoint behaviors;
+  @ complete behaviors;
+
+
+
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cmd_read_data6(scsi_state_t current_state, cdb_t * current_cdb)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbmsc_lba_t rw_lba;
+    uint32_t rw_size;
+    uint8_t next_state;
+
+    log_printf("%s\n", __func__);
+
+    /* Sanity check and next state detection */
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_6)) {
+        /*@ assert current_state != SCSI_IDLE; */
+        goto invalid_transition;
+    }
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_READ_6);
+    /* @ assert next_state == SCSI_IDLE; */
+
+    /* entering READ state... */
+    scsi_set_state(next_state);
+
+    /* SCSI standard says that the host should not request READ10 cmd
+     * before requesting GET_CAPACITY cmd. In this very case, we have to
+     * send back INVALID to the host */
+    if (scsi_ctx.storage_size == 0) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
+
+    /* 21 bits LBA: the 5 low bits of the CDB byte 1, then a big endian
+     * 16 bits value */
+    rw_lba = ((usbmsc_lba_t)current_cdb->payload.cdb6.logical_block_msb << 16) |
+        ntohs(current_cdb->payload.cdb6.logical_block);
+
+    rw_size = current_cdb->payload.cdb6.transfer_blocks;
+    if (rw_size == 0) {
+        /* for READ(6), a transfer length of 0 means 256 blocks */
+        rw_size = 256;
+    }
+    errcode = scsi_read_blocks(rw_lba, rw_size);
+
+ end:
+    return errcode;
+
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
+    return errcode;
+}
+
+
+/* SCSI_CMD_READ_10 */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \valid_read(current_cdb);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+
+  // this assign line is the consequence of the synchronized scsi_data_sent() trigger (instead of async one)
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
+
+  @ behavior badstate:
+  @    assumes current_state != SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVSTATE;
+
+  @ behavior ok:
+  @    assumes current_state == SCSI_IDLE;
+  @    ensures scsi_ctx.state == SCSI_IDLE;
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+
+
+  @ disjoint behaviors;
+  @ complete behaviors;
+
+
+
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cmd_read_data10(const scsi_state_t current_state,
+                                         cdb_t * current_cdb)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbmsc_lba_t rw_lba;
+    uint32_t rw_size;
+    uint8_t next_state;
+
+    log_printf("%s\n", __func__);
+
+    /* Sanity check and next state detection */
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_10)) {
+        /* @ assert current_state != SCSI_IDLE; */
+        goto invalid_transition;
+    }
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_READ_10);
+    /* @ assert next_state == SCSI_IDLE; */
+
+    /* entering READ state... */
+    scsi_set_state(next_state);
+
+    /* SCSI standard says that the host should not request READ10 cmd
+     * before requesting GET_CAPACITY cmd. In this very case, we have to
+     * send back INVALID to the host */
+    if (scsi_ctx.storage_size == 0) {
+        log_printf("read capcity not yet set\n");
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
+
+    rw_lba = ntohl(current_cdb->payload.cdb10.logical_block);
+    rw_size = ntohs(current_cdb->payload.cdb10.transfer_blocks);
+    errcode = scsi_read_blocks(rw_lba, rw_size);
+
+ end:
+    return errcode;
+
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+            ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
+    return errcode;
+}
+
+
+/* SCSI_CMD_READ_12 */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \valid_read(current_cdb);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+
+  // this assign line is the consequence of the synchronized scsi_data_sent() trigger (instead of async one)
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
+
+  @ behavior badstate:
+  @    assumes current_state != SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVSTATE;
+
+  @ behavior ok:
+  @    assumes current_state == SCSI_IDLE;
+  @    ensures scsi_ctx.state == SCSI_IDLE;
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+
+
+  @ disjoint behaviors;
+  @ complete behaviors;
+
+
+
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cmd_read_data12(const scsi_state_t current_state,
+                                         cdb_t * current_cdb)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbmsc_lba_t rw_lba;
+    uint32_t rw_size;
+    uint8_t next_state;
+
+    log_printf("%s\n", __func__);
+
+    /* Sanity check and next state detection */
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_12)) {
+        /* @ assert current_state != SCSI_IDLE; */
+        goto invalid_transition;
+    }
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_READ_12);
+    /* @ assert next_state == SCSI_IDLE; */
+
+    /* entering READ state... */
+    scsi_set_state(next_state);
+
+    /* SCSI standard says that the host should not request READ12 cmd
+     * before requesting GET_CAPACITY cmd. In this very case, we have to
+     * send back INVALID to the host */
+    if (scsi_ctx.storage_size == 0) {
+        log_printf("read capcity not yet set\n");
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
+
+    rw_lba = ntohl(current_cdb->payload.cdb12.logical_block);
+    rw_size = ntohl(current_cdb->payload.cdb12.transfer_blocks);
+    errcode = scsi_read_blocks(rw_lba, rw_size);
+
+ end:
+    return errcode;
+
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+            ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
+    return errcode;
+}
+
+
+/* SCSI_CMD_READ_16 */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \valid_read(current_cdb);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+
+  // this assign line is the consequence of the synchronized scsi_data_sent() trigger (instead of async one)
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
+
+  @ behavior badstate:
+  @    assumes current_state != SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVSTATE;
+
+  @ behavior ok:
+  @    assumes current_state == SCSI_IDLE;
+  @    ensures scsi_ctx.state == SCSI_IDLE;
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+
+
+  @ disjoint behaviors;
+  @ complete behaviors;
+
+
+
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cmd_read_data16(const scsi_state_t current_state,
+                                         cdb_t * current_cdb)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint64_t rw_lba64;
+    usbmsc_lba_t rw_lba;
+    uint32_t rw_size;
+    uint8_t next_state;
+
+    log_printf("%s\n", __func__);
+
+    /* Sanity check and next state detection */
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_16)) {
+        /* @ assert current_state != SCSI_IDLE; */
+        goto invalid_transition;
+    }
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_READ_16);
+    /* @ assert next_state == SCSI_IDLE; */
+
+    /* entering READ state... */
+    scsi_set_state(next_state);
+
+    /* SCSI standard says that the host should not request READ16 cmd
+     * before requesting GET_CAPACITY cmd. In this very case, we have to
+     * send back INVALID to the host */
+    if (scsi_ctx.storage_size == 0) {
+        log_printf("read capcity not yet set\n");
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
+
+    rw_lba64 = scsi_ntohll(current_cdb->payload.cdb16.logical_block);
+#if !CONFIG_USR_LIB_MASSSTORAGE_LBA64
+    if (rw_lba64 > UINT32_MAX) {
+        /* beyond the 32 bits storage size */
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+                   ASCQ_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+#endif
+    rw_lba = (usbmsc_lba_t)rw_lba64;
+    rw_size = ntohl(current_cdb->payload.cdb16.transfer_blocks);
+    errcode = scsi_read_blocks(rw_lba, rw_size);
+
+ end:
+    return errcode;
+
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+            ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
+    return errcode;
+}
+
+
+/*
+ * Get back the storage geometry from the backend into the SCSI context,
+ * using the 64 bits capacity hook when the LBA are 64 bits wide.
+ * The backend is only queried once: the geometry is then cached until the
+ * application signals a media change with usbmsc_media_changed().
+ */
+/*@
+  @ assigns scsi_ctx.storage_size, scsi_ctx.block_size, scsi_ctx.capacity_cached;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+uint8_t scsi_get_capacity(void)
+{
+    uint8_t ret;
+
+    if (scsi_ctx.capacity_cached) {
+        return 0;
+    }
+#if CONFIG_USR_LIB_MASSSTORAGE_LBA64
+    ret = usbmsc_storage_backend_capacity64(&(scsi_ctx.storage_size),
+                                            &(scsi_ctx.block_size));
+#else
+    ret = usbmsc_storage_backend_capacity(&(scsi_ctx.storage_size),
+                                          &(scsi_ctx.block_size));
+#endif
+    if (ret == 0 && scsi_ctx.storage_size != 0 && scsi_ctx.block_size != 0) {
+        scsi_ctx.capacity_cached = true;
+    }
+    return ret;
+}
+
+
+/* SCSI_CMD_READ_CAPACITY_10 */
+/*@
+  @ requires \separated(current_cdb, &cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \valid_read(current_cdb);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state,
+            bbb_ctx.state, scsi_ctx.state,
+            scsi_ctx.storage_size,scsi_ctx.block_size, scsi_ctx.capacity_cached,
+            scsi_ctx.error,
+            scsi_ctx.state;
+
+  @ behavior badstate:
+  @    assumes current_state != SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVSTATE;
+
+  @ behavior ok:
+  @    assumes current_state == SCSI_IDLE;
+  @    ensures scsi_ctx.state == SCSI_IDLE;
+  @    ensures (\result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_NONE);
 
 
   @ disjoint behaviors;
   @ complete behaviors;
+
   */
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_inquiry(scsi_state_t  current_state, cdb_t const * const cdb)
+mbed_error_t scsi_cmd_read_capacity10(scsi_state_t current_state,
+                                             cdb_t * current_cdb __attribute__((unused)))
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    inquiry_data_t response = { 0 };
-    cdb6_inquiry_t const * inq;
     uint8_t next_state;
+    read_capacity10_parameter_data_t response;
+    uint8_t ret;
+
+    log_printf("%s\n", __func__);
 
-    log_printf("%s:\n", __func__);
     /* Sanity check and next state detection */
 
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_INQUIRY)) {
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_CAPACITY_10)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
-
     /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_INQUIRY);
+    next_state = scsi_next_state(current_state, SCSI_CMD_READ_CAPACITY_10);
     /* @ assert next_state == SCSI_IDLE; */
-    scsi_set_state(next_state);
 
-    /* effective transition execution (if needed) */
-    inq = &(cdb->payload.cdb6_inquiry);
-
-
-#if SCSI_DEBUG > 1
-    scsi_debug_dump_cmd(cdb, SCSI_CMD_INQUIRY);
-#endif
-
-    uint16_t alen = ntohs(inq->allocation_length);
 
-    /* sanitize received cmd in conformity with SCSI standard */
-    if (inq->EVPD == 0 && alen < 5) {
-        /* invalid: additional fields parameter can't be send */
-        /*@ assert is_invalid_inquiry(&(cdb->payload.cdb6_inquiry)); */
-        goto invalid_cmd;
-    }
+    /* entering target state */
+    scsi_set_state(next_state);
 
-    if (inq->EVPD == 1 && alen < 4) {
-        /* invalid: additional fields parameter can't be send */
-        /*@ assert is_invalid_inquiry(&(cdb->payload.cdb6_inquiry)); */
-        goto invalid_cmd;
+    /* let's get capacity from upper layer */
+    ret = scsi_get_capacity();
+    if (ret != 0) {
+        /* unable to get back capacity from backend... */
+        scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto err;
     }
 
+    /* what is expected is the _LAST_ LBA address ....
+     * See Working draft SCSI block cmd  5.10.2 READ CAPACITY (10) */
 
-    /*@ assert !is_invalid_inquiry(&(cdb->payload.cdb6_inquiry)); */
-
-    /* Most of support bits are set to 0
-     * version is 0 because the device does not claim conformance to any
-     * standard
-     */
-    response.periph_device_type = 0x0;  /* direct access block device */
-    response.RMB = 1;           /* Removable media */
-
-    response.data_format = 2;   /* < 2 obsoletes, > 2 reserved */
-    response.additional_len = sizeof(response) - 5;     /* (36 - 5) bytes after this one remain */
-    response.additional_len = sizeof(response) - 5;     /* (36 - 5) bytes after this one remain */
-
-#ifdef __FRAMAC__
-    FC_memset_ch(response.vendor_info, 0x20, sizeof(response.vendor_info));
-    FC_memcpy_ch(response.vendor_info, CONFIG_USB_DEV_MANUFACTURER,
-           strlen(CONFIG_USB_DEV_MANUFACTURER));
-    FC_memset_ch(response.product_identification, 0x20,
-           sizeof(response.product_identification));
-    FC_memcpy_ch(response.product_identification, CONFIG_USB_DEV_PRODNAME,
-           strlen(CONFIG_USB_DEV_PRODNAME));
-    FC_memcpy_ch(response.product_revision, CONFIG_USB_DEV_REVISION,
-           strlen(CONFIG_USB_DEV_REVISION));
-#else
-    /* empty char must be set with spaces */
-    memset(response.vendor_info, 0x20, sizeof(response.vendor_info));
-    memcpy(response.vendor_info, CONFIG_USB_DEV_MANUFACTURER,
-           strlen(CONFIG_USB_DEV_MANUFACTURER));
-    /* empty char must be set with spaces */
-    memset(response.product_identification, 0x20,
-           sizeof(response.product_identification));
-    memcpy(response.product_identification, CONFIG_USB_DEV_PRODNAME,
-           strlen(CONFIG_USB_DEV_PRODNAME));
-    memcpy(response.product_revision, CONFIG_USB_DEV_REVISION,
-           strlen(CONFIG_USB_DEV_REVISION));
-#endif
-    log_printf("%s: %s\n", __func__, response.product_revision);
-
-
-    if (inq->allocation_length > 0) {
-        usb_bbb_send((uint8_t *) & response,
-                     (alen < sizeof(response)) ? alen : sizeof(response));
+    if (scsi_ctx.storage_size - 1 > 0xfffffffe) {
+        /* the last LBA does not fit: the host must use READ CAPACITY (16) */
+        response.ret_lba = 0xffffffff;
     } else {
-        log_printf("allocation length is 0\n");
+        response.ret_lba = htonl((uint32_t)(scsi_ctx.storage_size - 1));
     }
-    return errcode;
+    response.ret_block_length = htonl(scsi_ctx.block_size);
 
- invalid_cmd:
-    log_printf("%s: malformed cmd\n", __func__);
-    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
-               ASCQ_NO_ADDITIONAL_SENSE);
-    errcode = MBED_ERROR_INVPARAM;
+    usb_bbb_send((uint8_t *) & response,
+                 sizeof(read_capacity10_parameter_data_t));
+err:
     return errcode;
 
+
  invalid_transition:
     log_printf("%s: invalid_transition\n", __func__);
     scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
@@ -800,46 +2688,17 @@ mbed_error_t scsi_cmd_inquiry(scsi_state_t  current_state, cdb_t const * const c
     return errcode;
 }
 
+/* SCSI_CMD_READ_CAPACITY_16 */
 /*@
-  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
-  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
-  @ requires \valid_read(current_cdb);
-
-  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.state ;
-  @ ensures \result == MBED_ERROR_NONE;
-
-  */
-#ifndef __FRAMAC__
-static
-#endif
-mbed_error_t scsi_cmd_prevent_allow_medium_removal(scsi_state_t current_state,
-                                                          cdb_t * current_cdb __attribute__((unused)))
-{
-    mbed_error_t errcode = MBED_ERROR_NONE;
-    uint8_t next_state;
-
-    log_printf("%s\n", __func__);
-
-    /* no invalid transition as this CMD is allowed in both IDLE & ERROR states */
-
-    next_state = scsi_next_state(current_state, SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL);
-    scsi_set_state(next_state);
-
-    log_printf("%s: Prevent allow medium removal: %x\n", __func__,
-           current_cdb->payload.cdb10_prevent_allow_removal.prevent);
-    /* TODO: Add callback ? */
-    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
-
-    return errcode;
-    /* effective transition execution (if needed) */
-}
-
-/*@
-  @ requires \separated(&cbw, current_cdb, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \separated(current_cdb, &cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.error, scsi_ctx.state;
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state,
+            bbb_ctx.state, scsi_ctx.state,
+            scsi_ctx.storage_size,scsi_ctx.block_size, scsi_ctx.capacity_cached,
+            scsi_ctx.error,
+            scsi_ctx.state;
 
   @ behavior badstate:
   @    assumes current_state != SCSI_IDLE;
@@ -847,81 +2706,92 @@ mbed_error_t scsi_cmd_prevent_allow_medium_removal(scsi_state_t current_state,
 
   @ behavior ok:
   @    assumes current_state == SCSI_IDLE;
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE);
   @    ensures scsi_ctx.state == SCSI_IDLE;
-  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOBACKEND);
 
 
   @ disjoint behaviors;
   @ complete behaviors;
 
-
   */
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_read_format_capacities(scsi_state_t current_state,
-                                                         cdb_t * current_cdb)
+mbed_error_t scsi_cmd_read_capacity16(scsi_state_t current_state,
+                                             cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     uint8_t next_state;
-
+    read_capacity16_parameter_data_t response;
+    cdb16_read_capacity_16_t *rc16;
+    uint32_t alloc_len;
+    uint8_t ret;
 
     log_printf("%s\n", __func__);
 
     /* Sanity check and next state detection */
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_FORMAT_CAPACITIES)) {
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_CAPACITY_16)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
-
     /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_READ_FORMAT_CAPACITIES);
+    next_state = scsi_next_state(current_state, SCSI_CMD_READ_CAPACITY_16);
     /* @ assert next_state == SCSI_IDLE; */
+
+    /* entering target state */
     scsi_set_state(next_state);
 
-    cdb12_read_format_capacities_t *rfc =
-        &(current_cdb->payload.cdb12_read_format_capacities);
 
-    uint32_t storage_size = scsi_ctx.storage_size;
-    if (storage_size == 0) {
-        /* This should not happend in a nominal way (i.e. should have been set previously */
-        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
-                ASCQ_NO_ADDITIONAL_SENSE);
-        errcode = MBED_ERROR_NOBACKEND;
-        goto end;
+    /* let's get capacity from upper layer */
+    ret = scsi_get_capacity();
+    if (ret != 0) {
+        /* unable to get back capacity from backend... */
+        scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto err;
     }
 
-    capacity_list_t response = {
-        .list_header.reserved_1            = 0,
-        .list_header.reserved_2            = 0,
-        .list_header.capacity_list_length  = 8,
-        .cur_max_capacity.number_of_blocks = htonl(scsi_ctx.storage_size - 1),
-        .cur_max_capacity.reserved         = 0,
-        .cur_max_capacity.descriptor_code  = FORMATTED_MEDIA,
-        .cur_max_capacity.block_length     = htonl(scsi_ctx.block_size),
-        .num_format_descriptors            = 1,
-        .formattable_descriptor.number_of_blocks =
-		htonl(scsi_ctx.storage_size - 1),
-        .formattable_descriptor.reserved  = 0,
-        .formattable_descriptor.block_length = htonl(scsi_ctx.block_size)
-    };
+    /* get back cdb content from union */
+    rc16 = &(current_cdb->payload.cdb16_read_capacity);
 
-    /* we return only the current/max capacity descriptor, no formatable capacity descriptor, making the
-     * response size the following: */
-    uint32_t size =
-        sizeof(capacity_list_header_t) +
-        sizeof(curr_max_capacity_descriptor_t) + 1 +
-        sizeof(formattable_capacity_descriptor_t);
+    /* what is expected is the _LAST_ LBA address ....
+     * See Working draft SCSI block cmd  5.10.2 READ CAPACITY (16) */
 
-    if (ntohs(rfc->allocation_length_msb) > 0) {
+    /* creating response... */
+#ifndef __FRAMAC__
+    memset((void *) &response, 0x0, sizeof(read_capacity16_parameter_data_t));
+#endif
+    /* byte swapping is symmetric, scsi_ntohll() is also a htonll() */
+    response.ret_lba = scsi_ntohll((uint64_t)(scsi_ctx.storage_size - 1));
+    response.ret_block_length = htonl(scsi_ctx.block_size);
+    response.prot_enable = 0;   /* no prot_enable, protection associated fields
+                                   are disabled. */
+    response.rc_basis = 0x01;   /* LBA is the LBA of the last logical block
+                                   on the logical unit. See Seagate SCSI
+                                   command ref., chap. 3.23.2 */
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP
+    response.lbpme = 1;         /* logical block provisioning management
+                                   (UNMAP) is supported */
+#endif
+
+#if SCSI_DEBUG > 1
+    log_printf("%s: last lba: %x%08x block size: %d\n", __func__,
+           (uint32_t)((uint64_t)(scsi_ctx.storage_size - 1) >> 32),
+           (uint32_t)(scsi_ctx.storage_size - 1), scsi_ctx.block_size);
+#endif
+
+    /* the amount of bytes sent in the response depends on the allocation
+     * length value set in the read_capacity16 cmd. If this value is null,
+     * no response should be sent.
+     * See Seagate SCSI command ref. chap. 3.23.2 */
+    alloc_len = ntohl(rc16->allocation_length);
+    if (alloc_len > 0) {
         usb_bbb_send((uint8_t *) & response,
-                     (ntohs(rfc->allocation_length_msb) <
-                      size) ? rfc->allocation_length_msb : size);
-    } else {
-        log_printf("allocation length is 0\n");
-        usb_bbb_send((uint8_t *) & response, size);
+                     (alloc_len < sizeof(response)) ?
+		         alloc_len : sizeof(response));
     }
-end:
+err:
     return errcode;
 
 
@@ -931,189 +2801,114 @@ end:
                ASCQ_NO_ADDITIONAL_SENSE);
     errcode = MBED_ERROR_INVSTATE;
     return errcode;
-
 }
 
 
-/*
- * SCSI_CMD_READ_6
- * INFO: this command is deprecated but is implemented for retrocompatibility
- * with older Operating Systems
- */
+/* SCSI_CMD_REPORT_LUNS */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
-
-  // this assign line is the consequence of the synchronized scsi_data_sent() trigger (instead of async one)
-  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
+  @ assigns scsi_ctx, scsi_ctx.state, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
 
   @ behavior badstate:
   @    assumes current_state != SCSI_IDLE;
   @    ensures \result == MBED_ERROR_INVSTATE;
 
+  @ behavior badinput:
+  @    assumes current_state == SCSI_IDLE;
+  @    assumes is_invalid_report_luns(&current_cdb->payload.cdb12_report_luns);
+  @    ensures scsi_ctx.state == SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVPARAM;
+
   @ behavior ok:
   @    assumes current_state == SCSI_IDLE;
+  @    assumes !is_invalid_report_luns(&current_cdb->payload.cdb12_report_luns);
   @    ensures scsi_ctx.state == SCSI_IDLE;
-  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+  @    ensures \result == MBED_ERROR_NONE;
 
 
   @ disjoint behaviors;
   @ complete behaviors;
 
 
-
   */
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_read_data6(scsi_state_t current_state, cdb_t * current_cdb)
+mbed_error_t scsi_cmd_report_luns(scsi_state_t current_state,
+                                         cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    uint32_t num_sectors;
-    uint32_t total_num_sectors;
-
-    uint32_t rw_lba;
-    uint16_t rw_size;
-    uint64_t rw_addr;
     uint8_t next_state;
-    mbed_error_t error;
+    cdb12_report_luns_t *rl;
+    uint8_t i;
 
     log_printf("%s\n", __func__);
 
     /* Sanity check and next state detection */
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_6)) {
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_REPORT_LUNS)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
-    /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_READ_6);
-    /* @ assert next_state == SCSI_IDLE; */
 
-    /* entering READ state... */
-    scsi_set_state(next_state);
-
-    /* SCSI standard says that the host should not request READ10 cmd
-     * before requesting GET_CAPACITY cmd. In this very case, we have to
-     * send back INVALID to the host */
-    if (scsi_ctx.storage_size == 0) {
-        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
-                   ASCQ_NO_ADDITIONAL_SENSE);
-        errcode = MBED_ERROR_NOSTORAGE;
-        goto end;
-    }
 
-    /* TODO: is the big endian is set only on the last 16 bytes of this
-     * unaligned field ? */
-    rw_lba = ntohs((uint16_t)(current_cdb->payload.cdb6.logical_block & 0xffff))
-        + (current_cdb->payload.cdb6.logical_block & 0x1f0000);
+    rl = &(current_cdb->payload.cdb12_report_luns);
 
-    rw_size = current_cdb->payload.cdb6.transfer_blocks;
-    rw_addr = (uint64_t) scsi_ctx.block_size * (uint64_t) rw_lba;
-    /* initialize size_to_process. This variable will be upated during the
-     * active wait loop below by the USB BBB triggers (usb_data_sent for
-     * read, usb_data_available for write */
-    set_u32_with_membarrier(&scsi_ctx.size_to_process, scsi_ctx.block_size * rw_size);
+    if (ntohl(rl->allocation_length) < 16) {
+        /* invalid: requested to be at least 16 by standard */
+        goto invalid_cmd;
+    }
 
-    total_num_sectors = scsi_ctx.size_to_process / scsi_ctx.block_size;
-#if SCSI_DEBUG > 1
-    log_printf("%s: sz %u, block_size: %u | num_sectors: %u\n", __func__,
-           scsi_ctx.size_to_process, scsi_ctx.block_size, total_num_sectors);
-#endif
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_REPORT_LUNS);
+    /* @ assert next_state == SCSI_IDLE; */
 
+    scsi_set_state(next_state);
 
+    /* the list length is given in bytes, each LUN being encoded on 8 bytes
+     * with the peripheral device addressing method (SAM-5, 4.7.7.2): bus
+     * identifier 0 in the first byte and the LUN in the second one */
+    report_luns_data_t response = {
+        .lun_list_length = htonl(sizeof(response.luns)),
+        .reserved = 0,
+    };
     /*@
-      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, current_cdb, &scsi_ctx);
-      @ loop invariant scsi_ctx.size_to_process >= 0;
-      @ loop assigns num_sectors, rw_lba, error, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state,
-            scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.addr, scsi_ctx.direction, scsi_ctx.error, scsi_ctx.state;
+      @ loop invariant 0 <= i <= SCSI_MAX_LUNS;
+      @ loop assigns i, response.luns[0 .. SCSI_MAX_LUNS-1];
+      @ loop variant SCSI_MAX_LUNS - i;
       */
-    while (scsi_ctx.size_to_process > scsi_ctx.global_buf_len) {
-        /* There is more data to send that the buffer is able to process,
-         * data are sent in multiple chunks of buf_len size... */
-
-        /* INFO: num_sectors may be defined out of the loop */
-        num_sectors = scsi_ctx.global_buf_len / scsi_ctx.block_size;
-        error = usbmsc_storage_backend_read(rw_lba, num_sectors);
-        if (error == MBED_ERROR_RDERROR) {
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR,
-                       ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_NOSTORAGE;
-            goto end;
-        }
-        /* send data we have just read */
-        scsi_send_data(scsi_ctx.global_buf, scsi_ctx.global_buf_len);
-        /* check for unsigned overflow */
-        uint32_t logicalblock_increment = scsi_ctx.global_buf_len / scsi_ctx.block_size;
-        if ((UINT32_MAX - rw_lba) < logicalblock_increment) {
-            /* uint32 overflow detected! */
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
-                       ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_INVPARAM;
-            goto end;
-        }
-        /* increment read pointer */
-        /*@ assert ((uint64_t)logicalblock_increment + (uint64_t)rw_lba <= UINT32_MAX); */
-        rw_lba += logicalblock_increment;
-        /* active wait for data to be sent */
-        /* here, we wait for an asyncrhonous execution of a trigger setting the IN EP as ready.
-         * This trigger is scsi_data_sent(), which is executed when all the previously data
-         * configured to be send has been transmitted to the host.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (!scsi_is_ready_for_data_send()) {
-            /* previous scsi_send_data() finished to be sent by the core (this should be an async trap in nominal mode) */
-            scsi_data_sent();
-        }
-#else
-        while (!scsi_is_ready_for_data_send()) {
-            request_data_membarrier();
-            continue;
-        }
-#endif
+    for (i = 0; i < SCSI_MAX_LUNS; i++) {
+        response.luns[i] = scsi_ntohll((uint64_t)i << 48);
     }
 
-    /* Fractional residue */
-    if (scsi_ctx.size_to_process > 0) {
-#if SCSI_DEBUG > 1
-        log_printf("%s: sending data residue to host.\n", __func__);
-#endif
-        num_sectors = (scsi_ctx.size_to_process) / scsi_ctx.block_size;
-        error = usbmsc_storage_backend_read((uint32_t) rw_lba, num_sectors);
-        if (error == MBED_ERROR_RDERROR) {
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR,
-                       ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_NOSTORAGE;
-            goto end;
-        }
-        scsi_send_data(scsi_ctx.global_buf, scsi_ctx.size_to_process);
-        /* active wait for data to be sent */
-        /* here, we wait for an asyncrhonous execution of a trigger setting the IN EP as ready.
-         * This trigger is scsi_data_sent(), which is executed when all the previously data
-         * configured to be send has been transmitted to the host.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (!scsi_is_ready_for_data_send()) {
-            /* previous scsi_send_data() finished to be sent by the core (this should be an async trap in nominal mode) */
-            scsi_data_sent();
-        }
-#else
-        while (!scsi_is_ready_for_data_send()) {
-            request_data_membarrier();
-            continue;
-        }
-#endif
-    }
+    /* sending response, truncated to the allocation length (SPC-4 4.2.5.6):
+     * the host reads the list length and asks again for the whole list */
+    usb_bbb_send((uint8_t *) & response,
+                 (ntohl(rl->allocation_length) <
+                  sizeof(response)) ? ntohl(rl->
+                                            allocation_length) :
+                 sizeof(response));
+    return errcode;
 
- end:
+    /* XXX
+     * If the logical unit inventory changes for any reason
+     * (e.g., completion of initialization, removal of a logical unit, or creation of a logical unit),
+     * then the device server shall establish a unit attention condition (see SAM-3) for the
+     * initiator port associated with every I_T nexus, with the additional sense code set
+     * to REPORTED LUNS DATA HAS CHANGED.
+     */
+
+
+ invalid_cmd:
+    log_printf("%s: malformed cmd\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVPARAM;
     return errcode;
 
+
  invalid_transition:
     log_printf("%s: invalid_transition\n", __func__);
     scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
@@ -1122,200 +2917,256 @@ mbed_error_t scsi_cmd_read_data6(scsi_state_t current_state, cdb_t * current_cdb
     return errcode;
 }
 
-
-/* SCSI_CMD_READ_10 */
+/* SCSI_CMD_REQUEST_SENSE */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ assigns scsi_ctx, scsi_ctx.state, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures \result == MBED_ERROR_NONE;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cmd_request_sense(scsi_state_t current_state,
+                                           cdb_t * current_cdb __attribute__((unused)))
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t next_state;
+    request_sense_parameter_data_t data = { 0 };
 
-  // this assign line is the consequence of the synchronized scsi_data_sent() trigger (instead of async one)
-  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
+    log_printf("%s\n", __func__);
 
-  @ behavior badstate:
-  @    assumes current_state != SCSI_IDLE;
-  @    ensures \result == MBED_ERROR_INVSTATE;
+    /* @ assert SCSI_IDLE <= current_state <= SCSI_ERROR; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_REQUEST_SENSE);
+    /* @ assert next_state == SCSI_IDLE; */
 
-  @ behavior ok:
-  @    assumes current_state == SCSI_IDLE;
-  @    ensures scsi_ctx.state == SCSI_IDLE;
-  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+    scsi_set_state(next_state);
+
+#if SCSI_DEBUG > 1
+    log_printf("%s: desc: %x, allocation_length: %x\n",
+           current_cdb->payload.cdb10_request_sense.desc,
+           current_cdb->payload.cdb10_request_sense.allocation_length);
+#endif
 
+    /* TODO If desc is set to 1 and descriptor format sense data is supported */
+
+    /* descriptor format sense data shall be returned. */
+
+    data.error_code = (scsi_ctx.error & SCSI_ERROR_DEFERRED) ? 0x71 : 0x70;
+    data.sense_key = scsi_error_get_sense_key(scsi_ctx.error);
+    data.additional_sense_length = 0x0a;
+    data.asc = scsi_error_get_asc(scsi_ctx.error);
+    data.ascq = scsi_error_get_ascq(scsi_ctx.error);
+    /* now that data has been sent successfully, scsi error is cleared */
+    scsi_ctx.error = 0;
+
+    usb_bbb_send((uint8_t *) & data, sizeof(data));
+    return errcode;
+}
 
-  @ disjoint behaviors;
-  @ complete behaviors;
 
 
+/* SCSI_CMD_MODE_SENSE(10) */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \valid_read(current_cdb);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures \result == MBED_ERROR_NONE;
   */
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_read_data10(const scsi_state_t current_state,
-                                         cdb_t * current_cdb)
+mbed_error_t scsi_cmd_mode_sense10(scsi_state_t current_state,
+                                          cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    uint32_t num_sectors;
-    uint32_t total_num_sectors;
-
-    uint32_t rw_lba;
-    uint16_t rw_size;
-    uint64_t rw_addr;
     uint8_t next_state;
 
-    mbed_error_t error;
-
     log_printf("%s\n", __func__);
 
-    /* Sanity check and next state detection */
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_10)) {
-        /* @ assert current_state != SCSI_IDLE; */
-        goto invalid_transition;
-    }
-    /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_READ_10);
+    /* @ assert SCSI_IDLE <= current_state <= SCSI_ERROR; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_MODE_SENSE_10);
     /* @ assert next_state == SCSI_IDLE; */
-
-    /* entering READ state... */
     scsi_set_state(next_state);
 
-    /* SCSI standard says that the host should not request READ10 cmd
-     * before requesting GET_CAPACITY cmd. In this very case, we have to
-     * send back INVALID to the host */
-    if (scsi_ctx.storage_size == 0) {
-        log_printf("read capcity not yet set\n");
-        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
-                   ASCQ_NO_ADDITIONAL_SENSE);
-        errcode = MBED_ERROR_NOSTORAGE;
-        goto end;
+#if SCSI_DEBUG > 1
+    scsi_debug_dump_cmd(current_cdb, SCSI_CMD_MODE_SENSE_10);
+#endif
+
+    /* Sending Mode Sense 10 answer */
+    u_mode_parameter response = { 0 };
+    uint32_t len;
+    uint16_t alloc_len;
+
+    len = scsi_forge_mode_sense_response(& response, SCSI_CMD_MODE_SENSE_10,
+                                         current_cdb->payload.cdb10_mode_sense.page_code,
+                                         current_cdb->payload.cdb10_mode_sense.PC);
+    alloc_len = ntohs(current_cdb->payload.cdb10_mode_sense.allocation_length);
+    if (len > alloc_len) {
+        len = alloc_len;
+    }
+    if (len == 0) {
+        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    } else {
+        usb_bbb_send((uint8_t *) & response.mode10, len);
     }
 
-    rw_lba = ntohl(current_cdb->payload.cdb10.logical_block);
-    rw_size = ntohs(current_cdb->payload.cdb10.transfer_blocks);
-    rw_addr = (uint64_t) scsi_ctx.block_size * (uint64_t) rw_lba;
-    /* initialize size_to_process. This variable will be upated during the
-     * active wait loop below by the USB BBB triggers (usb_data_sent for
-     * read, usb_data_available for write */
-    set_u32_with_membarrier(&scsi_ctx.size_to_process, scsi_ctx.block_size * rw_size);
+    return errcode;
+}
+
+
+/* SCSI_CMD_MODE_SENSE(6) */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \valid_read(current_cdb);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+
+
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures \result == MBED_ERROR_NONE;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cmd_mode_sense6(scsi_state_t current_state,
+                                         cdb_t * current_cdb)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t next_state;
+
+    log_printf("%s\n", __func__);
+
+    next_state = scsi_next_state(current_state, SCSI_CMD_MODE_SENSE_6);
+    scsi_set_state(next_state);
 
-    total_num_sectors = scsi_ctx.size_to_process / scsi_ctx.block_size;
 #if SCSI_DEBUG > 1
-    log_printf("%s: sz %u, block_size: %u | num_sectors: %u\n", __func__,
-           scsi_ctx.size_to_process, scsi_ctx.block_size, total_num_sectors);
+    scsi_debug_dump_cmd(current_cdb, SCSI_CMD_MODE_SENSE_10);
 #endif
 
-    /*@
-      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, current_cdb, &scsi_ctx);
-      @ loop invariant scsi_ctx.size_to_process >= 0;
-      @ loop assigns num_sectors, rw_lba, error, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state,
-            scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.addr, scsi_ctx.direction, scsi_ctx.error, scsi_ctx.state;
-      */
-    while (scsi_ctx.size_to_process > scsi_ctx.global_buf_len) {
-        /* There is more data to send that the buffer is able to process,
-         * data are sent in multiple chunks of buf_len size... */
+    u_mode_parameter response = { 0 };
+    uint32_t len;
 
-        /* INFO: num_sectors may be defined out of the loop */
-        num_sectors = scsi_ctx.global_buf_len / scsi_ctx.block_size;
-        error = usbmsc_storage_backend_read(rw_lba, num_sectors);
-        /* send data we have just read */
-        if (error == MBED_ERROR_RDERROR) {
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR,
-                    ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_NOSTORAGE;
-            goto end;
-        }
-        scsi_send_data(scsi_ctx.global_buf, scsi_ctx.global_buf_len);
-        /* check for unsigned overflow */
-        uint32_t logicalblock_increment = scsi_ctx.global_buf_len / scsi_ctx.block_size;
-        if ((UINT32_MAX - rw_lba) < logicalblock_increment) {
-            /* increment will generate overflow ! This should not happen as logical blocks of
-             * 512 bytes should not exceed U32_MAX */
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR,
-                    ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_INVPARAM;
-            goto end;
+    len = scsi_forge_mode_sense_response(& response, SCSI_CMD_MODE_SENSE_6,
+                                         current_cdb->payload.cdb6_mode_sense.page_code,
+                                         current_cdb->payload.cdb6_mode_sense.PC);
+    /* Sending Mode Sense 6 answer */
+    if (len > current_cdb->payload.cdb6_mode_sense.allocation_length) {
+        len = current_cdb->payload.cdb6_mode_sense.allocation_length;
+    }
+    if (len == 0) {
+        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    } else {
+        usb_bbb_send((uint8_t *) & response.mode6, len);
+    }
+    return errcode;
+}
 
+/*
+ * Receive and apply the parameter list of a MODE SELECT command. The only
+ * changeable field is the WCE bit of the caching mode page, the other mode
+ * pages and fields are ignored.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_mode_select_params(uint8_t mode, uint32_t param_len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t *params = scsi_ctx.global_buf;
+    mode_parameter_caching_t *caching;
+    uint32_t offset;
+    uint32_t page_len;
+
+    if (param_len == 0) {
+        /* no parameter list, nothing is changed */
+        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+        goto end;
+    }
+    if (param_len > scsi_ctx.global_buf_len) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_PARAMETER_LIST_LENGTH_ERROR,
+                   ASCQ_PARAMETER_LIST_LENGTH_ERROR);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+
+    /* receiving the parameter list */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, param_len);
+    scsi_get_data(params, param_len);
+    scsi_wait_for_data_received();
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+
+    /* skipping the mode parameter header and the block descriptors */
+    if (mode == SCSI_CMD_MODE_SELECT_6) {
+        offset = sizeof(mode_parameter6_header_t);
+        if (param_len >= offset) {
+            offset += params[3];
         }
-        /* increment read pointer */
-        /*@ assert ((uint64_t)logicalblock_increment + (uint64_t)rw_lba <= UINT32_MAX); */
-        rw_lba += logicalblock_increment;
-        /* active wait for data to be sent */
-        /* here, we wait for an asyncrhonous execution of a trigger setting the IN EP as ready.
-         * This trigger is scsi_data_sent(), which is executed when all the previously data
-         * configured to be send has been transmitted to the host.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (!scsi_is_ready_for_data_send()) {
-            /* previous scsi_send_data() finished to be sent by the core (this should be an async trap in nominal mode) */
-            scsi_data_sent();
-        }
-#else
-        while (!scsi_is_ready_for_data_send()) {
-            request_data_membarrier();
-            continue;
+    } else {
+        offset = sizeof(mode_parameter10_header_t);
+        if (param_len >= offset) {
+            offset += ((uint32_t)params[6] << 8) | params[7];
         }
-#endif
+    }
+    if (offset > param_len) {
+        goto invalid_length;
     }
 
-    /* Fractional residue */
-    if (scsi_ctx.size_to_process > 0) {
-#if SCSI_DEBUG > 1
-        log_printf("%s: sending data residue to host.\n", __func__);
-#endif
-        num_sectors = (scsi_ctx.size_to_process) / scsi_ctx.block_size;
-        error = usbmsc_storage_backend_read((uint32_t) rw_lba, num_sectors);
-        if (error == MBED_ERROR_RDERROR) {
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR,
-                       ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_NOSTORAGE;
-            goto end;
-        }
-        scsi_send_data(scsi_ctx.global_buf, scsi_ctx.size_to_process);
-        /* active wait for data to be sent */
-        /* here, we wait for an asyncrhonous execution of a trigger setting the IN EP as ready.
-         * This trigger is scsi_data_sent(), which is executed when all the previously data
-         * configured to be send has been transmitted to the host.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (!scsi_is_ready_for_data_send()) {
-            /* previous scsi_send_data() finished to be sent by the core (this should be an async trap in nominal mode) */
-            scsi_data_sent();
+    while (param_len - offset >= 2) {
+        page_len = params[offset + 1] + 2u;
+        if (page_len > param_len - offset) {
+            goto invalid_length;
         }
+        caching = (mode_parameter_caching_t *)&params[offset];
+        if (caching->page_code == MODE_PAGE_CACHING && page_len >= 3) {
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+            errcode = scsi_cache_set_wce(caching->WCE);
+#elif CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+            errcode = scsi_gather_set_wce(caching->WCE);
 #else
-        while (!scsi_is_ready_for_data_send()) {
-            request_data_membarrier();
-            continue;
-        }
+            errcode = caching->WCE ? MBED_ERROR_INVPARAM : MBED_ERROR_NONE;
 #endif
+            if (errcode == MBED_ERROR_INVPARAM) {
+                /* the write cache can't be enabled */
+                scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_PARAMETER_LIST,
+                           ASCQ_INVALID_FIELD_IN_PARAMETER_LIST);
+                goto end;
+            }
+            if (errcode != MBED_ERROR_NONE) {
+                /* the write cache has not been flushed */
+                scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+                           ASCQ_NO_ADDITIONAL_SENSE);
+                errcode = MBED_ERROR_WRERROR;
+                goto end;
+            }
+        }
+        offset += page_len;
     }
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
  end:
     return errcode;
 
- invalid_transition:
-    log_printf("%s: invalid_transition\n", __func__);
-    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
-            ASCQ_NO_ADDITIONAL_SENSE);
-    errcode = MBED_ERROR_INVSTATE;
+ invalid_length:
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_PARAMETER_LIST_LENGTH_ERROR,
+               ASCQ_PARAMETER_LIST_LENGTH_ERROR);
+    errcode = MBED_ERROR_INVPARAM;
     return errcode;
 }
 
-
-/* SCSI_CMD_READ_CAPACITY_10 */
+/* SCSI_CMD_MODE_SELECT(6) */
 /*@
-  @ requires \separated(current_cdb, &cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state,
-            bbb_ctx.state, scsi_ctx.state,
-            scsi_ctx.storage_size,scsi_ctx.block_size, scsi_ctx.error,
-            scsi_ctx.state;
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
 
   @ behavior badstate:
   @    assumes current_state != SCSI_IDLE;
@@ -1324,7 +3175,8 @@ mbed_error_t scsi_cmd_read_data10(const scsi_state_t current_state,
   @ behavior ok:
   @    assumes current_state == SCSI_IDLE;
   @    ensures scsi_ctx.state == SCSI_IDLE;
-  @    ensures (\result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_NONE);
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_INVPARAM ||
+                \result == MBED_ERROR_WRERROR);
 
 
   @ disjoint behaviors;
@@ -1334,54 +3186,28 @@ mbed_error_t scsi_cmd_read_data10(const scsi_state_t current_state,
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_read_capacity10(scsi_state_t current_state,
-                                             cdb_t * current_cdb __attribute__((unused)))
+mbed_error_t scsi_cmd_mode_select6(scsi_state_t current_state,
+                                          cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     uint8_t next_state;
-    read_capacity10_parameter_data_t response;
-    uint8_t ret;
 
     log_printf("%s\n", __func__);
 
     /* Sanity check and next state detection */
-
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_CAPACITY_10)) {
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_MODE_SELECT_6)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
     /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_READ_CAPACITY_10);
+    next_state = scsi_next_state(current_state, SCSI_CMD_MODE_SELECT_6);
     /* @ assert next_state == SCSI_IDLE; */
-
-
-    /* entering target state */
     scsi_set_state(next_state);
 
-    /* let's get capacity from upper layer */
-    ret =
-        usbmsc_storage_backend_capacity(&(scsi_ctx.storage_size),
-                                      &(scsi_ctx.block_size));
-    if (ret != 0) {
-        /* unable to get back capacity from backend... */
-        scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_NO_ADDITIONAL_SENSE,
-                   ASCQ_NO_ADDITIONAL_SENSE);
-        errcode = MBED_ERROR_NOSTORAGE;
-        goto err;
-    }
-
-    /* what is expected is the _LAST_ LBA address ....
-     * See Working draft SCSI block cmd  5.10.2 READ CAPACITY (10) */
-
-    response.ret_lba = htonl(scsi_ctx.storage_size - 1);
-    response.ret_block_length = htonl(scsi_ctx.block_size);
-
-    usb_bbb_send((uint8_t *) & response,
-                 sizeof(read_capacity10_parameter_data_t));
-err:
+    errcode = scsi_mode_select_params(SCSI_CMD_MODE_SELECT_6,
+                  current_cdb->payload.cdb6_mode_select.parameter_list_length);
     return errcode;
 
-
  invalid_transition:
     log_printf("%s: invalid_transition\n", __func__);
     scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
@@ -1390,16 +3216,14 @@ err:
     return errcode;
 }
 
-/* SCSI_CMD_READ_CAPACITY_16 */
+
+/* SCSI_CMD_MODE_SELECT(10) */
 /*@
-  @ requires \separated(current_cdb, &cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state,
-            bbb_ctx.state, scsi_ctx.state,
-            scsi_ctx.storage_size,scsi_ctx.block_size, scsi_ctx.error,
-            scsi_ctx.state;
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
 
   @ behavior badstate:
   @    assumes current_state != SCSI_IDLE;
@@ -1407,8 +3231,9 @@ err:
 
   @ behavior ok:
   @    assumes current_state == SCSI_IDLE;
-  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE);
   @    ensures scsi_ctx.state == SCSI_IDLE;
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_INVPARAM ||
+                \result == MBED_ERROR_WRERROR);
 
 
   @ disjoint behaviors;
@@ -1418,77 +3243,119 @@ err:
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_read_capacity16(scsi_state_t current_state,
-                                             cdb_t * current_cdb)
+mbed_error_t scsi_cmd_mode_select10(scsi_state_t current_state,
+                                           cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     uint8_t next_state;
-    read_capacity16_parameter_data_t response;
-    cdb16_read_capacity_16_t *rc16;
-    uint8_t ret;
 
     log_printf("%s\n", __func__);
 
     /* Sanity check and next state detection */
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_READ_CAPACITY_16)) {
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_MODE_SELECT_10)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
     /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_READ_CAPACITY_16);
+    next_state = scsi_next_state(current_state, SCSI_CMD_MODE_SELECT_10);
     /* @ assert next_state == SCSI_IDLE; */
-
-    /* entering target state */
     scsi_set_state(next_state);
 
+    /* effective transition execution (if needed) */
+    errcode = scsi_mode_select_params(SCSI_CMD_MODE_SELECT_10,
+                  ntohs(current_cdb->payload.cdb10_mode_select.parameter_list_length));
+    return errcode;
 
-    /* let's get capacity from upper layer */
-    ret =
-        usbmsc_storage_backend_capacity(&(scsi_ctx.storage_size),
-                                      &(scsi_ctx.block_size));
-    if (ret != 0) {
-        /* unable to get back capacity from backend... */
-        scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_NO_ADDITIONAL_SENSE,
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
+    return errcode;
+}
+
+
+/*
+ * Write the cached blocks to the storage backend, on behalf of a SCSI command.
+ * On error, the status is sent to the host.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ assigns scsi_ctx.error, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.state;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_WRERROR);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_flush_cache(void)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    if (scsi_cache_flush() != MBED_ERROR_NONE) {
+        scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
                    ASCQ_NO_ADDITIONAL_SENSE);
-        errcode = MBED_ERROR_NOSTORAGE;
-        goto err;
+        errcode = MBED_ERROR_WRERROR;
+    }
+#elif CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+    if (scsi_gather_flush() != MBED_ERROR_NONE) {
+        scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_WRERROR;
     }
+#endif
+    return errcode;
+}
 
-    /* get back cdb content from union */
-    rc16 = &(current_cdb->payload.cdb16_read_capacity);
+/* SCSI_CMD_SYNCHRONIZE_CACHE(10) and SYNCHRONIZE_CACHE(16) */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \valid_read(current_cdb);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-    /* what is expected is the _LAST_ LBA address ....
-     * See Working draft SCSI block cmd  5.10.2 READ CAPACITY (16) */
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
 
-    /* creating response... */
+  @ behavior badstate:
+  @    assumes current_state != SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVSTATE;
+
+  @ behavior ok:
+  @    assumes current_state == SCSI_IDLE;
+  @    ensures scsi_ctx.state == SCSI_IDLE;
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_WRERROR);
+
+  @ disjoint behaviors;
+  @ complete behaviors;
+
+  */
 #ifndef __FRAMAC__
-    memset((void *) &response, 0x0, sizeof(read_capacity16_parameter_data_t));
+static
 #endif
-    response.ret_lba = (uint64_t) htonl(scsi_ctx.storage_size - 1);
-    response.ret_block_length = htonl(scsi_ctx.block_size);
-    response.prot_enable = 0;   /* no prot_enable, protection associated fields
-                                   are disabled. */
-    response.rc_basis = 0x01;   /* LBA is the LBA of the last logical block
-                                   on the logical unit. See Seagate SCSI
-                                   command ref., chap. 3.23.2 */
+mbed_error_t scsi_cmd_synchronize_cache(scsi_state_t current_state,
+                                        cdb_t * current_cdb)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t next_state;
 
-#if SCSI_DEBUG > 1
-    log_printf("%s: response[0]: %d response[1]: %d\n", __func__, response.ret_lba,
-           response.ret_block_length);
-#endif
+    log_printf("%s\n", __func__);
 
-    /* the amount of bytes sent in the response depends on the allocation
-     * length value set in the read_capacity16 cmd. If this value is null,
-     * no response should be sent.
-     * See Seagate SCSI command ref. chap. 3.23.2 */
-    if (rc16->allocation_length > 0) {
-        usb_bbb_send((uint8_t *) & response,
-                     (rc16->allocation_length < sizeof(response)) ?
-		         rc16->allocation_length : sizeof(response));
+    /* Sanity check and next state detection */
+    if (!scsi_is_valid_transition(current_state, current_cdb->operation)) {
+        /*@ assert current_state != SCSI_IDLE; */
+        goto invalid_transition;
     }
-err:
-    return errcode;
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, current_cdb->operation);
+    /* @ assert next_state == SCSI_IDLE; */
+    scsi_set_state(next_state);
 
+    /* The whole cache is written, whatever the requested range. The IMMED
+     * bit is ignored: the status is returned once the blocks are written. */
+    errcode = scsi_flush_cache();
+    if (errcode == MBED_ERROR_NONE) {
+        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    }
+    return errcode;
 
  invalid_transition:
     log_printf("%s: invalid_transition\n", __func__);
@@ -1498,114 +3365,61 @@ err:
     return errcode;
 }
 
-
-/* SCSI_CMD_REPORT_LUNS */
+/* SCSI_CMD_START_STOP_UNIT */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns scsi_ctx, scsi_ctx.state, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
 
   @ behavior badstate:
   @    assumes current_state != SCSI_IDLE;
   @    ensures \result == MBED_ERROR_INVSTATE;
 
-  @ behavior badinput:
-  @    assumes current_state == SCSI_IDLE;
-  @    assumes is_invalid_report_luns(&current_cdb->payload.cdb12_report_luns);
-  @    ensures scsi_ctx.state == SCSI_IDLE;
-  @    ensures \result == MBED_ERROR_INVPARAM;
-
   @ behavior ok:
   @    assumes current_state == SCSI_IDLE;
-  @    assumes !is_invalid_report_luns(&current_cdb->payload.cdb12_report_luns);
   @    ensures scsi_ctx.state == SCSI_IDLE;
-  @    ensures \result == MBED_ERROR_NONE;
-
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_WRERROR);
 
   @ disjoint behaviors;
   @ complete behaviors;
 
-
   */
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_report_luns(scsi_state_t current_state,
-                                         cdb_t * current_cdb)
+mbed_error_t scsi_cmd_start_stop_unit(scsi_state_t current_state,
+                                      cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     uint8_t next_state;
-    cdb12_report_luns_t *rl;
-    bool    check_condition = false;
 
     log_printf("%s\n", __func__);
 
     /* Sanity check and next state detection */
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_REPORT_LUNS)) {
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_START_STOP_UNIT)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
-
-
-    rl = &(current_cdb->payload.cdb12_report_luns);
-
-    if (ntohl(rl->allocation_length) < 16) {
-        /* invalid: requested to be at least 16 by standard */
-        goto invalid_cmd;
-    }
-
     /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_REPORT_LUNS);
+    next_state = scsi_next_state(current_state, SCSI_CMD_START_STOP_UNIT);
     /* @ assert next_state == SCSI_IDLE; */
-
     scsi_set_state(next_state);
 
-    if (ntohl(rl->allocation_length) < 24) {
-        /* enable to send first lun informations */
-        check_condition = true;
-    }
-
-
-    /* TODO We only support 1 LUN */
-    report_luns_data_t response = {
-        .lun_list_length = 1,
-        .reserved = 0,
-    };
-    response.luns[0] = 0;
-
-    /* sending response, up to required bytes */
-    usb_bbb_send((uint8_t *) & response,
-                 (ntohl(rl->allocation_length) <
-                  sizeof(response)) ? ntohl(rl->
-                                            allocation_length) :
-                 sizeof(response));
-
-    /* if the host didn't reserve enough space to respond, inform it that
-     * some informations are missing */
-    if (check_condition) {
-        usb_bbb_send_csw(SCSI_STATUS_CHECK_CONDITION, 0);
+    /* The unit is always started and the power conditions are not handled.
+     * Hosts send a STOP (or an eject) before the device is removed: the
+     * cached blocks are written, unless NO_FLUSH is set. */
+    if (!current_cdb->payload.cdb6_start_stop_unit.no_flush) {
+        errcode = scsi_flush_cache();
+        if (errcode != MBED_ERROR_NONE) {
+            goto end;
+        }
     }
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+ end:
     return errcode;
 
-    /* XXX
-     * If the logical unit inventory changes for any reason
-     * (e.g., completion of initialization, removal of a logical unit, or creation of a logical unit),
-     * then the device server shall establish a unit attention condition (see SAM-3) for the
-     * initiator port associated with every I_T nexus, with the additional sense code set
-     * to REPORTED LUNS DATA HAS CHANGED.
-     */
-
-
- invalid_cmd:
-    log_printf("%s: malformed cmd\n", __func__);
-    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
-               ASCQ_NO_ADDITIONAL_SENSE);
-    errcode = MBED_ERROR_INVPARAM;
-    return errcode;
-
-
  invalid_transition:
     log_printf("%s: invalid_transition\n", __func__);
     scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
@@ -1614,146 +3428,273 @@ mbed_error_t scsi_cmd_report_luns(scsi_state_t current_state,
     return errcode;
 }
 
-/* SCSI_CMD_REQUEST_SENSE */
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP || CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME
+/*
+ * Drop the copies kept by the stack of blocks which are about to be modified
+ * without data phase (UNMAP, WRITE SAME).
+ */
 /*@
-  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
-  @ requires \valid_read(current_cdb);
-  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_drop_cached_blocks(usbmsc_lba_t lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
 
-  @ assigns scsi_ctx, scsi_ctx.state, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
-  @ ensures \result == MBED_ERROR_NONE;
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+    scsi_readahead_invalidate(lba, num_blocks);
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+    scsi_sector_cache_invalidate(lba, num_blocks);
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    /* the dirty blocks would be written back over the discarded area */
+    scsi_cache_invalidate(lba, num_blocks);
+#elif CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+    errcode = scsi_gather_flush_range(lba, num_blocks);
+#endif
+    return errcode;
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP
+/*
+ * Tell the storage backend that the given blocks are no more used.
+ */
+/*@
+  @ assigns \nothing;
   */
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_request_sense(scsi_state_t current_state,
-                                           cdb_t * current_cdb __attribute__((unused)))
+mbed_error_t scsi_discard_blocks(usbmsc_lba_t lba, uint32_t num_blocks)
 {
-    mbed_error_t errcode = MBED_ERROR_NONE;
-    uint8_t next_state;
-    request_sense_parameter_data_t data = { 0 };
-
-    log_printf("%s\n", __func__);
-
-    /* @ assert SCSI_IDLE <= current_state <= SCSI_ERROR; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_REQUEST_SENSE);
-    /* @ assert next_state == SCSI_IDLE; */
-
-    scsi_set_state(next_state);
+    mbed_error_t errcode;
 
-#if SCSI_DEBUG > 1
-    log_printf("%s: desc: %x, allocation_length: %x\n",
-           current_cdb->payload.cdb10_request_sense.desc,
-           current_cdb->payload.cdb10_request_sense.allocation_length);
+    errcode = scsi_drop_cached_blocks(lba, num_blocks);
+    if (errcode != MBED_ERROR_NONE) {
+        goto err;
+    }
+    errcode = usbmsc_storage_backend_discard(lba, num_blocks);
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    if (errcode != MBED_ERROR_NONE) {
+        scsi_stats_backend_error(true);
+    }
 #endif
-
-    /* TODO If desc is set to 1 and descriptor format sense data is supported */
-
-    /* descriptor format sense data shall be returned. */
-
-    data.error_code = 0x70;
-    data.sense_key = scsi_error_get_sense_key(scsi_ctx.error);
-    data.additional_sense_length = 0x0a;
-    data.asc = scsi_error_get_asc(scsi_ctx.error);
-    data.ascq = scsi_error_get_ascq(scsi_ctx.error);
-    /* now that data has been sent successfully, scsi error is cleared */
-    scsi_ctx.error = 0;
-
-    usb_bbb_send((uint8_t *) & data, sizeof(data));
+err:
     return errcode;
 }
 
-
-
-/* SCSI_CMD_MODE_SENSE(10) */
+/* SCSI_CMD_UNMAP */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
-  @ ensures \result == MBED_ERROR_NONE;
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+
+  @ behavior badstate:
+  @    assumes current_state != SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVSTATE;
+
+  @ behavior ok:
+  @    assumes current_state == SCSI_IDLE;
+  @    ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_INVPARAM || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_WRERROR);
+
+  @ disjoint behaviors;
+  @ complete behaviors;
+
   */
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_mode_sense10(scsi_state_t current_state,
-                                          cdb_t * current_cdb __attribute__((unused)))
+mbed_error_t scsi_cmd_unmap(scsi_state_t current_state, cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     uint8_t next_state;
+    uint8_t *params = scsi_ctx.global_buf;
+    unmap_parameter_list_header_t *header;
+    unmap_block_descriptor_t *desc;
+    uint64_t lba;
+    uint32_t num_blocks;
+    uint32_t param_len;
+    uint32_t num_desc;
+    uint32_t i;
 
     log_printf("%s\n", __func__);
 
-    /* @ assert SCSI_IDLE <= current_state <= SCSI_ERROR; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_MODE_SENSE_10);
+    /* Sanity check and next state detection */
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_UNMAP)) {
+        /*@ assert current_state != SCSI_IDLE; */
+        goto invalid_transition;
+    }
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_UNMAP);
     /* @ assert next_state == SCSI_IDLE; */
     scsi_set_state(next_state);
 
-#if SCSI_DEBUG > 1
-    scsi_debug_dump_cmd(current_cdb, SCSI_CMD_MODE_SENSE_10);
-#endif
+    if (scsi_get_capacity() != 0) {
+        scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
 
-    /* Sending Mode Sense 10 answer */
-    u_mode_parameter response = { 0 };
+    param_len = ntohs(current_cdb->payload.cdb10_unmap.parameter_list_length);
+    if (param_len == 0) {
+        /* no parameter list, nothing to unmap */
+        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+        goto end;
+    }
+    if (param_len < sizeof(unmap_parameter_list_header_t)) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_PARAMETER_LIST_LENGTH_ERROR,
+                   ASCQ_PARAMETER_LIST_LENGTH_ERROR);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    /* the parameter list is received in the global buffer, whose size gives
+     * the descriptors limit reported in the Block Limits VPD page: a longer
+     * list holds more descriptors than this limit */
+    if ((param_len - sizeof(unmap_parameter_list_header_t)) / sizeof(unmap_block_descriptor_t) >
+        scsi_get_max_unmap_descriptors()) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_PARAMETER_LIST,
+                   ASCQ_INVALID_FIELD_IN_PARAMETER_LIST);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    if (param_len > scsi_ctx.global_buf_len) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_PARAMETER_LIST_LENGTH_ERROR,
+                   ASCQ_PARAMETER_LIST_LENGTH_ERROR);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
 
-    scsi_forge_mode_sense_response(& response,
-                                   SCSI_CMD_MODE_SENSE_10);
-    /* Sending Mode Sense 10 answer */
+    /* receiving the parameter list */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, param_len);
+    scsi_get_data(params, param_len);
+    scsi_wait_for_data_received();
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
 
-    /*usb_bbb_send_csw(CSW_STATUS_SUCCESS, sizeof(mode_parameter_header_t)); */
-    usb_bbb_send((uint8_t *) & response.mode10, sizeof(mode_parameter10_data_t));
+    /* descriptors truncated by the parameter list length are ignored */
+    header = (unmap_parameter_list_header_t *)params;
+    num_desc = ntohs(header->block_descriptor_data_length);
+    if (num_desc > param_len - sizeof(unmap_parameter_list_header_t)) {
+        num_desc = param_len - sizeof(unmap_parameter_list_header_t);
+    }
+    num_desc /= sizeof(unmap_block_descriptor_t);
+    desc = (unmap_block_descriptor_t *)&params[sizeof(unmap_parameter_list_header_t)];
+
+    /* no block is unmapped if any descriptor is out of range */
+    for (i = 0; i < num_desc; i++) {
+        lba = scsi_ntohll(desc[i].logical_block_address);
+        num_blocks = ntohl(desc[i].num_blocks);
+        if (lba > scsi_ctx.storage_size ||
+            num_blocks > scsi_ctx.storage_size - lba) {
+            scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+                       ASCQ_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE);
+            errcode = MBED_ERROR_INVPARAM;
+            goto end;
+        }
+    }
+    for (i = 0; i < num_desc; i++) {
+        lba = scsi_ntohll(desc[i].logical_block_address);
+        num_blocks = ntohl(desc[i].num_blocks);
+        if (num_blocks == 0) {
+            continue;
+        }
+        if (scsi_discard_blocks((usbmsc_lba_t)lba, num_blocks) != MBED_ERROR_NONE) {
+            log_printf("%s: discard error\n", __func__);
+            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+                       ASCQ_NO_ADDITIONAL_SENSE);
+            errcode = MBED_ERROR_WRERROR;
+            goto end;
+        }
+    }
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+ end:
+    return errcode;
 
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
     return errcode;
 }
+#endif
 
-
-/* SCSI_CMD_MODE_SENSE(6) */
+/* SCSI_CMD_TEST_UNIT_READY */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-
   @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
-  @ ensures \result == MBED_ERROR_NONE;
+
+  @ behavior badstate:
+  @    assumes current_state != SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVSTATE;
+
+  @ behavior ok:
+  @    assumes current_state == SCSI_IDLE;
+  @    ensures scsi_ctx.state == SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_NONE;
+
+
+  @ disjoint behaviors;
+  @ complete behaviors;
+
   */
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_mode_sense6(scsi_state_t current_state,
-                                         cdb_t * current_cdb __attribute__((unused)))
+mbed_error_t scsi_cmd_test_unit_ready(scsi_state_t current_state,
+                                             cdb_t * current_cdb __attribute__((unused)))
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     uint8_t next_state;
 
     log_printf("%s\n", __func__);
 
-    next_state = scsi_next_state(current_state, SCSI_CMD_MODE_SENSE_6);
-    scsi_set_state(next_state);
-
-#if SCSI_DEBUG > 1
-    scsi_debug_dump_cmd(current_cdb, SCSI_CMD_MODE_SENSE_10);
-#endif
+    /* Sanity check and next state detection */
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_TEST_UNIT_READY)) {
+        /*@ assert current_state != SCSI_IDLE; */
+        goto invalid_transition;
+    }
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, SCSI_CMD_TEST_UNIT_READY);
+    /* @ assert next_state == SCSI_IDLE; */
 
-    u_mode_parameter response = { 0 };
+    scsi_set_state(next_state);
 
-    scsi_forge_mode_sense_response(& response,
-                                   SCSI_CMD_MODE_SENSE_6);
-    /* Sending Mode Sense 6 answer */
+    /* effective transition execution (if needed) */
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    return errcode;
 
-    /*usb_bbb_send_csw(CSW_STATUS_SUCCESS, sizeof(mode_parameter_header_t)); */
-    usb_bbb_send((uint8_t *) & response, sizeof(mode_parameter6_data_t));
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
     return errcode;
 }
 
-/* SCSI_CMD_MODE_SELECT(6) */
+/*
+ * SCSI_CMD_WRITE(6)
+ * This command is declared as obsolete by the T10 consorsium.
+ * It is implemented here for retrocompatibility with old Operating System
+ */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, bbb_ctx.state ;
+  // below is the consequence of synchronous call to scsi_data_available() in waiting loop
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
+
 
   @ behavior badstate:
   @    assumes current_state != SCSI_IDLE;
@@ -1762,7 +3703,7 @@ mbed_error_t scsi_cmd_mode_sense6(scsi_state_t current_state,
   @ behavior ok:
   @    assumes current_state == SCSI_IDLE;
   @    ensures scsi_ctx.state == SCSI_IDLE;
-  @    ensures \result == MBED_ERROR_NONE;
+  @    ensures \result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM;
 
 
   @ disjoint behaviors;
@@ -1772,25 +3713,49 @@ mbed_error_t scsi_cmd_mode_sense6(scsi_state_t current_state,
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_mode_select6(scsi_state_t current_state,
-                                          cdb_t * current_cdb __attribute__((unused)))
+mbed_error_t scsi_write_data6(scsi_state_t current_state, cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
+    usbmsc_lba_t rw_lba;
+    uint32_t rw_size;
     uint8_t next_state;
 
-    log_printf("%s\n", __func__);
+    log_printf("%s:\n", __func__);
 
     /* Sanity check and next state detection */
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_MODE_SELECT_6)) {
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_WRITE_6)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
     /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_MODE_SELECT_6);
+    next_state = scsi_next_state(current_state, SCSI_CMD_WRITE_6);
     /* @ assert next_state == SCSI_IDLE; */
+
     scsi_set_state(next_state);
 
-    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    /* SCSI standard says that the host should not request WRITE10 cmd
+     * before requesting GET_CAPACITY cmd. In this very case, we have to
+     * send back INVALID to the host */
+    if (scsi_ctx.storage_size == 0) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
+
+
+    /* 21 bits LBA: the 5 low bits of the CDB byte 1, then a big endian
+     * 16 bits value */
+    rw_lba = ((usbmsc_lba_t)current_cdb->payload.cdb6.logical_block_msb << 16) |
+        ntohs(current_cdb->payload.cdb6.logical_block);
+    rw_size = current_cdb->payload.cdb6.transfer_blocks;
+    if (rw_size == 0) {
+        /* for WRITE(6), a transfer length of 0 means 256 blocks */
+        rw_size = 256;
+    }
+    errcode = scsi_write_blocks(rw_lba, rw_size);
+
+ end:
     return errcode;
 
  invalid_transition:
@@ -1802,13 +3767,16 @@ mbed_error_t scsi_cmd_mode_select6(scsi_state_t current_state,
 }
 
 
-/* SCSI_CMD_MODE_SELECT(10) */
+
+/* SCSI_CMD_WRITE(10) */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, bbb_ctx.state ;
+  // below is the consequence of synchronous call to scsi_data_available() in waiting loop
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
 
   @ behavior badstate:
   @    assumes current_state != SCSI_IDLE;
@@ -1817,7 +3785,7 @@ mbed_error_t scsi_cmd_mode_select6(scsi_state_t current_state,
   @ behavior ok:
   @    assumes current_state == SCSI_IDLE;
   @    ensures scsi_ctx.state == SCSI_IDLE;
-  @    ensures \result == MBED_ERROR_NONE;
+  @    ensures \result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM;
 
 
   @ disjoint behaviors;
@@ -1827,45 +3795,61 @@ mbed_error_t scsi_cmd_mode_select6(scsi_state_t current_state,
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_mode_select10(scsi_state_t current_state,
-                                           cdb_t * current_cdb __attribute__((unused)))
+mbed_error_t scsi_write_data10(scsi_state_t current_state, cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
+    usbmsc_lba_t rw_lba;
+    uint32_t rw_size;
     uint8_t next_state;
 
-    log_printf("%s\n", __func__);
+    log_printf("%s:\n", __func__);
 
     /* Sanity check and next state detection */
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_MODE_SELECT_10)) {
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_WRITE_10)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
     /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_MODE_SELECT_10);
+    next_state = scsi_next_state(current_state, SCSI_CMD_WRITE_10);
     /* @ assert next_state == SCSI_IDLE; */
+
     scsi_set_state(next_state);
 
-    /* effective transition execution (if needed) */
-    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
-    /* @ assert bbb_ctx.state == USB_BBB_STATE_STATUS; */
+    /* SCSI standard says that the host should not request WRITE10 cmd
+     * before requesting GET_CAPACITY cmd. In this very case, we have to
+     * send back INVALID to the host */
+    if (scsi_ctx.storage_size == 0) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
+
+
+    rw_lba = ntohl(current_cdb->payload.cdb10.logical_block);
+    rw_size = ntohs(current_cdb->payload.cdb10.transfer_blocks);
+    errcode = scsi_write_blocks(rw_lba, rw_size);
+
+ end:
     return errcode;
 
  invalid_transition:
     log_printf("%s: invalid_transition\n", __func__);
     scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
-               ASCQ_NO_ADDITIONAL_SENSE);
+            ASCQ_NO_ADDITIONAL_SENSE);
     errcode = MBED_ERROR_INVSTATE;
     return errcode;
 }
 
-
-/* SCSI_CMD_TEST_UNIT_READY */
+/* SCSI_CMD_WRITE(12) */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns scsi_ctx, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, bbb_ctx.state ;
+  // below is the consequence of synchronous call to scsi_data_available() in waiting loop
+  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
 
   @ behavior badstate:
   @    assumes current_state != SCSI_IDLE;
@@ -1874,7 +3858,7 @@ mbed_error_t scsi_cmd_mode_select10(scsi_state_t current_state,
   @ behavior ok:
   @    assumes current_state == SCSI_IDLE;
   @    ensures scsi_ctx.state == SCSI_IDLE;
-  @    ensures \result == MBED_ERROR_NONE;
+  @    ensures \result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM;
 
 
   @ disjoint behaviors;
@@ -1884,42 +3868,53 @@ mbed_error_t scsi_cmd_mode_select10(scsi_state_t current_state,
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_cmd_test_unit_ready(scsi_state_t current_state,
-                                             cdb_t * current_cdb __attribute__((unused)))
+mbed_error_t scsi_write_data12(scsi_state_t current_state, cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
+    usbmsc_lba_t rw_lba;
+    uint32_t rw_size;
     uint8_t next_state;
 
-    log_printf("%s\n", __func__);
+    log_printf("%s:\n", __func__);
 
     /* Sanity check and next state detection */
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_TEST_UNIT_READY)) {
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_WRITE_12)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
     /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_TEST_UNIT_READY);
+    next_state = scsi_next_state(current_state, SCSI_CMD_WRITE_12);
     /* @ assert next_state == SCSI_IDLE; */
 
-    scsi_set_state(next_state);
+    scsi_set_state(next_state);
+
+    /* SCSI standard says that the host should not request WRITE12 cmd
+     * before requesting GET_CAPACITY cmd. In this very case, we have to
+     * send back INVALID to the host */
+    if (scsi_ctx.storage_size == 0) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
+
 
-    /* effective transition execution (if needed) */
-    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    rw_lba = ntohl(current_cdb->payload.cdb12.logical_block);
+    rw_size = ntohl(current_cdb->payload.cdb12.transfer_blocks);
+    errcode = scsi_write_blocks(rw_lba, rw_size);
+
+ end:
     return errcode;
 
  invalid_transition:
     log_printf("%s: invalid_transition\n", __func__);
     scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
-               ASCQ_NO_ADDITIONAL_SENSE);
+            ASCQ_NO_ADDITIONAL_SENSE);
     errcode = MBED_ERROR_INVSTATE;
     return errcode;
 }
 
-/*
- * SCSI_CMD_WRITE(6)
- * This command is declared as obsolete by the T10 consorsium.
- * It is implemented here for retrocompatibility with old Operating System
- */
+/* SCSI_CMD_WRITE(16) */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
@@ -1929,7 +3924,6 @@ mbed_error_t scsi_cmd_test_unit_ready(scsi_state_t current_state,
   // below is the consequence of synchronous call to scsi_data_available() in waiting loop
   @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
 
-
   @ behavior badstate:
   @    assumes current_state != SCSI_IDLE;
   @    ensures \result == MBED_ERROR_INVSTATE;
@@ -1947,32 +3941,28 @@ mbed_error_t scsi_cmd_test_unit_ready(scsi_state_t current_state,
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_write_data6(scsi_state_t current_state, cdb_t * current_cdb)
+mbed_error_t scsi_write_data16(scsi_state_t current_state, cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    uint32_t num_sectors;
-
-    uint32_t rw_lba;
-    uint16_t rw_size;
-    uint64_t rw_addr;
-
-    mbed_error_t error;
+    uint64_t rw_lba64;
+    usbmsc_lba_t rw_lba;
+    uint32_t rw_size;
     uint8_t next_state;
 
     log_printf("%s:\n", __func__);
 
     /* Sanity check and next state detection */
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_WRITE_6)) {
+    if (!scsi_is_valid_transition(current_state, SCSI_CMD_WRITE_16)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
     /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_WRITE_6);
+    next_state = scsi_next_state(current_state, SCSI_CMD_WRITE_16);
     /* @ assert next_state == SCSI_IDLE; */
 
     scsi_set_state(next_state);
 
-    /* SCSI standard says that the host should not request WRITE10 cmd
+    /* SCSI standard says that the host should not request WRITE16 cmd
      * before requesting GET_CAPACITY cmd. In this very case, we have to
      * send back INVALID to the host */
     if (scsi_ctx.storage_size == 0) {
@@ -1983,167 +3973,150 @@ mbed_error_t scsi_write_data6(scsi_state_t current_state, cdb_t * current_cdb)
     }
 
 
-    /* TODO: is the big endian is set only on the last 16 bytes of this
-     * unaligned field ? */
-    rw_lba = ntohs((uint16_t)(current_cdb->payload.cdb6.logical_block & 0xffff))
-        + (current_cdb->payload.cdb6.logical_block & 0x1f0000);
-    rw_size = current_cdb->payload.cdb6.transfer_blocks;
-    rw_addr = (uint64_t) scsi_ctx.block_size * (uint64_t) rw_lba;
+    rw_lba64 = scsi_ntohll(current_cdb->payload.cdb16.logical_block);
+#if !CONFIG_USR_LIB_MASSSTORAGE_LBA64
+    if (rw_lba64 > UINT32_MAX) {
+        /* beyond the 32 bits storage size */
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+                   ASCQ_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+#endif
+    rw_lba = (usbmsc_lba_t)rw_lba64;
+    rw_size = ntohl(current_cdb->payload.cdb16.transfer_blocks);
+    errcode = scsi_write_blocks(rw_lba, rw_size);
 
-    /* initialize size_to_process. This variable will be upated during the
-     * active wait loop below by the USB BBB triggers (usb_data_sent for
-     * read, usb_data_available for write */
-    set_u32_with_membarrier(&scsi_ctx.size_to_process, scsi_ctx.block_size * rw_size);
+ end:
+    return errcode;
 
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+            ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
+    return errcode;
+}
 
-#if SCSI_DEBUG > 1
-    uint32_t total_num_sectors = rw_size;
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME
+/*
+ * WRITE SAME engine.
+ *
+ * A single block is received from the host (or is made of zeros, NDOB set),
+ * and is written to num_blocks blocks starting at lba. The block is replicated
+ * in the whole buffer, which is then written to the backend as many times as
+ * needed, so that the backend is accessed with big requests. When the
+ * backend provides a zero-fill function, it is used for blocks of zeros.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires scsi_ctx.block_size > 0;
+  @ requires num_blocks > 0;
 
-    log_printf("%s: sz %u, block_size: %u | num_sectors: %u\n", __func__,
-           scsi_ctx.size_to_process, scsi_ctx.block_size, total_num_sectors);
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM);
+  */
+#ifndef __FRAMAC__
+static
 #endif
+mbed_error_t scsi_write_same_blocks(usbmsc_lba_t lba, uint32_t num_blocks, bool ndob)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    mbed_error_t error;
+    uint8_t *buf = scsi_ctx.global_buf;
+    uint32_t block_size = scsi_ctx.block_size;
+    uint32_t batch;
+    uint32_t cur_blocks;
+    uint32_t i;
+    bool zero = true;
 
-    /*@
-      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, current_cdb, &scsi_ctx);
+    /* the whole buffer is used, whatever the data path */
+    batch = scsi_ctx.global_buf_len / block_size;
+    if (batch == 0) {
+        log_printf("%s: buffer smaller than block size\n", __func__);
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
 
-      @ loop assigns num_sectors, error, rw_lba,
-                     scsi_ctx.addr, scsi_ctx.direction, scsi_ctx.line_state,GHOST_opaque_drv_privates, bbb_ctx.state,
-                     GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.state;
-      */
-    while (scsi_ctx.size_to_process > scsi_ctx.global_buf_len) {
-        scsi_get_data(scsi_ctx.global_buf, scsi_ctx.global_buf_len);
-        num_sectors = scsi_ctx.global_buf_len / scsi_ctx.block_size;
-        /* Wait until we have indeed received data from the USB lower layers */
-        /* here, we wait for an asyncrhonous execution of a trigger setting the OUT EP as having
-         * received data.
-         * This trigger is scsi_data_available(), which is executed when the bbb stack is triggered
-         * by the driver outep interrupt in DATA mode.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY) {
-            /* emulating asynchronous trigger */
-            scsi_data_available(scsi_ctx.global_buf_len);
-        }
-#else
-        while (scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY) {
-            request_data_membarrier();
-            continue;
-        }
+    if (ndob) {
+#ifndef __FRAMAC__
+        memset(buf, 0x0, block_size);
 #endif
-        error = usbmsc_storage_backend_write(rw_lba, num_sectors);
-        if (error == MBED_ERROR_WRERROR) {
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
-                    ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_NOSTORAGE;
-            goto end;
-        }
-        uint32_t logicalblock_increment = scsi_ctx.global_buf_len / scsi_ctx.block_size;
-        if ((UINT32_MAX - rw_lba) < logicalblock_increment) {
-            /* uint32 overflow detected! */
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
-                       ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_INVPARAM;
-            goto end;
-        }
-        rw_lba += logicalblock_increment;
-        /* wait for async event making current state ready to recv */
-        /* here, we wait for an asyncrhonous execution of a trigger setting the OUT EP as having
-         * received data.
-         * This trigger is scsi_data_available(), which is executed when the bbb stack is triggered
-         * by the driver outep interrupt in DATA mode.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (!scsi_is_ready_for_data_receive()) {
-            /* emulating asynchronous trigger */
-            scsi_data_available(scsi_ctx.global_buf_len);
-        }
-#else
-        while (!scsi_is_ready_for_data_receive()) {
-            request_data_membarrier();
-            continue;
+    } else {
+        /* receiving the single block of data */
+        set_u32_with_membarrier(&scsi_ctx.size_to_process, block_size);
+        scsi_get_data(buf, block_size);
+        scsi_wait_for_data_received();
+        set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+        for (i = 0; i < block_size && zero; i++) {
+            zero = (buf[i] == 0);
         }
-#endif
     }
 
-    /* Fractional residue */
-    if (scsi_ctx.size_to_process > 0) {
-
-        scsi_get_data(scsi_ctx.global_buf, scsi_ctx.size_to_process);
-        /* num_sectors *must* be calculated before waiting for ISR, as
-         * the ISR trigger decrement size_to_process */
-        num_sectors = (scsi_ctx.size_to_process) / scsi_ctx.block_size;
-        /* Wait until we have indeed received data from the USB lower layers */
-        /* here, we wait for an asyncrhonous execution of a trigger setting the OUT EP as having
-         * received data.
-         * This trigger is scsi_data_available(), which is executed when the bbb stack is triggered
-         * by the driver outep interrupt in DATA mode.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY) {
-            /* emulating asynchronous trigger */
-            scsi_data_available(scsi_ctx.global_buf_len);
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME_ZEROES
+    if (zero) {
+        error = scsi_drop_cached_blocks(lba, num_blocks);
+        if (error == MBED_ERROR_NONE) {
+            error = usbmsc_storage_backend_write_zeroes(lba, num_blocks);
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+            if (error != MBED_ERROR_NONE) {
+                scsi_stats_backend_error(true);
+            }
+#endif
         }
-#else
-        while(scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY){
-            request_data_membarrier();
-            continue;
+        if (error != MBED_ERROR_NONE) {
+            goto write_error;
         }
+        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+        goto end;
+    }
+#else
+    (void)zero;
 #endif
-        error = usbmsc_storage_backend_write(rw_lba, num_sectors);
-        if (error == MBED_ERROR_WRERROR) {
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
-                    ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_NOSTORAGE;
-            goto end;
+
+    /* the received block is replicated in the whole buffer */
+    if (batch > num_blocks) {
+        batch = num_blocks;
+    }
+    for (i = 1; i < batch; i++) {
+        memcpy(&buf[i * block_size], buf, block_size);
+    }
+    /*@ loop assigns num_blocks, lba, cur_blocks, error; */
+    while (num_blocks > 0) {
+        cur_blocks = (num_blocks > batch) ? batch : num_blocks;
+        error = scsi_drop_cached_blocks(lba, cur_blocks);
+        if (error == MBED_ERROR_NONE) {
+            error = scsi_backend_submit_write(buf, lba, cur_blocks);
         }
-        /* wait for async event making current state ready to recv */
-        /* here, we wait for an asyncrhonous execution of a trigger setting the OUT EP as having
-         * received data.
-         * This trigger is scsi_data_available(), which is executed when the bbb stack is triggered
-         * by the driver outep interrupt in DATA mode.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (!scsi_is_ready_for_data_receive()) {
-            /* emulating asynchronous trigger */
-            scsi_data_available(scsi_ctx.global_buf_len);
+        if (error == MBED_ERROR_NONE) {
+            error = scsi_backend_wait();
         }
-#else
-        while (!scsi_is_ready_for_data_receive()) {
-            request_data_membarrier();
-            continue;
+        if (error != MBED_ERROR_NONE) {
+            goto write_error;
         }
-#endif
+        lba += cur_blocks;
+        num_blocks -= cur_blocks;
     }
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
  end:
     return errcode;
 
- invalid_transition:
-    log_printf("%s: invalid_transition\n", __func__);
-    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+ write_error:
+    scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
                ASCQ_NO_ADDITIONAL_SENSE);
-    errcode = MBED_ERROR_INVSTATE;
+    errcode = MBED_ERROR_NOSTORAGE;
     return errcode;
 }
 
-
-
-/* SCSI_CMD_WRITE(10) */
+/* SCSI_CMD_WRITE_SAME_10 and WRITE_SAME_16 */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
   @ requires \valid_read(current_cdb);
   @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
 
-  @ assigns scsi_ctx, GHOST_opaque_drv_privates, bbb_ctx.state ;
-  // below is the consequence of synchronous call to scsi_data_available() in waiting loop
-  @ assigns GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.line_state, scsi_ctx.direction, scsi_ctx.state;
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
 
   @ behavior badstate:
   @    assumes current_state != SCSI_IDLE;
@@ -2151,10 +4124,8 @@ mbed_error_t scsi_write_data6(scsi_state_t current_state, cdb_t * current_cdb)
 
   @ behavior ok:
   @    assumes current_state == SCSI_IDLE;
-  @    ensures scsi_ctx.state == SCSI_IDLE;
   @    ensures \result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM;
 
-
   @ disjoint behaviors;
   @ complete behaviors;
 
@@ -2162,34 +4133,27 @@ mbed_error_t scsi_write_data6(scsi_state_t current_state, cdb_t * current_cdb)
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t scsi_write_data10(scsi_state_t current_state, cdb_t * current_cdb)
+mbed_error_t scsi_cmd_write_same(scsi_state_t current_state, cdb_t * current_cdb)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    uint32_t num_sectors;
-
-    uint32_t rw_lba;
-    uint16_t rw_size;
-    uint64_t rw_addr;
-
-    mbed_error_t error;
     uint8_t next_state;
+    uint64_t lba;
+    uint32_t num_blocks;
+    bool ndob = false;
+    bool invalid;
 
     log_printf("%s:\n", __func__);
 
     /* Sanity check and next state detection */
-    if (!scsi_is_valid_transition(current_state, SCSI_CMD_WRITE_10)) {
+    if (!scsi_is_valid_transition(current_state, current_cdb->operation)) {
         /*@ assert current_state != SCSI_IDLE; */
         goto invalid_transition;
     }
     /* @ assert current_state == SCSI_IDLE; */
-    next_state = scsi_next_state(current_state, SCSI_CMD_WRITE_10);
+    next_state = scsi_next_state(current_state, current_cdb->operation);
     /* @ assert next_state == SCSI_IDLE; */
-
     scsi_set_state(next_state);
 
-    /* SCSI standard says that the host should not request WRITE10 cmd
-     * before requesting GET_CAPACITY cmd. In this very case, we have to
-     * send back INVALID to the host */
     if (scsi_ctx.storage_size == 0) {
         scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
                    ASCQ_NO_ADDITIONAL_SENSE);
@@ -2197,141 +4161,348 @@ mbed_error_t scsi_write_data10(scsi_state_t current_state, cdb_t * current_cdb)
         goto end;
     }
 
+    if (current_cdb->operation == SCSI_CMD_WRITE_SAME_10) {
+        cdb10_write_same_t *ws10 = &current_cdb->payload.cdb10_write_same;
 
-    rw_lba = ntohl(current_cdb->payload.cdb10.logical_block);
-    rw_size = ntohs(current_cdb->payload.cdb10.transfer_blocks);
-    rw_addr = (uint64_t) scsi_ctx.block_size * (uint64_t) rw_lba;
+        lba = ntohl(ws10->logical_block);
+        num_blocks = ntohs(ws10->num_blocks);
+        /* no protection information, no anchored blocks */
+        invalid = (ws10->wrprotect || ws10->anchor || ws10->pbdata || ws10->lbdata);
+    } else {
+        cdb16_write_same_t *ws16 = &current_cdb->payload.cdb16_write_same;
+
+        lba = scsi_ntohll(ws16->logical_block);
+        num_blocks = ntohl(ws16->num_blocks);
+        ndob = ws16->ndob;
+        invalid = (ws16->wrprotect || ws16->anchor || ws16->pbdata || ws16->lbdata);
+    }
+    /* the UNMAP bit is ignored: the blocks are always written, as unmapped
+     * blocks don't read back as zeros (LBPRZ not set).
+     * A command is executed at once: its length is bounded by the MAXIMUM
+     * WRITE SAME LENGTH of the Block Limits VPD page, and the zero length,
+     * meaning up to the last block, is not supported (WSNZ set) */
+    if (invalid || num_blocks == 0 ||
+        num_blocks > CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME_MAX_LENGTH) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB,
+                   ASCQ_INVALID_FIELD_IN_CDB);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    if (lba > scsi_ctx.storage_size || num_blocks > scsi_ctx.storage_size - lba) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+                   ASCQ_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    errcode = scsi_write_same_blocks((usbmsc_lba_t)lba, num_blocks, ndob);
 
-    /* initialize size_to_process. This variable will be upated during the
-     * active wait loop below by the USB BBB triggers (usb_data_sent for
-     * read, usb_data_available for write */
-    set_u32_with_membarrier(&scsi_ctx.size_to_process, scsi_ctx.block_size * rw_size);
+ end:
+    return errcode;
 
+ invalid_transition:
+    log_printf("%s: invalid_transition\n", __func__);
+    scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+            ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_INVSTATE;
+    return errcode;
+}
+#endif
 
-#if SCSI_DEBUG > 1
-    uint32_t total_num_sectors = rw_size;
+/*
+ * Get the content of at most max_blocks storage blocks starting at lba, for
+ * VERIFY. With the buffered data paths, the blocks are read into buf, which
+ * is the beginning of the global buffer. With the zero-copy data path, the
+ * backend maps them, and the area is released by scsi_verify_release().
+ */
+/*@
+  @ requires \valid(data) && \valid(num_blocks);
+  @ assigns *data, *num_blocks;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_verify_fetch(usbmsc_lba_t lba, uint32_t max_blocks, uint8_t *buf,
+                               uint8_t **data, uint32_t *num_blocks)
+{
+    mbed_error_t errcode;
+
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+    (void)buf;
+    *data = NULL;
+    *num_blocks = 0;
+    errcode = usbmsc_storage_backend_map(lba, max_blocks, false, data, num_blocks);
+    if (errcode == MBED_ERROR_NONE &&
+        (*data == NULL || *num_blocks == 0 || *num_blocks > max_blocks)) {
+        if (*data != NULL) {
+            usbmsc_storage_backend_unmap(lba, 0, false, *data);
+        }
+        errcode = MBED_ERROR_NOSTORAGE;
+    }
+# if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    if (errcode != MBED_ERROR_NONE) {
+        scsi_stats_backend_error(false);
+    }
+# endif
+#else
+    errcode = scsi_backend_submit_read(buf, lba, max_blocks);
+    if (errcode == MBED_ERROR_NONE) {
+        errcode = scsi_backend_wait();
+    }
+    *data = buf;
+    *num_blocks = max_blocks;
+#endif
+    return errcode;
+}
+
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+void scsi_verify_release(usbmsc_lba_t lba, uint32_t num_blocks, uint8_t *data)
+{
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+    usbmsc_storage_backend_unmap(lba, num_blocks, false, data);
+#else
+    (void)lba;
+    (void)num_blocks;
+    (void)data;
+#endif
+}
+
+/*
+ * VERIFY engine.
+ *
+ * With BYTCHK set to 0, the blocks are only checked to be readable, by the
+ * backend verify function when there is one, or by reading them from the
+ * backend, without any data phase. With BYTCHK set to 1, the blocks are
+ * compared with the data sent by the host, chunk by chunk. With BYTCHK set to
+ * 3, a single block is sent by the host and compared with each block.
+ * Writes still held by the stack are flushed first, so that the storage
+ * itself is verified.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires scsi_ctx.block_size > 0;
+  @ requires num_blocks > 0;
+
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+  @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM || \result == MBED_ERROR_WRERROR);
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_verify_blocks(usbmsc_lba_t lba, uint32_t num_blocks, uint8_t bytchk)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t block_size = scsi_ctx.block_size;
+    uint32_t max_blocks;
+    uint32_t cur_blocks;
+    uint32_t i;
+    uint8_t *host_buf;
+    uint8_t *data = NULL;
+    bool miscompare = false;
+
+    /* the host data are received after the blocks read from the backend,
+     * which always fills the beginning of the buffer */
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+    max_blocks = scsi_ctx.global_buf_len / block_size;
+    host_buf = scsi_ctx.global_buf;
+#else
+    max_blocks = (scsi_ctx.global_buf_len / 2) / block_size;
+    host_buf = &scsi_ctx.global_buf[max_blocks * block_size];
+#endif
+    if (max_blocks == 0) {
+        log_printf("%s: buffer too small\n", __func__);
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    if (scsi_cache_flush() != MBED_ERROR_NONE) {
+        goto write_error;
+    }
+#elif CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+    if (scsi_gather_flush_range(lba, num_blocks) != MBED_ERROR_NONE) {
+        goto write_error;
+    }
+#endif
 
-    log_printf("%s: sz %u, block_size: %u | num_sectors: %u\n", __func__,
-           scsi_ctx.size_to_process, scsi_ctx.block_size, total_num_sectors);
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_VERIFY
+    if (bytchk == 0) {
+        if (usbmsc_storage_backend_verify(lba, num_blocks) != MBED_ERROR_NONE) {
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+            scsi_stats_backend_error(false);
+#endif
+            goto read_error;
+        }
+        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+        goto end;
+    }
 #endif
 
+    if (bytchk == 1) {
+        set_u32_with_membarrier(&scsi_ctx.size_to_process, num_blocks * block_size);
+    } else if (bytchk == 3) {
+        /* receiving the single block compared with all the others */
+        set_u32_with_membarrier(&scsi_ctx.size_to_process, block_size);
+        scsi_get_data(host_buf, block_size);
+        scsi_wait_for_data_received();
+        set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    }
+
     /*@
-      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, current_cdb, &scsi_ctx);
+      @ loop invariant \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+      @ loop assigns cur_blocks, num_blocks, lba, i, data, miscompare,
+                     scsi_ctx.addr, scsi_ctx.transfer_size, scsi_ctx.direction, scsi_ctx.line_state,
+                     GHOST_opaque_drv_privates, bbb_ctx.state,
+                     GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.state;
+      */
+    while (num_blocks > 0) {
+        cur_blocks = (num_blocks > max_blocks) ? max_blocks : num_blocks;
+        if (scsi_verify_fetch(lba, cur_blocks, scsi_ctx.global_buf, &data, &cur_blocks) != MBED_ERROR_NONE) {
+            goto read_error;
+        }
+        if (bytchk == 1) {
+            scsi_get_data(host_buf, cur_blocks * block_size);
+            scsi_wait_for_data_received();
+            miscompare = (memcmp(data, host_buf, cur_blocks * block_size) != 0);
+        } else if (bytchk == 3) {
+            for (i = 0; i < cur_blocks && !miscompare; i++) {
+                miscompare = (memcmp(&data[i * block_size], host_buf, block_size) != 0);
+            }
+        }
+        scsi_verify_release(lba, cur_blocks, data);
+        if (miscompare) {
+            goto miscompare;
+        }
+        lba += cur_blocks;
+        num_blocks -= cur_blocks;
+    }
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+    scsi_set_state(SCSI_IDLE);
+ end:
+    return errcode;
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE || CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+ write_error:
+    scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_WRERROR;
+    return errcode;
+#endif
+
+ read_error:
+    /* the data phase, if any, is aborted */
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, 0);
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR,
+               ASCQ_NO_ADDITIONAL_SENSE);
+    errcode = MBED_ERROR_NOSTORAGE;
+    return errcode;
+
+ miscompare:
+    set_u32_with_membarrier(&scsi_ctx.size_to_process, 0);
+    set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
+    scsi_error(SCSI_SENSE_MISCOMPARE, ASC_MISCOMPARE_DURING_VERIFY_OPERATION,
+               ASCQ_MISCOMPARE_DURING_VERIFY_OPERATION);
+    errcode = MBED_ERROR_INVPARAM;
+    return errcode;
+}
+
+/* SCSI_CMD_VERIFY_10 and VERIFY_16 */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx);
+  @ requires \valid_read(current_cdb);
+  @ requires SCSI_IDLE <= current_state <= SCSI_ERROR;
+
+  @ assigns scsi_ctx, GHOST_opaque_drv_privates, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
+
+  @ behavior badstate:
+  @    assumes current_state != SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_INVSTATE;
+
+  @ behavior ok:
+  @    assumes current_state == SCSI_IDLE;
+  @    ensures \result == MBED_ERROR_NONE || \result == MBED_ERROR_NOSTORAGE || \result == MBED_ERROR_INVPARAM || \result == MBED_ERROR_WRERROR;
+
+  @ disjoint behaviors;
+  @ complete behaviors;
+
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cmd_verify(scsi_state_t current_state, cdb_t * current_cdb)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t next_state;
+    uint64_t lba;
+    uint32_t num_blocks;
+    uint8_t bytchk;
+    uint8_t vrprotect;
 
-      @ loop assigns num_sectors, error, rw_lba,
-                     scsi_ctx.addr, scsi_ctx.direction, scsi_ctx.line_state,GHOST_opaque_drv_privates, bbb_ctx.state,
-                     GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, scsi_ctx.size_to_process, scsi_ctx.state;
-      */
-    while (scsi_ctx.size_to_process > scsi_ctx.global_buf_len) {
-        scsi_get_data(scsi_ctx.global_buf, scsi_ctx.global_buf_len);
-        num_sectors = scsi_ctx.global_buf_len / scsi_ctx.block_size;
-        /* Wait until we have indeed received data from the USB lower layers */
-        /* here, we wait for an asyncrhonous execution of a trigger setting the OUT EP as having
-         * received data.
-         * This trigger is scsi_data_available(), which is executed when the bbb stack is triggered
-         * by the driver outep interrupt in DATA mode.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
+    log_printf("%s:\n", __func__);
 
-#ifdef __FRAMAC__
-        if (scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY) {
-            /* emulating asynchronous trigger */
-            scsi_data_available(scsi_ctx.global_buf_len);
-        }
-#else
-        while(scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY) {
-            request_data_membarrier();
-            continue;
-        }
-#endif
-        error = usbmsc_storage_backend_write(rw_lba, num_sectors);
-        if (error == MBED_ERROR_WRERROR) {
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
-                    ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_NOSTORAGE;
-            goto end;
-        }
-        uint32_t logicalblock_increment = scsi_ctx.global_buf_len / scsi_ctx.block_size;
-        if ((UINT32_MAX - rw_lba) < logicalblock_increment) {
-            /* uint32 overflow detected! */
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
-                       ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_INVPARAM;
-            goto end;
-        }
-        rw_lba += logicalblock_increment;
-        /* here, we wait for an asyncrhonous execution of a trigger setting the IN EP as ready.
-         * This trigger is scsi_data_sent(), which is executed when all the previously data
-         * configured to be send has been transmitted to the host.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (!scsi_is_ready_for_data_receive()) {
-            /* emulating asynchronous trigger */
-            scsi_data_available(scsi_ctx.global_buf_len);
-        }
-#else
-        while (!scsi_is_ready_for_data_receive()) {
-            request_data_membarrier();
-            continue;
-        }
-#endif
+    /* Sanity check and next state detection */
+    if (!scsi_is_valid_transition(current_state, current_cdb->operation)) {
+        /*@ assert current_state != SCSI_IDLE; */
+        goto invalid_transition;
     }
+    /* @ assert current_state == SCSI_IDLE; */
+    next_state = scsi_next_state(current_state, current_cdb->operation);
+    /* @ assert next_state == SCSI_IDLE; */
+    scsi_set_state(next_state);
 
-    /* Fractional residue */
-    if (scsi_ctx.size_to_process > 0) {
+    if (scsi_ctx.storage_size == 0) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto end;
+    }
 
-        scsi_get_data(scsi_ctx.global_buf, scsi_ctx.size_to_process);
-        /* num_sectors *must* be calculated before waiting for ISR, as
-         * the ISR trigger decrement size_to_process */
-        num_sectors = (scsi_ctx.size_to_process) / scsi_ctx.block_size;
-        /* Wait until we have indeed received data from the USB lower layers */
-        /* here, we wait for an asyncrhonous execution of a trigger setting the OUT EP as having
-         * received data.
-         * This trigger is scsi_data_available(), which is executed when the bbb stack is triggered
-         * by the driver outep interrupt in DATA mode.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY) {
-            /* emulating asynchronous trigger */
-            scsi_data_available(scsi_ctx.global_buf_len);
-        }
-#else
-        while(scsi_ctx.line_state != SCSI_TRANSMIT_LINE_READY){
-            request_data_membarrier();
-            continue;
-        }
-#endif
-        error = usbmsc_storage_backend_write(rw_lba, num_sectors);
-        if (error == MBED_ERROR_WRERROR) {
-            scsi_error(SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
-                       ASCQ_NO_ADDITIONAL_SENSE);
-            errcode = MBED_ERROR_NOSTORAGE;
-            goto end;
-        }
-        /* here, we wait for an asyncrhonous execution of a trigger setting the OUT EP as having
-         * received data.
-         * This trigger is scsi_data_available(), which is executed when the bbb stack is triggered
-         * by the driver outep interrupt in DATA mode.
-         * Using FramaC, we can't emulate multithreaded execution, so we synchronously execute
-         * this trigger, instead of waiting for its asyncrhonous execution.
-         */
-#ifdef __FRAMAC__
-        if (!scsi_is_ready_for_data_receive()) {
-            /* emulating asynchronous trigger */
-            scsi_data_available(scsi_ctx.global_buf_len);
-        }
-#else
-        while (!scsi_is_ready_for_data_receive()) {
-            request_data_membarrier();
-            continue;
-        }
-#endif
+    if (current_cdb->operation == SCSI_CMD_VERIFY_10) {
+        lba = ntohl(current_cdb->payload.cdb10_verify.logical_block);
+        num_blocks = ntohs(current_cdb->payload.cdb10_verify.verification_length);
+        bytchk = current_cdb->payload.cdb10_verify.bytchk;
+        vrprotect = current_cdb->payload.cdb10_verify.vrprotect;
+    } else {
+        lba = scsi_ntohll(current_cdb->payload.cdb16_verify.logical_block);
+        num_blocks = ntohl(current_cdb->payload.cdb16_verify.verification_length);
+        bytchk = current_cdb->payload.cdb16_verify.bytchk;
+        vrprotect = current_cdb->payload.cdb16_verify.vrprotect;
+    }
+    /* no protection information, BYTCHK 2 is reserved */
+    if (vrprotect != 0 || bytchk == 2) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB,
+                   ASCQ_INVALID_FIELD_IN_CDB);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    if (lba > scsi_ctx.storage_size || num_blocks > scsi_ctx.storage_size - lba) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+                   ASCQ_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    /* size_to_process is a 32 bits byte counter */
+    if (bytchk == 1 && (uint64_t)num_blocks * (uint64_t)scsi_ctx.block_size > UINT32_MAX) {
+        scsi_error(SCSI_SENSE_ILLEGAL_REQUEST, ASC_NO_ADDITIONAL_SENSE,
+                   ASCQ_NO_ADDITIONAL_SENSE);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    if (num_blocks == 0) {
+        /* nothing to verify, no data phase */
+        usb_bbb_send_csw(CSW_STATUS_SUCCESS, 0);
+        goto end;
     }
+    errcode = scsi_verify_blocks((usbmsc_lba_t)lba, num_blocks, bytchk);
+
  end:
     return errcode;
 
@@ -2358,12 +4529,300 @@ mbed_error_t usbmsc_initialize_automaton(void)
     return MBED_ERROR_NONE;
 }
 
+/*
+ * Signal a media change, from any context. The capacity cache is invalidated
+ * and the next command is failed with a UNIT ATTENTION by the main thread.
+ */
+/*@
+  @ assigns scsi_ctx.luns[0 .. SCSI_MAX_LUNS-1].media_changed;
+  */
+void usbmsc_media_changed(void)
+{
+    uint8_t i;
+
+    /*@
+      @ loop invariant 0 <= i <= SCSI_MAX_LUNS;
+      @ loop assigns i, scsi_ctx.luns[0 .. SCSI_MAX_LUNS-1].media_changed;
+      @ loop variant SCSI_MAX_LUNS - i;
+      */
+    for (i = 0; i < SCSI_MAX_LUNS; i++) {
+        set_bool_with_membarrier(&scsi_ctx.luns[i].media_changed, true);
+    }
+}
+
+/*
+ * Signal a media change of a single LUN, from any context.
+ */
+/*@
+  @ assigns scsi_ctx.luns[0 .. SCSI_MAX_LUNS-1].media_changed;
+  */
+mbed_error_t usbmsc_lun_media_changed(uint8_t lun)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (lun >= SCSI_MAX_LUNS) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    set_bool_with_membarrier(&scsi_ctx.luns[lun].media_changed, true);
+err:
+    return errcode;
+}
+
+/*
+ * LUN of the command being executed, or when the automaton is idle, of the
+ * blocks held by the caches (e.g. for read-ahead and gathered writes
+ * flushes).
+ */
+/*@
+  @ assigns \nothing;
+  */
+uint8_t usbmsc_get_lun(void)
+{
+    return scsi_ctx.lun;
+}
+
+/*
+ * Make the given LUN the addressed one, before executing a command. The
+ * state of the previous LUN is saved in its context and the state of the new
+ * one is loaded. The caches are left untouched, see scsi_select_media_lun().
+ */
+/*@
+  @ requires lun < SCSI_MAX_LUNS;
+  @ requires scsi_ctx.lun < SCSI_MAX_LUNS;
+  @ assigns scsi_ctx.lun, scsi_ctx.luns[0 .. SCSI_MAX_LUNS-1], scsi_ctx.error,
+            scsi_ctx.block_size, scsi_ctx.storage_size, scsi_ctx.capacity_cached,
+            scsi_ctx.unit_attention;
+  @ ensures scsi_ctx.lun == lun;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void scsi_select_lun(uint8_t lun)
+{
+    scsi_lun_context_t *lun_ctx;
+
+    if (lun == scsi_ctx.lun) {
+        return;
+    }
+    log_printf("%s: LUN %d -> %d\n", __func__, scsi_ctx.lun, lun);
+    lun_ctx = &scsi_ctx.luns[scsi_ctx.lun];
+    lun_ctx->error = scsi_ctx.error;
+    lun_ctx->block_size = scsi_ctx.block_size;
+    lun_ctx->storage_size = scsi_ctx.storage_size;
+    lun_ctx->capacity_cached = scsi_ctx.capacity_cached;
+    lun_ctx->unit_attention = scsi_ctx.unit_attention;
+
+    lun_ctx = &scsi_ctx.luns[lun];
+    scsi_ctx.error = lun_ctx->error;
+    scsi_ctx.block_size = lun_ctx->block_size;
+    scsi_ctx.storage_size = lun_ctx->storage_size;
+    scsi_ctx.capacity_cached = lun_ctx->capacity_cached;
+    scsi_ctx.unit_attention = lun_ctx->unit_attention;
+    scsi_ctx.lun = lun;
+}
+
+/*
+ * Commands reading or writing the media, or flushing the write caches. The
+ * others (e.g. TEST UNIT READY or INQUIRY, which hosts periodically send to
+ * every LUN) don't touch the caches.
+ */
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+bool scsi_is_media_command(uint8_t operation)
+{
+    switch (operation) {
+        case SCSI_CMD_READ_6:
+        case SCSI_CMD_READ_10:
+        case SCSI_CMD_READ_12:
+        case SCSI_CMD_READ_16:
+        case SCSI_CMD_WRITE_6:
+        case SCSI_CMD_WRITE_10:
+        case SCSI_CMD_WRITE_12:
+        case SCSI_CMD_WRITE_16:
+        case SCSI_CMD_VERIFY_10:
+        case SCSI_CMD_VERIFY_16:
+        case SCSI_CMD_UNMAP:
+        case SCSI_CMD_WRITE_SAME_10:
+        case SCSI_CMD_WRITE_SAME_16:
+        case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+        case SCSI_CMD_SYNCHRONIZE_CACHE_16:
+        case SCSI_CMD_START_STOP_UNIT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Make the caches hold the blocks of the given LUN, before executing a
+ * command accessing its media. The read-ahead, sector and write caches only
+ * hold blocks of media_lun: when another LUN is accessed, the cached writes
+ * are flushed to the backend with media_lun addressed, so that
+ * usbmsc_get_lun() returns it, then the caches are emptied. The cached
+ * writes which could not be flushed are dropped anyway, as they must not
+ * reach the storage of the new LUN: the error is deferred to the next
+ * command of the previous LUN.
+ */
+/*@
+  @ requires lun < SCSI_MAX_LUNS;
+  @ requires scsi_ctx.lun < SCSI_MAX_LUNS;
+  @ requires scsi_ctx.media_lun < SCSI_MAX_LUNS;
+  @ assigns scsi_ctx.lun, scsi_ctx.media_lun, scsi_ctx.luns[0 .. SCSI_MAX_LUNS-1],
+            scsi_ctx.error, scsi_ctx.block_size, scsi_ctx.storage_size,
+            scsi_ctx.capacity_cached, scsi_ctx.unit_attention;
+  @ ensures scsi_ctx.media_lun == lun;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void scsi_select_media_lun(uint8_t lun)
+{
+    if (lun == scsi_ctx.media_lun) {
+        return;
+    }
+    log_printf("%s: LUN %d -> %d\n", __func__, scsi_ctx.media_lun, lun);
+    scsi_select_lun(scsi_ctx.media_lun);
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    if (scsi_cache_flush() != MBED_ERROR_NONE) {
+        log_printf("%s: cached writes flush error\n", __func__);
+        scsi_defer_error(scsi_ctx.lun, SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+                         ASCQ_NO_ADDITIONAL_SENSE);
+    }
+    scsi_cache_drop();
+#elif CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+    if (scsi_gather_flush() != MBED_ERROR_NONE) {
+        log_printf("%s: gathered writes flush error\n", __func__);
+        scsi_defer_error(scsi_ctx.lun, SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+                         ASCQ_NO_ADDITIONAL_SENSE);
+    }
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+    scsi_readahead_reset();
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+    scsi_sector_cache_reset();
+#endif
+    scsi_ctx.media_lun = lun;
+}
+
+/*
+ * Handle a media change signaled by usbmsc_media_changed(), in the main
+ * thread. The storage geometry is invalidated and a UNIT ATTENTION condition
+ * is established. This condition is reported to the host with the next
+ * command, except for INQUIRY, REQUEST SENSE and REPORT LUNS, which are
+ * executed normally (see SPC-4, 5.14 Unit attention conditions).
+ * Returns true if the command has been failed with the UNIT ATTENTION status.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx, cdb);
+  @ requires \valid_read(cdb);
+  @ requires scsi_ctx.lun < SCSI_MAX_LUNS;
+  @ assigns scsi_ctx.luns[scsi_ctx.lun].media_changed, scsi_ctx.unit_attention, scsi_ctx.capacity_cached,
+            scsi_ctx.storage_size, scsi_ctx.block_size, scsi_ctx.error,
+            GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.state;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+bool scsi_check_unit_attention(const cdb_t *cdb)
+{
+    if (scsi_ctx.luns[scsi_ctx.lun].media_changed) {
+        set_bool_with_membarrier(&scsi_ctx.luns[scsi_ctx.lun].media_changed, false);
+        scsi_ctx.capacity_cached = false;
+        scsi_ctx.storage_size = 0;
+        scsi_ctx.block_size = 0;
+        scsi_ctx.unit_attention = true;
+        if (scsi_ctx.lun == scsi_ctx.media_lun) {
+            /* the cached blocks belong to the previous medium. Otherwise
+             * the caches hold the blocks of another LUN */
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+            scsi_readahead_reset();
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+            scsi_cache_drop();
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+            scsi_sector_cache_reset();
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+            scsi_gather_drop();
+#endif
+        }
+    }
+    if (!scsi_ctx.unit_attention) {
+        return false;
+    }
+    switch (cdb->operation) {
+        case SCSI_CMD_INQUIRY:
+        case SCSI_CMD_REQUEST_SENSE:
+        case SCSI_CMD_REPORT_LUNS:
+            return false;
+        default:
+            break;
+    }
+    scsi_ctx.unit_attention = false;
+    log_printf("%s: media changed, unit attention\n", __func__);
+    scsi_error(SCSI_SENSE_UNIT_ATTENTION, ASC_MEDIUM_MAY_HAVE_CHANGED,
+               ASCQ_MEDIUM_MAY_HAVE_CHANGED);
+    return true;
+}
+
+/*
+ * Report the deferred error of the addressed LUN, if any, recorded by
+ * scsi_defer_error(). As for unit attentions, INQUIRY and REPORT LUNS are
+ * executed normally. REQUEST SENSE returns the deferred error when no other
+ * sense is pending (see SPC-4, 4.5.5 Deferred errors).
+ * Returns true if the command has been failed with the deferred error.
+ */
+/*@
+  @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &scsi_ctx, cdb);
+  @ requires \valid_read(cdb);
+  @ requires scsi_ctx.lun < SCSI_MAX_LUNS;
+  @ assigns scsi_ctx.luns[scsi_ctx.lun].deferred_error, scsi_ctx.error,
+            GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state, scsi_ctx.state;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+bool scsi_check_deferred_error(const cdb_t *cdb)
+{
+    uint32_t err = scsi_ctx.luns[scsi_ctx.lun].deferred_error;
+
+    if (err == 0) {
+        return false;
+    }
+    switch (cdb->operation) {
+        case SCSI_CMD_INQUIRY:
+        case SCSI_CMD_REPORT_LUNS:
+            return false;
+        case SCSI_CMD_REQUEST_SENSE:
+            if (scsi_ctx.error == 0) {
+                scsi_ctx.error = err | SCSI_ERROR_DEFERRED;
+                scsi_ctx.luns[scsi_ctx.lun].deferred_error = 0;
+            }
+            return false;
+        default:
+            break;
+    }
+    scsi_ctx.luns[scsi_ctx.lun].deferred_error = 0;
+    log_printf("%s: deferred error %x\n", __func__, err);
+    scsi_error_sense(err | SCSI_ERROR_DEFERRED);
+    return true;
+}
+
 /*
  * SCSI Automaton execution
  */
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates, &GHOST_opaque_usbmsc_privates, &scsi_ctx);
   @ requires SCSI_IDLE <= scsi_ctx.state <= SCSI_ERROR;
+  @ requires scsi_ctx.queue.head < 2 * SCSI_CMD_QUEUE_DEPTH;
+  @ requires scsi_ctx.queue.tail < 2 * SCSI_CMD_QUEUE_DEPTH;
 
   @ assigns scsi_ctx, bbb_ctx.state, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state, bbb_ctx.state ;
 
@@ -2372,45 +4831,52 @@ mbed_error_t usbmsc_exec_automaton(void)
 {
     /* local cdb copy */
     cdb_t   local_cdb;
+    uint8_t lun = 0;
     mbed_error_t errcode = MBED_ERROR_NONE;
 
     /*@ ghost
         GHOST_opaque_usbmsc_privates = 1;
       */
-    if (scsi_ctx.queue_empty == true) {
-        request_data_membarrier();
+    /* we handle a signe command at a time, which is standard for the
+     * SCSI automaton, as SCSI is syncrhonous */
+    if (scsi_queue_pop(&local_cdb, &lun) == false) {
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER || CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+        /* the idle work is done on the blocks of the cached LUN */
+        scsi_select_lun(scsi_ctx.media_lun);
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+        /* the automaton is idle: flushing the gathered writes once their
+         * deadline is reached. They have been acknowledged, the host is
+         * told of an error with its next command */
+        if (scsi_gather_run() != MBED_ERROR_NONE) {
+            scsi_defer_error(scsi_ctx.lun, SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+                             ASCQ_NO_ADDITIONAL_SENSE);
+        }
+        if (scsi_gather_pending()) {
+            /* the backend content is not up to date, no prefetch */
+            goto nothing_to_do;
+        }
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+        /* the automaton is idle: prefetching the next sectors of a
+         * sequential read stream */
+        scsi_readahead_run(scsi_ctx.block_size, scsi_ctx.storage_size);
+#endif
         goto nothing_to_do;
     }
-
-    /* critical section part. This part of the code is handling
-     * the command queue to get back the queued cdb block from it.
-     */
-    if (enter_critical_section() != MBED_ERROR_NONE) {
-        /* unable to enter critical section by now... leaving current turn */
-        log_printf("Unable to enter critical section!\n");
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    scsi_stats_command(local_cdb.operation);
+#endif
+    if (scsi_is_media_command(local_cdb.operation)) {
+        scsi_select_media_lun(lun);
+    }
+    scsi_select_lun(lun);
+    if (scsi_check_unit_attention(&local_cdb)) {
+        goto nothing_to_do;
+    }
+    if (scsi_check_deferred_error(&local_cdb)) {
         goto nothing_to_do;
     }
-#ifdef __FRAMAC__
-    /* Here, we use a local memcpy implementation. The resulting execution is the
-     * same, but accepted by framaC.
-     * We keep the libC memcpy in non-FramaC implementation for performances reasons */
-    uint8_t *local_u8_cdb = (uint8_t*)&local_cdb;
-    uint8_t *queued_u8_cdb = (uint8_t*)&queued_cdb;
-    /*@ assert \valid(queued_u8_cdb+(0..sizeof(cdb_t)-1)); */
-    /*@ assert \valid(local_u8_cdb+(0..sizeof(cdb_t)-1)); */
-
-    FC_memcpy_u8(local_u8_cdb, queued_u8_cdb, sizeof(cdb_t));
-#else
-    memcpy((void *) &local_cdb, (void *) &queued_cdb, sizeof(cdb_t));
-#endif
-    /* we handle a signe command at a time, which is standard for the
-     * SCSI automaton, as SCSI is syncrhonous */
-    set_bool_with_membarrier(&scsi_ctx.queue_empty, true);
-
-    leave_critical_section();
-    /* end of the critical section part. From now one, ISR can
-     * be executed again
-     */
 
     scsi_state_t current_state = scsi_get_state();
     /*@ assert SCSI_IDLE <= current_state <= SCSI_ERROR; */
@@ -2432,6 +4898,14 @@ mbed_error_t usbmsc_exec_automaton(void)
             errcode = scsi_cmd_read_data10(current_state, &local_cdb);
             break;
 
+        case SCSI_CMD_READ_12:
+            errcode = scsi_cmd_read_data12(current_state, &local_cdb);
+            break;
+
+        case SCSI_CMD_READ_16:
+            errcode = scsi_cmd_read_data16(current_state, &local_cdb);
+            break;
+
         case SCSI_CMD_READ_CAPACITY_10:
             errcode = scsi_cmd_read_capacity10(current_state, &local_cdb);
             break;
@@ -2474,10 +4948,30 @@ mbed_error_t usbmsc_exec_automaton(void)
             scsi_cmd_send_diagnostic(current_state, &local_cdb);
             break;
 #endif
+        case SCSI_CMD_START_STOP_UNIT:
+            errcode = scsi_cmd_start_stop_unit(current_state, &local_cdb);
+            break;
+
+        case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+        case SCSI_CMD_SYNCHRONIZE_CACHE_16:
+            errcode = scsi_cmd_synchronize_cache(current_state, &local_cdb);
+            break;
+
         case SCSI_CMD_TEST_UNIT_READY:
             errcode = scsi_cmd_test_unit_ready(current_state, &local_cdb);
             break;
 
+        case SCSI_CMD_VERIFY_10:
+        case SCSI_CMD_VERIFY_16:
+            errcode = scsi_cmd_verify(current_state, &local_cdb);
+            break;
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP
+        case SCSI_CMD_UNMAP:
+            errcode = scsi_cmd_unmap(current_state, &local_cdb);
+            break;
+#endif
+
         case SCSI_CMD_WRITE_6:
             errcode = scsi_write_data6(current_state, &local_cdb);
             break;
@@ -2486,6 +4980,21 @@ mbed_error_t usbmsc_exec_automaton(void)
             errcode = scsi_write_data10(current_state, &local_cdb);
             break;
 
+        case SCSI_CMD_WRITE_12:
+            errcode = scsi_write_data12(current_state, &local_cdb);
+            break;
+
+        case SCSI_CMD_WRITE_16:
+            errcode = scsi_write_data16(current_state, &local_cdb);
+            break;
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME
+        case SCSI_CMD_WRITE_SAME_10:
+        case SCSI_CMD_WRITE_SAME_16:
+            errcode = scsi_cmd_write_same(current_state, &local_cdb);
+            break;
+#endif
+
         default:
             log_printf("%s: Unsupported command: %x  \n", __func__,
                    local_cdb.operation);
@@ -2505,6 +5014,9 @@ mbed_error_t usbmsc_exec_automaton(void)
  */
 /*@
   @ requires \separated(&scsi_ctx);
+  @ requires scsi_ctx.queue.head < 2 * SCSI_CMD_QUEUE_DEPTH;
+  @ requires scsi_ctx.queue.tail < 2 * SCSI_CMD_QUEUE_DEPTH;
+  @ requires scsi_ctx.queue.reset_mark < 2 * SCSI_CMD_QUEUE_DEPTH;
   @ assigns scsi_ctx;
   */
 #ifndef __FRAMAC__
@@ -2512,16 +5024,55 @@ static
 #endif
 void scsi_reset_context(void)
 {
+    uint8_t  reset_seq;
+    uint32_t reset_mark;
+
     log_printf("[reset] clearing USB context\n");
     /* resetting the context in a known, empty, idle state */
     set_u8_with_membarrier(&scsi_ctx.direction, SCSI_DIRECTION_IDLE);
     set_u8_with_membarrier(&scsi_ctx.line_state, SCSI_TRANSMIT_LINE_READY);
     set_u32_with_membarrier(&scsi_ctx.size_to_process, 0);
+    set_u32_with_membarrier(&scsi_ctx.transfer_size, 0);
     scsi_ctx.addr = 0;
     scsi_ctx.error = 0;
-    set_bool_with_membarrier(&scsi_ctx.queue_empty, true);
-    scsi_ctx.block_size = 0;
-    scsi_ctx.storage_size = 0;
+    /* dropping the commands received before the last reset, if any. The
+     * commands received since are kept. */
+    reset_seq = scsi_ctx.queue.reset_seq;
+    if (reset_seq != scsi_ctx.queue.reset_ack) {
+        request_data_membarrier();
+        reset_mark = scsi_ctx.queue.reset_mark;
+        if (scsi_queue_count(reset_mark, scsi_ctx.queue.tail) <=
+            scsi_queue_count(scsi_queue_load_acquire(&scsi_ctx.queue.head), scsi_ctx.queue.tail)) {
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+            scsi_stats_dropped(true, scsi_queue_count(reset_mark, scsi_ctx.queue.tail));
+#endif
+            scsi_queue_store_release(&scsi_ctx.queue.tail, reset_mark);
+        }
+        set_u8_with_membarrier(&scsi_ctx.queue.reset_ack, reset_seq);
+    }
+    /* the cached blocks are flushed to their LUN */
+    scsi_select_lun(scsi_ctx.media_lun);
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+    scsi_readahead_reset();
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    /* the device may be removed after a reset: the cached blocks are written.
+     * The blocks which can't be are dropped, the host is told with its next
+     * command */
+    if (scsi_cache_flush() != MBED_ERROR_NONE) {
+        log_printf("%s: write cache flush error\n", __func__);
+        scsi_defer_error(scsi_ctx.lun, SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+                         ASCQ_NO_ADDITIONAL_SENSE);
+    }
+#elif CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+    if (scsi_gather_flush() != MBED_ERROR_NONE) {
+        log_printf("%s: gathered writes flush error\n", __func__);
+        scsi_defer_error(scsi_ctx.lun, SCSI_SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR,
+                         ASCQ_NO_ADDITIONAL_SENSE);
+    }
+#endif
+    /* the storage geometry is kept: a reset doesn't change the media, and
+     * the host gets it back from the capacity cache */
     scsi_set_state(SCSI_IDLE);
     request_data_membarrier();
 }
@@ -2535,8 +5086,9 @@ void scsi_reset_context(void)
   @ requires \separated(&scsi_ctx, &bbb_ctx, buf + (0..len-1), &cbw, &GHOST_opaque_usbmsc_privates);
   @ assigns scsi_ctx, bbb_ctx;
   */
-mbed_error_t usbmsc_declare(uint8_t * buf, uint16_t len)
+mbed_error_t usbmsc_declare(uint8_t * buf, uint32_t len)
 {
+    uint8_t i;
 
     /*@ ghost
         GHOST_opaque_usbmsc_privates = 1;
@@ -2549,13 +5101,36 @@ mbed_error_t usbmsc_declare(uint8_t * buf, uint16_t len)
     scsi_ctx.direction = SCSI_DIRECTION_IDLE,
     scsi_ctx.line_state = SCSI_TRANSMIT_LINE_READY,
     scsi_ctx.size_to_process = 0,
+    scsi_ctx.transfer_size = 0,
     scsi_ctx.addr = 0,
     scsi_ctx.error = 0,
-    scsi_ctx.queue_empty = true,
+    scsi_ctx.queue.head = 0,
+    scsi_ctx.queue.tail = 0,
+    scsi_ctx.queue.reset_mark = 0,
+    scsi_ctx.queue.reset_seq = 0,
+    scsi_ctx.queue.reset_ack = 0,
     scsi_ctx.global_buf = NULL,
     scsi_ctx.global_buf_len = 0,
     scsi_ctx.block_size = 0,
     scsi_ctx.storage_size = 0,
+    scsi_ctx.capacity_cached = false,
+    scsi_ctx.unit_attention = false,
+    scsi_ctx.lun = 0;
+    scsi_ctx.media_lun = 0;
+    /*@
+      @ loop invariant 0 <= i <= SCSI_MAX_LUNS;
+      @ loop assigns i, scsi_ctx.luns[0 .. SCSI_MAX_LUNS-1];
+      @ loop variant SCSI_MAX_LUNS - i;
+      */
+    for (i = 0; i < SCSI_MAX_LUNS; i++) {
+        scsi_ctx.luns[i].error = 0;
+        scsi_ctx.luns[i].deferred_error = 0;
+        scsi_ctx.luns[i].block_size = 0;
+        scsi_ctx.luns[i].storage_size = 0;
+        scsi_ctx.luns[i].capacity_cached = false;
+        scsi_ctx.luns[i].media_changed = false;
+        scsi_ctx.luns[i].unit_attention = false;
+    }
 
     scsi_ctx.global_buf = buf;
     scsi_ctx.global_buf_len = len;
@@ -2629,6 +5204,7 @@ mbed_error_t usbmsc_initialize(uint32_t usbdci_handler)
 
     scsi_ctx.storage_size = 0;
     scsi_ctx.block_size = 4096; /* default */
+    scsi_ctx.capacity_cached = false;
 
     /*@
       @ loop invariant 0 <= i <= scsi_ctx.global_buf_len;
@@ -24,9 +24,14 @@
 #ifndef SCSI_H_
 #define SCSI_H_
 
+#include "autoconf.h"
+#include "api/libusbmsc.h"
 #include "usbmsc_framac_private.h"
 
 #ifndef __FRAMAC__
+/* depth of the received commands queue */
+#define SCSI_CMD_QUEUE_DEPTH CONFIG_USR_LIB_MASSSTORAGE_CMD_QUEUE_DEPTH
+
 typedef enum {
     SCSI_TRANSMIT_LINE_READY = 0,
     SCSI_TRANSMIT_LINE_BUSY,
@@ -39,22 +44,72 @@ typedef enum {
     SCSI_DIRECTION_RECV,
 } transmission_direction_t;
 
+/*
+ * Received commands queue indexes. head is only written by the producer
+ * (scsi_parse_cdb(), ISR context) and tail by the consumer (main thread).
+ * Both run in [0, 2 * SCSI_CMD_QUEUE_DEPTH[ so that a full queue can be
+ * told from an empty one without overflowing.
+ * reset_mark is the head value when the last Bulk-Only Mass Storage Reset
+ * has been received. reset_seq is incremented by the producer at each
+ * reset and reset_ack is its last value handled by the consumer.
+ */
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t reset_mark;
+    uint8_t  reset_seq;
+    uint8_t  reset_ack;
+} scsi_cmd_queue_t;
+
+/* number of exposed Logical Units */
+#define SCSI_MAX_LUNS CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS
+
+/*
+ * Per-LUN state. The geometry, sense data and unit attention of the LUN
+ * being addressed are loaded in the SCSI context by scsi_select_lun(), and
+ * saved back here when another LUN is addressed. media_changed is set by
+ * usbmsc_media_changed() from any context and is never loaded.
+ * deferred_error is the sense of a write acknowledged to the host which
+ * failed later, reported with the next command of the LUN. It is never
+ * loaded either.
+ * The read-ahead, sector and write caches hold the blocks of a single LUN,
+ * media_lun in the SCSI context, which is only changed by the commands
+ * accessing the media (see scsi_select_media_lun()).
+ */
+typedef struct {
+    uint32_t error;
+    uint32_t deferred_error;
+    uint32_t block_size;
+    usbmsc_lba_t storage_size;
+    bool     capacity_cached;
+    bool     media_changed;
+    bool     unit_attention;
+} scsi_lun_context_t;
+
 typedef struct {
     uint8_t  direction;
     uint8_t  line_state;
     uint32_t size_to_process;
+    uint32_t transfer_size;
     uint32_t addr;
     uint32_t error;
-    bool     queue_empty;
+    scsi_cmd_queue_t queue;
     uint8_t *global_buf;
-    uint16_t global_buf_len;
+    uint32_t global_buf_len;
     uint32_t block_size;
-    uint32_t storage_size;
+    usbmsc_lba_t storage_size;
+    bool     capacity_cached;
+    bool     unit_attention;
     uint8_t  state;
+    uint8_t  lun;
+    uint8_t  media_lun;
+    scsi_lun_context_t luns[SCSI_MAX_LUNS];
 } scsi_context_t;
 
 #endif/*!__FRAMAC__*/
 
 scsi_context_t *scsi_get_context(void);
 
+void scsi_queue_mark_reset(void);
+
 #endif/*!SCSI_H_*/
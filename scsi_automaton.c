@@ -28,6 +28,7 @@
 #include "libc/sync.h"
 #include "scsi.h"
 #include "scsi_dbg.h"
+#include "scsi_trace.h"
 #ifdef __FRAMAC__
 # include "usbmsc_framac_private.h"
 #endif
@@ -61,7 +62,7 @@ scsi_state_t state = SCSI_IDLE;
  * the transition handler has to handle this manually.
  */
 
-#define MAX_TRANSITION_STATE 17
+#define MAX_TRANSITION_STATE 29
 
 /* considering SCSI_ERROR the last state, states starting with 0 */
 #define SCSI_NUM_STATES SCSI_ERROR + 1
@@ -82,7 +83,7 @@ typedef struct {
 } scsi_state_transitions_t;
 
 /* IDLE SCSI transitions */
-static const scsi_operation_code_transition_t scsi_idle_trans[17] = {
+static const scsi_operation_code_transition_t scsi_idle_trans[29] = {
     {SCSI_CMD_TEST_UNIT_READY, SCSI_IDLE},
     {SCSI_CMD_INQUIRY, SCSI_IDLE},
     {SCSI_CMD_MODE_SELECT_10, SCSI_IDLE},
@@ -92,14 +93,26 @@ static const scsi_operation_code_transition_t scsi_idle_trans[17] = {
     {SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL, SCSI_IDLE},
     {SCSI_CMD_READ_6, SCSI_IDLE},
     {SCSI_CMD_READ_10, SCSI_IDLE},
+    {SCSI_CMD_READ_12, SCSI_IDLE},
+    {SCSI_CMD_READ_16, SCSI_IDLE},
     {SCSI_CMD_READ_CAPACITY_10, SCSI_IDLE},
     {SCSI_CMD_READ_CAPACITY_16, SCSI_IDLE},
     {SCSI_CMD_READ_FORMAT_CAPACITIES, SCSI_IDLE},
     {SCSI_CMD_REPORT_LUNS, SCSI_IDLE},
     {SCSI_CMD_REQUEST_SENSE, SCSI_IDLE},
     {SCSI_CMD_SEND_DIAGNOSTIC, SCSI_IDLE},
+    {SCSI_CMD_START_STOP_UNIT, SCSI_IDLE},
+    {SCSI_CMD_SYNCHRONIZE_CACHE_10, SCSI_IDLE},
+    {SCSI_CMD_SYNCHRONIZE_CACHE_16, SCSI_IDLE},
+    {SCSI_CMD_UNMAP, SCSI_IDLE},
+    {SCSI_CMD_VERIFY_10, SCSI_IDLE},
+    {SCSI_CMD_VERIFY_16, SCSI_IDLE},
     {SCSI_CMD_WRITE_6, SCSI_IDLE},
-    {SCSI_CMD_WRITE_10, SCSI_IDLE}
+    {SCSI_CMD_WRITE_10, SCSI_IDLE},
+    {SCSI_CMD_WRITE_12, SCSI_IDLE},
+    {SCSI_CMD_WRITE_16, SCSI_IDLE},
+    {SCSI_CMD_WRITE_SAME_10, SCSI_IDLE},
+    {SCSI_CMD_WRITE_SAME_16, SCSI_IDLE}
 };
 
 /* ERROR SCSI transitions */
@@ -120,7 +133,7 @@ static const scsi_automaton_t scsi_automaton[2] = {
     {
         .state = SCSI_IDLE,
         .trans_list = {
-            .number = 17,
+            .number = 29,
             .transitions = &scsi_idle_trans[0]
         }
     },
@@ -145,13 +158,25 @@ static const scsi_automaton_t scsi_automaton[2] = {
          req == SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL ||
          req == SCSI_CMD_READ_6 ||
          req == SCSI_CMD_READ_10 ||
+         req == SCSI_CMD_READ_12 ||
+         req == SCSI_CMD_READ_16 ||
          req == SCSI_CMD_READ_CAPACITY_10 ||
          req == SCSI_CMD_READ_FORMAT_CAPACITIES ||
          req == SCSI_CMD_REPORT_LUNS ||
          req == SCSI_CMD_REQUEST_SENSE ||
+         req == SCSI_CMD_START_STOP_UNIT ||
+         req == SCSI_CMD_SYNCHRONIZE_CACHE_10 ||
+         req == SCSI_CMD_SYNCHRONIZE_CACHE_16 ||
          req == SCSI_CMD_TEST_UNIT_READY ||
+         req == SCSI_CMD_UNMAP ||
+         req == SCSI_CMD_VERIFY_10 ||
+         req == SCSI_CMD_VERIFY_16 ||
          req == SCSI_CMD_WRITE_6 ||
          req == SCSI_CMD_WRITE_10 ||
+         req == SCSI_CMD_WRITE_12 ||
+         req == SCSI_CMD_WRITE_16 ||
+         req == SCSI_CMD_WRITE_SAME_10 ||
+         req == SCSI_CMD_WRITE_SAME_16 ||
          req == SCSI_CMD_READ_CAPACITY_16) ? \true : \false;
 
    logic boolean transition_valid_for_idle(uint8_t req) =
@@ -164,13 +189,25 @@ static const scsi_automaton_t scsi_automaton[2] = {
          req == SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL ||
          req == SCSI_CMD_READ_6 ||
          req == SCSI_CMD_READ_10 ||
+         req == SCSI_CMD_READ_12 ||
+         req == SCSI_CMD_READ_16 ||
          req == SCSI_CMD_READ_CAPACITY_10 ||
          req == SCSI_CMD_READ_FORMAT_CAPACITIES ||
          req == SCSI_CMD_REPORT_LUNS ||
          req == SCSI_CMD_REQUEST_SENSE ||
+         req == SCSI_CMD_START_STOP_UNIT ||
+         req == SCSI_CMD_SYNCHRONIZE_CACHE_10 ||
+         req == SCSI_CMD_SYNCHRONIZE_CACHE_16 ||
          req == SCSI_CMD_TEST_UNIT_READY ||
+         req == SCSI_CMD_UNMAP ||
+         req == SCSI_CMD_VERIFY_10 ||
+         req == SCSI_CMD_VERIFY_16 ||
          req == SCSI_CMD_WRITE_6 ||
          req == SCSI_CMD_WRITE_10 ||
+         req == SCSI_CMD_WRITE_12 ||
+         req == SCSI_CMD_WRITE_16 ||
+         req == SCSI_CMD_WRITE_SAME_10 ||
+         req == SCSI_CMD_WRITE_SAME_16 ||
          req == SCSI_CMD_READ_CAPACITY_16) ? \true : \false;
 
    logic boolean transition_valid_for_error(uint8_t req) =
@@ -230,6 +267,9 @@ void scsi_set_state(const scsi_state_t new_state)
     }
     /*@ assert SCSI_IDLE <= new_state <= SCSI_ERROR ; */
     log_printf("%s: state: %x => %x\n", __func__, ctx->state, new_state);
+    if (new_state != ctx->state) {
+        scsi_trace(USBMSC_TRACE_STATE, new_state, ctx->state, 0);
+    }
     set_u8_with_membarrier(&ctx->state, new_state);
     /*@ assert scsi_ctx.state == new_state; */
 err:
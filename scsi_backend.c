@@ -0,0 +1,208 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "autoconf.h"
+#include "libc/types.h"
+#include "libc/sync.h"
+
+#include "api/libusbmsc.h"
+#include "scsi_backend.h"
+#include "scsi_wait.h"
+#include "scsi_stats.h"
+#include "scsi_trace.h"
+
+#if !CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+/*
+ * Asynchronous backend request state. pending is set by the SCSI stack when
+ * a request is submitted and cleared by usbmsc_storage_backend_complete(),
+ * which may be executed in ISR context. write and counted are only used by
+ * the main thread, to count the failed requests once.
+ */
+typedef struct {
+    volatile bool     pending;
+    volatile uint32_t status;
+    bool              write;
+    bool              counted;
+} scsi_backend_context_t;
+
+static scsi_backend_context_t backend_ctx = {
+    .pending = false,
+    .status  = MBED_ERROR_NONE,
+    .write   = false,
+    .counted = true,
+};
+
+/*
+ * Mark a request as in progress before submitting it, as the backend may
+ * notify its completion before returning from the submit function.
+ * A request still pending here belongs to a command which has been aborted
+ * (e.g. by a USB reset) and its buffer must not be reused before it
+ * completes.
+ */
+#ifndef __FRAMAC__
+static inline
+#endif
+void scsi_backend_prepare(bool write)
+{
+    scsi_backend_wait();
+    backend_ctx.write = write;
+    backend_ctx.counted = false;
+    set_u32_with_membarrier(&backend_ctx.status, MBED_ERROR_NONE);
+    set_bool_with_membarrier(&backend_ctx.pending, true);
+}
+
+/*
+ * Completion notification, called by the backend. This function only
+ * updates two volatile fields and is ISR safe.
+ */
+void usbmsc_storage_backend_complete(mbed_error_t status)
+{
+    if (backend_ctx.pending == false) {
+        /* spurious notification, no request in progress */
+        return;
+    }
+    scsi_trace(USBMSC_TRACE_BACKEND_DONE, 0, 0, status);
+    set_u32_with_membarrier(&backend_ctx.status, (uint32_t)status);
+    set_bool_with_membarrier(&backend_ctx.pending, false);
+}
+#endif
+
+/*
+ * Storage backend read access.
+ * When the backend is not given the buffer address, it always fills the
+ * beginning of the buffer declared with usbmsc_declare().
+ */
+/*@
+  @ assigns \nothing;
+  */
+mbed_error_t scsi_backend_submit_read(uint8_t *buf, usbmsc_lba_t sector_addr,
+                                      uint32_t num_sectors)
+{
+    mbed_error_t errcode;
+
+    scsi_trace(USBMSC_TRACE_BACKEND_READ, 0, (num_sectors > 0xffff) ? 0xffff : num_sectors,
+               sector_addr);
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+    scsi_backend_prepare(false);
+    errcode = usbmsc_storage_backend_read_submit(sector_addr, num_sectors, buf);
+    if (errcode != MBED_ERROR_NONE) {
+        /* request refused, no completion will be notified */
+        scsi_trace(USBMSC_TRACE_BACKEND_DONE, 0, 0, errcode);
+        backend_ctx.counted = true;
+        set_bool_with_membarrier(&backend_ctx.pending, false);
+    }
+#elif CONFIG_USR_LIB_MASSSTORAGE_BACKEND_BUF
+    errcode = usbmsc_storage_backend_read_buf(sector_addr, num_sectors, buf);
+    scsi_trace(USBMSC_TRACE_BACKEND_DONE, 0, 0, errcode);
+#else
+    (void)buf;
+    errcode = usbmsc_storage_backend_read(sector_addr, num_sectors);
+    scsi_trace(USBMSC_TRACE_BACKEND_DONE, 0, 0, errcode);
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    if (errcode != MBED_ERROR_NONE) {
+        scsi_stats_backend_error(false);
+    }
+#endif
+    return errcode;
+}
+
+/*
+ * Storage backend write access.
+ * When the backend is not given the buffer address, it always flushes the
+ * beginning of the buffer declared with usbmsc_declare().
+ */
+/*@
+  @ assigns \nothing;
+  */
+mbed_error_t scsi_backend_submit_write(uint8_t *buf, usbmsc_lba_t sector_addr,
+                                       uint32_t num_sectors)
+{
+    mbed_error_t errcode;
+
+    scsi_trace(USBMSC_TRACE_BACKEND_WRITE, 0, (num_sectors > 0xffff) ? 0xffff : num_sectors,
+               sector_addr);
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+    scsi_backend_prepare(true);
+    errcode = usbmsc_storage_backend_write_submit(sector_addr, num_sectors, buf);
+    if (errcode != MBED_ERROR_NONE) {
+        /* request refused, no completion will be notified */
+        scsi_trace(USBMSC_TRACE_BACKEND_DONE, 0, 0, errcode);
+        backend_ctx.counted = true;
+        set_bool_with_membarrier(&backend_ctx.pending, false);
+    }
+#elif CONFIG_USR_LIB_MASSSTORAGE_BACKEND_BUF
+    errcode = usbmsc_storage_backend_write_buf(sector_addr, num_sectors, buf);
+    scsi_trace(USBMSC_TRACE_BACKEND_DONE, 0, 0, errcode);
+#else
+    (void)buf;
+    errcode = usbmsc_storage_backend_write(sector_addr, num_sectors);
+    scsi_trace(USBMSC_TRACE_BACKEND_DONE, 0, 0, errcode);
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    if (errcode != MBED_ERROR_NONE) {
+        scsi_stats_backend_error(true);
+    }
+#endif
+    return errcode;
+}
+
+/*
+ * Wait for the end of the last submitted request and return its status.
+ * With a synchronous backend, the request has already been executed by the
+ * submit function and its status returned by it.
+ */
+/*@
+  @ assigns \nothing;
+  */
+mbed_error_t scsi_backend_wait(void)
+{
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+    mbed_error_t errcode;
+# if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    uint64_t wait_start = 0;
+
+    if (backend_ctx.pending) {
+        wait_start = scsi_stats_wait_start();
+    }
+# endif
+    while (backend_ctx.pending) {
+        scsi_wait_event();
+    }
+    errcode = (mbed_error_t)backend_ctx.status;
+# if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    scsi_stats_wait_end(SCSI_STATS_WAIT_BACKEND, wait_start);
+    if (errcode != MBED_ERROR_NONE && !backend_ctx.counted) {
+        scsi_stats_backend_error(backend_ctx.write);
+    }
+# endif
+    backend_ctx.counted = true;
+    return errcode;
+#else
+    return MBED_ERROR_NONE;
+#endif
+}
+
+#endif /* !CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY */
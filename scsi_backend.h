@@ -0,0 +1,50 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SCSI_BACKEND_H_
+#define SCSI_BACKEND_H_
+
+#include "libc/types.h"
+#include "api/libusbmsc.h"
+
+/*
+ * Storage backend access layer, used by the buffered read and write engines.
+ *
+ * A request is submitted with scsi_backend_submit_read() or
+ * scsi_backend_submit_write(), and its completion status is got back with
+ * scsi_backend_wait(). With a synchronous backend, the request is fully
+ * executed at submission time. With an asynchronous backend, submission
+ * returns immediately and the backend notifies the completion with
+ * usbmsc_storage_backend_complete().
+ * Only one request is handled at a time.
+ */
+
+mbed_error_t scsi_backend_submit_read(uint8_t *buf, usbmsc_lba_t sector_addr,
+                                      uint32_t num_sectors);
+
+mbed_error_t scsi_backend_submit_write(uint8_t *buf, usbmsc_lba_t sector_addr,
+                                       uint32_t num_sectors);
+
+mbed_error_t scsi_backend_wait(void);
+
+#endif /*!SCSI_BACKEND_H_ */
@@ -0,0 +1,406 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "autoconf.h"
+#include "libc/types.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+
+#include "api/libusbmsc.h"
+#include "scsi_dbg.h"
+#include "scsi_backend.h"
+#include "scsi_cache.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+
+#define SCSI_CACHE_MAX_LINES CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE_LINES
+
+typedef enum {
+    SCSI_CACHE_LINE_INVALID = 0,
+    SCSI_CACHE_LINE_CLEAN,
+    SCSI_CACHE_LINE_DIRTY,
+} scsi_cache_line_state_t;
+
+/*
+ * A cache line holds a single block. Line i is stored at offset
+ * i * block_size of the cache buffer.
+ */
+typedef struct {
+    usbmsc_lba_t lba;
+    uint8_t      state;
+} scsi_cache_line_t;
+
+/*
+ * Write cache context. It is only accessed by the main thread.
+ * The lines are sized when the first block is cached, as the block size is
+ * only known once the host has requested the storage capacity.
+ */
+typedef struct {
+    uint8_t           *buf;
+    uint32_t           len;
+    uint32_t           block_size;
+    uint32_t           num_lines;
+    uint32_t           victim;
+    uint32_t           dirty;
+    bool               wce;
+    scsi_cache_line_t  lines[SCSI_CACHE_MAX_LINES];
+} scsi_cache_context_t;
+
+static scsi_cache_context_t cache_ctx = {
+    .buf        = NULL,
+    .len        = 0,
+    .block_size = 0,
+    .num_lines  = 0,
+    .victim     = 0,
+    .dirty      = 0,
+    .wce        = true,
+};
+
+/*@
+  @ assigns cache_ctx;
+  */
+mbed_error_t usbmsc_declare_write_cache(uint8_t *buf, uint32_t len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (buf == NULL || len == 0) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    cache_ctx.buf = buf;
+    cache_ctx.len = len;
+    scsi_cache_drop();
+err:
+    return errcode;
+}
+
+/*
+ * Size the cache lines for the given block size. The lines of another block
+ * size are dropped.
+ */
+/*@
+  @ requires block_size > 0;
+  @ assigns cache_ctx;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void scsi_cache_configure(uint32_t block_size)
+{
+    if (cache_ctx.block_size == block_size) {
+        return;
+    }
+    scsi_cache_drop();
+    cache_ctx.block_size = block_size;
+    cache_ctx.num_lines = cache_ctx.len / block_size;
+    if (cache_ctx.num_lines > SCSI_CACHE_MAX_LINES) {
+        cache_ctx.num_lines = SCSI_CACHE_MAX_LINES;
+    }
+}
+
+/*
+ * Current value of the WCE bit. The write cache can't be enabled before
+ * a cache buffer is declared.
+ */
+/*@
+  @ assigns \nothing;
+  */
+bool scsi_cache_get_wce(void)
+{
+    return (cache_ctx.buf != NULL && cache_ctx.wce);
+}
+
+/*
+ * Update the WCE bit (MODE SELECT). Disabling the write cache flushes it.
+ */
+/*@
+  @ assigns cache_ctx;
+  */
+mbed_error_t scsi_cache_set_wce(bool wce)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (wce && cache_ctx.buf == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (!wce) {
+        errcode = scsi_cache_flush();
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+    cache_ctx.wce = wce;
+err:
+    return errcode;
+}
+
+/*
+ * Tell if a WRITE command of num_blocks blocks is to be cached. Writes bigger
+ * than half of the cache are written through, so that a big transfer doesn't
+ * evict the small scattered writes the cache is made for.
+ */
+/*@
+  @ assigns cache_ctx;
+  */
+bool scsi_cache_accepts(uint32_t num_blocks, uint32_t block_size)
+{
+    if (!scsi_cache_get_wce() || block_size == 0) {
+        return false;
+    }
+    scsi_cache_configure(block_size);
+    return (num_blocks > 0 && num_blocks <= (cache_ctx.num_lines + 1) / 2);
+}
+
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+uint8_t *scsi_cache_line_buf(uint32_t idx)
+{
+    return &cache_ctx.buf[idx * cache_ctx.block_size];
+}
+
+/*
+ * Index of the line holding the given block, or num_lines if not cached.
+ */
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+uint32_t scsi_cache_lookup(usbmsc_lba_t lba)
+{
+    uint32_t i;
+
+    for (i = 0; i < cache_ctx.num_lines; i++) {
+        if (cache_ctx.lines[i].state != SCSI_CACHE_LINE_INVALID &&
+            cache_ctx.lines[i].lba == lba) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Get a free or clean line, flushing the cache when all the lines are dirty.
+ * The lines are reused in a round robin way, so that the blocks of a single
+ * WRITE command usually get contiguous lines and are flushed together.
+ */
+/*@
+  @ requires \valid(idx);
+  @ assigns cache_ctx, *idx;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t scsi_cache_alloc(uint32_t *idx)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t i;
+
+    if (cache_ctx.dirty == cache_ctx.num_lines) {
+        errcode = scsi_cache_flush();
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+    for (i = 0; i < cache_ctx.num_lines; i++) {
+        if (cache_ctx.lines[cache_ctx.victim].state != SCSI_CACHE_LINE_DIRTY) {
+            break;
+        }
+        cache_ctx.victim = (cache_ctx.victim + 1) % cache_ctx.num_lines;
+    }
+    *idx = cache_ctx.victim;
+    cache_ctx.victim = (cache_ctx.victim + 1) % cache_ctx.num_lines;
+err:
+    return errcode;
+}
+
+/*
+ * Copy blocks received from the host into the cache. The WRITE command can
+ * be acknowledged once this function returns successfully.
+ */
+/*@
+  @ requires block_size > 0;
+  @ assigns cache_ctx;
+  */
+mbed_error_t scsi_cache_write(usbmsc_lba_t lba, const uint8_t *buf,
+                              uint32_t num_blocks, uint32_t block_size)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t idx;
+    uint32_t i;
+
+    scsi_cache_configure(block_size);
+    for (i = 0; i < num_blocks; i++) {
+        idx = scsi_cache_lookup(lba + i);
+        if (idx == cache_ctx.num_lines) {
+            errcode = scsi_cache_alloc(&idx);
+            if (errcode != MBED_ERROR_NONE) {
+                goto err;
+            }
+        }
+        memcpy(scsi_cache_line_buf(idx), &buf[i * block_size], block_size);
+        if (cache_ctx.lines[idx].state != SCSI_CACHE_LINE_DIRTY) {
+            cache_ctx.dirty++;
+        }
+        cache_ctx.lines[idx].lba = lba + i;
+        cache_ctx.lines[idx].state = SCSI_CACHE_LINE_DIRTY;
+    }
+err:
+    return errcode;
+}
+
+/*
+ * Replace, in data read from the backend, the blocks which are held by the
+ * cache, as the backend content of the dirty ones is outdated.
+ */
+/*@
+  @ assigns buf[0 .. num_blocks * cache_ctx.block_size - 1];
+  */
+void scsi_cache_overlay(usbmsc_lba_t lba, uint8_t *buf, uint32_t num_blocks)
+{
+    uint32_t i;
+
+    for (i = 0; i < cache_ctx.num_lines; i++) {
+        if (cache_ctx.lines[i].state == SCSI_CACHE_LINE_INVALID) {
+            continue;
+        }
+        if (cache_ctx.lines[i].lba >= lba &&
+            cache_ctx.lines[i].lba - lba < num_blocks) {
+            memcpy(&buf[(cache_ctx.lines[i].lba - lba) * cache_ctx.block_size],
+                   scsi_cache_line_buf(i), cache_ctx.block_size);
+        }
+    }
+}
+
+/*
+ * Drop the cached copies of blocks which are written through.
+ */
+/*@
+  @ assigns cache_ctx.lines[0 .. SCSI_CACHE_MAX_LINES - 1], cache_ctx.dirty;
+  */
+void scsi_cache_invalidate(usbmsc_lba_t lba, uint32_t num_blocks)
+{
+    uint32_t i;
+
+    for (i = 0; i < cache_ctx.num_lines; i++) {
+        if (cache_ctx.lines[i].state == SCSI_CACHE_LINE_INVALID) {
+            continue;
+        }
+        if (cache_ctx.lines[i].lba >= lba &&
+            cache_ctx.lines[i].lba - lba < num_blocks) {
+            if (cache_ctx.lines[i].state == SCSI_CACHE_LINE_DIRTY) {
+                cache_ctx.dirty--;
+            }
+            cache_ctx.lines[i].state = SCSI_CACHE_LINE_INVALID;
+        }
+    }
+}
+
+/*
+ * Write all the dirty lines to the storage backend, by increasing LBA.
+ * Dirty lines which follow each other in both LBA and cache buffer are
+ * written with a single backend request.
+ * A run which can't be written is dropped and the flush goes on with the
+ * next ones, so that a bad block doesn't keep the cache full. The first
+ * error is returned, for the caller to report it once to the host.
+ */
+/*@
+  @ assigns cache_ctx.lines[0 .. SCSI_CACHE_MAX_LINES - 1], cache_ctx.dirty;
+  */
+mbed_error_t scsi_cache_flush(void)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    mbed_error_t error;
+    uint32_t first;
+    uint32_t count;
+    uint32_t i;
+
+    while (cache_ctx.dirty > 0) {
+        /* dirty line of lowest LBA */
+        first = cache_ctx.num_lines;
+        for (i = 0; i < cache_ctx.num_lines; i++) {
+            if (cache_ctx.lines[i].state == SCSI_CACHE_LINE_DIRTY &&
+                (first == cache_ctx.num_lines ||
+                 cache_ctx.lines[i].lba < cache_ctx.lines[first].lba)) {
+                first = i;
+            }
+        }
+        if (first == cache_ctx.num_lines) {
+            /* dirty lines counter out of sync, should not happen */
+            cache_ctx.dirty = 0;
+            break;
+        }
+        count = 1;
+        while (first + count < cache_ctx.num_lines &&
+               cache_ctx.lines[first + count].state == SCSI_CACHE_LINE_DIRTY &&
+               cache_ctx.lines[first + count].lba == cache_ctx.lines[first].lba + count) {
+            count++;
+        }
+        error = scsi_backend_submit_write(scsi_cache_line_buf(first),
+                                          cache_ctx.lines[first].lba, count);
+        if (error == MBED_ERROR_NONE) {
+            error = scsi_backend_wait();
+        }
+        if (error != MBED_ERROR_NONE) {
+            log_printf("%s: backend write error %d, %d blocks dropped\n",
+                       __func__, error, count);
+            if (errcode == MBED_ERROR_NONE) {
+                errcode = error;
+            }
+        }
+        for (i = first; i < first + count; i++) {
+            cache_ctx.lines[i].state = (error == MBED_ERROR_NONE) ?
+                SCSI_CACHE_LINE_CLEAN : SCSI_CACHE_LINE_INVALID;
+        }
+        cache_ctx.dirty -= count;
+    }
+    return errcode;
+}
+
+/*
+ * Drop the whole cache content, without writing it (media change). The WCE
+ * bit is kept.
+ */
+/*@
+  @ assigns cache_ctx;
+  */
+void scsi_cache_drop(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < SCSI_CACHE_MAX_LINES; i++) {
+        cache_ctx.lines[i].state = SCSI_CACHE_LINE_INVALID;
+    }
+    cache_ctx.block_size = 0;
+    cache_ctx.num_lines = 0;
+    cache_ctx.victim = 0;
+    cache_ctx.dirty = 0;
+}
+
+#endif /* CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE */
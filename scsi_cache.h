@@ -0,0 +1,64 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SCSI_CACHE_H_
+#define SCSI_CACHE_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "api/libusbmsc.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+
+/*
+ * Write-back sector cache.
+ *
+ * When the write cache is enabled (WCE bit of the caching mode page), small
+ * WRITE commands are acknowledged once their blocks are copied into the cache
+ * buffer, declared by the application with usbmsc_declare_write_cache(). The
+ * dirty blocks are written to the storage backend, in LBA order, when the
+ * cache is full, on SYNCHRONIZE CACHE, START STOP UNIT and reset.
+ * Reads are kept coherent by overlaying the cached blocks on the data read
+ * from the backend.
+ */
+
+bool scsi_cache_get_wce(void);
+
+mbed_error_t scsi_cache_set_wce(bool wce);
+
+bool scsi_cache_accepts(uint32_t num_blocks, uint32_t block_size);
+
+mbed_error_t scsi_cache_write(usbmsc_lba_t lba, const uint8_t *buf,
+                              uint32_t num_blocks, uint32_t block_size);
+
+void scsi_cache_overlay(usbmsc_lba_t lba, uint8_t *buf, uint32_t num_blocks);
+
+void scsi_cache_invalidate(usbmsc_lba_t lba, uint32_t num_blocks);
+
+mbed_error_t scsi_cache_flush(void);
+
+void scsi_cache_drop(void);
+
+#endif
+
+#endif /*!SCSI_CACHE_H_ */
@@ -37,6 +37,8 @@ typedef enum {
     SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL = 0x1e,
     SCSI_CMD_READ_6 = 0x08,     // Mandatory for olders
     SCSI_CMD_READ_10 = 0x28,    // Mandatory
+    SCSI_CMD_READ_12 = 0xa8,
+    SCSI_CMD_READ_16 = 0x88,
     SCSI_CMD_READ_CAPACITY_10 = 0x25,   // Mandatory
     SCSI_CMD_READ_FORMAT_CAPACITIES = 0x23,
     SCSI_CMD_REPORT_LUNS = 0xa0,        // Mandatory
@@ -44,10 +46,17 @@ typedef enum {
     SCSI_CMD_SEND_DIAGNOSTIC = 0x1d,    // Mandatory
     SCSI_CMD_START_STOP_UNIT = 0x1b,
     SCSI_CMD_SYNCHRONIZE_CACHE_10 = 0x35,
+    SCSI_CMD_SYNCHRONIZE_CACHE_16 = 0x91,
     SCSI_CMD_TEST_UNIT_READY = 0x00,    // Mandatory
+    SCSI_CMD_UNMAP = 0x42,
     SCSI_CMD_VERIFY_10 = 0x2f,
+    SCSI_CMD_VERIFY_16 = 0x8f,
     SCSI_CMD_WRITE_6 = 0x0a,    // Mandatory for olders
     SCSI_CMD_WRITE_10 = 0x2a,   // Mandatory
+    SCSI_CMD_WRITE_12 = 0xaa,
+    SCSI_CMD_WRITE_16 = 0x8a,
+    SCSI_CMD_WRITE_SAME_10 = 0x41,
+    SCSI_CMD_WRITE_SAME_16 = 0x93,
     SCSI_CMD_READ_CAPACITY_16 = 0x9e,
 } scsi_operation_code_t;
 
@@ -73,8 +82,8 @@ typedef struct __attribute__((packed)) {
     uint8_t LLBAA:2;
     uint8_t DBD:2;
     uint8_t reserved2:1;
-    uint8_t PC:2;
     uint8_t page_code:6;
+    uint8_t PC:2;
     uint8_t sub_page_code;
     uint16_t reserved3;
     uint16_t allocation_length;
@@ -112,8 +121,9 @@ typedef struct __attribute__((packed)) {
 
 /* READ 6 / WRITE 6 */
 typedef struct __attribute__((packed)) {
-    uint32_t reserved:3;
-    uint32_t logical_block:21;
+    uint8_t logical_block_msb:5;   /* LBA bits 20 to 16 */
+    uint8_t reserved:3;
+    uint16_t logical_block;        /* LBA bits 15 to 0 */
     uint8_t transfer_blocks;
     uint8_t control;
 } cdb6_t;
@@ -129,14 +139,32 @@ typedef struct __attribute__((packed)) {
     uint8_t control;
 } cdb10_t;
 
+/* READ 12 / WRITE 12 */
+typedef struct __attribute__((packed)) {
+    uint8_t misc1;
+    uint32_t logical_block;
+    uint32_t transfer_blocks;
+    uint8_t misc2;
+    uint8_t control;
+} cdb12_t;
+
+/* READ 16 / WRITE 16 */
+typedef struct __attribute__((packed)) {
+    uint8_t misc1;
+    uint64_t logical_block;
+    uint32_t transfer_blocks;
+    uint8_t misc2;
+    uint8_t control;
+} cdb16_t;
+
 /* MODE SENSE 6 */
 typedef struct __attribute__((packed)) {
     uint8_t LUN:3;
     uint8_t reserved4:1;
     uint8_t DBD:1;
     uint8_t reserved3:3;
-    uint8_t PC:2;
     uint8_t page_code:6;
+    uint8_t PC:2;
     uint8_t reserved2;
     uint8_t allocation_length;
     uint8_t vendor_specific:2;
@@ -160,14 +188,29 @@ typedef struct __attribute__((packed)) {
 
 /* INQUIRY 6 */
 typedef struct __attribute__((packed)) {
-    uint8_t reserved:6;
-    uint8_t CMDDT:1;            /* obsolete */
     uint8_t EVPD:1;
+    uint8_t CMDDT:1;            /* obsolete */
+    uint8_t reserved:6;
     uint8_t page_code;
     uint16_t allocation_length;
     uint8_t control;
 } cdb6_inquiry_t;
 
+/* START STOP UNIT */
+typedef struct __attribute__((packed)) {
+    uint8_t immed:1;
+    uint8_t reserved1:7;
+    uint8_t reserved2;
+    uint8_t power_condition_modifier:4;
+    uint8_t reserved3:4;
+    uint8_t start:1;
+    uint8_t loej:1;
+    uint8_t no_flush:1;
+    uint8_t reserved4:1;
+    uint8_t power_condition:4;
+    uint8_t control;
+} cdb6_start_stop_unit_t;
+
 /* MODE SELECT 10 */
 typedef struct __attribute__((packed)) {
     uint8_t reserved3:3;
@@ -180,6 +223,59 @@ typedef struct __attribute__((packed)) {
     uint8_t control;
 } cdb10_mode_select_t;
 
+/* WRITE SAME 10 */
+typedef struct __attribute__((packed)) {
+    uint8_t reserved1:1;
+    uint8_t lbdata:1;           /* obsolete */
+    uint8_t pbdata:1;           /* obsolete */
+    uint8_t unmap:1;
+    uint8_t anchor:1;
+    uint8_t wrprotect:3;
+    uint32_t logical_block;
+    uint8_t group_number:5;
+    uint8_t reserved2:3;
+    uint16_t num_blocks;
+    uint8_t control;
+} cdb10_write_same_t;
+
+/* VERIFY 10 */
+typedef struct __attribute__((packed)) {
+    uint8_t reserved1:1;        /* obsolete */
+    uint8_t bytchk:2;
+    uint8_t reserved2:1;
+    uint8_t dpo:1;
+    uint8_t vrprotect:3;
+    uint32_t logical_block;
+    uint8_t group_number:5;
+    uint8_t reserved3:3;
+    uint16_t verification_length;
+    uint8_t control;
+} cdb10_verify_t;
+
+/* UNMAP */
+typedef struct __attribute__((packed)) {
+    uint8_t anchor:1;
+    uint8_t reserved1:7;
+    uint32_t reserved2;
+    uint8_t group_number:5;
+    uint8_t reserved3:3;
+    uint16_t parameter_list_length;
+    uint8_t control;
+} cdb10_unmap_t;
+
+/* UNMAP parameter list: a header followed by block descriptors */
+typedef struct __attribute__((packed)) {
+    uint16_t unmap_data_length;
+    uint16_t block_descriptor_data_length;
+    uint32_t reserved;
+} unmap_parameter_list_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t logical_block_address;
+    uint32_t num_blocks;
+    uint32_t reserved;
+} unmap_block_descriptor_t;
+
 /* REPORT LUNS */
 typedef struct __attribute__((packed)) {
     uint8_t reserved3;
@@ -203,6 +299,35 @@ typedef struct __attribute__((packed)) {
     uint8_t control;
 } cdb16_read_capacity_16_t;
 
+/* WRITE SAME 16 */
+typedef struct __attribute__((packed)) {
+    uint8_t ndob:1;
+    uint8_t lbdata:1;           /* obsolete */
+    uint8_t pbdata:1;           /* obsolete */
+    uint8_t unmap:1;
+    uint8_t anchor:1;
+    uint8_t wrprotect:3;
+    uint64_t logical_block;
+    uint32_t num_blocks;
+    uint8_t group_number:5;
+    uint8_t reserved:3;
+    uint8_t control;
+} cdb16_write_same_t;
+
+/* VERIFY 16 */
+typedef struct __attribute__((packed)) {
+    uint8_t reserved1:1;
+    uint8_t bytchk:2;
+    uint8_t reserved2:1;
+    uint8_t dpo:1;
+    uint8_t vrprotect:3;
+    uint64_t logical_block;
+    uint32_t verification_length;
+    uint8_t group_number:5;
+    uint8_t reserved3:3;
+    uint8_t control;
+} cdb16_verify_t;
+
 /*
  * polymorphic SCSI command content, using a C union
  * type.
@@ -217,17 +342,25 @@ typedef union {
     cdb6_mode_sense_t cdb6_mode_sense;
     cdb6_mode_select_t cdb6_mode_select;
     cdb6_inquiry_t cdb6_inquiry;
+    cdb6_start_stop_unit_t cdb6_start_stop_unit;
     /* CDB 10 bytes length */
     cdb10_t cdb10;              /* read and write */
     cdb10_mode_sense_t cdb10_mode_sense;
     cdb10_mode_select_t cdb10_mode_select;
+    cdb10_unmap_t cdb10_unmap;
+    cdb10_write_same_t cdb10_write_same;
+    cdb10_verify_t cdb10_verify;
     cdb10_prevent_allow_removal_t cdb10_prevent_allow_removal;
     cdb10_request_sense_t cdb10_request_sense;
     /* CDB 12 bytes length */
+    cdb12_t cdb12;              /* read and write */
     cdb12_report_luns_t cdb12_report_luns;
     cdb12_read_format_capacities_t cdb12_read_format_capacities;
     /* CDB 16 bytes length */
+    cdb16_t cdb16;              /* read and write */
     cdb16_read_capacity_16_t cdb16_read_capacity;
+    cdb16_write_same_t cdb16_write_same;
+    cdb16_verify_t cdb16_verify;
 } u_cdb_payload;
 
 /*
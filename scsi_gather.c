@@ -0,0 +1,270 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "autoconf.h"
+#include "libc/types.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "libc/syscall.h"
+
+#include "api/libusbmsc.h"
+#include "scsi_dbg.h"
+#include "scsi_backend.h"
+#include "scsi_gather.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+
+#define SCSI_GATHER_SIZE CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER_SIZE
+
+/*
+ * Write gathering context. It is only accessed by the main thread.
+ * The buffer holds 'blocks' blocks, starting at 'lba', gathered since 'start'
+ * (systick, in milliseconds).
+ */
+typedef struct {
+    usbmsc_lba_t  lba;
+    uint32_t      blocks;
+    uint32_t      block_size;
+    uint64_t      start;
+    bool          wce;
+    uint8_t       buf[SCSI_GATHER_SIZE] __attribute__((aligned(4)));
+} scsi_gather_context_t;
+
+static scsi_gather_context_t gather_ctx = {
+    .lba        = 0,
+    .blocks     = 0,
+    .block_size = 0,
+    .start      = 0,
+    .wce        = true,
+};
+
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+uint64_t scsi_gather_now(void)
+{
+    uint64_t now = 0;
+
+    sys_get_systick(&now, PREC_MILLI);
+    return now;
+}
+
+/*
+ * Current value of the WCE bit.
+ */
+/*@
+  @ assigns \nothing;
+  */
+bool scsi_gather_get_wce(void)
+{
+    return gather_ctx.wce;
+}
+
+/*
+ * Update the WCE bit (MODE SELECT). Disabling the write cache flushes the
+ * gathered blocks.
+ */
+/*@
+  @ assigns gather_ctx;
+  */
+mbed_error_t scsi_gather_set_wce(bool wce)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (!wce) {
+        errcode = scsi_gather_flush();
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+    gather_ctx.wce = wce;
+err:
+    return errcode;
+}
+
+/*
+ * Tell if a WRITE command of num_blocks blocks is to be gathered.
+ */
+/*@
+  @ assigns \nothing;
+  */
+bool scsi_gather_accepts(uint32_t num_blocks, uint32_t block_size)
+{
+    if (!gather_ctx.wce || block_size == 0 || num_blocks == 0) {
+        return false;
+    }
+    return (num_blocks <= SCSI_GATHER_SIZE / block_size);
+}
+
+/*
+ * Prepare the gathering of a WRITE command. When the command doesn't extend
+ * the current run, or doesn't fit in the buffer with it, the run is flushed
+ * and a new one is started.
+ */
+/*@
+  @ requires block_size > 0;
+  @ assigns gather_ctx;
+  */
+mbed_error_t scsi_gather_begin(usbmsc_lba_t lba, uint32_t num_blocks,
+                               uint32_t block_size)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (gather_ctx.blocks > 0 &&
+        (block_size != gather_ctx.block_size ||
+         lba != gather_ctx.lba + gather_ctx.blocks ||
+         num_blocks > SCSI_GATHER_SIZE / block_size - gather_ctx.blocks)) {
+        errcode = scsi_gather_flush();
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+    if (gather_ctx.blocks == 0) {
+        gather_ctx.lba = lba;
+        gather_ctx.block_size = block_size;
+        gather_ctx.start = scsi_gather_now();
+    }
+err:
+    return errcode;
+}
+
+/*
+ * Append received blocks to the current run. The run is flushed as soon as
+ * the buffer is full.
+ */
+/*@
+  @ assigns gather_ctx;
+  */
+mbed_error_t scsi_gather_write(const uint8_t *buf, uint32_t num_blocks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t max_blocks = SCSI_GATHER_SIZE / gather_ctx.block_size;
+
+    if (num_blocks > max_blocks - gather_ctx.blocks) {
+        /* scsi_gather_begin() has not been called for these blocks */
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    memcpy(&gather_ctx.buf[gather_ctx.blocks * gather_ctx.block_size], buf,
+           num_blocks * gather_ctx.block_size);
+    gather_ctx.blocks += num_blocks;
+    if (gather_ctx.blocks == max_blocks) {
+        errcode = scsi_gather_flush();
+    }
+err:
+    return errcode;
+}
+
+/*@
+  @ assigns \nothing;
+  */
+bool scsi_gather_pending(void)
+{
+    return (gather_ctx.blocks > 0);
+}
+
+/*
+ * Write the current run to the storage backend.
+ */
+/*@
+  @ assigns gather_ctx;
+  */
+mbed_error_t scsi_gather_flush(void)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (gather_ctx.blocks > 0) {
+        errcode = scsi_backend_submit_write(gather_ctx.buf, gather_ctx.lba,
+                                            gather_ctx.blocks);
+        if (errcode == MBED_ERROR_NONE) {
+            errcode = scsi_backend_wait();
+        }
+        /* the blocks are dropped on error: the host is told and must write
+         * them again */
+        gather_ctx.blocks = 0;
+    }
+    return errcode;
+}
+
+/*
+ * Flush the current run if it overlaps the given blocks, which are about to
+ * be read from the storage backend.
+ */
+/*@
+  @ assigns gather_ctx;
+  */
+mbed_error_t scsi_gather_flush_range(usbmsc_lba_t lba, uint32_t num_blocks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (gather_ctx.blocks > 0 &&
+        lba < gather_ctx.lba + gather_ctx.blocks &&
+        gather_ctx.lba < lba + num_blocks) {
+        errcode = scsi_gather_flush();
+    }
+    return errcode;
+}
+
+/*
+ * Executed while the automaton is idle: the current run is flushed once its
+ * deadline is reached, i.e. its first block was received more than the
+ * deadline ago. The blocks have been acknowledged: the caller reports a flush
+ * error to the host as a deferred error.
+ */
+/*@
+  @ assigns gather_ctx;
+  */
+mbed_error_t scsi_gather_run(void)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (gather_ctx.blocks == 0) {
+        goto end;
+    }
+    if (scsi_gather_now() - gather_ctx.start <
+        CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER_DEADLINE) {
+        goto end;
+    }
+    errcode = scsi_gather_flush();
+    if (errcode != MBED_ERROR_NONE) {
+        log_printf("%s: flush error %d\n", __func__, errcode);
+    }
+end:
+    return errcode;
+}
+
+/*
+ * Drop the current run (media change).
+ */
+/*@
+  @ assigns gather_ctx.blocks;
+  */
+void scsi_gather_drop(void)
+{
+    gather_ctx.blocks = 0;
+}
+
+#endif /* CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER */
@@ -0,0 +1,68 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SCSI_GATHER_H_
+#define SCSI_GATHER_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "api/libusbmsc.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+
+/*
+ * Write gathering.
+ *
+ * When the write cache is enabled (WCE bit of the caching mode page), the
+ * data of contiguous WRITE commands are appended to a static gather buffer of
+ * CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER_SIZE bytes and acknowledged at once.
+ * The gathered run is written to the storage backend in a single request when
+ * a WRITE doesn't extend it, when the buffer is full, when a READ overlaps
+ * it, on SYNCHRONIZE CACHE, START STOP UNIT and reset, or when the run is
+ * older than CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER_DEADLINE milliseconds.
+ */
+
+bool scsi_gather_get_wce(void);
+
+mbed_error_t scsi_gather_set_wce(bool wce);
+
+bool scsi_gather_accepts(uint32_t num_blocks, uint32_t block_size);
+
+mbed_error_t scsi_gather_begin(usbmsc_lba_t lba, uint32_t num_blocks,
+                               uint32_t block_size);
+
+mbed_error_t scsi_gather_write(const uint8_t *buf, uint32_t num_blocks);
+
+bool scsi_gather_pending(void);
+
+mbed_error_t scsi_gather_flush(void);
+
+mbed_error_t scsi_gather_flush_range(usbmsc_lba_t lba, uint32_t num_blocks);
+
+mbed_error_t scsi_gather_run(void);
+
+void scsi_gather_drop(void);
+
+#endif
+
+#endif /*!SCSI_GATHER_H_ */
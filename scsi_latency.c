@@ -0,0 +1,285 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "libc/string.h"
+#include "libc/syscall.h"
+#include "libc/sync.h"
+
+#include "api/libusbmsc.h"
+#include "scsi_latency.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+
+#define SCSI_LATENCY_OPCODES CONFIG_USR_LIB_MASSSTORAGE_LATENCY_OPCODES
+
+/*
+ * Timestamps of the command being executed. 'active' is set by the main
+ * thread when the command is dequeued, 'done' by the context sending the
+ * status (main thread or ISR). Once both are set, the command is recorded by
+ * the main thread.
+ */
+typedef struct {
+    uint32_t          recv;
+    uint32_t          dequeue;
+    uint32_t          data;
+    volatile uint32_t end;
+    uint8_t           opcode;
+    bool              data_started;
+    volatile bool     active;
+    volatile bool     done;
+} scsi_latency_cmd_t;
+
+static scsi_latency_cmd_t latency_cmd = { 0 };
+
+/* histograms of the tracked opcodes, in their order of first use */
+static usbmsc_latency_hist_t latency_hists[SCSI_LATENCY_OPCODES] = { 0 };
+static uint8_t latency_num_opcodes = 0;
+/* recorded commands whose opcode could not be tracked */
+static uint32_t latency_untracked = 0;
+
+/*
+ * Current value of the cycle counter, truncated to 32 bits: the measured
+ * intervals are computed modulo 2^32 cycles.
+ */
+/*@
+  @ assigns \nothing;
+  */
+uint32_t scsi_latency_now(void)
+{
+    uint64_t now = 0;
+
+    sys_get_systick(&now, PREC_CYCLE);
+    return (uint32_t) now;
+}
+
+/*
+ * log2 bucket of a duration. Null durations are counted in the first bucket.
+ */
+/*@
+  @ assigns \nothing;
+  @ ensures \result < USBMSC_LATENCY_BUCKETS;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+uint8_t scsi_latency_bucket(uint32_t duration)
+{
+    uint8_t bucket = 0;
+
+    /*@
+      @ loop invariant 0 <= bucket < USBMSC_LATENCY_BUCKETS;
+      @ loop assigns duration, bucket;
+      @ loop variant duration;
+      */
+    while (duration > 1 && bucket < (USBMSC_LATENCY_BUCKETS - 1)) {
+        duration >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/*
+ * Histograms of the given opcode. A new slot is used on the first occurrence
+ * of an opcode. Returns NULL when all the slots are used by other opcodes.
+ */
+/*@
+  @ assigns latency_hists[0 .. SCSI_LATENCY_OPCODES-1], latency_num_opcodes;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+usbmsc_latency_hist_t *scsi_latency_slot(uint8_t opcode)
+{
+    usbmsc_latency_hist_t *hist = NULL;
+    uint8_t i;
+
+    /*@
+      @ loop invariant 0 <= i <= latency_num_opcodes;
+      @ loop assigns i;
+      @ loop variant latency_num_opcodes - i;
+      */
+    for (i = 0; i < latency_num_opcodes; ++i) {
+        if (latency_hists[i].opcode == opcode) {
+            hist = &latency_hists[i];
+            goto end;
+        }
+    }
+    if (latency_num_opcodes >= SCSI_LATENCY_OPCODES) {
+        goto end;
+    }
+    hist = &latency_hists[latency_num_opcodes];
+    memset(hist, 0x0, sizeof(usbmsc_latency_hist_t));
+    hist->opcode = opcode;
+    latency_num_opcodes++;
+end:
+    return hist;
+}
+
+/*@
+  @ requires \valid(hist);
+  @ requires stage < USBMSC_LATENCY_STAGES;
+  @ assigns hist->max[stage], hist->hist[stage][0 .. USBMSC_LATENCY_BUCKETS-1];
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void scsi_latency_add(usbmsc_latency_hist_t *hist, usbmsc_latency_stage_t stage,
+                      uint32_t duration)
+{
+    hist->hist[stage][scsi_latency_bucket(duration)]++;
+    if (duration > hist->max[stage]) {
+        hist->max[stage] = duration;
+    }
+}
+
+/*
+ * Record the last command once its status is sent. Executed by the main
+ * thread only.
+ */
+/*@
+  @ assigns latency_cmd, latency_hists[0 .. SCSI_LATENCY_OPCODES-1],
+            latency_num_opcodes, latency_untracked;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void scsi_latency_commit(void)
+{
+    usbmsc_latency_hist_t *hist;
+    uint32_t end;
+    uint32_t data;
+
+    if (!latency_cmd.active || !latency_cmd.done) {
+        goto err;
+    }
+    request_data_membarrier();
+    end = latency_cmd.end;
+    /* without data phase, the setup lasts until the status */
+    data = latency_cmd.data_started ? latency_cmd.data : end;
+
+    hist = scsi_latency_slot(latency_cmd.opcode);
+    if (hist == NULL) {
+        latency_untracked++;
+        goto clear;
+    }
+    hist->count++;
+    scsi_latency_add(hist, USBMSC_LATENCY_QUEUE, latency_cmd.dequeue - latency_cmd.recv);
+    scsi_latency_add(hist, USBMSC_LATENCY_SETUP, data - latency_cmd.dequeue);
+    scsi_latency_add(hist, USBMSC_LATENCY_DATA, end - data);
+    scsi_latency_add(hist, USBMSC_LATENCY_TOTAL, end - latency_cmd.recv);
+clear:
+    set_bool_with_membarrier(&latency_cmd.active, false);
+err:
+    return;
+}
+
+/*
+ * A command has been dequeued by the main thread. The previous command is
+ * recorded if its status has been sent, and dropped otherwise (reset).
+ */
+/*@
+  @ assigns latency_cmd, latency_hists[0 .. SCSI_LATENCY_OPCODES-1],
+            latency_num_opcodes, latency_untracked;
+  */
+void scsi_latency_begin(uint32_t recv_stamp, uint8_t opcode)
+{
+    scsi_latency_commit();
+    latency_cmd.recv = recv_stamp;
+    latency_cmd.dequeue = scsi_latency_now();
+    latency_cmd.data = 0;
+    latency_cmd.end = 0;
+    latency_cmd.opcode = opcode;
+    latency_cmd.data_started = false;
+    set_bool_with_membarrier(&latency_cmd.done, false);
+    set_bool_with_membarrier(&latency_cmd.active, true);
+}
+
+/*
+ * Data phase chunk requested by the main thread. Only the first one is
+ * timestamped.
+ */
+/*@
+  @ assigns latency_cmd.data, latency_cmd.data_started;
+  */
+void scsi_latency_data(void)
+{
+    if (latency_cmd.active && !latency_cmd.data_started && !latency_cmd.done) {
+        latency_cmd.data = scsi_latency_now();
+        latency_cmd.data_started = true;
+    }
+}
+
+/*
+ * Status sent, from the main thread or the ISR. Any later status (e.g. a
+ * CSW sent after a reset) is ignored.
+ */
+/*@
+  @ assigns latency_cmd.end, latency_cmd.done;
+  */
+void scsi_latency_end(void)
+{
+    if (latency_cmd.active && !latency_cmd.done) {
+        latency_cmd.end = scsi_latency_now();
+        set_bool_with_membarrier(&latency_cmd.done, true);
+    }
+}
+
+/*@
+  @ requires \valid(hist);
+  @ assigns *hist, *untracked;
+  */
+mbed_error_t usbmsc_latency_get(uint8_t idx, usbmsc_latency_hist_t *hist,
+                                uint32_t *untracked)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (hist == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* the last executed command is recorded first */
+    scsi_latency_commit();
+    if (untracked != NULL) {
+        *untracked = latency_untracked;
+    }
+    if (idx >= latency_num_opcodes) {
+        errcode = MBED_ERROR_NOTFOUND;
+        goto err;
+    }
+    memcpy(hist, &latency_hists[idx], sizeof(usbmsc_latency_hist_t));
+err:
+    return errcode;
+}
+
+/*@
+  @ assigns latency_cmd, latency_hists[0 .. SCSI_LATENCY_OPCODES-1],
+            latency_num_opcodes, latency_untracked;
+  */
+void usbmsc_latency_reset(void)
+{
+    scsi_latency_commit();
+    latency_num_opcodes = 0;
+    latency_untracked = 0;
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SCSI_LATENCY_H_
+#define SCSI_LATENCY_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "api/libusbmsc.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+
+/*
+ * Command latency instrumentation.
+ *
+ * Each command is timestamped when it is received (scsi_parse_cdb(), called
+ * by the transport ISR), when it is dequeued by usbmsc_exec_automaton(), when
+ * its data phase is started and when its status is sent. The intervals are
+ * accumulated in log2 histograms, per opcode, read back with
+ * usbmsc_latency_get().
+ * The status may be sent from the ISR (end of a data-in phase): the ISR only
+ * takes the last timestamp, the histograms are updated by the main thread.
+ */
+
+uint32_t scsi_latency_now(void);
+
+void scsi_latency_begin(uint32_t recv_stamp, uint8_t opcode);
+
+void scsi_latency_data(void);
+
+void scsi_latency_end(void);
+
+#endif
+
+#endif /*!SCSI_LATENCY_H_ */
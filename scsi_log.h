@@ -87,6 +87,11 @@ typedef enum {
 #define ASC_SERVO_FAULT                            0x09
 #define ASC_ABORTED_COMMAND                        0x0B
 #define ASC_ECHO_BUFFER_OVERWRITTEN                0x3F
+#define ASC_MEDIUM_MAY_HAVE_CHANGED                0x28
+#define ASC_PARAMETER_LIST_LENGTH_ERROR            0x1A
+#define ASC_INVALID_FIELD_IN_PARAMETER_LIST        0x26
+#define ASC_INVALID_FIELD_IN_CDB                   0x24
+#define ASC_MISCOMPARE_DURING_VERIFY_OPERATION     0x1D
 
 #define ASCQ_NO_ADDITIONAL_SENSE                   0x00
 #define ASCQ_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE    0x00
@@ -94,8 +99,19 @@ typedef enum {
 #define ASCQ_PERIPHERAL_DEVICE_WRITE_FAULT         0x00
 #define ASCQ_UNRECOVERED_READ_ERROR                0x00
 #define ASCQ_WRITE_PROTECTED                       0x00
+#define ASCQ_MEDIUM_MAY_HAVE_CHANGED               0x00
+#define ASCQ_PARAMETER_LIST_LENGTH_ERROR           0x00
+#define ASCQ_INVALID_FIELD_IN_PARAMETER_LIST       0x00
+#define ASCQ_INVALID_FIELD_IN_CDB                  0x00
+#define ASCQ_MISCOMPARE_DURING_VERIFY_OPERATION    0x00
 
 
+/*
+ * Flag of the SCSI errors which are reported as deferred errors (sense
+ * response code 0x71, see SPC-4, 4.5.5 Deferred errors)
+ */
+#define SCSI_ERROR_DEFERRED                        0x1000000
+
 #ifndef __FRAMAC__
 /* SCSI errors */
 /*@
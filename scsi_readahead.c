@@ -0,0 +1,204 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "autoconf.h"
+#include "libc/types.h"
+#include "libc/stdio.h"
+
+#include "api/libusbmsc.h"
+#include "scsi_dbg.h"
+#include "scsi_backend.h"
+#include "scsi_readahead.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+
+/*
+ * Read-ahead context. It is only accessed by the main thread.
+ * The buffer holds 'blocks' valid sectors, starting at 'lba', from 'offset'
+ * (in bytes). next_lba is the LBA following the last READ command, and
+ * stream is set when this READ was contiguous with the previous one.
+ */
+typedef struct {
+    uint8_t      *buf;
+    uint32_t      len;
+    usbmsc_lba_t  lba;
+    uint32_t      blocks;
+    uint32_t      offset;
+    usbmsc_lba_t  next_lba;
+    bool          stream;
+    uint32_t      hits;
+    uint32_t      misses;
+} scsi_readahead_context_t;
+
+static scsi_readahead_context_t ra_ctx = {
+    .buf      = NULL,
+    .len      = 0,
+    .lba      = 0,
+    .blocks   = 0,
+    .offset   = 0,
+    .next_lba = 0,
+    .stream   = false,
+    .hits     = 0,
+    .misses   = 0,
+};
+
+/*@
+  @ assigns ra_ctx;
+  */
+mbed_error_t usbmsc_declare_readahead(uint8_t *buf, uint32_t len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (buf == NULL || len == 0) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    ra_ctx.buf = buf;
+    ra_ctx.len = len;
+    scsi_readahead_reset();
+err:
+    return errcode;
+}
+
+/*@
+  @ requires \valid(hits) && \valid(misses);
+  @ assigns *hits, *misses;
+  */
+void usbmsc_readahead_get_stats(uint32_t *hits, uint32_t *misses)
+{
+    *hits = ra_ctx.hits;
+    *misses = ra_ctx.misses;
+}
+
+/*
+ * Called at the beginning of each READ command. Returns the number of blocks
+ * of the request, starting at lba, which are held by the read-ahead buffer
+ * (0 on miss), and their address in buf. These blocks are consumed: the
+ * caller must send them before the next call to scsi_readahead_run().
+ */
+/*@
+  @ requires \valid(buf);
+  @ requires block_size > 0;
+  @ assigns ra_ctx, *buf;
+  */
+uint32_t scsi_readahead_get(usbmsc_lba_t lba, uint32_t num_blocks,
+                            uint32_t block_size, uint8_t **buf)
+{
+    uint32_t found = 0;
+
+    /* sequential stream detection */
+    ra_ctx.stream = (lba == ra_ctx.next_lba);
+    ra_ctx.next_lba = lba + num_blocks;
+
+    if (ra_ctx.blocks == 0 || lba != ra_ctx.lba) {
+        /* the prefetched data don't start the request: they are useless,
+         * the stream is broken */
+        ra_ctx.blocks = 0;
+        ra_ctx.misses++;
+        goto end;
+    }
+    found = (num_blocks < ra_ctx.blocks) ? num_blocks : ra_ctx.blocks;
+    *buf = &ra_ctx.buf[ra_ctx.offset];
+    ra_ctx.lba += found;
+    ra_ctx.blocks -= found;
+    ra_ctx.offset += found * block_size;
+    ra_ctx.hits++;
+end:
+    return found;
+}
+
+/*
+ * Executed while the automaton is idle. When the last READ belongs to a
+ * sequential stream and the prefetched data have been consumed, the sectors
+ * following it are read into the read-ahead buffer.
+ */
+/*@
+  @ assigns ra_ctx;
+  */
+void scsi_readahead_run(uint32_t block_size, usbmsc_lba_t storage_size)
+{
+    mbed_error_t error;
+    uint32_t num_blocks;
+
+    if (ra_ctx.buf == NULL || !ra_ctx.stream || ra_ctx.blocks > 0) {
+        goto end;
+    }
+    if (block_size == 0 || ra_ctx.next_lba >= storage_size) {
+        goto end;
+    }
+    num_blocks = ra_ctx.len / block_size;
+    if (num_blocks > storage_size - ra_ctx.next_lba) {
+        num_blocks = (uint32_t)(storage_size - ra_ctx.next_lba);
+    }
+    if (num_blocks == 0) {
+        goto end;
+    }
+    error = scsi_backend_submit_read(ra_ctx.buf, ra_ctx.next_lba, num_blocks);
+    if (error == MBED_ERROR_NONE) {
+        error = scsi_backend_wait();
+    }
+    if (error != MBED_ERROR_NONE) {
+        /* not an error for the host: the READ will be executed normally */
+        log_printf("%s: prefetch error %d\n", __func__, error);
+        ra_ctx.stream = false;
+        goto end;
+    }
+    ra_ctx.lba = ra_ctx.next_lba;
+    ra_ctx.blocks = num_blocks;
+    ra_ctx.offset = 0;
+end:
+    return;
+}
+
+/*
+ * Drop the prefetched data if they overlap the given blocks, which are
+ * being written.
+ */
+/*@
+  @ assigns ra_ctx.blocks;
+  */
+void scsi_readahead_invalidate(usbmsc_lba_t lba, uint32_t num_blocks)
+{
+    if (ra_ctx.blocks == 0) {
+        return;
+    }
+    if (lba < ra_ctx.lba + ra_ctx.blocks && ra_ctx.lba < lba + num_blocks) {
+        ra_ctx.blocks = 0;
+    }
+}
+
+/*
+ * Drop the prefetched data and the stream detection state (reset, media
+ * change).
+ */
+/*@
+  @ assigns ra_ctx.blocks, ra_ctx.stream, ra_ctx.next_lba;
+  */
+void scsi_readahead_reset(void)
+{
+    ra_ctx.blocks = 0;
+    ra_ctx.stream = false;
+    ra_ctx.next_lba = 0;
+}
+
+#endif /* CONFIG_USR_LIB_MASSSTORAGE_READAHEAD */
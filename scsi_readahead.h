@@ -0,0 +1,55 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SCSI_READAHEAD_H_
+#define SCSI_READAHEAD_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "api/libusbmsc.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+
+/*
+ * Sequential read-ahead.
+ *
+ * Each READ command is given to scsi_readahead_get(), which detects the
+ * sequential streams (a READ starting where the previous one ended) and
+ * returns the part of the request already held in the read-ahead buffer.
+ * When the automaton is idle, scsi_readahead_run() prefetches the sectors
+ * following the last READ of a stream into the read-ahead buffer, declared
+ * by the application with usbmsc_declare_readahead().
+ */
+
+uint32_t scsi_readahead_get(usbmsc_lba_t lba, uint32_t num_blocks,
+                            uint32_t block_size, uint8_t **buf);
+
+void scsi_readahead_run(uint32_t block_size, usbmsc_lba_t storage_size);
+
+void scsi_readahead_invalidate(usbmsc_lba_t lba, uint32_t num_blocks);
+
+void scsi_readahead_reset(void);
+
+#endif
+
+#endif /*!SCSI_READAHEAD_H_ */
@@ -49,15 +49,18 @@ typedef struct __attribute__((packed)) {
 typedef struct __attribute__((packed)) {
     uint64_t ret_lba;
     uint32_t ret_block_length;
-    uint8_t reserved2:2;
-    uint8_t rc_basis:2;
-    uint8_t p_type:3;
+    /* bitfields are declared from the least significant bit, as
+     * allocated by the compiler on little endian targets */
     uint8_t prot_enable:1;
-    uint8_t p_i_expornent:4;
+    uint8_t p_type:3;
+    uint8_t rc_basis:2;
+    uint8_t reserved2:2;
     uint8_t logical_block_per_phys_block_component:4;
-    uint16_t lbpme:1;
-    uint16_t lbprz:1;
-    uint16_t lowest_aligned_lba:14;
+    uint8_t p_i_expornent:4;
+    uint8_t lowest_aligned_lba_msb:6;
+    uint8_t lbprz:1;
+    uint8_t lbpme:1;
+    uint8_t lowest_aligned_lba_lsb;
     uint8_t reserved1[16];
 } read_capacity16_parameter_data_t;
 
@@ -163,6 +166,59 @@ typedef struct __packed inquiry_data {
 } inquiry_data_t;
 
 
+/* VITAL PRODUCT DATA PAGES (INQUIRY with EVPD set) */
+#define VPD_PAGE_SUPPORTED_PAGES          0x00
+#define VPD_PAGE_BLOCK_LIMITS             0xb0
+#define VPD_PAGE_LOGICAL_BLOCK_PROVISIONING 0xb2
+
+typedef struct __attribute__((packed)) {
+    uint8_t periph_device_type:5;
+    uint8_t periph_qualifier:3;
+    uint8_t page_code;
+    uint16_t page_length;
+} vpd_page_header_t;
+
+/* Supported VPD pages (0x00) */
+typedef struct __attribute__((packed)) {
+    vpd_page_header_t header;
+    uint8_t pages[3];
+} vpd_supported_pages_t;
+
+/* Block Limits VPD page (0xB0), see SBC-3 6.5.3 */
+typedef struct __attribute__((packed)) {
+    vpd_page_header_t header;
+    uint8_t wsnz:1;
+    uint8_t reserved1:7;
+    uint8_t max_compare_and_write_length;
+    uint16_t optimal_transfer_length_granularity;
+    uint32_t max_transfer_length;
+    uint32_t optimal_transfer_length;
+    uint32_t max_prefetch_length;
+    uint32_t max_unmap_lba_count;
+    uint32_t max_unmap_block_descriptor_count;
+    uint32_t optimal_unmap_granularity;
+    uint32_t unmap_granularity_alignment;   /* and UGAVALID (MSB) */
+    uint64_t max_write_same_length;
+    uint8_t reserved2[20];
+} vpd_block_limits_t;
+
+/* Logical Block Provisioning VPD page (0xB2), see SBC-3 6.5.13 */
+typedef struct __attribute__((packed)) {
+    vpd_page_header_t header;
+    uint8_t threshold_exponent;
+    uint8_t dp:1;
+    uint8_t anc_sup:1;
+    uint8_t lbprz:1;
+    uint8_t reserved1:2;
+    uint8_t lbpws10:1;
+    uint8_t lbpws:1;
+    uint8_t lbpu:1;
+    uint8_t provisioning_type:3;
+    uint8_t reserved2:5;
+    uint8_t reserved3;
+} vpd_logical_block_provisioning_t;
+
+
 /* About MODE SELECT and MODE SENSE responses   */
 
 /* MODE SENSE PARAMETER DATA */
@@ -236,50 +292,52 @@ typedef struct __attribute__((packed)) {
 
 
 /* 1) Caching mode */
+/* bitfields are declared from the least significant bit, as allocated by the
+ * compiler on little endian targets */
 typedef struct __attribute__((packed)) {
-    uint8_t PS:1;
-    uint8_t SPF:1;
     uint8_t page_code:6;
+    uint8_t SPF:1;
+    uint8_t PS:1;
     uint8_t page_length;
-    uint8_t IC:1;
-    uint8_t ABPF:1;
-    uint8_t CAP:1;
-    uint8_t disk:1;
-    uint8_t size:1;
-    uint8_t WCE:1;
-    uint8_t MF:1;
     uint8_t RCD:1;
-    uint8_t dmd_read_retention_prio:4;
+    uint8_t MF:1;
+    uint8_t WCE:1;
+    uint8_t size:1;
+    uint8_t disk:1;
+    uint8_t CAP:1;
+    uint8_t ABPF:1;
+    uint8_t IC:1;
     uint8_t write_retention_prio:4;
+    uint8_t dmd_read_retention_prio:4;
     uint16_t disable_prefetch_transfer_length;
     uint16_t min_prefetch;
     uint16_t max_prefetch;
     uint16_t max_prefetch_ceil;
-    uint8_t FSW:1;
-    uint8_t LB_CSS:1;
-    uint8_t DRA:1;
-    uint8_t vendor_specific:2;
-    uint8_t SYNC_PROG:2;
     uint8_t NV_DIS:1;
+    uint8_t SYNC_PROG:2;
+    uint8_t vendor_specific:2;
+    uint8_t DRA:1;
+    uint8_t LB_CSS:1;
+    uint8_t FSW:1;
     uint8_t cache_segment_number;
     uint16_t cache_segment_size;
     uint8_t reserved1;
+    uint8_t obsolete[3];
 } mode_parameter_caching_t;
 
-/* TODO: the following is hard-coded as we reply only caching info.
- * A cleaner way, for MODE_SENSE and MODE_SELECT, would be to forge
- * the required mode pages and associated mode pages header depending
- * on the CDB content */
+#define MODE_PAGE_CACHING       0x08
+#define MODE_PAGE_ALL           0x3f
+#define MODE_PAGE_CACHING_LEN   (sizeof(mode_parameter_caching_t) - 2)
+
+/* The only mode page returned by MODE SENSE is the caching one */
 typedef struct __attribute__((packed)) {
     mode_parameter6_header_t header;
-
-    // mode_parameter_caching_t  caching;
+    mode_parameter_caching_t caching;
 } mode_parameter6_data_t;
 
 typedef struct __attribute__((packed)) {
     mode_parameter10_header_t header;
-
-    // mode_parameter_caching_t  caching;
+    mode_parameter_caching_t caching;
 } mode_parameter10_data_t;
 
 typedef union {
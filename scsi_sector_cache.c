@@ -0,0 +1,292 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "autoconf.h"
+#include "libc/types.h"
+#include "libc/string.h"
+
+#include "api/libusbmsc.h"
+#include "scsi_dbg.h"
+#include "scsi_sector_cache.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+
+#define SCSI_SECTOR_CACHE_SIZE CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE_SIZE
+
+/* the smallest block size supported by the hosts */
+#define SCSI_SECTOR_CACHE_MAX_LINES (SCSI_SECTOR_CACHE_SIZE / 512)
+
+/*
+ * A cache line holds a single block, stored at offset i * block_size of the
+ * cache buffer. last_use is the value of the access clock when the line was
+ * last hit or filled, 0 for a free line.
+ */
+typedef struct {
+    usbmsc_lba_t lba;
+    uint32_t     last_use;
+} scsi_sector_cache_line_t;
+
+/*
+ * Sector cache context. It is only accessed by the main thread.
+ * The lines are sized when the first block is cached, as the block size is
+ * only known once the host has requested the storage capacity.
+ */
+typedef struct {
+    uint32_t                  block_size;
+    uint32_t                  num_lines;
+    uint32_t                  clock;
+    uint32_t                  hits;
+    uint32_t                  misses;
+    scsi_sector_cache_line_t  lines[SCSI_SECTOR_CACHE_MAX_LINES];
+    uint8_t                   buf[SCSI_SECTOR_CACHE_SIZE] __attribute__((aligned(4)));
+} scsi_sector_cache_context_t;
+
+static scsi_sector_cache_context_t sc_ctx = {
+    .block_size = 0,
+    .num_lines  = 0,
+    .clock      = 0,
+    .hits       = 0,
+    .misses     = 0,
+};
+
+/*@
+  @ requires \valid(hits) && \valid(misses);
+  @ assigns *hits, *misses;
+  */
+void usbmsc_sector_cache_get_stats(uint32_t *hits, uint32_t *misses)
+{
+    *hits = sc_ctx.hits;
+    *misses = sc_ctx.misses;
+}
+
+/*@
+  @ assigns sc_ctx.lines[0 .. SCSI_SECTOR_CACHE_MAX_LINES - 1];
+  */
+void usbmsc_sector_cache_invalidate(usbmsc_lba_t lba, uint32_t num_blocks)
+{
+    scsi_sector_cache_invalidate(lba, num_blocks);
+}
+
+/*
+ * Size the cache lines for the given block size. The lines of another block
+ * size are dropped. Blocks bigger than the cache are not cached.
+ */
+/*@
+  @ requires block_size > 0;
+  @ assigns sc_ctx;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void scsi_sector_cache_configure(uint32_t block_size)
+{
+    if (sc_ctx.block_size == block_size) {
+        return;
+    }
+    scsi_sector_cache_reset();
+    sc_ctx.block_size = block_size;
+    sc_ctx.num_lines = SCSI_SECTOR_CACHE_SIZE / block_size;
+    if (sc_ctx.num_lines > SCSI_SECTOR_CACHE_MAX_LINES) {
+        sc_ctx.num_lines = SCSI_SECTOR_CACHE_MAX_LINES;
+    }
+}
+
+/*
+ * Tell if a READ command of num_blocks blocks is to be looked up and kept in
+ * the cache. Only the READs of at most a quarter of the cache are, so that a
+ * file transfer doesn't evict the metadata blocks the cache is made for.
+ */
+/*@
+  @ assigns sc_ctx;
+  */
+bool scsi_sector_cache_accepts(uint32_t num_blocks, uint32_t block_size)
+{
+    uint32_t max_blocks;
+
+    if (block_size == 0) {
+        return false;
+    }
+    scsi_sector_cache_configure(block_size);
+    max_blocks = sc_ctx.num_lines / 4;
+    if (max_blocks == 0) {
+        max_blocks = 1;
+    }
+    return (num_blocks > 0 && num_blocks <= max_blocks && num_blocks <= sc_ctx.num_lines);
+}
+
+/*
+ * Tick the access clock. When it wraps, which only happens after 2^32 block
+ * accesses, the lines in use are given the same age.
+ */
+/*@
+  @ assigns sc_ctx.clock, sc_ctx.lines[0 .. SCSI_SECTOR_CACHE_MAX_LINES - 1].last_use;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+uint32_t scsi_sector_cache_tick(void)
+{
+    uint32_t i;
+
+    if (sc_ctx.clock == UINT32_MAX) {
+        for (i = 0; i < sc_ctx.num_lines; i++) {
+            if (sc_ctx.lines[i].last_use != 0) {
+                sc_ctx.lines[i].last_use = 1;
+            }
+        }
+        sc_ctx.clock = 1;
+    }
+    sc_ctx.clock++;
+    return sc_ctx.clock;
+}
+
+/*
+ * Index of the line holding the given block, or num_lines if not cached.
+ */
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+uint32_t scsi_sector_cache_lookup(usbmsc_lba_t lba)
+{
+    uint32_t i;
+
+    for (i = 0; i < sc_ctx.num_lines; i++) {
+        if (sc_ctx.lines[i].last_use != 0 && sc_ctx.lines[i].lba == lba) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Copy the given blocks into buf if they are all cached. A partial hit is
+ * counted as a miss: the whole request is then read from the backend.
+ */
+/*@
+  @ assigns sc_ctx, buf[0 .. num_blocks * sc_ctx.block_size - 1];
+  */
+bool scsi_sector_cache_read(usbmsc_lba_t lba, uint8_t *buf, uint32_t num_blocks)
+{
+    uint32_t i;
+    uint32_t idx;
+    bool hit = false;
+
+    if (num_blocks == 0 || num_blocks > sc_ctx.num_lines) {
+        goto end;
+    }
+    for (i = 0; i < num_blocks; i++) {
+        if (scsi_sector_cache_lookup(lba + i) == sc_ctx.num_lines) {
+            goto end;
+        }
+    }
+    for (i = 0; i < num_blocks; i++) {
+        idx = scsi_sector_cache_lookup(lba + i);
+        memcpy(&buf[i * sc_ctx.block_size],
+               &sc_ctx.buf[idx * sc_ctx.block_size], sc_ctx.block_size);
+        sc_ctx.lines[idx].last_use = scsi_sector_cache_tick();
+    }
+    hit = true;
+end:
+    if (hit) {
+        sc_ctx.hits++;
+    } else {
+        sc_ctx.misses++;
+    }
+    return hit;
+}
+
+/*
+ * Keep the given blocks, just read by the host, in the cache. Each block
+ * replaces its previous copy, a free line or the least recently used one.
+ */
+/*@
+  @ requires block_size > 0;
+  @ assigns sc_ctx;
+  */
+void scsi_sector_cache_fill(usbmsc_lba_t lba, const uint8_t *buf,
+                            uint32_t num_blocks, uint32_t block_size)
+{
+    uint32_t i;
+    uint32_t j;
+    uint32_t idx;
+
+    if (!scsi_sector_cache_accepts(num_blocks, block_size)) {
+        return;
+    }
+    for (i = 0; i < num_blocks; i++) {
+        idx = scsi_sector_cache_lookup(lba + i);
+        if (idx == sc_ctx.num_lines) {
+            /* free lines have the oldest possible last_use (0) */
+            idx = 0;
+            for (j = 1; j < sc_ctx.num_lines; j++) {
+                if (sc_ctx.lines[j].last_use < sc_ctx.lines[idx].last_use) {
+                    idx = j;
+                }
+            }
+        }
+        memcpy(&sc_ctx.buf[idx * block_size], &buf[i * block_size], block_size);
+        sc_ctx.lines[idx].lba = lba + i;
+        sc_ctx.lines[idx].last_use = scsi_sector_cache_tick();
+    }
+}
+
+/*
+ * Drop the cached copies of the given blocks (WRITE commands, application
+ * request).
+ */
+/*@
+  @ assigns sc_ctx.lines[0 .. SCSI_SECTOR_CACHE_MAX_LINES - 1];
+  */
+void scsi_sector_cache_invalidate(usbmsc_lba_t lba, uint32_t num_blocks)
+{
+    uint32_t i;
+
+    for (i = 0; i < sc_ctx.num_lines; i++) {
+        if (sc_ctx.lines[i].last_use != 0 &&
+            sc_ctx.lines[i].lba >= lba &&
+            sc_ctx.lines[i].lba - lba < num_blocks) {
+            sc_ctx.lines[i].last_use = 0;
+        }
+    }
+}
+
+/*
+ * Drop all the cached blocks (media change).
+ */
+/*@
+  @ assigns sc_ctx.lines[0 .. SCSI_SECTOR_CACHE_MAX_LINES - 1], sc_ctx.clock;
+  */
+void scsi_sector_cache_reset(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < SCSI_SECTOR_CACHE_MAX_LINES; i++) {
+        sc_ctx.lines[i].last_use = 0;
+    }
+    sc_ctx.clock = 0;
+}
+
+#endif /* CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE */
@@ -0,0 +1,58 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SCSI_SECTOR_CACHE_H_
+#define SCSI_SECTOR_CACHE_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "api/libusbmsc.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+
+/*
+ * LRU sector cache.
+ *
+ * Small READ commands (partition table, FAT, directory clusters...) are
+ * kept in a static cache of CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE_SIZE
+ * bytes, one block per line. A READ whose blocks are all cached is served
+ * without accessing the storage backend. When a block is to be cached and
+ * no line is free, the least recently used line is reused.
+ * The cache never holds data which are not in the storage (or in the write
+ * cache): the blocks written by the host are invalidated.
+ */
+
+bool scsi_sector_cache_accepts(uint32_t num_blocks, uint32_t block_size);
+
+bool scsi_sector_cache_read(usbmsc_lba_t lba, uint8_t *buf, uint32_t num_blocks);
+
+void scsi_sector_cache_fill(usbmsc_lba_t lba, const uint8_t *buf,
+                            uint32_t num_blocks, uint32_t block_size);
+
+void scsi_sector_cache_invalidate(usbmsc_lba_t lba, uint32_t num_blocks);
+
+void scsi_sector_cache_reset(void);
+
+#endif
+
+#endif /*!SCSI_SECTOR_CACHE_H_ */
@@ -0,0 +1,179 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "libc/string.h"
+#include "libc/syscall.h"
+
+#include "api/libusbmsc.h"
+#include "scsi_stats.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+
+static usbmsc_stats_t stats_ctx = { 0 };
+
+/*
+ * A command has been dequeued for execution.
+ */
+/*@
+  @ assigns stats_ctx.commands[opcode];
+  */
+void scsi_stats_command(uint8_t opcode)
+{
+    stats_ctx.commands[opcode]++;
+}
+
+/*
+ * Data of a successful READ (write false) or WRITE (write true) command.
+ */
+/*@
+  @ assigns stats_ctx.bytes_read, stats_ctx.bytes_written;
+  */
+void scsi_stats_data(bool write, uint64_t bytes)
+{
+    if (write) {
+        stats_ctx.bytes_written += bytes;
+    } else {
+        stats_ctx.bytes_read += bytes;
+    }
+}
+
+/*
+ * Failed storage backend request.
+ */
+/*@
+  @ assigns stats_ctx.backend_read_errors, stats_ctx.backend_write_errors;
+  */
+void scsi_stats_backend_error(bool write)
+{
+    if (write) {
+        stats_ctx.backend_write_errors++;
+    } else {
+        stats_ctx.backend_read_errors++;
+    }
+}
+
+/*
+ * CHECK CONDITION status reported with the given sense key.
+ */
+/*@
+  @ assigns stats_ctx.sense_keys[0 .. 15];
+  */
+void scsi_stats_sense(uint8_t sense_key)
+{
+    stats_ctx.sense_keys[sense_key & 0xf]++;
+}
+
+/*
+ * Transport reset, executed in ISR context.
+ */
+/*@
+  @ assigns stats_ctx.resets;
+  */
+void scsi_stats_reset(void)
+{
+    stats_ctx.resets++;
+}
+
+/*
+ * Received commands dropped, because the queue is full (ISR context) or by
+ * a reset (main thread).
+ */
+/*@
+  @ assigns stats_ctx.dropped_queue_full, stats_ctx.dropped_reset;
+  */
+void scsi_stats_dropped(bool reset, uint32_t num_commands)
+{
+    if (reset) {
+        stats_ctx.dropped_reset += num_commands;
+    } else {
+        stats_ctx.dropped_queue_full += num_commands;
+    }
+}
+
+/*
+ * Start of a wait, to be called only when the waited event has not happened
+ * yet: the time is read from the kernel, which is not free.
+ */
+/*@
+  @ assigns \nothing;
+  */
+uint64_t scsi_stats_wait_start(void)
+{
+    uint64_t now = 0;
+
+    sys_get_systick(&now, PREC_MICRO);
+    return now;
+}
+
+/*
+ * End of a wait started at the given time. A null start time means that
+ * there has been no wait.
+ */
+/*@
+  @ assigns stats_ctx.usb_wait_us, stats_ctx.backend_wait_us;
+  */
+void scsi_stats_wait_end(scsi_stats_wait_t wait, uint64_t start)
+{
+    uint64_t now = 0;
+
+    if (start == 0) {
+        goto end;
+    }
+    sys_get_systick(&now, PREC_MICRO);
+    if (now < start) {
+        goto end;
+    }
+    if (wait == SCSI_STATS_WAIT_BACKEND) {
+        stats_ctx.backend_wait_us += now - start;
+    } else {
+        stats_ctx.usb_wait_us += now - start;
+    }
+end:
+    return;
+}
+
+/*@
+  @ assigns *stats;
+  */
+mbed_error_t usbmsc_get_stats(usbmsc_stats_t *stats)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (stats == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    memcpy(stats, &stats_ctx, sizeof(usbmsc_stats_t));
+err:
+    return errcode;
+}
+
+/*@
+  @ assigns stats_ctx;
+  */
+void usbmsc_reset_stats(void)
+{
+    memset(&stats_ctx, 0x0, sizeof(usbmsc_stats_t));
+}
+
+#endif
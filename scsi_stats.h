@@ -0,0 +1,64 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SCSI_STATS_H_
+#define SCSI_STATS_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "api/libusbmsc.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+
+/*
+ * Runtime statistics.
+ *
+ * The counters are updated by the main thread, except the resets and the
+ * commands dropped because the queue is full, which are counted by the
+ * transport ISR. Each counter is updated by a single context.
+ */
+
+typedef enum {
+    SCSI_STATS_WAIT_USB = 0,
+    SCSI_STATS_WAIT_BACKEND,
+} scsi_stats_wait_t;
+
+void scsi_stats_command(uint8_t opcode);
+
+void scsi_stats_data(bool write, uint64_t bytes);
+
+void scsi_stats_backend_error(bool write);
+
+void scsi_stats_sense(uint8_t sense_key);
+
+void scsi_stats_reset(void);
+
+void scsi_stats_dropped(bool reset, uint32_t num_commands);
+
+uint64_t scsi_stats_wait_start(void);
+
+void scsi_stats_wait_end(scsi_stats_wait_t wait, uint64_t start);
+
+#endif
+
+#endif /*!SCSI_STATS_H_ */
@@ -0,0 +1,128 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "libc/string.h"
+#include "libc/syscall.h"
+#include "libc/sync.h"
+
+#include "api/libusbmsc.h"
+#include "scsi_trace.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_TRACE
+
+#define SCSI_TRACE_RECORDS CONFIG_USR_LIB_MASSSTORAGE_TRACE_RECORDS
+
+#if (SCSI_TRACE_RECORDS & (SCSI_TRACE_RECORDS - 1)) != 0
+# error "CONFIG_USR_LIB_MASSSTORAGE_TRACE_RECORDS must be a power of two"
+#endif
+
+/*
+ * Trace ring. 'last' is the sequence number of the last reserved record.
+ * The seq field of a record is cleared while it is written, and set to its
+ * sequence number once written, so that a reader never uses a record being
+ * written or overwritten.
+ */
+typedef struct {
+    volatile uint32_t      last;
+    usbmsc_trace_record_t  ring[SCSI_TRACE_RECORDS];
+} scsi_trace_context_t;
+
+static scsi_trace_context_t trace_ctx = { 0 };
+
+/*
+ * Record an event. Executed in ISR or main thread context.
+ */
+/*@
+  @ assigns trace_ctx;
+  */
+void scsi_trace_record(usbmsc_trace_event_t event, uint8_t arg8,
+                       uint16_t arg16, uint32_t arg32)
+{
+    uint64_t now = 0;
+    uint32_t seq;
+    usbmsc_trace_record_t *rec;
+
+    sys_get_systick(&now, PREC_CYCLE);
+    seq = __atomic_add_fetch(&trace_ctx.last, 1, __ATOMIC_RELAXED);
+    if (seq == 0) {
+        /* 0 means 'being written', skipping it when wrapping */
+        seq = __atomic_add_fetch(&trace_ctx.last, 1, __ATOMIC_RELAXED);
+    }
+    rec = &trace_ctx.ring[(seq - 1) % SCSI_TRACE_RECORDS];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    request_data_membarrier();
+    rec->stamp = (uint32_t)now;
+    rec->event = (uint8_t)event;
+    rec->arg8 = arg8;
+    rec->arg16 = arg16;
+    rec->arg32 = arg32;
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+/*@
+  @ requires \valid(seq);
+  @ requires \valid(records + (0 .. max-1));
+  @ assigns *seq, records[0 .. max-1];
+  */
+uint32_t usbmsc_trace_read(uint32_t *seq, usbmsc_trace_record_t *records,
+                           uint32_t max)
+{
+    uint32_t last = __atomic_load_n(&trace_ctx.last, __ATOMIC_ACQUIRE);
+    uint32_t cur = *seq;
+    uint32_t count = 0;
+    uint32_t rec_seq;
+    usbmsc_trace_record_t *rec;
+
+    if (records == NULL) {
+        goto end;
+    }
+    /* the records older than the ring size are overwritten */
+    if (cur == 0 || (last + 1 - cur) > SCSI_TRACE_RECORDS) {
+        cur = (last >= SCSI_TRACE_RECORDS) ? last - SCSI_TRACE_RECORDS + 1 : 1;
+    }
+    /*@
+      @ loop invariant count <= max;
+      @ loop assigns cur, count, rec, rec_seq, records[0 .. max-1];
+      */
+    while (count < max && (int32_t)(last - cur) >= 0) {
+        rec = &trace_ctx.ring[(cur - 1) % SCSI_TRACE_RECORDS];
+        rec_seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        if (rec_seq == cur) {
+            memcpy(&records[count], rec, sizeof(usbmsc_trace_record_t));
+            request_data_membarrier();
+            if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == cur) {
+                count++;
+            }
+        } else if (rec_seq == 0 || (int32_t)(rec_seq - cur) < 0) {
+            /* still being written: read again by the next call */
+            goto end;
+        }
+        /* else overwritten before being read */
+        cur++;
+    }
+end:
+    *seq = cur;
+    return count;
+}
+
+#endif
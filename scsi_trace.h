@@ -0,0 +1,50 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SCSI_TRACE_H_
+#define SCSI_TRACE_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "api/libusbmsc.h"
+
+/*
+ * Binary event trace.
+ *
+ * Events are recorded in a ring of CONFIG_USR_LIB_MASSSTORAGE_TRACE_RECORDS
+ * records, from the main thread and from ISRs: a record is reserved with an
+ * atomic increment of the sequence number, and is published once written.
+ * scsi_trace() compiles to nothing when the trace is disabled.
+ */
+#if CONFIG_USR_LIB_MASSSTORAGE_TRACE
+
+void scsi_trace_record(usbmsc_trace_event_t event, uint8_t arg8,
+                       uint16_t arg16, uint32_t arg32);
+
+# define scsi_trace(event, arg8, arg16, arg32) \
+    scsi_trace_record((event), (uint8_t)(arg8), (uint16_t)(arg16), (uint32_t)(arg32))
+#else
+# define scsi_trace(event, arg8, arg16, arg32)
+#endif
+
+#endif /*!SCSI_TRACE_H_ */
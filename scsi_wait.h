@@ -0,0 +1,56 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SCSI_WAIT_H_
+#define SCSI_WAIT_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "libc/syscall.h"
+#include "libc/sync.h"
+
+/*
+ * Waiting for an asynchronous event during a data phase.
+ *
+ * The data path waits for triggers executed in ISR context: scsi_data_sent()
+ * and scsi_data_available() (USB driver) and usbmsc_storage_backend_complete()
+ * (asynchronous backend). This function is called in the body of the waiting
+ * loops, which check again their condition each time it returns.
+ *
+ * With active polling, it only reloads the memory. With interruptible sleep,
+ * the task sleeps until one of its ISRs is executed. As the event may happen
+ * between the condition check and the sleep request, the sleep duration is
+ * bounded, so that such an event is never missed for more than one period.
+ */
+/*@
+  @ assigns \nothing;
+  */
+static inline void scsi_wait_event(void)
+{
+#if CONFIG_USR_LIB_MASSSTORAGE_WAIT_SLEEP
+    sys_sleep(CONFIG_USR_LIB_MASSSTORAGE_WAIT_SLEEP_PERIOD, SLEEP_MODE_INTERRUPTIBLE);
+#endif
+    request_data_membarrier();
+}
+
+#endif /*!SCSI_WAIT_H_ */
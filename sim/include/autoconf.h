@@ -0,0 +1,88 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SIM_AUTOCONF_H
+#define SIM_AUTOCONF_H
+
+/*
+ * Library configuration of the simulation build. Each option can be
+ * overridden from the command line, e.g.
+ * make SIM_CONFIG="BACKEND_BUF=1 READAHEAD=1" (see the Makefile).
+ */
+
+#define CONFIG_USR_LIB_MASSSTORAGE 1
+
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_SCSI_DEBUG
+# define CONFIG_USR_LIB_MASSSTORAGE_SCSI_DEBUG 0
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_BBB_DEBUG
+# define CONFIG_USR_LIB_MASSSTORAGE_BBB_DEBUG 0
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS
+# define CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS 1
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_CMD_QUEUE_DEPTH
+# define CONFIG_USR_LIB_MASSSTORAGE_CMD_QUEUE_DEPTH 4
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE_LINES
+# define CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE_LINES 32
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER_SIZE
+# define CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER_SIZE 32768
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER_DEADLINE
+# define CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER_DEADLINE 20
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME_MAX_LENGTH
+# define CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME_MAX_LENGTH 8192
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE_SIZE
+# define CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE_SIZE 16384
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_WAIT_SLEEP_PERIOD
+# define CONFIG_USR_LIB_MASSSTORAGE_WAIT_SLEEP_PERIOD 1
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_TRACE_RECORDS
+# define CONFIG_USR_LIB_MASSSTORAGE_TRACE_RECORDS 1024
+#endif
+#ifndef CONFIG_USR_LIB_MASSSTORAGE_LATENCY_OPCODES
+# define CONFIG_USR_LIB_MASSSTORAGE_LATENCY_OPCODES 8
+#endif
+
+/* data path choice */
+#if !CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_DOUBLE_BUFFER && \
+    !CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+# define CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_CLASSIC 1
+#endif
+
+/* data phase wait choice, interruptible sleep by default as in Kconfig */
+#if !CONFIG_USR_LIB_MASSSTORAGE_WAIT_POLL
+# define CONFIG_USR_LIB_MASSSTORAGE_WAIT_SLEEP 1
+#endif
+
+#define CONFIG_USB_DEV_MANUFACTURER "WOOKEY"
+#define CONFIG_USB_DEV_PRODNAME "wookey"
+#define CONFIG_USB_DEV_REVISION "0001"
+#define CONFIG_USBCTRL_FW_MAX_CTX 1
+
+#endif /* SIM_AUTOCONF_H */
@@ -0,0 +1,44 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SIM_LIBC_SANHANDLERS_H
+#define SIM_LIBC_SANHANDLERS_H
+
+#include "libc/types.h"
+
+/*
+ * Handlers are not registered on the host: every handler is valid.
+ */
+#define ADD_LOC_HANDLER(x)
+
+static inline int handler_sanity_check(physaddr_t handler)
+{
+    return handler == 0;
+}
+
+static inline int handler_sanity_check_with_panic(physaddr_t handler)
+{
+    return handler == 0;
+}
+
+#endif /* SIM_LIBC_SANHANDLERS_H */
@@ -0,0 +1,62 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SIM_LIBC_SYNC_H
+#define SIM_LIBC_SYNC_H
+
+#include "libc/types.h"
+
+/*
+ * The simulated ISRs run in their own thread: the memory barriers are full
+ * fences.
+ */
+static inline void request_data_membarrier(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void set_u8_with_membarrier(volatile uint8_t *target, uint8_t val)
+{
+    *target = val;
+    request_data_membarrier();
+}
+
+static inline void set_u16_with_membarrier(volatile uint16_t *target, uint16_t val)
+{
+    *target = val;
+    request_data_membarrier();
+}
+
+static inline void set_u32_with_membarrier(volatile uint32_t *target, uint32_t val)
+{
+    *target = val;
+    request_data_membarrier();
+}
+
+static inline void set_bool_with_membarrier(volatile bool *target, bool val)
+{
+    *target = val;
+    request_data_membarrier();
+}
+
+#endif /* SIM_LIBC_SYNC_H */
@@ -0,0 +1,59 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SIM_LIBC_SYSCALL_H
+#define SIM_LIBC_SYSCALL_H
+
+#include "libc/types.h"
+
+/*
+ * Subset of the wookey syscalls used by the USB MSC stack, implemented by
+ * sim_usb.c.
+ */
+typedef enum {
+    SYS_E_DONE = 0,
+    SYS_E_INVAL,
+    SYS_E_DENIED,
+    SYS_E_BUSY,
+} e_syscall_ret;
+
+typedef enum {
+    SLEEP_MODE_DEEP,
+    SLEEP_MODE_INTERRUPTIBLE,
+} sleep_mode_t;
+
+typedef enum {
+    PREC_MILLI,
+    PREC_MICRO,
+    PREC_CYCLE,
+} e_tick_type;
+
+e_syscall_ret sys_yield(void);
+
+/* sleep until the given duration (ms) is elapsed or, in interruptible
+ * mode, until a simulated ISR is executed */
+e_syscall_ret sys_sleep(uint32_t time, sleep_mode_t mode);
+
+e_syscall_ret sys_get_systick(uint64_t *val, e_tick_type type);
+
+#endif /* SIM_LIBC_SYSCALL_H */
@@ -0,0 +1,61 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SIM_LIBC_TYPES_H
+#define SIM_LIBC_TYPES_H
+
+/*
+ * Host build of the wookey libstd types used by the USB MSC stack.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uintptr_t physaddr_t;
+
+#ifndef __packed
+# define __packed __attribute__((packed))
+#endif
+
+typedef enum {
+    MBED_ERROR_NONE = 0,
+    MBED_ERROR_NOMEM,
+    MBED_ERROR_NOSTORAGE,
+    MBED_ERROR_NOBACKEND,
+    MBED_ERROR_INVCREDENCIALS,
+    MBED_ERROR_UNSUPORTED_CMD,
+    MBED_ERROR_INVSTATE,
+    MBED_ERROR_NOTREADY,
+    MBED_ERROR_BUSY,
+    MBED_ERROR_DENIED,
+    MBED_ERROR_UNKNOWN,
+    MBED_ERROR_INVPARAM,
+    MBED_ERROR_WRERROR,
+    MBED_ERROR_RDERROR,
+    MBED_ERROR_INITFAIL,
+    MBED_ERROR_TOOBIG,
+    MBED_ERROR_NOTFOUND,
+    MBED_ERROR_INTR,
+} mbed_error_t;
+
+#endif /* SIM_LIBC_TYPES_H */
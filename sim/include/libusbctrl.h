@@ -0,0 +1,120 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SIM_LIBUSBCTRL_H
+#define SIM_LIBUSBCTRL_H
+
+/*
+ * Subset of the libusbctrl and USB backend driver API used by the USB MSC
+ * stack. The simulated controller is implemented by sim_usb.c.
+ */
+#include "autoconf.h"
+#include "libc/types.h"
+
+#define MAX_EP_PER_INTERFACE 8
+
+/* control endpoint */
+#define EP0 0
+
+typedef enum {
+    USB_CLASS_MSC_UMS = 0x08,
+} usb_class_t;
+
+typedef enum {
+    USB_EP_TYPE_CONTROL,
+    USB_EP_TYPE_ISOCHRONOUS,
+    USB_EP_TYPE_BULK,
+    USB_EP_TYPE_INTERRUPT,
+} usb_ep_type_t;
+
+typedef enum {
+    USB_EP_DIR_OUT,
+    USB_EP_DIR_IN,
+    USB_EP_DIR_BOTH,
+} usb_ep_dir_t;
+
+typedef enum {
+    USB_EP_ATTR_NO_SYNC,
+} usb_ep_attr_t;
+
+typedef enum {
+    USB_EP_USAGE_DATA,
+} usb_ep_usage_t;
+
+typedef enum {
+    USB_BACKEND_DRV_EP_DIR_OUT,
+    USB_BACKEND_DRV_EP_DIR_IN,
+} usb_backend_drv_ep_dir_t;
+
+typedef struct __packed {
+    uint8_t  bmRequestType;
+    uint8_t  bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} usbctrl_setup_pkt_t;
+
+typedef mbed_error_t (*usb_ioep_handler_t)(uint32_t dev_id, uint32_t size, uint8_t ep);
+
+typedef mbed_error_t (*usb_rqst_handler_t)(uint32_t usbdci_handler, usbctrl_setup_pkt_t *pkt);
+
+typedef mbed_error_t (*usb_class_get_descriptor_t)(uint8_t iface_id, uint8_t *buf,
+                                                   uint32_t *desc_size,
+                                                   uint32_t usbdci_handler);
+
+typedef struct {
+    uint8_t            type;
+    uint8_t            dir;
+    uint8_t            attr;
+    uint8_t            usage;
+    uint16_t           pkt_maxsize;
+    uint8_t            ep_num;
+    usb_ioep_handler_t handler;
+} usb_ep_infos_t;
+
+typedef struct {
+    uint8_t                    usb_class;
+    uint8_t                    usb_subclass;
+    uint8_t                    usb_protocol;
+    bool                       dedicated;
+    usb_rqst_handler_t         rqst_handler;
+    usb_class_get_descriptor_t class_desc_handler;
+    uint8_t                    usb_ep_number;
+    usb_ep_infos_t             eps[MAX_EP_PER_INTERFACE];
+} usbctrl_interface_t;
+
+mbed_error_t usbctrl_declare_interface(uint32_t usbdci_handler, usbctrl_interface_t *iface);
+
+mbed_error_t usb_backend_drv_send_data(uint8_t *src, uint32_t size, uint8_t ep);
+
+mbed_error_t usb_backend_drv_set_recv_fifo(uint8_t *dst, uint32_t size, uint8_t ep);
+
+mbed_error_t usb_backend_drv_activate_endpoint(uint8_t ep, usb_backend_drv_ep_dir_t dir);
+
+mbed_error_t usb_backend_drv_ack(uint8_t ep, usb_backend_drv_ep_dir_t dir);
+
+mbed_error_t usb_backend_drv_send_zlp(uint8_t ep);
+
+mbed_error_t usb_backend_drv_stall(uint8_t ep, usb_backend_drv_ep_dir_t dir);
+
+#endif /* SIM_LIBUSBCTRL_H */
@@ -0,0 +1,477 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/** @file sim_backend.c
+ *
+ * File-backed storage backend of the simulation.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "autoconf.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "api/libusbmsc.h"
+#include "sim_backend.h"
+#include "sim_usb.h"
+
+#define SIM_BACKEND_MAX_LUNS 8
+
+typedef struct {
+    int       fd;
+    uint8_t  *data;
+    uint64_t  num_blocks;
+    uint32_t  block_size;
+    uint64_t  bad_block;
+} sim_lun_t;
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+/* single request slot, the stack has at most one request in progress */
+typedef struct {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    bool            running;
+    bool            pending;
+    bool            write;
+    uint8_t         lun;
+    usbmsc_lba_t    sector_addr;
+    uint32_t        num_sectors;
+    uint8_t        *buf;
+} sim_async_t;
+
+static sim_async_t async_ctx = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .running = false,
+    .pending = false,
+};
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+/* write mappings are staged, as an aborted command must not modify the
+ * storage. The stack maps at most two areas at the same time */
+static uint8_t map_slots[2][SIM_BACKEND_MAP_SIZE];
+static bool map_slot_used[2];
+#endif
+
+static sim_lun_t luns[SIM_BACKEND_MAX_LUNS];
+static uint8_t *global_buf = NULL;
+static uint32_t global_buf_len = 0;
+static volatile bool reset_requested = false;
+
+mbed_error_t sim_backend_open(uint8_t lun, const char *path,
+                              uint64_t num_blocks, uint32_t block_size)
+{
+    sim_lun_t *l;
+    size_t len = (size_t)(num_blocks * block_size);
+
+    if (lun >= SIM_BACKEND_MAX_LUNS || num_blocks == 0 || block_size == 0) {
+        return MBED_ERROR_INVPARAM;
+    }
+    l = &luns[lun];
+    l->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (l->fd < 0) {
+        perror(path);
+        return MBED_ERROR_NOSTORAGE;
+    }
+    if (ftruncate(l->fd, (off_t)len) != 0) {
+        perror(path);
+        goto err;
+    }
+    l->data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, l->fd, 0);
+    if (l->data == MAP_FAILED) {
+        perror(path);
+        goto err;
+    }
+    l->num_blocks = num_blocks;
+    l->block_size = block_size;
+    l->bad_block = SIM_BACKEND_NO_BAD_BLOCK;
+    return MBED_ERROR_NONE;
+err:
+    close(l->fd);
+    l->data = NULL;
+    return MBED_ERROR_NOSTORAGE;
+}
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+static void sim_async_stop(void);
+#endif
+
+void sim_backend_close(void)
+{
+    uint8_t i;
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+    sim_async_stop();
+#endif
+    for (i = 0; i < SIM_BACKEND_MAX_LUNS; i++) {
+        if (luns[i].data == NULL) {
+            continue;
+        }
+        munmap(luns[i].data, (size_t)(luns[i].num_blocks * luns[i].block_size));
+        close(luns[i].fd);
+        luns[i].data = NULL;
+    }
+}
+
+void sim_backend_set_buffer(uint8_t *buf, uint32_t len)
+{
+    global_buf = buf;
+    global_buf_len = len;
+}
+
+void sim_backend_set_bad_block(uint8_t lun, uint64_t lba)
+{
+    if (lun < SIM_BACKEND_MAX_LUNS) {
+        __atomic_store_n(&luns[lun].bad_block, lba, __ATOMIC_SEQ_CST);
+    }
+}
+
+mbed_error_t sim_backend_write_direct(uint8_t lun, uint64_t lba,
+                                      const uint8_t *buf, uint32_t num_blocks)
+{
+    sim_lun_t *l;
+
+    if (lun >= SIM_BACKEND_MAX_LUNS) {
+        return MBED_ERROR_INVPARAM;
+    }
+    l = &luns[lun];
+    if (l->data == NULL || lba > l->num_blocks || num_blocks > l->num_blocks - lba) {
+        return MBED_ERROR_INVPARAM;
+    }
+    memcpy(&l->data[lba * l->block_size], buf, (size_t)num_blocks * l->block_size);
+    return MBED_ERROR_NONE;
+}
+
+bool sim_backend_reset_requested(void)
+{
+    return __atomic_exchange_n(&reset_requested, false, __ATOMIC_SEQ_CST);
+}
+
+/* return the currently addressed LUN if the sector range is valid */
+static sim_lun_t *sim_get_range(usbmsc_lba_t sector_addr, uint32_t num_sectors)
+{
+    uint8_t lun = usbmsc_get_lun();
+    sim_lun_t *l;
+
+    if (lun >= SIM_BACKEND_MAX_LUNS) {
+        return NULL;
+    }
+    l = &luns[lun];
+    if (l->data == NULL || (uint64_t)sector_addr > l->num_blocks ||
+        num_sectors > l->num_blocks - (uint64_t)sector_addr) {
+        return NULL;
+    }
+    return l;
+}
+
+static mbed_error_t sim_read(sim_lun_t *l, usbmsc_lba_t sector_addr,
+                             uint32_t num_sectors, uint8_t *buf)
+{
+    if (l == NULL) {
+        return MBED_ERROR_RDERROR;
+    }
+    memcpy(buf, &l->data[(uint64_t)sector_addr * l->block_size],
+           (size_t)num_sectors * l->block_size);
+    return MBED_ERROR_NONE;
+}
+
+static mbed_error_t sim_write(sim_lun_t *l, usbmsc_lba_t sector_addr,
+                              uint32_t num_sectors, const uint8_t *buf)
+{
+    uint64_t bad_block;
+
+    if (l == NULL) {
+        return MBED_ERROR_WRERROR;
+    }
+    bad_block = __atomic_load_n(&l->bad_block, __ATOMIC_SEQ_CST);
+    if (bad_block >= (uint64_t)sector_addr &&
+        bad_block - (uint64_t)sector_addr < num_sectors) {
+        /* nothing is written */
+        return MBED_ERROR_WRERROR;
+    }
+    memcpy(&l->data[(uint64_t)sector_addr * l->block_size], buf,
+           (size_t)num_sectors * l->block_size);
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * Backend hooks
+ */
+mbed_error_t usbmsc_storage_backend_read(usbmsc_lba_t sector_addr, uint32_t num_sectors)
+{
+    sim_lun_t *l = sim_get_range(sector_addr, num_sectors);
+
+    if (l != NULL && (uint64_t)num_sectors * l->block_size > global_buf_len) {
+        return MBED_ERROR_INVPARAM;
+    }
+    return sim_read(l, sector_addr, num_sectors, global_buf);
+}
+
+mbed_error_t usbmsc_storage_backend_write(usbmsc_lba_t sector_addr, uint32_t num_sectors)
+{
+    sim_lun_t *l = sim_get_range(sector_addr, num_sectors);
+
+    if (l != NULL && (uint64_t)num_sectors * l->block_size > global_buf_len) {
+        return MBED_ERROR_INVPARAM;
+    }
+    return sim_write(l, sector_addr, num_sectors, global_buf);
+}
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_BUF
+mbed_error_t usbmsc_storage_backend_read_buf(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                             uint8_t *buf)
+{
+    return sim_read(sim_get_range(sector_addr, num_sectors), sector_addr, num_sectors, buf);
+}
+
+mbed_error_t usbmsc_storage_backend_write_buf(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                              uint8_t *buf)
+{
+    return sim_write(sim_get_range(sector_addr, num_sectors), sector_addr, num_sectors, buf);
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+static void *sim_async_thread(void *arg __attribute__((unused)))
+{
+    mbed_error_t errcode;
+    sim_lun_t *l;
+
+    pthread_mutex_lock(&async_ctx.lock);
+    while (async_ctx.running) {
+        if (!async_ctx.pending) {
+            pthread_cond_wait(&async_ctx.cond, &async_ctx.lock);
+            continue;
+        }
+        l = &luns[async_ctx.lun];
+        if (async_ctx.write) {
+            errcode = sim_write(l, async_ctx.sector_addr, async_ctx.num_sectors,
+                                async_ctx.buf);
+        } else {
+            errcode = sim_read(l, async_ctx.sector_addr, async_ctx.num_sectors,
+                               async_ctx.buf);
+        }
+        async_ctx.pending = false;
+        /* notified from the backend thread, as from a DMA ISR */
+        usbmsc_storage_backend_complete(errcode);
+        sim_usb_raise_isr();
+    }
+    pthread_mutex_unlock(&async_ctx.lock);
+    return NULL;
+}
+
+static void sim_async_stop(void)
+{
+    pthread_mutex_lock(&async_ctx.lock);
+    if (!async_ctx.running) {
+        pthread_mutex_unlock(&async_ctx.lock);
+        return;
+    }
+    async_ctx.running = false;
+    pthread_cond_signal(&async_ctx.cond);
+    pthread_mutex_unlock(&async_ctx.lock);
+    pthread_join(async_ctx.thread, NULL);
+}
+
+static mbed_error_t sim_async_submit(bool write, usbmsc_lba_t sector_addr,
+                                     uint32_t num_sectors, uint8_t *buf)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (sim_get_range(sector_addr, num_sectors) == NULL) {
+        return write ? MBED_ERROR_WRERROR : MBED_ERROR_RDERROR;
+    }
+    pthread_mutex_lock(&async_ctx.lock);
+    if (!async_ctx.running) {
+        if (pthread_create(&async_ctx.thread, NULL, sim_async_thread, NULL) != 0) {
+            errcode = MBED_ERROR_INITFAIL;
+            goto err;
+        }
+        async_ctx.running = true;
+    }
+    if (async_ctx.pending) {
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    async_ctx.write = write;
+    async_ctx.lun = usbmsc_get_lun();
+    async_ctx.sector_addr = sector_addr;
+    async_ctx.num_sectors = num_sectors;
+    async_ctx.buf = buf;
+    async_ctx.pending = true;
+    pthread_cond_signal(&async_ctx.cond);
+err:
+    pthread_mutex_unlock(&async_ctx.lock);
+    return errcode;
+}
+
+mbed_error_t usbmsc_storage_backend_read_submit(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                                uint8_t *buf)
+{
+    return sim_async_submit(false, sector_addr, num_sectors, buf);
+}
+
+mbed_error_t usbmsc_storage_backend_write_submit(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                                 uint8_t *buf)
+{
+    return sim_async_submit(true, sector_addr, num_sectors, buf);
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_VERIFY
+mbed_error_t usbmsc_storage_backend_verify(usbmsc_lba_t sector_addr, uint32_t num_sectors)
+{
+    sim_lun_t *l = sim_get_range(sector_addr, num_sectors);
+    uint64_t bad_block;
+
+    if (l == NULL) {
+        return MBED_ERROR_RDERROR;
+    }
+    /* the file content is always readable, only the bad block fails */
+    bad_block = __atomic_load_n(&l->bad_block, __ATOMIC_SEQ_CST);
+    if (bad_block >= (uint64_t)sector_addr &&
+        bad_block - (uint64_t)sector_addr < num_sectors) {
+        return MBED_ERROR_RDERROR;
+    }
+    return MBED_ERROR_NONE;
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP || CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME_ZEROES
+static mbed_error_t sim_zero(usbmsc_lba_t sector_addr, uint32_t num_sectors)
+{
+    sim_lun_t *l = sim_get_range(sector_addr, num_sectors);
+
+    if (l == NULL) {
+        return MBED_ERROR_WRERROR;
+    }
+    memset(&l->data[(uint64_t)sector_addr * l->block_size], 0,
+           (size_t)num_sectors * l->block_size);
+    return MBED_ERROR_NONE;
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP
+mbed_error_t usbmsc_storage_backend_discard(usbmsc_lba_t sector_addr, uint32_t num_sectors)
+{
+    /* discarded sectors read back as zeroes */
+    return sim_zero(sector_addr, num_sectors);
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME_ZEROES
+mbed_error_t usbmsc_storage_backend_write_zeroes(usbmsc_lba_t sector_addr, uint32_t num_sectors)
+{
+    return sim_zero(sector_addr, num_sectors);
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+mbed_error_t usbmsc_storage_backend_map(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                        bool write, uint8_t **buf,
+                                        uint32_t *mapped_sectors)
+{
+    sim_lun_t *l = sim_get_range(sector_addr, num_sectors);
+    uint32_t max_sectors;
+    uint8_t slot;
+
+    if (l == NULL || num_sectors == 0 || l->block_size > SIM_BACKEND_MAP_SIZE) {
+        return write ? MBED_ERROR_WRERROR : MBED_ERROR_RDERROR;
+    }
+    max_sectors = SIM_BACKEND_MAP_SIZE / l->block_size;
+    *mapped_sectors = num_sectors < max_sectors ? num_sectors : max_sectors;
+    if (!write) {
+        *buf = &l->data[(uint64_t)sector_addr * l->block_size];
+        return MBED_ERROR_NONE;
+    }
+    for (slot = 0; slot < 2; slot++) {
+        if (!map_slot_used[slot]) {
+            map_slot_used[slot] = true;
+            *buf = map_slots[slot];
+            return MBED_ERROR_NONE;
+        }
+    }
+    return MBED_ERROR_BUSY;
+}
+
+mbed_error_t usbmsc_storage_backend_unmap(usbmsc_lba_t sector_addr, uint32_t num_sectors,
+                                          bool write, uint8_t *buf)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t slot;
+
+    if (!write) {
+        return MBED_ERROR_NONE;
+    }
+    for (slot = 0; slot < 2; slot++) {
+        if (buf == map_slots[slot]) {
+            break;
+        }
+    }
+    if (slot == 2) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (num_sectors > 0) {
+        errcode = sim_write(sim_get_range(sector_addr, num_sectors), sector_addr,
+                            num_sectors, buf);
+    }
+    map_slot_used[slot] = false;
+    return errcode;
+}
+#endif
+
+#if !CONFIG_USR_LIB_MASSSTORAGE_LBA64
+mbed_error_t usbmsc_storage_backend_capacity(uint32_t *numblocks, uint32_t *blocksize)
+{
+    sim_lun_t *l = &luns[usbmsc_get_lun() % SIM_BACKEND_MAX_LUNS];
+
+    if (l->data == NULL || l->num_blocks > UINT32_MAX) {
+        return MBED_ERROR_NOSTORAGE;
+    }
+    *numblocks = (uint32_t)l->num_blocks;
+    *blocksize = l->block_size;
+    return MBED_ERROR_NONE;
+}
+#else
+mbed_error_t usbmsc_storage_backend_capacity64(uint64_t *numblocks, uint32_t *blocksize)
+{
+    sim_lun_t *l = &luns[usbmsc_get_lun() % SIM_BACKEND_MAX_LUNS];
+
+    if (l->data == NULL) {
+        return MBED_ERROR_NOSTORAGE;
+    }
+    *numblocks = l->num_blocks;
+    *blocksize = l->block_size;
+    return MBED_ERROR_NONE;
+}
+#endif
+
+void usbmsc_reset_stack(void)
+{
+    /* called in ISR context: the main loop reinitializes the stack */
+    __atomic_store_n(&reset_requested, true, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,75 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SIM_BACKEND_H
+#define SIM_BACKEND_H
+
+#include "libc/types.h"
+
+/*
+ * File-backed storage backend of the simulation, implementing the
+ * usbmsc_storage_backend_* hooks of the enabled configuration. Each LUN is
+ * stored in its own file, mapped in memory. The LUN addressed by the current
+ * command is got back with usbmsc_get_lun().
+ */
+
+/* maximum size of a zero-copy mapping */
+#define SIM_BACKEND_MAP_SIZE 65536
+
+/*
+ * Create (or truncate) the file of the given LUN and map it.
+ */
+mbed_error_t sim_backend_open(uint8_t lun, const char *path,
+                              uint64_t num_blocks, uint32_t block_size);
+
+void sim_backend_close(void);
+
+/*
+ * Declare the buffer given to usbmsc_declare(), used by the backend
+ * functions which are not given a buffer address.
+ */
+void sim_backend_set_buffer(uint8_t *buf, uint32_t len);
+
+#define SIM_BACKEND_NO_BAD_BLOCK UINT64_MAX
+
+/*
+ * Make the writes to the given block of the LUN, and its verification, fail
+ * as on a worn out medium, until another block (or SIM_BACKEND_NO_BAD_BLOCK)
+ * is set.
+ */
+void sim_backend_set_bad_block(uint8_t lun, uint64_t lba);
+
+/*
+ * Write blocks to the storage of the LUN without going through the stack,
+ * as the application modifying the storage content by itself.
+ */
+mbed_error_t sim_backend_write_direct(uint8_t lun, uint64_t lba,
+                                      const uint8_t *buf, uint32_t num_blocks);
+
+/*
+ * Return true if usbmsc_reset_stack() has been called since the last call,
+ * i.e. if the device main loop must reinitialize the stack.
+ */
+bool sim_backend_reset_requested(void);
+
+#endif /* SIM_BACKEND_H */
@@ -0,0 +1,526 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/** @file sim_bench.c
+ *
+ * Throughput benchmark of the USB mass storage stack, on top of the host
+ * simulation.
+ *
+ * For each backend block size and usbmsc_declare() buffer size, a simulated
+ * device is started in a child process and sequential WRITE(10) and READ(10)
+ * commands of each transfer size are executed by the host, under a link
+ * model (bandwidth and per transfer latency). Each measurement reports the
+ * throughput (MB/s, 1 MB = 10^6 bytes), the command rate and the CPU time
+ * used by the device side (stack, simulated ISRs and storage backend) per
+ * MB, as CSV on the standard output:
+ *
+ *   config,op,block_size,buf_size,xfer_size,bandwidth,latency,bytes,
+ *   commands,seconds,mb_s,cmd_s,cpu_ms_per_mb
+ *
+ * The write measurements include the final SYNCHRONIZE CACHE, so that the
+ * data kept in the stack caches is accounted for. When the LATENCY option is
+ * set, the latency histograms of each measurement are printed on the error
+ * output.
+ *
+ * usage: sim_bench [-b LIST] [-B LIST] [-x LIST] [-w MBPS] [-l US] [-s SIZE] [-d DIR]
+ *        sim_bench -c BASELINE RESULTS [-T TOLERANCE]
+ *
+ *   -b LIST      block sizes (default 512,4096)
+ *   -B LIST      usbmsc_declare() buffer sizes (default 4096,16384,65536)
+ *   -x LIST      transfer sizes in bytes (default 4096,16384,65536,262144)
+ *   -w MBPS      link bandwidth in MB/s, 0 for unlimited (default 40)
+ *   -l US        link latency per transfer in us (default 20)
+ *   -s SIZE      bytes transferred per measurement (default 16777216)
+ *   -d DIR       directory of the storage files (default /tmp)
+ *   -c           compare RESULTS to BASELINE: the throughput of each
+ *                measurement present in both files is compared, and the
+ *                exit status is 1 if it decreased by more than TOLERANCE
+ *                percent (default 5)
+ */
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "autoconf.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "api/libusbmsc.h"
+#include "sim_usb.h"
+#include "sim_host.h"
+#include "sim_device.h"
+
+#ifndef SIM_CONFIG_NAME
+# define SIM_CONFIG_NAME ""
+#endif
+
+#define SIM_BENCH_MAX_VALUES 16
+#define SIM_BENCH_MAX_LINE 512
+#define SIM_BENCH_MAX_ROWS 1024
+
+typedef struct {
+    uint32_t values[SIM_BENCH_MAX_VALUES];
+    uint8_t  num;
+} sim_list_t;
+
+typedef struct {
+    sim_list_t  block_sizes;
+    sim_list_t  buf_sizes;
+    sim_list_t  xfer_sizes;
+    uint32_t    bandwidth;      /* bytes/s */
+    uint32_t    latency;        /* us */
+    uint32_t    total;          /* bytes per measurement */
+    const char *dir;
+} sim_bench_config_t;
+
+static sim_bench_config_t bench_cfg = {
+    .block_sizes = { { 512, 4096 }, 2 },
+    .buf_sizes = { { 4096, 16384, 65536 }, 3 },
+    .xfer_sizes = { { 4096, 16384, 65536, 262144 }, 4 },
+    .bandwidth = 40000000,
+    .latency = 20,
+    .total = 16 * 1024 * 1024,
+    .dir = "/tmp",
+};
+
+static bool sim_parse_list(const char *str, sim_list_t *list)
+{
+    char *end;
+
+    list->num = 0;
+    while (*str != '\0') {
+        if (list->num == SIM_BENCH_MAX_VALUES) {
+            return false;
+        }
+        list->values[list->num] = (uint32_t)strtoul(str, &end, 0);
+        if (end == str || list->values[list->num] == 0) {
+            return false;
+        }
+        list->num++;
+        str = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return false;
+        }
+    }
+    return list->num > 0;
+}
+
+static uint64_t sim_wall_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* CPU time of the device side: the whole process except the host thread */
+static uint64_t sim_device_cpu_ns(void)
+{
+    struct rusage ru;
+    struct timespec ts;
+    uint64_t process;
+    uint64_t host;
+
+    getrusage(RUSAGE_SELF, &ru);
+    process = ((uint64_t)ru.ru_utime.tv_sec + (uint64_t)ru.ru_stime.tv_sec) * 1000000000ULL +
+              ((uint64_t)ru.ru_utime.tv_usec + (uint64_t)ru.ru_stime.tv_usec) * 1000ULL;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    host = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    return process > host ? process - host : 0;
+}
+
+static void sim_cdb10(uint8_t *cdb, uint8_t opcode, uint32_t lba, uint16_t count)
+{
+    memset(cdb, 0, 10);
+    cdb[0] = opcode;
+    cdb[2] = (uint8_t)(lba >> 24);
+    cdb[3] = (uint8_t)(lba >> 16);
+    cdb[4] = (uint8_t)(lba >> 8);
+    cdb[5] = (uint8_t)lba;
+    cdb[7] = (uint8_t)(count >> 8);
+    cdb[8] = (uint8_t)count;
+}
+
+static bool sim_rw(bool write, uint32_t lba, uint32_t count, uint32_t block_size,
+                   uint8_t *data)
+{
+    uint8_t cdb[10];
+    sim_status_t status;
+    uint32_t len = count * block_size;
+
+    sim_cdb10(cdb, write ? 0x2a : 0x28, lba, (uint16_t)count);
+    if (sim_host_command(0, cdb, sizeof(cdb), write ? SIM_DIR_OUT : SIM_DIR_IN,
+                         data, len, &status) != MBED_ERROR_NONE ||
+        status.status != 0 || status.transferred != len) {
+        fprintf(stderr, "%s of %u blocks at %u failed\n", write ? "write" : "read",
+                count, lba);
+        return false;
+    }
+    return true;
+}
+
+static bool sim_read_capacity(void)
+{
+    uint8_t cdb[10] = { 0x25 };
+    uint8_t data[8];
+    sim_status_t status;
+
+    return sim_host_command(0, cdb, sizeof(cdb), SIM_DIR_IN, data, sizeof(data),
+                            &status) == MBED_ERROR_NONE && status.status == 0;
+}
+
+static bool sim_sync_cache(void)
+{
+    uint8_t cdb[10] = { 0x35 };
+    sim_status_t status;
+
+    return sim_host_command(0, cdb, sizeof(cdb), SIM_DIR_NONE, NULL, 0,
+                            &status) == MBED_ERROR_NONE && status.status == 0;
+}
+
+/*
+ * One measurement: sequential commands of xfer_size bytes over the storage,
+ * until the configured amount of data is transferred.
+ */
+static bool sim_measure(bool write, uint32_t block_size, uint32_t buf_size,
+                        uint32_t xfer_size, uint32_t num_blocks, uint8_t *data)
+{
+    uint32_t count = xfer_size / block_size;
+    uint32_t lba = 0;
+    uint64_t bytes = 0;
+    uint32_t commands = 0;
+    uint64_t wall;
+    uint64_t cpu;
+    double seconds;
+    double mb;
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+    char label[64];
+#endif
+
+    /* one command out of the measurement, to start from a steady state */
+    if (!sim_rw(write, 0, count, block_size, data)) {
+        return false;
+    }
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+    usbmsc_latency_reset();
+#endif
+    wall = sim_wall_ns();
+    cpu = sim_device_cpu_ns();
+    while (bytes < bench_cfg.total) {
+        if (lba + count > num_blocks) {
+            lba = 0;
+        }
+        if (!sim_rw(write, lba, count, block_size, data)) {
+            return false;
+        }
+        lba += count;
+        bytes += xfer_size;
+        commands++;
+    }
+    if (write && !sim_sync_cache()) {
+        return false;
+    }
+    wall = sim_wall_ns() - wall;
+    cpu = sim_device_cpu_ns() - cpu;
+
+    seconds = (double)wall / 1e9;
+    mb = (double)bytes / 1e6;
+    printf("%s,%s,%u,%u,%u,%u,%u,%llu,%u,%.6f,%.3f,%.1f,%.4f\n",
+           SIM_CONFIG_NAME, write ? "write" : "read", block_size, buf_size,
+           xfer_size, bench_cfg.bandwidth, bench_cfg.latency,
+           (unsigned long long)bytes, commands, seconds, mb / seconds,
+           (double)commands / seconds, (double)cpu / 1e6 / mb);
+    fflush(stdout);
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+    snprintf(label, sizeof(label), "%s %u/%u/%u", write ? "write" : "read",
+             block_size, buf_size, xfer_size);
+    sim_device_latency_report(stderr, label);
+#endif
+    return true;
+}
+
+/*
+ * Run all the measurements of a block size and buffer size, executed in a
+ * child process so that each device starts from a fresh stack state.
+ */
+static int sim_bench_device(uint32_t block_size, uint32_t buf_size)
+{
+    sim_device_config_t cfg = {
+        .block_size = block_size,
+        .buf_size = buf_size,
+        .dir = bench_cfg.dir,
+    };
+    uint32_t max_xfer = block_size;
+    uint32_t num_blocks;
+    uint32_t count;
+    uint32_t xfer;
+    uint32_t lba;
+    uint8_t *data;
+    uint8_t i;
+    int ret = 1;
+
+    for (i = 0; i < bench_cfg.xfer_sizes.num; i++) {
+        if (bench_cfg.xfer_sizes.values[i] > max_xfer) {
+            max_xfer = bench_cfg.xfer_sizes.values[i];
+        }
+    }
+    num_blocks = bench_cfg.total / block_size;
+    if (num_blocks < max_xfer / block_size) {
+        num_blocks = max_xfer / block_size;
+    }
+    cfg.num_blocks = num_blocks;
+    data = malloc(max_xfer);
+    if (data == NULL) {
+        return 1;
+    }
+    for (xfer = 0; xfer < max_xfer; xfer++) {
+        data[xfer] = (uint8_t)(xfer * 7 + 1);
+    }
+    if (sim_device_start(&cfg) != MBED_ERROR_NONE) {
+        fprintf(stderr, "unable to start the device\n");
+        goto err;
+    }
+
+    /* as a host, the capacity is read before any access */
+    if (!sim_read_capacity()) {
+        goto err_dev;
+    }
+    /* preconditioning: the whole storage is written once, out of the
+     * link model, so that no measurement pays the first access costs */
+    count = max_xfer / block_size;
+    if (count > 0xffff) {
+        count = 0xffff;
+    }
+    for (lba = 0; lba < num_blocks; lba += count) {
+        if (!sim_rw(true, lba, (num_blocks - lba) < count ? num_blocks - lba : count,
+                    block_size, data)) {
+            goto err_dev;
+        }
+    }
+    if (!sim_sync_cache()) {
+        goto err_dev;
+    }
+    sim_usb_set_link(bench_cfg.bandwidth, bench_cfg.latency);
+
+    for (i = 0; i < bench_cfg.xfer_sizes.num; i++) {
+        xfer = bench_cfg.xfer_sizes.values[i];
+        if (xfer % block_size != 0 || xfer / block_size > 0xffff) {
+            /* not expressible with READ(10)/WRITE(10) */
+            continue;
+        }
+        if (!sim_measure(true, block_size, buf_size, xfer, num_blocks, data) ||
+            !sim_measure(false, block_size, buf_size, xfer, num_blocks, data)) {
+            goto err_dev;
+        }
+    }
+    ret = 0;
+err_dev:
+    sim_device_stop();
+err:
+    free(data);
+    return ret;
+}
+
+static int sim_bench_run(void)
+{
+    uint8_t b;
+    uint8_t u;
+    pid_t pid;
+    int status;
+    int ret = 0;
+
+    printf("config,op,block_size,buf_size,xfer_size,bandwidth,latency,bytes,"
+           "commands,seconds,mb_s,cmd_s,cpu_ms_per_mb\n");
+    fflush(stdout);
+    for (b = 0; b < bench_cfg.block_sizes.num; b++) {
+        for (u = 0; u < bench_cfg.buf_sizes.num; u++) {
+            pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                return 1;
+            }
+            if (pid == 0) {
+                exit(sim_bench_device(bench_cfg.block_sizes.values[b],
+                                      bench_cfg.buf_sizes.values[u]));
+            }
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "block size %u, buffer size %u: FAILED\n",
+                        bench_cfg.block_sizes.values[b], bench_cfg.buf_sizes.values[u]);
+                ret = 1;
+            }
+        }
+    }
+    return ret;
+}
+
+/*
+ * Results comparison
+ */
+typedef struct {
+    char   key[96];
+    double mb_s;
+    double cpu;
+} sim_row_t;
+
+/* load the rows of a results file, returns the number of rows or -1 */
+static int sim_load(const char *path, sim_row_t *rows, int max)
+{
+    char line[SIM_BENCH_MAX_LINE];
+    char *field[13];
+    char *p;
+    FILE *f;
+    int num = 0;
+    int n;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL && num < max) {
+        p = line;
+        for (n = 0; n < 13 && p != NULL; n++) {
+            field[n] = strsep(&p, ",\n");
+        }
+        if (n != 13 || !strcmp(field[1], "op")) {
+            /* header or invalid line */
+            continue;
+        }
+        /* op, block size, buffer size, transfer size and link model */
+        snprintf(rows[num].key, sizeof(rows[num].key), "%s,%s,%s,%s,%s,%s",
+                 field[1], field[2], field[3], field[4], field[5], field[6]);
+        rows[num].mb_s = strtod(field[10], NULL);
+        rows[num].cpu = strtod(field[12], NULL);
+        num++;
+    }
+    fclose(f);
+    return num;
+}
+
+static int sim_compare(const char *baseline, const char *results, double tolerance)
+{
+    static sim_row_t base[SIM_BENCH_MAX_ROWS];
+    static sim_row_t res[SIM_BENCH_MAX_ROWS];
+    int nbase;
+    int nres;
+    int i;
+    int j;
+    int regressions = 0;
+    double delta;
+
+    nbase = sim_load(baseline, base, SIM_BENCH_MAX_ROWS);
+    nres = sim_load(results, res, SIM_BENCH_MAX_ROWS);
+    if (nbase < 0 || nres < 0) {
+        return 2;
+    }
+    printf("%-40s %10s %10s %8s %10s %10s %8s\n", "op,bs,buf,xfer,bw,lat",
+           "base MB/s", "MB/s", "delta", "base cpu", "cpu", "delta");
+    for (i = 0; i < nres; i++) {
+        for (j = 0; j < nbase; j++) {
+            if (!strcmp(res[i].key, base[j].key)) {
+                break;
+            }
+        }
+        if (j == nbase || base[j].mb_s <= 0 || base[j].cpu <= 0) {
+            continue;
+        }
+        delta = (res[i].mb_s - base[j].mb_s) * 100.0 / base[j].mb_s;
+        printf("%-40s %10.2f %10.2f %+7.1f%% %10.3f %10.3f %+7.1f%%%s\n", res[i].key,
+               base[j].mb_s, res[i].mb_s, delta, base[j].cpu, res[i].cpu,
+               (res[i].cpu - base[j].cpu) * 100.0 / base[j].cpu,
+               delta < -tolerance ? "  REGRESSION" : "");
+        if (delta < -tolerance) {
+            regressions++;
+        }
+    }
+    printf("%d regression(s), tolerance %.1f%%\n", regressions, tolerance);
+    return regressions ? 1 : 0;
+}
+
+static void sim_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-b LIST] [-B LIST] [-x LIST] [-w MBPS] [-l US] [-s SIZE] [-d DIR]\n"
+                    "       %s -c BASELINE RESULTS [-T TOLERANCE]\n", name, name);
+}
+
+int main(int argc, char **argv)
+{
+    bool compare = false;
+    double tolerance = 5.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:B:x:w:l:s:d:cT:")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (!sim_parse_list(optarg, &bench_cfg.block_sizes)) {
+                    goto usage;
+                }
+                break;
+            case 'B':
+                if (!sim_parse_list(optarg, &bench_cfg.buf_sizes)) {
+                    goto usage;
+                }
+                break;
+            case 'x':
+                if (!sim_parse_list(optarg, &bench_cfg.xfer_sizes)) {
+                    goto usage;
+                }
+                break;
+            case 'w':
+                bench_cfg.bandwidth = (uint32_t)(strtod(optarg, NULL) * 1e6);
+                break;
+            case 'l':
+                bench_cfg.latency = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                bench_cfg.total = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                bench_cfg.dir = optarg;
+                break;
+            case 'c':
+                compare = true;
+                break;
+            case 'T':
+                tolerance = strtod(optarg, NULL);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (compare) {
+        if (optind != argc - 2) {
+            goto usage;
+        }
+        return sim_compare(argv[optind], argv[optind + 1], tolerance);
+    }
+    if (optind != argc || bench_cfg.total == 0) {
+        goto usage;
+    }
+    return sim_bench_run();
+usage:
+    sim_usage(argv[0]);
+    return 2;
+}
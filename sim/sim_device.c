@@ -0,0 +1,272 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/** @file sim_device.c
+ *
+ * Simulated USB mass storage device.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "autoconf.h"
+#include "libc/stdio.h"
+#include "api/libusbmsc.h"
+#include "sim_usb.h"
+#include "sim_backend.h"
+#include "sim_host.h"
+#include "sim_device.h"
+
+typedef struct {
+    pthread_t      thread;
+    volatile bool  running;
+    uint32_t       reinit_count;
+    uint8_t       *buf;
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+    uint8_t       *ra_buf;
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    uint8_t       *wc_buf;
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+    /* sector cache invalidation requested to the main loop */
+    bool           invalidate;
+    uint64_t       invalidate_lba;
+    uint32_t       invalidate_blocks;
+#endif
+} sim_device_context_t;
+
+static sim_device_context_t dev_ctx = {
+    .running = false,
+    .buf = NULL,
+};
+
+static void *sim_device_thread(void *arg __attribute__((unused)))
+{
+    uint32_t count;
+
+    while (dev_ctx.running) {
+        if (sim_backend_reset_requested()) {
+            usbmsc_reinit();
+            __atomic_add_fetch(&dev_ctx.reinit_count, 1, __ATOMIC_SEQ_CST);
+        }
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+        if (__atomic_load_n(&dev_ctx.invalidate, __ATOMIC_ACQUIRE)) {
+            usbmsc_sector_cache_invalidate(dev_ctx.invalidate_lba,
+                                           dev_ctx.invalidate_blocks);
+            __atomic_store_n(&dev_ctx.invalidate, false, __ATOMIC_RELEASE);
+        }
+#endif
+        count = sim_usb_isr_count();
+        usbmsc_exec_automaton();
+        /* idle: wait for the next ISR, bounded for the deadline driven
+         * features (e.g. gathered writes flush) */
+        sim_usb_wait_isr(count, 1);
+    }
+    return NULL;
+}
+
+static void sim_device_free(void)
+{
+    free(dev_ctx.buf);
+    dev_ctx.buf = NULL;
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+    free(dev_ctx.ra_buf);
+    dev_ctx.ra_buf = NULL;
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    free(dev_ctx.wc_buf);
+    dev_ctx.wc_buf = NULL;
+#endif
+}
+
+mbed_error_t sim_device_start(const sim_device_config_t *cfg)
+{
+    mbed_error_t errcode = MBED_ERROR_INITFAIL;
+    char path[256];
+    uint8_t lun;
+
+    for (lun = 0; lun < CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS; lun++) {
+        snprintf(path, sizeof(path), "%s/sim_msc_%d_lun%u.img", cfg->dir, (int)getpid(), lun);
+        errcode = sim_backend_open(lun, path, cfg->num_blocks, cfg->block_size);
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+        /* the file is removed at exit */
+        unlink(path);
+    }
+
+    errcode = MBED_ERROR_NOMEM;
+    dev_ctx.buf = aligned_alloc(64, cfg->buf_size);
+    if (dev_ctx.buf == NULL) {
+        goto err;
+    }
+    sim_backend_set_buffer(dev_ctx.buf, cfg->buf_size);
+    errcode = usbmsc_declare(dev_ctx.buf, cfg->buf_size);
+    if (errcode != MBED_ERROR_NONE) {
+        goto err;
+    }
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+    dev_ctx.ra_buf = aligned_alloc(64, cfg->buf_size);
+    if (dev_ctx.ra_buf == NULL) {
+        errcode = MBED_ERROR_NOMEM;
+        goto err;
+    }
+    errcode = usbmsc_declare_readahead(dev_ctx.ra_buf, cfg->buf_size);
+    if (errcode != MBED_ERROR_NONE) {
+        goto err;
+    }
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    dev_ctx.wc_buf = aligned_alloc(64, CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE_LINES *
+                                   cfg->block_size);
+    if (dev_ctx.wc_buf == NULL) {
+        errcode = MBED_ERROR_NOMEM;
+        goto err;
+    }
+    errcode = usbmsc_declare_write_cache(dev_ctx.wc_buf,
+                                         CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE_LINES *
+                                         cfg->block_size);
+    if (errcode != MBED_ERROR_NONE) {
+        goto err;
+    }
+#endif
+
+    errcode = sim_usb_start();
+    if (errcode != MBED_ERROR_NONE) {
+        goto err;
+    }
+    errcode = usbmsc_initialize(0);
+    if (errcode != MBED_ERROR_NONE) {
+        goto err_usb;
+    }
+    usbmsc_reinit();
+    usbmsc_initialize_automaton();
+
+    dev_ctx.running = true;
+    if (pthread_create(&dev_ctx.thread, NULL, sim_device_thread, NULL) != 0) {
+        dev_ctx.running = false;
+        errcode = MBED_ERROR_INITFAIL;
+        goto err_usb;
+    }
+    errcode = sim_host_init();
+    if (errcode != MBED_ERROR_NONE) {
+        sim_device_stop();
+        return errcode;
+    }
+    return MBED_ERROR_NONE;
+
+err_usb:
+    sim_usb_stop();
+err:
+    sim_backend_close();
+    sim_device_free();
+    return errcode;
+}
+
+uint32_t sim_device_reinit_count(void)
+{
+    return __atomic_load_n(&dev_ctx.reinit_count, __ATOMIC_SEQ_CST);
+}
+
+void sim_device_wait_reinit(uint32_t count, uint32_t ms)
+{
+    uint32_t i;
+
+    for (i = 0; i < ms * 10 && sim_device_reinit_count() == count; i++) {
+        usleep(100);
+    }
+}
+
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+void sim_device_sector_cache_invalidate(uint64_t lba, uint32_t num_blocks)
+{
+    dev_ctx.invalidate_lba = lba;
+    dev_ctx.invalidate_blocks = num_blocks;
+    __atomic_store_n(&dev_ctx.invalidate, true, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&dev_ctx.invalidate, __ATOMIC_ACQUIRE)) {
+        usleep(100);
+    }
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+/*
+ * Upper bound of the bucket holding the given fraction of the commands,
+ * bounded by the maximum.
+ */
+static uint64_t sim_latency_percentile(const uint32_t *hist, uint32_t count,
+                                       uint32_t max, uint32_t percent)
+{
+    uint64_t bound;
+    uint64_t seen = 0;
+    uint8_t b;
+
+    for (b = 0; b < USBMSC_LATENCY_BUCKETS - 1; b++) {
+        seen += hist[b];
+        if (seen * 100 >= (uint64_t)count * percent) {
+            break;
+        }
+    }
+    bound = ((uint64_t)1 << (b + 1)) - 1;
+    return (bound < max) ? bound : max;
+}
+
+void sim_device_latency_report(FILE *out, const char *label)
+{
+    static const char *stages[USBMSC_LATENCY_STAGES] = {
+        "queue", "setup", "data", "total"
+    };
+    usbmsc_latency_hist_t hist;
+    uint32_t untracked = 0;
+    uint8_t idx;
+    uint8_t s;
+
+    /* on the host, the cycle counter ticks are nanoseconds */
+    for (idx = 0; usbmsc_latency_get(idx, &hist, &untracked) == MBED_ERROR_NONE; idx++) {
+        fprintf(out, "%s: opcode 0x%02x, %u commands (us p50/p99/max):",
+                label, hist.opcode, hist.count);
+        for (s = 0; s < USBMSC_LATENCY_STAGES; s++) {
+            fprintf(out, " %s %.1f/%.1f/%.1f", stages[s],
+                    sim_latency_percentile(hist.hist[s], hist.count, hist.max[s], 50) / 1e3,
+                    sim_latency_percentile(hist.hist[s], hist.count, hist.max[s], 99) / 1e3,
+                    hist.max[s] / 1e3);
+        }
+        fprintf(out, "\n");
+    }
+    if (untracked != 0) {
+        fprintf(out, "%s: %u commands of untracked opcodes\n", label, untracked);
+    }
+}
+#endif
+
+void sim_device_stop(void)
+{
+    if (dev_ctx.running) {
+        dev_ctx.running = false;
+        pthread_join(dev_ctx.thread, NULL);
+    }
+    sim_usb_stop();
+    sim_backend_close();
+    sim_device_free();
+}
@@ -0,0 +1,77 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SIM_DEVICE_H
+#define SIM_DEVICE_H
+
+#include <stdio.h>
+
+#include "autoconf.h"
+#include "libc/types.h"
+
+/*
+ * Simulated USB mass storage device: storage files, stack buffers and
+ * initialization, and device main loop thread.
+ */
+typedef struct {
+    uint32_t    block_size;
+    uint64_t    num_blocks;     /* per LUN */
+    uint32_t    buf_size;       /* buffer given to usbmsc_declare() */
+    const char *dir;            /* directory of the storage files */
+} sim_device_config_t;
+
+/*
+ * Initialize the stack with the given configuration, start the device main
+ * loop and the simulated USB controller, and initialize the host side.
+ */
+mbed_error_t sim_device_start(const sim_device_config_t *cfg);
+
+void sim_device_stop(void);
+
+/*
+ * Number of stack reinitializations (usbmsc_reinit()) executed after a
+ * reset request, and wait for at most ms milliseconds until it differs from
+ * count.
+ */
+uint32_t sim_device_reinit_count(void);
+
+void sim_device_wait_reinit(uint32_t count, uint32_t ms);
+
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+/*
+ * Drop blocks from the sector cache with usbmsc_sector_cache_invalidate(),
+ * which the device main loop executes as required, and wait for it.
+ */
+void sim_device_sector_cache_invalidate(uint64_t lba, uint32_t num_blocks);
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+/*
+ * Print the latency histograms of the stack: per opcode and per interval,
+ * the median and 99th percentile (upper bound of their log2 bucket) and the
+ * maximum, in microseconds. Must be called while the device is idle.
+ */
+void sim_device_latency_report(FILE *out, const char *label);
+#endif
+
+#endif /* SIM_DEVICE_H */
@@ -0,0 +1,197 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/** @file sim_host.c
+ *
+ * Bulk-Only Transport initiator of the simulation (see sim_host_uas.c for
+ * the UAS one).
+ */
+#include "autoconf.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "libusbctrl.h"
+#include "sim_usb.h"
+#include "sim_host.h"
+
+#if !CONFIG_USR_LIB_MASSSTORAGE_UAS
+
+#define SIM_CBW_SIG 0x43425355      /* "USBC" */
+#define SIM_CSW_SIG 0x53425355      /* "USBS" */
+
+#define SIM_RQST_GET_MAX_LUN 0xfe
+#define SIM_RQST_MS_RESET    0xff
+
+struct __packed sim_cbw {
+    uint32_t sig;
+    uint32_t tag;
+    uint32_t transfer_len;
+    uint8_t  flags;
+    uint8_t  lun;
+    uint8_t  cdb_len;
+    uint8_t  cdb[16];
+};
+
+struct __packed sim_csw {
+    uint32_t sig;
+    uint32_t tag;
+    uint32_t data_residue;
+    uint8_t  status;
+};
+
+static struct {
+    uint8_t  ep_in;
+    uint8_t  ep_out;
+    uint32_t tag;
+} host_ctx = { 0 };
+
+mbed_error_t sim_host_init(void)
+{
+    host_ctx.ep_out = sim_usb_get_ep(USB_EP_DIR_OUT, 0);
+    host_ctx.ep_in = sim_usb_get_ep(USB_EP_DIR_IN, 0);
+    if (host_ctx.ep_out == 0 || host_ctx.ep_in == 0) {
+        return MBED_ERROR_INITFAIL;
+    }
+    return MBED_ERROR_NONE;
+}
+
+static mbed_error_t sim_host_check_csw(const struct sim_csw *csw, uint32_t size,
+                                       sim_status_t *status)
+{
+    if (size != sizeof(*csw) || csw->sig != SIM_CSW_SIG) {
+        fprintf(stderr, "sim host: invalid CSW (%u bytes)\n", size);
+        return MBED_ERROR_INVSTATE;
+    }
+    if (csw->tag != host_ctx.tag) {
+        fprintf(stderr, "sim host: CSW tag %x, expected %x\n", csw->tag, host_ctx.tag);
+        return MBED_ERROR_INVSTATE;
+    }
+    status->status = csw->status;
+    status->residue = csw->data_residue;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t sim_host_command(uint8_t lun, const uint8_t *cdb, uint8_t cdb_len,
+                              sim_dir_t dir, uint8_t *data, uint32_t len,
+                              sim_status_t *status)
+{
+    mbed_error_t errcode;
+    struct sim_cbw cbw;
+    struct sim_csw csw;
+    uint32_t actual = 0;
+
+    status->response = -1;
+    if (cdb_len == 0 || cdb_len > sizeof(cbw.cdb)) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (dir == SIM_DIR_NONE) {
+        len = 0;
+    }
+    memset(&cbw, 0, sizeof(cbw));
+    cbw.sig = SIM_CBW_SIG;
+    cbw.tag = ++host_ctx.tag;
+    cbw.transfer_len = len;
+    cbw.flags = (dir == SIM_DIR_IN) ? 0x80 : 0;
+    cbw.lun = lun;
+    cbw.cdb_len = cdb_len;
+    memcpy(cbw.cdb, cdb, cdb_len);
+    status->transferred = 0;
+
+    errcode = sim_host_out(host_ctx.ep_out, (uint8_t *)&cbw, sizeof(cbw), 0, &actual);
+    if (errcode != MBED_ERROR_NONE) {
+        fprintf(stderr, "sim host: CBW not accepted\n");
+        goto err;
+    }
+
+    if (dir == SIM_DIR_OUT && len > 0) {
+        errcode = sim_host_out(host_ctx.ep_out, data, len, host_ctx.ep_in, &actual);
+        if (errcode == MBED_ERROR_INTR) {
+            /* the device ended the data phase early */
+            errcode = MBED_ERROR_NONE;
+        } else if (errcode != MBED_ERROR_NONE) {
+            fprintf(stderr, "sim host: data OUT failed\n");
+            goto err;
+        }
+        status->transferred = actual;
+    } else if (dir == SIM_DIR_IN && len > 0) {
+        errcode = sim_host_in(host_ctx.ep_in, data, len, 0, &actual);
+        if (errcode != MBED_ERROR_NONE) {
+            fprintf(stderr, "sim host: data IN failed\n");
+            goto err;
+        }
+        if (actual == sizeof(csw) && len != sizeof(csw) &&
+            ((struct sim_csw *)data)->sig == SIM_CSW_SIG) {
+            /* the device ended the data phase early: CSW received */
+            memcpy(&csw, data, sizeof(csw));
+            errcode = sim_host_check_csw(&csw, sizeof(csw), status);
+            goto err;
+        }
+        status->transferred = actual;
+    }
+
+    errcode = sim_host_in(host_ctx.ep_in, (uint8_t *)&csw, sizeof(csw), 0, &actual);
+    if (errcode != MBED_ERROR_NONE) {
+        fprintf(stderr, "sim host: no CSW\n");
+        goto err;
+    }
+    errcode = sim_host_check_csw(&csw, actual, status);
+err:
+    return errcode;
+}
+
+mbed_error_t sim_host_get_max_lun(uint8_t *max_lun)
+{
+    usbctrl_setup_pkt_t pkt = {
+        .bmRequestType = 0xa1,
+        .bRequest = SIM_RQST_GET_MAX_LUN,
+        .wValue = 0,
+        .wIndex = 0,
+        .wLength = 1,
+    };
+    uint32_t actual = 0;
+    mbed_error_t errcode;
+
+    errcode = sim_host_control(&pkt, max_lun, 1, &actual);
+    if (errcode == MBED_ERROR_NONE && actual != 1) {
+        errcode = MBED_ERROR_INVSTATE;
+    }
+    return errcode;
+}
+
+mbed_error_t sim_host_reset(void)
+{
+    usbctrl_setup_pkt_t pkt = {
+        .bmRequestType = 0x21,
+        .bRequest = SIM_RQST_MS_RESET,
+        .wValue = 0,
+        .wIndex = 0,
+        .wLength = 0,
+    };
+    uint32_t actual = 0;
+    mbed_error_t errcode;
+
+    errcode = sim_host_control(&pkt, NULL, 0, &actual);
+    sim_usb_clear_halt(host_ctx.ep_in);
+    return errcode;
+}
+
+#endif/*!CONFIG_USR_LIB_MASSSTORAGE_UAS*/
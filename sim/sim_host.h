@@ -0,0 +1,99 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SIM_HOST_H
+#define SIM_HOST_H
+
+#include "autoconf.h"
+#include "libc/types.h"
+
+/*
+ * Bulk-Only Transport initiator of the simulation, or UAS one when the
+ * library is built with CONFIG_USR_LIB_MASSSTORAGE_UAS, executed by the
+ * host thread on top of the simulated USB controller (sim_usb.h).
+ */
+
+typedef enum {
+    SIM_DIR_NONE,
+    SIM_DIR_IN,
+    SIM_DIR_OUT,
+} sim_dir_t;
+
+/*
+ * Status of a command, as reported by its CSW. With UAS, the status of the
+ * SENSE IU is converted to the CSW one (CHECK CONDITION gives 1, command
+ * failed), and response is set to the code of the RESPONSE IU of a
+ * rejected command (-1 otherwise).
+ */
+typedef struct {
+    uint8_t  status;
+    uint32_t residue;
+    uint32_t transferred;
+    int      response;
+} sim_status_t;
+
+/*
+ * Get back the bulk endpoints of the declared interface. To be called once
+ * the stack is initialized. The UAS pipes are found with their Pipe Usage
+ * descriptors, in the configuration descriptor, as Linux does.
+ */
+mbed_error_t sim_host_init(void);
+
+/*
+ * Execute a SCSI command: CBW, data phase of len bytes in the given direction
+ * and CSW. An error is returned if the transport fails (timeout, invalid
+ * CSW); the SCSI status is returned in status.
+ * With UAS, the sense data of a CHECK CONDITION is kept by the host, and
+ * returned to the next REQUEST SENSE without sending it to the device.
+ */
+mbed_error_t sim_host_command(uint8_t lun, const uint8_t *cdb, uint8_t cdb_len,
+                              sim_dir_t dir, uint8_t *data, uint32_t len,
+                              sim_status_t *status);
+
+mbed_error_t sim_host_get_max_lun(uint8_t *max_lun);
+
+/*
+ * Bulk-Only Mass Storage Reset followed by the reset recovery of the bulk
+ * endpoints. With UAS, the commands in flight are dropped, and the host
+ * waits for the device to be reinitialized, as after a USB reset.
+ */
+mbed_error_t sim_host_reset(void);
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UAS
+/*
+ * Send the COMMAND IU of a command with the given tag, without waiting for
+ * its completion. The data buffer and the status must remain valid until
+ * the command is returned by sim_host_complete().
+ */
+mbed_error_t sim_host_submit(uint16_t tag, uint8_t lun, const uint8_t *cdb,
+                             uint8_t cdb_len, sim_dir_t dir, uint8_t *data,
+                             uint32_t len, sim_status_t *status);
+
+/*
+ * Handle the IUs of the status pipe, and the data phases they request,
+ * until a submitted command completes. Its status is returned in status.
+ */
+mbed_error_t sim_host_complete(sim_status_t **status);
+#endif
+
+#endif /* SIM_HOST_H */
@@ -0,0 +1,484 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/** @file sim_host_uas.c
+ *
+ * USB Attached SCSI initiator of the simulation (High Speed, no streams).
+ */
+#include "autoconf.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "libusbctrl.h"
+#include "sim_usb.h"
+#include "sim_device.h"
+#include "sim_host.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UAS
+
+#define SIM_RQST_GET_DESCRIPTOR 0x06
+#define SIM_RQST_MS_RESET       0xff
+
+#define SIM_DT_CONFIG       0x02
+#define SIM_DT_INTERFACE    0x04
+#define SIM_DT_ENDPOINT     0x05
+#define SIM_DT_PIPE_USAGE   0x24
+
+/* Pipe Usage descriptors pipe IDs */
+#define SIM_PIPE_COMMAND    1
+#define SIM_PIPE_STATUS     2
+#define SIM_PIPE_DATA_IN    3
+#define SIM_PIPE_DATA_OUT   4
+
+/* Information Unit identifiers */
+#define SIM_IU_COMMAND      0x01
+#define SIM_IU_SENSE        0x03
+#define SIM_IU_RESPONSE     0x04
+#define SIM_IU_READ_READY   0x06
+#define SIM_IU_WRITE_READY  0x07
+
+#define SIM_IU_COMMAND_LEN  32
+#define SIM_IU_SENSE_LEN    16      /* without the sense data */
+#define SIM_IU_RESPONSE_LEN 8
+#define SIM_IU_MAXLEN       64
+
+#define SIM_SCSI_GOOD       0x00
+#define SIM_SCSI_REQUEST_SENSE 0x03
+#define SIM_SCSI_REPORT_LUNS   0xa0
+#define SIM_SENSE_LEN       18
+
+/* commands in flight, including the ones rejected by the device */
+#define SIM_MAX_CMDS        32
+
+typedef struct {
+    bool          used;
+    bool          done;
+    uint16_t      tag;
+    uint32_t      seq;          /* submission, then completion order */
+    sim_dir_t     dir;
+    uint8_t      *data;
+    uint32_t      len;
+    sim_status_t *status;
+} sim_uas_cmd_t;
+
+static struct {
+    uint8_t       pipes[SIM_PIPE_DATA_OUT + 1];   /* endpoint of each pipe ID */
+    uint16_t      tag;                            /* last tag of sim_host_command() */
+    uint32_t      seq;
+    sim_uas_cmd_t cmds[SIM_MAX_CMDS];
+    uint8_t       sense[SIM_SENSE_LEN];           /* autosense of the last command */
+    bool          sense_valid;
+} host_ctx = { 0 };
+
+/*
+ * The Pipe Usage descriptor of an endpoint is searched among the descriptors
+ * following the endpoint descriptor, up to the next one, as the Linux uas
+ * driver does with the extra descriptors of each endpoint.
+ */
+mbed_error_t sim_host_init(void)
+{
+    usbctrl_setup_pkt_t pkt = {
+        .bmRequestType = 0x80,
+        .bRequest = SIM_RQST_GET_DESCRIPTOR,
+        .wValue = SIM_DT_CONFIG << 8,
+        .wIndex = 0,
+        .wLength = 255,
+    };
+    uint8_t desc[255];
+    uint32_t len = 0;
+    uint32_t pos;
+    uint8_t ep = 0;
+    uint8_t pipe;
+    mbed_error_t errcode;
+
+    memset(&host_ctx, 0, sizeof(host_ctx));
+    errcode = sim_host_control(&pkt, desc, sizeof(desc), &len);
+    if (errcode != MBED_ERROR_NONE) {
+        fprintf(stderr, "sim host: no configuration descriptor\n");
+        return MBED_ERROR_INITFAIL;
+    }
+    for (pos = 0; pos + 3 <= len && desc[pos] >= 2; pos += desc[pos]) {
+        if (desc[pos + 1] == SIM_DT_ENDPOINT) {
+            ep = desc[pos + 2] & 0x0f;
+        } else if (desc[pos + 1] == SIM_DT_INTERFACE) {
+            ep = 0;
+        } else if (desc[pos + 1] == SIM_DT_PIPE_USAGE && ep != 0) {
+            pipe = desc[pos + 2];
+            if (pipe >= SIM_PIPE_COMMAND && pipe <= SIM_PIPE_DATA_OUT) {
+                host_ctx.pipes[pipe] = ep;
+            }
+            /* only the first Pipe Usage descriptor of an endpoint counts */
+            ep = 0;
+        }
+    }
+    for (pipe = SIM_PIPE_COMMAND; pipe <= SIM_PIPE_DATA_OUT; pipe++) {
+        if (host_ctx.pipes[pipe] == 0) {
+            fprintf(stderr, "sim host: no endpoint for the UAS pipe %u\n", pipe);
+            return MBED_ERROR_INITFAIL;
+        }
+    }
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * Command in flight with the given tag: the oldest one, or the newest one
+ * for a RESPONSE IU, which rejects a command just received (e.g. with the
+ * tag of a command in flight).
+ */
+static sim_uas_cmd_t *sim_uas_find(uint16_t tag, bool newest)
+{
+    sim_uas_cmd_t *found = NULL;
+    uint32_t i;
+
+    for (i = 0; i < SIM_MAX_CMDS; i++) {
+        if (!host_ctx.cmds[i].used || host_ctx.cmds[i].done ||
+            host_ctx.cmds[i].tag != tag) {
+            continue;
+        }
+        if (found == NULL || (host_ctx.cmds[i].seq > found->seq) == newest) {
+            found = &host_ctx.cmds[i];
+        }
+    }
+    return found;
+}
+
+static void sim_uas_done(sim_uas_cmd_t *cmd)
+{
+    cmd->done = true;
+    cmd->seq = ++host_ctx.seq;
+}
+
+static mbed_error_t sim_uas_status_iu(bool data_phase);
+
+/*
+ * Data phases. The device may end them early, sending the SENSE IU of the
+ * command, and RESPONSE IUs of other commands may be received meanwhile.
+ */
+static mbed_error_t sim_uas_data_in(sim_uas_cmd_t *cmd)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t actual;
+
+    while (!cmd->done && cmd->status->transferred < cmd->len) {
+        errcode = sim_host_in(host_ctx.pipes[SIM_PIPE_DATA_IN],
+                              &cmd->data[cmd->status->transferred],
+                              cmd->len - cmd->status->transferred,
+                              host_ctx.pipes[SIM_PIPE_STATUS], &actual);
+        cmd->status->transferred += actual;
+        if (errcode == MBED_ERROR_INTR) {
+            errcode = sim_uas_status_iu(true);
+            if (errcode != MBED_ERROR_NONE) {
+                break;
+            }
+            continue;
+        }
+        if (errcode != MBED_ERROR_NONE) {
+            fprintf(stderr, "sim host: data IN failed\n");
+        }
+        /* short packet or all the data received */
+        break;
+    }
+    return errcode;
+}
+
+static mbed_error_t sim_uas_data_out(sim_uas_cmd_t *cmd)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t actual;
+
+    while (!cmd->done && cmd->status->transferred < cmd->len) {
+        errcode = sim_host_out(host_ctx.pipes[SIM_PIPE_DATA_OUT],
+                               &cmd->data[cmd->status->transferred],
+                               cmd->len - cmd->status->transferred,
+                               host_ctx.pipes[SIM_PIPE_STATUS], &actual);
+        cmd->status->transferred += actual;
+        if (errcode == MBED_ERROR_INTR) {
+            errcode = sim_uas_status_iu(true);
+            if (errcode != MBED_ERROR_NONE) {
+                break;
+            }
+            continue;
+        }
+        if (errcode != MBED_ERROR_NONE) {
+            fprintf(stderr, "sim host: data OUT failed\n");
+            break;
+        }
+    }
+    return errcode;
+}
+
+/*
+ * Receive and handle an IU of the status pipe. READ READY and WRITE READY
+ * IUs start the data phase of their command, unless one is in progress.
+ */
+static mbed_error_t sim_uas_status_iu(bool data_phase)
+{
+    uint8_t iu[SIM_IU_MAXLEN];
+    sim_uas_cmd_t *cmd;
+    uint32_t actual = 0;
+    uint32_t sense_len;
+    uint16_t tag;
+    mbed_error_t errcode;
+
+    errcode = sim_host_in(host_ctx.pipes[SIM_PIPE_STATUS], iu, sizeof(iu), 0, &actual);
+    if (errcode != MBED_ERROR_NONE) {
+        fprintf(stderr, "sim host: no status IU\n");
+        return errcode;
+    }
+    if (actual < 4) {
+        fprintf(stderr, "sim host: invalid status IU (%u bytes)\n", actual);
+        return MBED_ERROR_INVSTATE;
+    }
+    tag = (uint16_t)((iu[2] << 8) | iu[3]);
+    cmd = sim_uas_find(tag, iu[0] == SIM_IU_RESPONSE);
+    if (cmd == NULL) {
+        fprintf(stderr, "sim host: IU %x, unknown tag %x\n", iu[0], tag);
+        return MBED_ERROR_INVSTATE;
+    }
+    switch (iu[0]) {
+        case SIM_IU_READ_READY:
+        case SIM_IU_WRITE_READY:
+            if (data_phase ||
+                cmd->dir != ((iu[0] == SIM_IU_READ_READY) ? SIM_DIR_IN : SIM_DIR_OUT)) {
+                fprintf(stderr, "sim host: unexpected IU %x, tag %x\n", iu[0], tag);
+                return MBED_ERROR_INVSTATE;
+            }
+            return (iu[0] == SIM_IU_READ_READY) ? sim_uas_data_in(cmd) : sim_uas_data_out(cmd);
+        case SIM_IU_SENSE:
+            if (actual < SIM_IU_SENSE_LEN) {
+                break;
+            }
+            /* CHECK CONDITION is reported as a failed CSW */
+            cmd->status->status = (iu[6] == SIM_SCSI_GOOD) ? 0 : 1;
+            sense_len = (uint32_t)((iu[14] << 8) | iu[15]);
+            if (sense_len > actual - SIM_IU_SENSE_LEN) {
+                break;
+            }
+            memset(host_ctx.sense, 0, sizeof(host_ctx.sense));
+            memcpy(host_ctx.sense, &iu[SIM_IU_SENSE_LEN],
+                   (sense_len < SIM_SENSE_LEN) ? sense_len : SIM_SENSE_LEN);
+            host_ctx.sense_valid = (sense_len != 0);
+            sim_uas_done(cmd);
+            return MBED_ERROR_NONE;
+        case SIM_IU_RESPONSE:
+            if (actual < SIM_IU_RESPONSE_LEN) {
+                break;
+            }
+            cmd->status->response = iu[7];
+            sim_uas_done(cmd);
+            return MBED_ERROR_NONE;
+        default:
+            break;
+    }
+    fprintf(stderr, "sim host: invalid IU %x (%u bytes)\n", iu[0], actual);
+    return MBED_ERROR_INVSTATE;
+}
+
+static mbed_error_t sim_uas_submit(uint16_t tag, uint8_t lun, const uint8_t *cdb,
+                                   uint8_t cdb_len, sim_dir_t dir, uint8_t *data,
+                                   uint32_t len, sim_status_t *status,
+                                   sim_uas_cmd_t **cmd)
+{
+    uint8_t iu[SIM_IU_COMMAND_LEN];
+    uint32_t actual = 0;
+    uint32_t i;
+    mbed_error_t errcode;
+
+    if (cdb_len == 0 || cdb_len > 16) {
+        return MBED_ERROR_INVPARAM;
+    }
+    for (i = 0; i < SIM_MAX_CMDS && host_ctx.cmds[i].used; i++) {
+        ;
+    }
+    if (i == SIM_MAX_CMDS) {
+        return MBED_ERROR_NOMEM;
+    }
+    *cmd = &host_ctx.cmds[i];
+    (*cmd)->done = false;
+    (*cmd)->tag = tag;
+    (*cmd)->seq = ++host_ctx.seq;
+    (*cmd)->dir = dir;
+    (*cmd)->data = data;
+    (*cmd)->len = (dir == SIM_DIR_NONE) ? 0 : len;
+    (*cmd)->status = status;
+    memset(status, 0, sizeof(*status));
+    status->response = -1;
+
+    /* simple task, LUN with the peripheral device addressing method */
+    memset(iu, 0, sizeof(iu));
+    iu[0] = SIM_IU_COMMAND;
+    iu[2] = (uint8_t)(tag >> 8);
+    iu[3] = (uint8_t)tag;
+    iu[9] = lun;
+    memcpy(&iu[16], cdb, cdb_len);
+    for (;;) {
+        errcode = sim_host_out(host_ctx.pipes[SIM_PIPE_COMMAND], iu, sizeof(iu),
+                               host_ctx.pipes[SIM_PIPE_STATUS], &actual);
+        if (errcode != MBED_ERROR_INTR) {
+            break;
+        }
+        /* the status pipe is read meanwhile, as the device may wait for
+         * its IUs to be sent (or the commands in flight to complete)
+         * before arming the command pipe */
+        errcode = sim_uas_status_iu(false);
+        if (errcode != MBED_ERROR_NONE) {
+            break;
+        }
+    }
+    if (errcode != MBED_ERROR_NONE) {
+        fprintf(stderr, "sim host: COMMAND IU not accepted\n");
+        return errcode;
+    }
+    (*cmd)->used = true;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t sim_host_submit(uint16_t tag, uint8_t lun, const uint8_t *cdb,
+                             uint8_t cdb_len, sim_dir_t dir, uint8_t *data,
+                             uint32_t len, sim_status_t *status)
+{
+    sim_uas_cmd_t *cmd;
+
+    return sim_uas_submit(tag, lun, cdb, cdb_len, dir, data, len, status, &cmd);
+}
+
+mbed_error_t sim_host_complete(sim_status_t **status)
+{
+    sim_uas_cmd_t *done;
+    bool in_flight;
+    uint32_t i;
+    mbed_error_t errcode;
+
+    for (;;) {
+        done = NULL;
+        in_flight = false;
+        for (i = 0; i < SIM_MAX_CMDS; i++) {
+            if (!host_ctx.cmds[i].used) {
+                continue;
+            }
+            in_flight = true;
+            if (host_ctx.cmds[i].done &&
+                (done == NULL || host_ctx.cmds[i].seq < done->seq)) {
+                done = &host_ctx.cmds[i];
+            }
+        }
+        if (done != NULL) {
+            done->used = false;
+            *status = done->status;
+            return MBED_ERROR_NONE;
+        }
+        if (!in_flight) {
+            return MBED_ERROR_INVSTATE;
+        }
+        errcode = sim_uas_status_iu(false);
+        if (errcode != MBED_ERROR_NONE) {
+            return errcode;
+        }
+    }
+}
+
+mbed_error_t sim_host_command(uint8_t lun, const uint8_t *cdb, uint8_t cdb_len,
+                              sim_dir_t dir, uint8_t *data, uint32_t len,
+                              sim_status_t *status)
+{
+    sim_uas_cmd_t *cmd = NULL;
+    mbed_error_t errcode;
+
+    if (cdb_len > 0 && cdb[0] == SIM_SCSI_REQUEST_SENSE && host_ctx.sense_valid) {
+        /* the sense data has been received with the status */
+        memset(status, 0, sizeof(*status));
+        status->response = -1;
+        status->transferred = (len < SIM_SENSE_LEN) ? len : SIM_SENSE_LEN;
+        memcpy(data, host_ctx.sense, status->transferred);
+        host_ctx.sense_valid = false;
+        return MBED_ERROR_NONE;
+    }
+    do {
+        host_ctx.tag++;
+    } while (sim_uas_find(host_ctx.tag, false) != NULL);
+    errcode = sim_uas_submit(host_ctx.tag, lun, cdb, cdb_len, dir, data, len, status, &cmd);
+    if (errcode != MBED_ERROR_NONE) {
+        return errcode;
+    }
+    while (errcode == MBED_ERROR_NONE && !cmd->done) {
+        errcode = sim_uas_status_iu(false);
+    }
+    cmd->used = false;
+    return errcode;
+}
+
+/*
+ * GET MAX LUN is a Bulk-Only request: the LUNs are reported by REPORT LUNS.
+ */
+mbed_error_t sim_host_get_max_lun(uint8_t *max_lun)
+{
+    uint8_t cdb[12] = { SIM_SCSI_REPORT_LUNS, 0, 0, 0, 0, 0, 0, 0, 0, 136, 0, 0 };
+    uint8_t data[136];
+    sim_status_t status;
+    uint32_t list_len;
+    mbed_error_t errcode;
+
+    errcode = sim_host_command(0, cdb, sizeof(cdb), SIM_DIR_IN, data, sizeof(data), &status);
+    if (errcode != MBED_ERROR_NONE) {
+        return errcode;
+    }
+    list_len = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+               ((uint32_t)data[2] << 8) | data[3];
+    if (status.status != 0 || status.transferred < 16 || list_len < 8 ||
+        list_len > 8 * 256) {
+        return MBED_ERROR_INVSTATE;
+    }
+    *max_lun = (uint8_t)(list_len / 8 - 1);
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * The device is reset with the Bulk-Only class request, the simulated
+ * controller having no USB reset. As after a USB reset, the host then waits
+ * for the device to be configured again, i.e. for the stack to be
+ * reinitialized, before sending commands.
+ */
+mbed_error_t sim_host_reset(void)
+{
+    usbctrl_setup_pkt_t pkt = {
+        .bmRequestType = 0x21,
+        .bRequest = SIM_RQST_MS_RESET,
+        .wValue = 0,
+        .wIndex = 0,
+        .wLength = 0,
+    };
+    uint32_t count = sim_device_reinit_count();
+    uint32_t actual = 0;
+    mbed_error_t errcode;
+
+    errcode = sim_host_control(&pkt, NULL, 0, &actual);
+    if (errcode == MBED_ERROR_NONE) {
+        sim_device_wait_reinit(count, SIM_USB_TIMEOUT);
+    }
+    sim_usb_clear_halt(host_ctx.pipes[SIM_PIPE_STATUS]);
+    sim_usb_clear_halt(host_ctx.pipes[SIM_PIPE_DATA_IN]);
+    memset(host_ctx.cmds, 0, sizeof(host_ctx.cmds));
+    host_ctx.sense_valid = false;
+    return errcode;
+}
+
+#endif/*CONFIG_USR_LIB_MASSSTORAGE_UAS*/
@@ -0,0 +1,1129 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/** @file sim_main.c
+ *
+ * Host-side simulation of the USB mass storage stack: the unmodified stack
+ * runs in a device thread, on top of a simulated USB controller and a
+ * file-backed storage, and is driven by a scripted Bulk-Only or UAS host.
+ *
+ * usage: sim_msc [-b block_size] [-n num_blocks] [-B buf_size] [-d dir] script
+ *
+ * Script syntax, one command per line ('#' starts a comment). Each command
+ * may be followed by "status=N", the expected CSW status (default 0), or
+ * with UAS by "response=CODE", the code of the RESPONSE IU expected to
+ * reject the command. With UAS, a CHECK CONDITION gives the status 1, and
+ * request_sense returns the sense data received with it.
+ * The following commands must precede the others, as the device is started
+ * by the first command which is not one of them:
+ *   disk NUM_BLOCKS          set the number of blocks of each LUN, as -n
+ *   config [!]OPTION         skip the rest of the script if the library
+ *                            OPTION (e.g. LBA64, UNMAP) is not set, or if it
+ *                            is set with '!'
+ *   luns N                   skip the rest of the script if less than N
+ *                            LUNs are configured
+ *   lun N                    address LUN N with the following commands
+ *   max_lun                  check the GET MAX LUN answer
+ *   inquiry
+ *   test_unit_ready
+ *   read_capacity            check the READ CAPACITY(10) answer against -n
+ *                            and -b, the last LBA saturating to 0xffffffff
+ *   read_capacity16          check the READ CAPACITY(16) answer
+ *   write LBA COUNT SEED     WRITE(10) of a pattern derived from SEED
+ *   read LBA COUNT SEED      READ(10), checking the pattern of SEED
+ *   sync_cache
+ *   request_sense [KEY ASC [deferred]]
+ *                            optionally check the sense key and ASC, and
+ *                            the response code of a current or deferred
+ *                            error
+ *   bad_block LBA|none       make the backend writes to LBA of the current
+ *                            LUN, and its verification, fail
+ *   storage_write LBA COUNT SEED
+ *                            write the pattern of SEED to the storage of the
+ *                            current LUN without going through the stack, as
+ *                            the application
+ *   invalidate LBA COUNT     drop the blocks from the sector cache with
+ *                            usbmsc_sector_cache_invalidate(), when the
+ *                            SECTOR_CACHE option is set
+ *   sleep MS                 let the device run idle for MS milliseconds
+ *   media_changed            signal a media change, as from an ISR
+ *   media_changed_lun N      signal a media change of LUN N
+ *   reset                    Bulk-Only Mass Storage Reset, also used to
+ *                            reset the device with UAS
+ *   queue TAG COMMAND...     with UAS, send the SCSI COMMAND (one of the
+ *                            commands below) with TAG, without waiting for
+ *                            its completion
+ *   wait                     with UAS, handle the data phases and wait for
+ *                            the completion of the queued commands, then
+ *                            check them
+ *   stats reset              clear the runtime statistics and the cache
+ *                            counters
+ *   stats command OPCODE N   check the statistics, when the STATS option is
+ *   stats read_blocks N      set: executed commands of OPCODE (hexadecimal),
+ *   stats write_blocks N     blocks read and written, CHECK CONDITION
+ *   stats sense KEY N        statuses with sense key KEY, resets
+ *   stats resets N
+ *   stats readahead HITS MISSES
+ *   stats sector_cache HITS MISSES
+ *                            check the READ commands served from the
+ *                            read-ahead buffer or the sector cache, and the
+ *                            others, since the last stats reset, when the
+ *                            READAHEAD or SECTOR_CACHE option is set
+ *   trace [FILE]             read the trace records since the last trace
+ *                            command, check that the statuses and the
+ *                            commands alternate and append the records to
+ *                            FILE, when the TRACE option is set
+ *   latency OPCODES...       print the latency histograms and check that
+ *                            the OPCODES (hexadecimal) have been recorded,
+ *                            when the LATENCY option is set
+ *   cdb in|out|none LEN BYTES...   raw command, hexadecimal CDB bytes
+ *
+ * The data sent by "write" and "cdb out" and checked after "read" and
+ * "cdb in" (on success only) is given by the SEED argument of read and
+ * write, or by the following options:
+ *   data=LBA:SEED            pattern of the sectors from LBA with SEED
+ *   data=zero                zeroes
+ *   block=SEED               each sector holds the pattern of sector 0
+ *                            with SEED, as written by WRITE SAME
+ *   hex=BYTES                hexadecimal bytes, followed by zeroes
+ *   byte=OFFSET:VALUE[:MASK] check a byte of the received data (hexadecimal
+ *                            VALUE and MASK), may be repeated
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "autoconf.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "libc/arpa/inet.h"
+#include "api/libusbmsc.h"
+#include "sim_host.h"
+#include "sim_device.h"
+#include "sim_backend.h"
+
+#define SIM_MAX_LINE 1024
+#define SIM_MAX_TOKENS 24
+#define SIM_MAX_OPTS 8
+#define SIM_MAX_HEX 256
+#define SIM_MAX_BYTES 8
+#define SIM_MAX_QUEUED 16
+
+typedef enum {
+    SIM_DATA_NONE,          /* zeroes sent, nothing checked */
+    SIM_DATA_PATTERN,       /* pattern of the sectors from lba with seed */
+    SIM_DATA_BLOCK,         /* pattern of sector 0 with seed in each sector */
+    SIM_DATA_ZERO,
+    SIM_DATA_HEX,           /* hex bytes followed by zeroes */
+} sim_data_kind_t;
+
+/* data sent or expected by a command */
+typedef struct {
+    sim_data_kind_t kind;
+    uint64_t  lba;
+    uint32_t  seed;
+    uint8_t   hex[SIM_MAX_HEX];
+    uint32_t  hex_len;
+    uint32_t  nbytes;
+    struct {
+        uint32_t offset;
+        uint8_t  value;
+        uint8_t  mask;
+    } bytes[SIM_MAX_BYTES];
+} sim_data_t;
+
+/* SCSI command of the script */
+typedef struct {
+    char     **tok;
+    int        ntok;
+    int        expected;    /* CSW status */
+    int        response;    /* UAS RESPONSE IU code, -1 if none */
+    uint8_t    cdb[16];
+    uint8_t    cdb_len;
+    sim_dir_t  dir;
+    uint32_t   len;
+    sim_data_t data;
+    uint8_t   *buf;
+} sim_cmd_t;
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UAS
+/* command sent with "queue", waiting for its completion */
+typedef struct {
+    bool         used;
+    uint16_t     tag;
+    sim_cmd_t    cmd;
+    sim_status_t status;
+    char        *tok[SIM_MAX_TOKENS];
+    char         words[SIM_MAX_LINE];
+} sim_queued_t;
+
+static sim_queued_t sim_queued[SIM_MAX_QUEUED];
+#endif
+
+typedef struct {
+    sim_device_config_t dev;
+    bool      started;
+    uint32_t  block_size;
+    uint64_t  num_blocks;
+    uint8_t  *data;
+    uint32_t  data_size;
+    uint8_t   lun;
+#if CONFIG_USR_LIB_MASSSTORAGE_TRACE
+    uint32_t  trace_seq;    /* next trace record to read */
+#endif
+} sim_config_t;
+
+static sim_config_t sim_cfg = {
+    .dev = {
+        .block_size = 512,
+        .num_blocks = 2048,
+        .buf_size = 16384,
+        .dir = "/tmp",
+    },
+    .started = false,
+    .block_size = 512,
+    .num_blocks = 2048,
+    .lun = 0,
+};
+
+/* library options checked by the "config" command */
+static const char *sim_options[] = {
+#if CONFIG_USR_LIB_MASSSTORAGE_UAS
+    "UAS",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_LBA64
+    "LBA64",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_BUF
+    "BACKEND_BUF",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_ASYNC
+    "BACKEND_ASYNC",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_BACKEND_VERIFY
+    "BACKEND_VERIFY",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_DATAPATH_ZERO_COPY
+    "DATAPATH_ZERO_COPY",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+    "READAHEAD",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+    "SECTOR_CACHE",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_CACHE
+    "WRITE_CACHE",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_GATHER
+    "WRITE_GATHER",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_UNMAP
+    "UNMAP",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME
+    "WRITE_SAME",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_WRITE_SAME_ZEROES
+    "WRITE_SAME_ZEROES",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    "STATS",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+    "LATENCY",
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_TRACE
+    "TRACE",
+#endif
+    NULL
+};
+
+/*
+ * Data pattern of a sector, depending on its address and on a seed
+ */
+static void sim_pattern(uint8_t *buf, uint64_t lba, uint32_t count, uint32_t seed)
+{
+    uint64_t i;
+    uint32_t x;
+
+    for (i = 0; i < (uint64_t)count * sim_cfg.block_size; i++) {
+        x = (uint32_t)(lba + i / sim_cfg.block_size) * 2654435761u;
+        x ^= seed * 40503u + (uint32_t)(i % sim_cfg.block_size);
+        buf[i] = (uint8_t)(x ^ (x >> 8) ^ (x >> 16));
+    }
+}
+
+static bool sim_data_alloc(uint32_t size)
+{
+    if (size <= sim_cfg.data_size) {
+        return true;
+    }
+    free(sim_cfg.data);
+    sim_cfg.data = malloc(size);
+    sim_cfg.data_size = sim_cfg.data ? size : 0;
+    return sim_cfg.data != NULL;
+}
+
+static bool sim_option_set(const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; sim_options[i] != NULL; i++) {
+        if (!strcmp(sim_options[i], name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Parse a data option of a command. Returns false on syntax error.
+ */
+static bool sim_data_parse(const char *opt, sim_data_t *d)
+{
+    const char *val = strchr(opt, '=') + 1;
+    char *end;
+    uint32_t i;
+
+    if (!strncmp(opt, "data=", 5) && !strcmp(val, "zero")) {
+        d->kind = SIM_DATA_ZERO;
+    } else if (!strncmp(opt, "data=", 5)) {
+        d->kind = SIM_DATA_PATTERN;
+        d->lba = strtoull(val, &end, 0);
+        if (*end != ':') {
+            return false;
+        }
+        d->seed = (uint32_t)strtoul(end + 1, NULL, 0);
+    } else if (!strncmp(opt, "block=", 6)) {
+        d->kind = SIM_DATA_BLOCK;
+        d->seed = (uint32_t)strtoul(val, NULL, 0);
+    } else if (!strncmp(opt, "hex=", 4)) {
+        d->kind = SIM_DATA_HEX;
+        d->hex_len = (uint32_t)strlen(val) / 2;
+        if (d->hex_len > SIM_MAX_HEX || (strlen(val) % 2) != 0) {
+            return false;
+        }
+        for (i = 0; i < d->hex_len; i++) {
+            if (sscanf(&val[2 * i], "%2hhx", &d->hex[i]) != 1) {
+                return false;
+            }
+        }
+    } else if (!strncmp(opt, "byte=", 5) && d->nbytes < SIM_MAX_BYTES) {
+        d->bytes[d->nbytes].offset = (uint32_t)strtoul(val, &end, 0);
+        if (*end != ':') {
+            return false;
+        }
+        d->bytes[d->nbytes].value = (uint8_t)strtoul(end + 1, &end, 16);
+        d->bytes[d->nbytes].mask = (*end == ':') ? (uint8_t)strtoul(end + 1, NULL, 16) : 0xff;
+        d->nbytes++;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* data sent, or expected, for len bytes */
+static void sim_data_fill(const sim_data_t *d, uint8_t *buf, uint32_t len)
+{
+    uint32_t i;
+
+    memset(buf, 0, len);
+    switch (d->kind) {
+        case SIM_DATA_PATTERN:
+            sim_pattern(buf, d->lba, len / sim_cfg.block_size, d->seed);
+            break;
+        case SIM_DATA_BLOCK:
+            for (i = 0; i + sim_cfg.block_size <= len; i += sim_cfg.block_size) {
+                sim_pattern(&buf[i], 0, 1, d->seed);
+            }
+            break;
+        case SIM_DATA_HEX:
+            memcpy(buf, d->hex, (d->hex_len < len) ? d->hex_len : len);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Check the received data against the expected one. Only the given bytes
+ * are checked with hex.
+ */
+static int sim_data_check(const sim_data_t *d, const uint8_t *buf, uint32_t len,
+                          uint32_t transferred)
+{
+    uint8_t *ref = NULL;
+    uint32_t i;
+    int ret = 1;
+
+    if (d->kind == SIM_DATA_HEX) {
+        if (transferred < d->hex_len || memcmp(buf, d->hex, d->hex_len)) {
+            fprintf(stderr, "data mismatch\n");
+            goto err;
+        }
+    } else if (d->kind != SIM_DATA_NONE) {
+        ref = malloc(len);
+        if (ref == NULL) {
+            goto err;
+        }
+        sim_data_fill(d, ref, len);
+        if (transferred != len || memcmp(ref, buf, len)) {
+            fprintf(stderr, "read data mismatch\n");
+            goto err;
+        }
+    }
+    for (i = 0; i < d->nbytes; i++) {
+        if (d->bytes[i].offset >= transferred ||
+            (buf[d->bytes[i].offset] & d->bytes[i].mask) != d->bytes[i].value) {
+            fprintf(stderr, "byte %u: %x, expected %x\n", d->bytes[i].offset,
+                    (d->bytes[i].offset < transferred) ? buf[d->bytes[i].offset] : 0,
+                    d->bytes[i].value);
+            goto err;
+        }
+    }
+    ret = 0;
+err:
+    free(ref);
+    return ret;
+}
+
+static void sim_rw10_cdb(uint8_t *cdb, uint8_t opcode, uint32_t lba, uint16_t count)
+{
+    memset(cdb, 0, 10);
+    cdb[0] = opcode;
+    cdb[2] = (uint8_t)(lba >> 24);
+    cdb[3] = (uint8_t)(lba >> 16);
+    cdb[4] = (uint8_t)(lba >> 8);
+    cdb[5] = (uint8_t)lba;
+    cdb[7] = (uint8_t)(count >> 8);
+    cdb[8] = (uint8_t)count;
+}
+
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD || CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+/* hits and misses counters of a cache, as of the last "stats reset" */
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+} sim_cache_stats_t;
+
+/* check the hits and misses of a cache since the last "stats reset" */
+static int sim_cache_stats(const char *name, const sim_cache_stats_t *base,
+                           uint32_t hits, uint32_t misses, char **tok)
+{
+    uint32_t expected_hits = (uint32_t)strtoul(tok[2], NULL, 0);
+    uint32_t expected_misses = (uint32_t)strtoul(tok[3], NULL, 0);
+
+    hits -= base->hits;
+    misses -= base->misses;
+    if (hits != expected_hits || misses != expected_misses) {
+        fprintf(stderr, "stats %s: %u hits, %u misses, expected %u and %u\n",
+                name, hits, misses, expected_hits, expected_misses);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+static sim_cache_stats_t sim_readahead_base;
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+static sim_cache_stats_t sim_sector_cache_base;
+#endif
+
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+static int sim_stack_stats(char **tok, int ntok)
+{
+    usbmsc_stats_t stats;
+    uint64_t value;
+    uint64_t expected;
+
+    if (usbmsc_get_stats(&stats) != MBED_ERROR_NONE) {
+        return 1;
+    }
+    expected = strtoull(tok[ntok - 1], NULL, 0);
+    if (!strcmp(tok[1], "command") && ntok == 4) {
+        value = stats.commands[(uint8_t)strtoul(tok[2], NULL, 16)];
+    } else if (!strcmp(tok[1], "read_blocks") && ntok == 3) {
+        value = stats.bytes_read / sim_cfg.block_size;
+    } else if (!strcmp(tok[1], "write_blocks") && ntok == 3) {
+        value = stats.bytes_written / sim_cfg.block_size;
+    } else if (!strcmp(tok[1], "sense") && ntok == 4) {
+        value = stats.sense_keys[strtoul(tok[2], NULL, 0) & 0xf];
+    } else if (!strcmp(tok[1], "resets") && ntok == 3) {
+        value = stats.resets;
+    } else {
+        fprintf(stderr, "syntax error\n");
+        return 1;
+    }
+    if (value != expected) {
+        fprintf(stderr, "stats %s: %llu, expected %llu\n", tok[1],
+                (unsigned long long)value, (unsigned long long)expected);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Statistics checks. Each kind of counters is only checked when its library
+ * option is set, the command succeeds otherwise.
+ */
+static int sim_stats(char **tok, int ntok)
+{
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD || CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+    uint32_t hits;
+    uint32_t misses;
+#endif
+
+    if (!strcmp(tok[1], "reset") && ntok == 2) {
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+        usbmsc_reset_stats();
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+        usbmsc_readahead_get_stats(&sim_readahead_base.hits,
+                                   &sim_readahead_base.misses);
+#endif
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+        usbmsc_sector_cache_get_stats(&sim_sector_cache_base.hits,
+                                      &sim_sector_cache_base.misses);
+#endif
+        return 0;
+    }
+    if (!strcmp(tok[1], "readahead") && ntok == 4) {
+#if CONFIG_USR_LIB_MASSSTORAGE_READAHEAD
+        usbmsc_readahead_get_stats(&hits, &misses);
+        return sim_cache_stats(tok[1], &sim_readahead_base, hits, misses, tok);
+#else
+        return 0;
+#endif
+    }
+    if (!strcmp(tok[1], "sector_cache") && ntok == 4) {
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+        usbmsc_sector_cache_get_stats(&hits, &misses);
+        return sim_cache_stats(tok[1], &sim_sector_cache_base, hits, misses, tok);
+#else
+        return 0;
+#endif
+    }
+#if CONFIG_USR_LIB_MASSSTORAGE_STATS
+    return sim_stack_stats(tok, ntok);
+#else
+    return 0;
+#endif
+}
+
+#if CONFIG_USR_LIB_MASSSTORAGE_TRACE
+static int sim_trace(const char *path)
+{
+    usbmsc_trace_record_t records[64];
+    uint32_t count;
+    uint32_t total = 0;
+    uint32_t prev = 0;
+    uint32_t i;
+    bool in_cmd = false;
+    bool synced = false;
+    FILE *out = NULL;
+    int ret = 1;
+
+    if (path != NULL && (out = fopen(path, "ab")) == NULL) {
+        perror(path);
+        return 1;
+    }
+    while ((count = usbmsc_trace_read(&sim_cfg.trace_seq, records, 64)) > 0) {
+        for (i = 0; i < count; i++) {
+            if (prev != 0 && records[i].seq != prev + 1) {
+                /* records lost: checking again from the next command */
+                synced = false;
+            }
+            prev = records[i].seq;
+            if (records[i].event == USBMSC_TRACE_CBW) {
+                if (synced && in_cmd) {
+                    fprintf(stderr, "trace %u: command without status\n", records[i].seq);
+                    goto err;
+                }
+                synced = true;
+                in_cmd = true;
+            } else if (records[i].event == USBMSC_TRACE_CSW && synced) {
+                if (!in_cmd) {
+                    fprintf(stderr, "trace %u: status without command\n", records[i].seq);
+                    goto err;
+                }
+                in_cmd = false;
+            } else if (records[i].event == USBMSC_TRACE_RESET) {
+                synced = false;
+            } else if (records[i].event == USBMSC_TRACE_DROP) {
+                fprintf(stderr, "trace %u: command dropped\n", records[i].seq);
+                goto err;
+            }
+        }
+        if (out != NULL && fwrite(records, sizeof(records[0]), count, out) != count) {
+            perror(path);
+            goto err;
+        }
+        total += count;
+    }
+    if (total == 0) {
+        fprintf(stderr, "no trace record\n");
+        goto err;
+    }
+    ret = 0;
+err:
+    if (out != NULL) {
+        fclose(out);
+    }
+    return ret;
+}
+#endif
+
+/*
+ * Build the CDB and the data of a SCSI command from its tokens and options.
+ * Returns false on syntax error.
+ */
+static bool sim_cmd_parse(sim_cmd_t *cmd, char **opt, int nopt)
+{
+    char **tok = cmd->tok;
+    int ntok = cmd->ntok;
+    uint32_t lba = 0, count = 0;
+    int i;
+
+    cmd->cdb_len = 6;
+    cmd->dir = SIM_DIR_NONE;
+    cmd->len = 0;
+    cmd->response = -1;
+    cmd->data.kind = SIM_DATA_NONE;
+    for (i = 0; i < nopt; i++) {
+        if (!strncmp(opt[i], "response=", 9)) {
+            cmd->response = (int)strtol(opt[i] + 9, NULL, 0);
+        } else if (!sim_data_parse(opt[i], &cmd->data)) {
+            return false;
+        }
+    }
+    if (!strcmp(tok[0], "inquiry")) {
+        cmd->cdb[0] = 0x12;
+        cmd->cdb[4] = 36;
+        cmd->dir = SIM_DIR_IN;
+        cmd->len = 36;
+    } else if (!strcmp(tok[0], "test_unit_ready")) {
+        cmd->cdb[0] = 0x00;
+    } else if (!strcmp(tok[0], "request_sense")) {
+        cmd->cdb[0] = 0x03;
+        cmd->cdb[4] = 18;
+        cmd->dir = SIM_DIR_IN;
+        cmd->len = 18;
+    } else if (!strcmp(tok[0], "read_capacity")) {
+        cmd->cdb[0] = 0x25;
+        cmd->cdb_len = 10;
+        cmd->dir = SIM_DIR_IN;
+        cmd->len = 8;
+    } else if (!strcmp(tok[0], "read_capacity16")) {
+        /* SERVICE ACTION IN(16), READ CAPACITY(16) */
+        cmd->cdb[0] = 0x9e;
+        cmd->cdb[1] = 0x10;
+        cmd->cdb[13] = 32;
+        cmd->cdb_len = 16;
+        cmd->dir = SIM_DIR_IN;
+        cmd->len = 32;
+    } else if (!strcmp(tok[0], "sync_cache")) {
+        cmd->cdb[0] = 0x35;
+        cmd->cdb_len = 10;
+    } else if ((!strcmp(tok[0], "read") || !strcmp(tok[0], "write")) &&
+               (ntok == 4 || (ntok == 3 && cmd->data.kind != SIM_DATA_NONE))) {
+        lba = (uint32_t)strtoul(tok[1], NULL, 0);
+        count = (uint32_t)strtoul(tok[2], NULL, 0);
+        if (ntok == 4) {
+            cmd->data.kind = SIM_DATA_PATTERN;
+            cmd->data.lba = lba;
+            cmd->data.seed = (uint32_t)strtoul(tok[3], NULL, 0);
+        }
+        if (count > 0xffff) {
+            return false;
+        }
+        cmd->cdb_len = 10;
+        cmd->len = count * sim_cfg.block_size;
+        if (tok[0][0] == 'w') {
+            sim_rw10_cdb(cmd->cdb, 0x2a, lba, (uint16_t)count);
+            cmd->dir = SIM_DIR_OUT;
+        } else {
+            sim_rw10_cdb(cmd->cdb, 0x28, lba, (uint16_t)count);
+            cmd->dir = SIM_DIR_IN;
+        }
+    } else if (!strcmp(tok[0], "cdb") && ntok >= 4) {
+        if (!strcmp(tok[1], "in")) {
+            cmd->dir = SIM_DIR_IN;
+        } else if (!strcmp(tok[1], "out")) {
+            cmd->dir = SIM_DIR_OUT;
+        } else if (strcmp(tok[1], "none")) {
+            return false;
+        }
+        cmd->len = (uint32_t)strtoul(tok[2], NULL, 0);
+        if (ntok - 3 > (int)sizeof(cmd->cdb)) {
+            return false;
+        }
+        cmd->cdb_len = (uint8_t)(ntok - 3);
+        for (i = 3; i < ntok; i++) {
+            cmd->cdb[i - 3] = (uint8_t)strtoul(tok[i], NULL, 16);
+        }
+    } else {
+        return false;
+    }
+
+    if (cmd->len % sim_cfg.block_size != 0 &&
+        (cmd->data.kind == SIM_DATA_PATTERN || cmd->data.kind == SIM_DATA_BLOCK)) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Check the status and the data of an executed SCSI command. Returns 0 on
+ * success.
+ */
+static int sim_cmd_check(const sim_cmd_t *cmd, const sim_status_t *status)
+{
+    char **tok = cmd->tok;
+    int ntok = cmd->ntok;
+    uint8_t *data = cmd->buf;
+    int i;
+
+    if (status->response != cmd->response) {
+        fprintf(stderr, "RESPONSE IU code %d, expected %d\n", status->response, cmd->response);
+        return 1;
+    }
+    if (cmd->response >= 0) {
+        return 0;
+    }
+    if (status->status != cmd->expected) {
+        fprintf(stderr, "CSW status %u, expected %d\n", status->status, cmd->expected);
+        return 1;
+    }
+    if (cmd->expected != 0) {
+        return 0;
+    }
+
+    /* command specific checks */
+    if (cmd->dir == SIM_DIR_IN && sim_data_check(&cmd->data, data, cmd->len, status->transferred)) {
+        return 1;
+    }
+    if (!strcmp(tok[0], "read_capacity")) {
+        uint32_t last_lba, block_size;
+
+        memcpy(&last_lba, &data[0], 4);
+        memcpy(&block_size, &data[4], 4);
+        if (ntohl(last_lba) != ((sim_cfg.num_blocks - 1 > 0xffffffff) ?
+                                 0xffffffff : sim_cfg.num_blocks - 1) ||
+            ntohl(block_size) != sim_cfg.block_size) {
+            fprintf(stderr, "capacity %u x %u\n", ntohl(last_lba) + 1, ntohl(block_size));
+            return 1;
+        }
+    } else if (!strcmp(tok[0], "read_capacity16")) {
+        uint64_t last_lba = 0;
+        uint32_t block_size;
+
+        for (i = 0; i < 8; i++) {
+            last_lba = (last_lba << 8) | data[i];
+        }
+        memcpy(&block_size, &data[8], 4);
+        if (status->transferred < 32 || last_lba != sim_cfg.num_blocks - 1 ||
+            ntohl(block_size) != sim_cfg.block_size) {
+            fprintf(stderr, "capacity %llu x %u\n", (unsigned long long)last_lba + 1,
+                    ntohl(block_size));
+            return 1;
+        }
+    } else if (!strcmp(tok[0], "request_sense") && ntok >= 3) {
+        if ((data[2] & 0xf) != strtoul(tok[1], NULL, 0) ||
+            data[12] != strtoul(tok[2], NULL, 0) ||
+            (data[0] & 0x7f) != ((ntok == 4 && !strcmp(tok[3], "deferred")) ? 0x71 : 0x70)) {
+            fprintf(stderr, "sense %x/%x, response code %x\n", data[2] & 0xf,
+                    data[12], data[0] & 0x7f);
+            return 1;
+        }
+    } else if (!strcmp(tok[0], "inquiry")) {
+        if (status->transferred < 36 || (data[0] & 0x1f) != 0) {
+            fprintf(stderr, "invalid inquiry data\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UAS
+/*
+ * Send a SCSI command with the given UAS tag, checked by the next "wait".
+ */
+static int sim_queue(char **tok, int ntok, char **opt, int nopt, int expected)
+{
+    sim_queued_t *q = NULL;
+    char *p;
+    int i;
+
+    for (i = 0; i < SIM_MAX_QUEUED && q == NULL; i++) {
+        if (!sim_queued[i].used) {
+            q = &sim_queued[i];
+        }
+    }
+    if (q == NULL) {
+        fprintf(stderr, "too many queued commands\n");
+        return 1;
+    }
+    memset(q, 0, sizeof(*q));
+    /* the tokens are checked once the command completes */
+    p = q->words;
+    for (i = 2; i < ntok; i++) {
+        strcpy(p, tok[i]);
+        q->tok[i - 2] = p;
+        p += strlen(p) + 1;
+    }
+    q->tag = (uint16_t)strtoul(tok[1], NULL, 0);
+    q->cmd.tok = q->tok;
+    q->cmd.ntok = ntok - 2;
+    q->cmd.expected = expected;
+    if (!sim_cmd_parse(&q->cmd, opt, nopt)) {
+        fprintf(stderr, "syntax error\n");
+        return 1;
+    }
+    q->cmd.buf = malloc(q->cmd.len + 1);
+    if (q->cmd.buf == NULL) {
+        return 1;
+    }
+    sim_data_fill(&q->cmd.data, q->cmd.buf, q->cmd.len);
+    if (sim_host_submit(q->tag, sim_cfg.lun, q->cmd.cdb, q->cmd.cdb_len, q->cmd.dir,
+                        q->cmd.buf, q->cmd.len, &q->status) != MBED_ERROR_NONE) {
+        fprintf(stderr, "transport error\n");
+        free(q->cmd.buf);
+        return 1;
+    }
+    q->used = true;
+    return 0;
+}
+
+/*
+ * Wait for the completion of all the queued commands, and check them.
+ */
+static int sim_wait(void)
+{
+    sim_status_t *status;
+    sim_queued_t *q;
+    int ret = 0;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < SIM_MAX_QUEUED && !sim_queued[i].used; i++) {
+            ;
+        }
+        if (i == SIM_MAX_QUEUED) {
+            break;
+        }
+        if (sim_host_complete(&status) != MBED_ERROR_NONE) {
+            fprintf(stderr, "transport error\n");
+            return 1;
+        }
+        for (i = 0; i < SIM_MAX_QUEUED && &sim_queued[i].status != status; i++) {
+            ;
+        }
+        if (i == SIM_MAX_QUEUED) {
+            fprintf(stderr, "unknown command completed\n");
+            return 1;
+        }
+        q = &sim_queued[i];
+        if (sim_cmd_check(&q->cmd, status)) {
+            fprintf(stderr, "queued %s, tag %u: FAILED\n", q->tok[0], q->tag);
+            ret = 1;
+        }
+        free(q->cmd.buf);
+        q->used = false;
+    }
+    return ret;
+}
+#endif
+
+/*
+ * Execute a script command. Returns 0 on success, -1 if the rest of the
+ * script must be skipped.
+ */
+static int sim_exec(char **tok, int ntok, char **opt, int nopt, int expected)
+{
+    sim_cmd_t cmd;
+    sim_status_t status = { 0 };
+    uint8_t max_lun = 0;
+
+    if (!strcmp(tok[0], "luns") && ntok == 2) {
+        if (strtoul(tok[1], NULL, 0) > CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS) {
+            printf("less than %s LUNs, skipped\n", tok[1]);
+            return -1;
+        }
+        return 0;
+    }
+    if (!strcmp(tok[0], "config") && ntok == 2) {
+        if (sim_option_set(tok[1] + (tok[1][0] == '!')) == (tok[1][0] == '!')) {
+            printf("%s%s, skipped\n", (tok[1][0] == '!') ? "" : "no ",
+                   tok[1] + (tok[1][0] == '!'));
+            return -1;
+        }
+        return 0;
+    }
+    if (!strcmp(tok[0], "disk") && ntok == 2) {
+        if (sim_cfg.started) {
+            fprintf(stderr, "the device is already started\n");
+            return 1;
+        }
+        sim_cfg.dev.num_blocks = strtoull(tok[1], NULL, 0);
+        sim_cfg.num_blocks = sim_cfg.dev.num_blocks;
+        return 0;
+    }
+    if (!sim_cfg.started) {
+        if (sim_device_start(&sim_cfg.dev) != MBED_ERROR_NONE) {
+            fprintf(stderr, "device start failed\n");
+            return 1;
+        }
+        sim_cfg.started = true;
+    }
+    if (!strcmp(tok[0], "lun") && ntok == 2) {
+        sim_cfg.lun = (uint8_t)strtoul(tok[1], NULL, 0);
+        return 0;
+    }
+    if (!strcmp(tok[0], "max_lun")) {
+        if (sim_host_get_max_lun(&max_lun) != MBED_ERROR_NONE) {
+            return 1;
+        }
+        if (max_lun != CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS - 1) {
+            fprintf(stderr, "max lun %u\n", max_lun);
+            return 1;
+        }
+        return 0;
+    }
+    if (!strcmp(tok[0], "storage_write") && ntok == 4) {
+        uint32_t count = (uint32_t)strtoul(tok[2], NULL, 0);
+
+        if (!sim_data_alloc(count * sim_cfg.block_size)) {
+            return 1;
+        }
+        sim_pattern(sim_cfg.data, strtoull(tok[1], NULL, 0), count,
+                    (uint32_t)strtoul(tok[3], NULL, 0));
+        return sim_backend_write_direct(sim_cfg.lun, strtoull(tok[1], NULL, 0),
+                                        sim_cfg.data, count) != MBED_ERROR_NONE;
+    }
+    if (!strcmp(tok[0], "invalidate") && ntok == 3) {
+#if CONFIG_USR_LIB_MASSSTORAGE_SECTOR_CACHE
+        sim_device_sector_cache_invalidate(strtoull(tok[1], NULL, 0),
+                                           (uint32_t)strtoul(tok[2], NULL, 0));
+#endif
+        return 0;
+    }
+    if (!strcmp(tok[0], "media_changed")) {
+        usbmsc_media_changed();
+        return 0;
+    }
+    if (!strcmp(tok[0], "media_changed_lun") && ntok == 2) {
+        return usbmsc_lun_media_changed((uint8_t)strtoul(tok[1], NULL, 0)) != MBED_ERROR_NONE;
+    }
+    if (!strcmp(tok[0], "reset")) {
+#if CONFIG_USR_LIB_MASSSTORAGE_UAS
+        int i;
+
+        /* the commands in flight are dropped */
+        for (i = 0; i < SIM_MAX_QUEUED; i++) {
+            if (sim_queued[i].used) {
+                free(sim_queued[i].cmd.buf);
+                sim_queued[i].used = false;
+            }
+        }
+#endif
+        return sim_host_reset() != MBED_ERROR_NONE;
+    }
+    if (!strcmp(tok[0], "sleep") && ntok == 2) {
+        usleep((useconds_t)strtoul(tok[1], NULL, 0) * 1000);
+        return 0;
+    }
+    if (!strcmp(tok[0], "bad_block") && ntok == 2) {
+        sim_backend_set_bad_block(sim_cfg.lun, strcmp(tok[1], "none") ?
+                                  strtoull(tok[1], NULL, 0) : SIM_BACKEND_NO_BAD_BLOCK);
+        return 0;
+    }
+    if (!strcmp(tok[0], "stats") && ntok >= 2) {
+        return sim_stats(tok, ntok);
+    }
+    if (!strcmp(tok[0], "trace") && ntok <= 2) {
+#if CONFIG_USR_LIB_MASSSTORAGE_TRACE
+        return sim_trace((ntok == 2) ? tok[1] : NULL);
+#else
+        return 0;
+#endif
+    }
+    if (!strcmp(tok[0], "latency") && ntok >= 2) {
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+        usbmsc_latency_hist_t hist;
+        uint8_t idx;
+        int i;
+
+        sim_device_latency_report(stdout, "latency");
+        for (i = 1; i < ntok; i++) {
+            for (idx = 0; usbmsc_latency_get(idx, &hist, NULL) == MBED_ERROR_NONE; idx++) {
+                if (hist.opcode == (uint8_t)strtoul(tok[i], NULL, 16)) {
+                    break;
+                }
+            }
+            if (usbmsc_latency_get(idx, &hist, NULL) != MBED_ERROR_NONE || hist.count == 0) {
+                fprintf(stderr, "opcode %s not recorded\n", tok[i]);
+                return 1;
+            }
+        }
+        return 0;
+#else
+        return 0;
+#endif
+    }
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UAS
+    if (!strcmp(tok[0], "queue") && ntok >= 3) {
+        return sim_queue(tok, ntok, opt, nopt, expected);
+    }
+    if (!strcmp(tok[0], "wait") && ntok == 1) {
+        return sim_wait();
+    }
+#endif
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.tok = tok;
+    cmd.ntok = ntok;
+    cmd.expected = expected;
+    if (!sim_cmd_parse(&cmd, opt, nopt)) {
+        goto syntax;
+    }
+    if (!sim_data_alloc(cmd.len + 1)) {
+        return 1;
+    }
+    cmd.buf = sim_cfg.data;
+    sim_data_fill(&cmd.data, cmd.buf, cmd.len);
+    if (sim_host_command(sim_cfg.lun, cmd.cdb, cmd.cdb_len, cmd.dir, cmd.buf, cmd.len,
+                         &status) != MBED_ERROR_NONE) {
+        fprintf(stderr, "transport error\n");
+        return 1;
+    }
+    return sim_cmd_check(&cmd, &status);
+syntax:
+    fprintf(stderr, "syntax error\n");
+    return 1;
+}
+
+static int sim_run_script(FILE *f)
+{
+    char line[SIM_MAX_LINE];
+    char *tok[SIM_MAX_TOKENS];
+    char *opt[SIM_MAX_OPTS];
+    char *p;
+    int ntok;
+    int nopt;
+    int expected;
+    int lineno = 0;
+    int ret;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        p = strchr(line, '#');
+        if (p != NULL) {
+            *p = '\0';
+        }
+        ntok = 0;
+        nopt = 0;
+        expected = 0;
+        for (p = strtok(line, " \t\r\n"); p != NULL; p = strtok(NULL, " \t\r\n")) {
+            if (!strncmp(p, "status=", 7)) {
+                expected = atoi(p + 7);
+            } else if (strchr(p, '=') != NULL && nopt < SIM_MAX_OPTS) {
+                opt[nopt++] = p;
+            } else if (ntok < SIM_MAX_TOKENS) {
+                tok[ntok++] = p;
+            }
+        }
+        if (ntok == 0) {
+            continue;
+        }
+        ret = sim_exec(tok, ntok, opt, nopt, expected);
+        if (ret < 0) {
+            break;
+        }
+        if (ret != 0) {
+            fprintf(stderr, "line %d: %s: FAILED\n", lineno, tok[0]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void sim_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-b block_size] [-n num_blocks] [-B buf_size] [-d dir] script\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    sim_device_config_t *cfg = &sim_cfg.dev;
+    FILE *script;
+    int opt;
+    int ret = 1;
+
+    while ((opt = getopt(argc, argv, "b:n:B:d:")) != -1) {
+        switch (opt) {
+            case 'b':
+                cfg->block_size = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                cfg->num_blocks = strtoull(optarg, NULL, 0);
+                break;
+            case 'B':
+                cfg->buf_size = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                cfg->dir = optarg;
+                break;
+            default:
+                sim_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        sim_usage(argv[0]);
+        return 1;
+    }
+    script = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+    if (script == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    sim_cfg.block_size = cfg->block_size;
+    sim_cfg.num_blocks = cfg->num_blocks;
+
+    /* the device is started by the first command of the script */
+    ret = sim_run_script(script);
+    if (sim_cfg.started) {
+        sim_device_stop();
+    }
+    if (script != stdin) {
+        fclose(script);
+    }
+    free(sim_cfg.data);
+    printf("%s\n", ret ? "FAIL" : "PASS");
+    return ret;
+}
@@ -0,0 +1,750 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/** @file sim_usb.c
+ *
+ * Simulated USB device controller and wookey syscalls of the host build.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "libc/string.h"
+#include "libc/syscall.h"
+#include "libusbctrl.h"
+#include "sim_usb.h"
+
+#define SIM_USB_MAX_EP 16
+#define SIM_USB_MAX_EVENTS 64
+#define SIM_USB_CTRL_SIZE 256
+/* standard requests and descriptor types */
+#define SIM_USB_RQST_TYPE_MASK      0x60
+#define SIM_USB_RQST_GET_DESCRIPTOR 0x06
+#define SIM_USB_DT_CONFIG           0x02
+#define SIM_USB_DT_INTERFACE        0x04
+#define SIM_USB_DT_ENDPOINT         0x05
+/* link delays are busy-waited below this duration (ns) */
+#define SIM_USB_SPIN_NS 200000ULL
+
+/* receive FIFO armed by the device on an OUT endpoint */
+typedef struct {
+    uint8_t  *dst;
+    uint32_t  size;
+    uint32_t  received;
+    bool      armed;
+} sim_ep_out_t;
+
+/* data given by the device on an IN endpoint */
+typedef struct {
+    const uint8_t *src;
+    uint32_t       size;
+    uint32_t       sent;
+    bool           pending;
+    /* small transfers (e.g. CSW) are copied, as the device may give a
+     * buffer allocated on its stack */
+    uint8_t        copy[SIM_USB_MPSIZE];
+} sim_ep_in_t;
+
+typedef enum {
+    SIM_EVENT_OUT,
+    SIM_EVENT_IN,
+    SIM_EVENT_SETUP,
+} sim_event_type_t;
+
+typedef struct {
+    uint8_t             type;
+    uint8_t             ep;
+    uint32_t            size;
+    usbctrl_setup_pkt_t pkt;
+} sim_event_t;
+
+typedef struct {
+    pthread_mutex_t      lock;
+    pthread_cond_t       host_cond;     /* endpoint state changed */
+    pthread_cond_t       isr_cond;      /* event queued */
+    pthread_cond_t       wake_cond;     /* ISR executed */
+    pthread_t            isr_thread;
+    bool                 running;
+    uint32_t             isr_count;
+    usbctrl_interface_t *iface;
+    sim_ep_out_t         out[SIM_USB_MAX_EP];
+    sim_ep_in_t          in[SIM_USB_MAX_EP];
+    sim_event_t          events[SIM_USB_MAX_EVENTS];
+    uint32_t             ev_head;
+    uint32_t             ev_tail;
+    /* control endpoint */
+    uint8_t              ctrl_data[SIM_USB_CTRL_SIZE];
+    uint32_t             ctrl_len;
+    bool                 ctrl_complete;
+    bool                 ctrl_stall;
+    /* link model */
+    uint32_t             bandwidth;
+    uint32_t             latency;
+    uint64_t             bus_time;
+} sim_usb_context_t;
+
+static sim_usb_context_t sim_ctx = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .running = false,
+    .iface = NULL,
+    .bandwidth = 0,
+    .latency = 0,
+    .bus_time = 0,
+};
+
+/*
+ * Time helpers
+ */
+static uint64_t sim_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sim_deadline(struct timespec *ts, uint32_t ms)
+{
+    uint64_t t = sim_now_ns() + (uint64_t)ms * 1000000ULL;
+
+    ts->tv_sec = (time_t)(t / 1000000000ULL);
+    ts->tv_nsec = (long)(t % 1000000000ULL);
+}
+
+/* wait on a condition, with the context lock held. Returns false on
+ * timeout */
+static bool sim_wait(pthread_cond_t *cond, const struct timespec *deadline)
+{
+    return pthread_cond_timedwait(cond, &sim_ctx.lock, deadline) == 0;
+}
+
+/*
+ * Link model: each transfer occupies the bus for the link latency plus its
+ * transfer time, and is completed at the end of this period. Transfers are
+ * scheduled back to back on the bus timeline, so that the sleep overshoots
+ * do not accumulate. Called by the host thread with the context lock held.
+ */
+static void sim_link_delay(uint32_t bytes)
+{
+    uint64_t now;
+    uint64_t end;
+    struct timespec ts;
+
+    if (sim_ctx.bandwidth == 0 && sim_ctx.latency == 0) {
+        return;
+    }
+    now = sim_now_ns();
+    if (sim_ctx.bus_time < now) {
+        /* idle link */
+        sim_ctx.bus_time = now;
+    }
+    sim_ctx.bus_time += (uint64_t)sim_ctx.latency * 1000ULL;
+    if (sim_ctx.bandwidth != 0) {
+        sim_ctx.bus_time += (uint64_t)bytes * 1000000000ULL / sim_ctx.bandwidth;
+    }
+    end = sim_ctx.bus_time;
+    pthread_mutex_unlock(&sim_ctx.lock);
+    /* sleeping is too coarse for the end of the period */
+    if (end > now + SIM_USB_SPIN_NS) {
+        end -= SIM_USB_SPIN_NS;
+        ts.tv_sec = (time_t)(end / 1000000000ULL);
+        ts.tv_nsec = (long)(end % 1000000000ULL);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        end += SIM_USB_SPIN_NS;
+    }
+    while (sim_now_ns() < end) {
+        ;
+    }
+    pthread_mutex_lock(&sim_ctx.lock);
+}
+
+void sim_usb_set_link(uint32_t bandwidth, uint32_t latency)
+{
+    pthread_mutex_lock(&sim_ctx.lock);
+    sim_ctx.bandwidth = bandwidth;
+    sim_ctx.latency = latency;
+    pthread_mutex_unlock(&sim_ctx.lock);
+}
+
+/*
+ * ISR thread
+ */
+
+/* queue an event, with the context lock held */
+static void sim_push_event(uint8_t type, uint8_t ep, uint32_t size,
+                           const usbctrl_setup_pkt_t *pkt)
+{
+    sim_event_t *ev;
+
+    while (sim_ctx.ev_head - sim_ctx.ev_tail == SIM_USB_MAX_EVENTS) {
+        pthread_cond_wait(&sim_ctx.host_cond, &sim_ctx.lock);
+    }
+    ev = &sim_ctx.events[sim_ctx.ev_head % SIM_USB_MAX_EVENTS];
+    ev->type = type;
+    ev->ep = ep;
+    ev->size = size;
+    if (pkt != NULL) {
+        ev->pkt = *pkt;
+    }
+    sim_ctx.ev_head++;
+    pthread_cond_signal(&sim_ctx.isr_cond);
+}
+
+static usb_ioep_handler_t sim_get_handler(uint8_t ep, usb_ep_dir_t dir)
+{
+    usbctrl_interface_t *iface = sim_ctx.iface;
+    uint8_t i;
+
+    if (iface == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < iface->usb_ep_number && i < MAX_EP_PER_INTERFACE; i++) {
+        if (iface->eps[i].ep_num == ep &&
+            (iface->eps[i].dir == dir || iface->eps[i].dir == USB_EP_DIR_BOTH)) {
+            return iface->eps[i].handler;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Configuration descriptor, as built by libusbctrl from the declared
+ * interface: the class specific descriptors of the interface follow the
+ * interface descriptor, before the endpoint descriptors.
+ */
+static mbed_error_t sim_config_desc(uint8_t *buf, uint32_t size, uint32_t *len)
+{
+    usbctrl_interface_t *iface = sim_ctx.iface;
+    usb_ep_infos_t *ep;
+    uint32_t pos = 18;
+    uint32_t desc_size;
+    uint8_t i;
+
+    if (iface == NULL || size < pos) {
+        return MBED_ERROR_INVSTATE;
+    }
+    /* configuration and interface descriptors */
+    memset(buf, 0, pos);
+    buf[0] = 9;
+    buf[1] = SIM_USB_DT_CONFIG;
+    buf[4] = 1;     /* bNumInterfaces */
+    buf[5] = 1;     /* bConfigurationValue */
+    buf[7] = 0x80;  /* bus powered */
+    buf[8] = 50;    /* 100 mA */
+    buf[9] = 9;
+    buf[10] = SIM_USB_DT_INTERFACE;
+    buf[13] = iface->usb_ep_number;
+    buf[14] = iface->usb_class;
+    buf[15] = iface->usb_subclass;
+    buf[16] = iface->usb_protocol;
+    if (iface->class_desc_handler != NULL) {
+        desc_size = size - pos;
+        if (iface->class_desc_handler(0, &buf[pos], &desc_size, 0) != MBED_ERROR_NONE) {
+            return MBED_ERROR_NOMEM;
+        }
+        pos += desc_size;
+    }
+    for (i = 0; i < iface->usb_ep_number && i < MAX_EP_PER_INTERFACE; i++) {
+        ep = &iface->eps[i];
+        if (size - pos < 7) {
+            return MBED_ERROR_NOMEM;
+        }
+        buf[pos] = 7;
+        buf[pos + 1] = SIM_USB_DT_ENDPOINT;
+        buf[pos + 2] = ep->ep_num | ((ep->dir == USB_EP_DIR_IN) ? 0x80 : 0);
+        buf[pos + 3] = ep->type;
+        buf[pos + 4] = (uint8_t)ep->pkt_maxsize;
+        buf[pos + 5] = (uint8_t)(ep->pkt_maxsize >> 8);
+        buf[pos + 6] = 0;
+        pos += 7;
+    }
+    buf[2] = (uint8_t)pos;
+    buf[3] = (uint8_t)(pos >> 8);
+    *len = pos;
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * Standard requests are handled by libusbctrl. Only GET_DESCRIPTOR
+ * (CONFIGURATION) is simulated, for the host to find the endpoints.
+ */
+static mbed_error_t sim_std_request(const usbctrl_setup_pkt_t *pkt)
+{
+    uint8_t desc[SIM_USB_CTRL_SIZE];
+    uint32_t len = 0;
+    mbed_error_t errcode;
+
+    if (pkt->bRequest != SIM_USB_RQST_GET_DESCRIPTOR ||
+        (pkt->wValue >> 8) != SIM_USB_DT_CONFIG) {
+        return MBED_ERROR_UNSUPORTED_CMD;
+    }
+    errcode = sim_config_desc(desc, sizeof(desc), &len);
+    if (errcode != MBED_ERROR_NONE) {
+        return errcode;
+    }
+    return usb_backend_drv_send_data(desc, (len < pkt->wLength) ? len : pkt->wLength, EP0);
+}
+
+static void sim_dispatch(sim_event_t *ev)
+{
+    usb_ioep_handler_t handler;
+    mbed_error_t errcode;
+
+    switch (ev->type) {
+        case SIM_EVENT_OUT:
+        case SIM_EVENT_IN:
+            handler = sim_get_handler(ev->ep, ev->type == SIM_EVENT_OUT ?
+                                      USB_EP_DIR_OUT : USB_EP_DIR_IN);
+            if (handler != NULL) {
+                handler(0, ev->size, ev->ep);
+            }
+            break;
+        case SIM_EVENT_SETUP:
+            errcode = MBED_ERROR_UNSUPORTED_CMD;
+            if ((ev->pkt.bmRequestType & SIM_USB_RQST_TYPE_MASK) == 0) {
+                errcode = sim_std_request(&ev->pkt);
+            } else if (sim_ctx.iface != NULL && sim_ctx.iface->rqst_handler != NULL) {
+                errcode = sim_ctx.iface->rqst_handler(0, &ev->pkt);
+            }
+            pthread_mutex_lock(&sim_ctx.lock);
+            if (errcode != MBED_ERROR_NONE) {
+                /* request not handled: libusbctrl stalls EP0 */
+                sim_ctx.ctrl_stall = true;
+            }
+            sim_ctx.ctrl_complete = true;
+            pthread_mutex_unlock(&sim_ctx.lock);
+            break;
+        default:
+            break;
+    }
+}
+
+static void *sim_isr_thread(void *arg __attribute__((unused)))
+{
+    sim_event_t ev;
+
+    pthread_mutex_lock(&sim_ctx.lock);
+    while (sim_ctx.running) {
+        if (sim_ctx.ev_head == sim_ctx.ev_tail) {
+            pthread_cond_wait(&sim_ctx.isr_cond, &sim_ctx.lock);
+            continue;
+        }
+        ev = sim_ctx.events[sim_ctx.ev_tail % SIM_USB_MAX_EVENTS];
+        sim_ctx.ev_tail++;
+        /* the handlers call back the driver API, which takes the lock */
+        pthread_mutex_unlock(&sim_ctx.lock);
+        sim_dispatch(&ev);
+        pthread_mutex_lock(&sim_ctx.lock);
+        sim_ctx.isr_count++;
+        pthread_cond_broadcast(&sim_ctx.wake_cond);
+        pthread_cond_broadcast(&sim_ctx.host_cond);
+    }
+    pthread_mutex_unlock(&sim_ctx.lock);
+    return NULL;
+}
+
+mbed_error_t sim_usb_start(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sim_ctx.host_cond, &attr);
+    pthread_cond_init(&sim_ctx.isr_cond, &attr);
+    pthread_cond_init(&sim_ctx.wake_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    sim_ctx.running = true;
+    if (pthread_create(&sim_ctx.isr_thread, NULL, sim_isr_thread, NULL) != 0) {
+        sim_ctx.running = false;
+        return MBED_ERROR_INITFAIL;
+    }
+    return MBED_ERROR_NONE;
+}
+
+void sim_usb_stop(void)
+{
+    pthread_mutex_lock(&sim_ctx.lock);
+    if (!sim_ctx.running) {
+        pthread_mutex_unlock(&sim_ctx.lock);
+        return;
+    }
+    sim_ctx.running = false;
+    pthread_cond_signal(&sim_ctx.isr_cond);
+    pthread_mutex_unlock(&sim_ctx.lock);
+    pthread_join(sim_ctx.isr_thread, NULL);
+}
+
+uint8_t sim_usb_get_ep(usb_ep_dir_t dir, uint8_t idx)
+{
+    usbctrl_interface_t *iface = sim_ctx.iface;
+    uint8_t i;
+
+    if (iface == NULL) {
+        return 0;
+    }
+    for (i = 0; i < iface->usb_ep_number && i < MAX_EP_PER_INTERFACE; i++) {
+        if (iface->eps[i].dir != dir) {
+            continue;
+        }
+        if (idx == 0) {
+            return iface->eps[i].ep_num;
+        }
+        idx--;
+    }
+    return 0;
+}
+
+uint32_t sim_usb_isr_count(void)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&sim_ctx.lock);
+    count = sim_ctx.isr_count;
+    pthread_mutex_unlock(&sim_ctx.lock);
+    return count;
+}
+
+void sim_usb_wait_isr(uint32_t count, uint32_t ms)
+{
+    struct timespec deadline;
+
+    sim_deadline(&deadline, ms);
+    pthread_mutex_lock(&sim_ctx.lock);
+    while (sim_ctx.isr_count == count) {
+        if (!sim_wait(&sim_ctx.wake_cond, &deadline)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim_ctx.lock);
+}
+
+void sim_usb_raise_isr(void)
+{
+    pthread_mutex_lock(&sim_ctx.lock);
+    sim_ctx.isr_count++;
+    pthread_cond_broadcast(&sim_ctx.wake_cond);
+    pthread_mutex_unlock(&sim_ctx.lock);
+}
+
+void sim_usb_clear_halt(uint8_t ep)
+{
+    if (ep == 0 || ep >= SIM_USB_MAX_EP) {
+        return;
+    }
+    pthread_mutex_lock(&sim_ctx.lock);
+    sim_ctx.in[ep].pending = false;
+    pthread_mutex_unlock(&sim_ctx.lock);
+}
+
+/*
+ * Host side
+ */
+mbed_error_t sim_host_out(uint8_t ep, const uint8_t *data, uint32_t len,
+                          uint8_t abort_ep, uint32_t *actual)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    sim_ep_out_t *out;
+    struct timespec deadline;
+    uint32_t total = len;
+    uint32_t chunk;
+
+    *actual = 0;
+    if (ep == 0 || ep >= SIM_USB_MAX_EP) {
+        return MBED_ERROR_INVPARAM;
+    }
+    out = &sim_ctx.out[ep];
+    sim_deadline(&deadline, SIM_USB_TIMEOUT);
+    pthread_mutex_lock(&sim_ctx.lock);
+    while (len > 0) {
+        while (!out->armed) {
+            if (abort_ep != 0 && abort_ep < SIM_USB_MAX_EP &&
+                sim_ctx.in[abort_ep].pending) {
+                errcode = MBED_ERROR_INTR;
+                goto err;
+            }
+            if (!sim_wait(&sim_ctx.host_cond, &deadline)) {
+                errcode = MBED_ERROR_BUSY;
+                goto err;
+            }
+        }
+        chunk = out->size - out->received;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(&out->dst[out->received], data, chunk);
+        out->received += chunk;
+        data += chunk;
+        len -= chunk;
+        *actual += chunk;
+        /* the transfer ends when the FIFO is full or on a short packet */
+        if (out->received == out->size ||
+            (len == 0 && (total % SIM_USB_MPSIZE) != 0)) {
+            out->armed = false;
+            sim_link_delay(out->received);
+            sim_push_event(SIM_EVENT_OUT, ep, out->received, NULL);
+        }
+    }
+err:
+    pthread_mutex_unlock(&sim_ctx.lock);
+    return errcode;
+}
+
+mbed_error_t sim_host_in(uint8_t ep, uint8_t *data, uint32_t len, uint8_t abort_ep,
+                         uint32_t *actual)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    sim_ep_in_t *in;
+    struct timespec deadline;
+    uint32_t got = 0;
+    uint32_t chunk;
+
+    if (ep == 0 || ep >= SIM_USB_MAX_EP) {
+        return MBED_ERROR_INVPARAM;
+    }
+    in = &sim_ctx.in[ep];
+    sim_deadline(&deadline, SIM_USB_TIMEOUT);
+    pthread_mutex_lock(&sim_ctx.lock);
+    while (got < len) {
+        while (!in->pending) {
+            if (abort_ep != 0 && abort_ep < SIM_USB_MAX_EP &&
+                sim_ctx.in[abort_ep].pending) {
+                errcode = MBED_ERROR_INTR;
+                goto err;
+            }
+            if (!sim_wait(&sim_ctx.host_cond, &deadline)) {
+                errcode = MBED_ERROR_BUSY;
+                goto err;
+            }
+        }
+        chunk = in->size - in->sent;
+        if (chunk > len - got) {
+            chunk = len - got;
+        }
+        memcpy(&data[got], &in->src[in->sent], chunk);
+        in->sent += chunk;
+        got += chunk;
+        if (in->sent == in->size) {
+            in->pending = false;
+            sim_link_delay(in->size);
+            sim_push_event(SIM_EVENT_IN, ep, in->size, NULL);
+            if ((in->size % SIM_USB_MPSIZE) != 0 || in->size == 0) {
+                /* short packet: end of the host transfer */
+                break;
+            }
+        }
+    }
+err:
+    pthread_mutex_unlock(&sim_ctx.lock);
+    *actual = got;
+    return errcode;
+}
+
+mbed_error_t sim_host_control(const usbctrl_setup_pkt_t *pkt, uint8_t *data,
+                              uint32_t len, uint32_t *actual)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct timespec deadline;
+
+    *actual = 0;
+    sim_deadline(&deadline, SIM_USB_TIMEOUT);
+    pthread_mutex_lock(&sim_ctx.lock);
+    sim_ctx.ctrl_len = 0;
+    sim_ctx.ctrl_complete = false;
+    sim_ctx.ctrl_stall = false;
+    sim_push_event(SIM_EVENT_SETUP, EP0, 0, pkt);
+    while (!sim_ctx.ctrl_complete) {
+        if (!sim_wait(&sim_ctx.host_cond, &deadline)) {
+            errcode = MBED_ERROR_BUSY;
+            goto err;
+        }
+    }
+    if (sim_ctx.ctrl_stall) {
+        errcode = MBED_ERROR_UNSUPORTED_CMD;
+        goto err;
+    }
+    if (len > sim_ctx.ctrl_len) {
+        len = sim_ctx.ctrl_len;
+    }
+    if (data != NULL) {
+        memcpy(data, sim_ctx.ctrl_data, len);
+        *actual = len;
+    }
+err:
+    pthread_mutex_unlock(&sim_ctx.lock);
+    return errcode;
+}
+
+/*
+ * libusbctrl and USB backend driver API
+ */
+mbed_error_t usbctrl_declare_interface(uint32_t usbdci_handler __attribute__((unused)),
+                                       usbctrl_interface_t *iface)
+{
+    if (iface == NULL || iface->usb_ep_number > MAX_EP_PER_INTERFACE) {
+        return MBED_ERROR_INVPARAM;
+    }
+    pthread_mutex_lock(&sim_ctx.lock);
+    sim_ctx.iface = iface;
+    pthread_mutex_unlock(&sim_ctx.lock);
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usb_backend_drv_send_data(uint8_t *src, uint32_t size, uint8_t ep)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    sim_ep_in_t *in;
+
+    if (ep >= SIM_USB_MAX_EP) {
+        return MBED_ERROR_INVPARAM;
+    }
+    pthread_mutex_lock(&sim_ctx.lock);
+    if (ep == EP0) {
+        if (size > SIM_USB_CTRL_SIZE) {
+            size = SIM_USB_CTRL_SIZE;
+        }
+        memcpy(sim_ctx.ctrl_data, src, size);
+        sim_ctx.ctrl_len = size;
+        goto err;
+    }
+    in = &sim_ctx.in[ep];
+    if (in->pending) {
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    if (size <= sizeof(in->copy)) {
+        memcpy(in->copy, src, size);
+        src = in->copy;
+    }
+    in->src = src;
+    in->size = size;
+    in->sent = 0;
+    in->pending = true;
+    pthread_cond_broadcast(&sim_ctx.host_cond);
+err:
+    pthread_mutex_unlock(&sim_ctx.lock);
+    return errcode;
+}
+
+mbed_error_t usb_backend_drv_send_zlp(uint8_t ep)
+{
+    static uint8_t zlp;
+
+    return usb_backend_drv_send_data(&zlp, 0, ep);
+}
+
+mbed_error_t usb_backend_drv_set_recv_fifo(uint8_t *dst, uint32_t size, uint8_t ep)
+{
+    sim_ep_out_t *out;
+
+    if (ep == 0 || ep >= SIM_USB_MAX_EP || size == 0) {
+        return MBED_ERROR_INVPARAM;
+    }
+    pthread_mutex_lock(&sim_ctx.lock);
+    out = &sim_ctx.out[ep];
+    out->dst = dst;
+    out->size = size;
+    out->received = 0;
+    out->armed = false;
+    pthread_mutex_unlock(&sim_ctx.lock);
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usb_backend_drv_activate_endpoint(uint8_t ep, usb_backend_drv_ep_dir_t dir)
+{
+    if (ep >= SIM_USB_MAX_EP) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (ep == 0 || dir != USB_BACKEND_DRV_EP_DIR_OUT) {
+        return MBED_ERROR_NONE;
+    }
+    pthread_mutex_lock(&sim_ctx.lock);
+    if (sim_ctx.out[ep].dst != NULL) {
+        sim_ctx.out[ep].armed = true;
+        pthread_cond_broadcast(&sim_ctx.host_cond);
+    }
+    pthread_mutex_unlock(&sim_ctx.lock);
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usb_backend_drv_ack(uint8_t ep __attribute__((unused)),
+                                 usb_backend_drv_ep_dir_t dir __attribute__((unused)))
+{
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usb_backend_drv_stall(uint8_t ep, usb_backend_drv_ep_dir_t dir __attribute__((unused)))
+{
+    if (ep == EP0) {
+        pthread_mutex_lock(&sim_ctx.lock);
+        sim_ctx.ctrl_stall = true;
+        pthread_mutex_unlock(&sim_ctx.lock);
+    }
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * Syscalls
+ */
+e_syscall_ret sys_yield(void)
+{
+    sched_yield();
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_sleep(uint32_t time, sleep_mode_t mode)
+{
+    struct timespec deadline;
+    uint32_t count;
+
+    sim_deadline(&deadline, time);
+    pthread_mutex_lock(&sim_ctx.lock);
+    count = sim_ctx.isr_count;
+    while (mode != SLEEP_MODE_INTERRUPTIBLE || sim_ctx.isr_count == count) {
+        if (!sim_wait(&sim_ctx.wake_cond, &deadline)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim_ctx.lock);
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_get_systick(uint64_t *val, e_tick_type type)
+{
+    uint64_t now = sim_now_ns();
+
+    switch (type) {
+        case PREC_MILLI:
+            *val = now / 1000000ULL;
+            break;
+        case PREC_MICRO:
+            *val = now / 1000ULL;
+            break;
+        case PREC_CYCLE:
+            *val = now;
+            break;
+        default:
+            return SYS_E_INVAL;
+    }
+    return SYS_E_DONE;
+}
@@ -0,0 +1,114 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef SIM_USB_H
+#define SIM_USB_H
+
+#include "libc/types.h"
+#include "libusbctrl.h"
+
+/*
+ * Simulated USB device controller.
+ *
+ * The usb_backend_drv_* functions called by the USB MSC stack only record
+ * the endpoint configuration (receive FIFO armed, data to send). Transfers
+ * are executed by the host side functions below, called from the host
+ * thread. Their completion is notified to the stack by the simulated ISR
+ * thread, which calls the endpoint handlers asynchronously, as the USB
+ * driver does on the target.
+ */
+
+/* maximum packet size of the bulk endpoints (high speed) */
+#define SIM_USB_MPSIZE 512
+
+/* maximum time the host waits for the device to arm an endpoint (ms) */
+#define SIM_USB_TIMEOUT 5000
+
+mbed_error_t sim_usb_start(void);
+
+void sim_usb_stop(void);
+
+/*
+ * Set the link model: bandwidth in bytes per second (0: unlimited) and
+ * latency in microseconds, paid by each bulk transfer.
+ */
+void sim_usb_set_link(uint32_t bandwidth, uint32_t latency);
+
+/*
+ * Get the number of the idx-th endpoint of the given direction of the
+ * declared interface, or 0 if it does not exist.
+ */
+uint8_t sim_usb_get_ep(usb_ep_dir_t dir, uint8_t idx);
+
+/*
+ * Number of simulated ISRs executed so far, and wait for at most ms
+ * milliseconds until it differs from count. This lets the device main loop
+ * sleep when it is idle without missing an event.
+ */
+uint32_t sim_usb_isr_count(void);
+
+void sim_usb_wait_isr(uint32_t count, uint32_t ms);
+
+/*
+ * Signal an ISR executed out of the USB ISR thread (e.g. a storage backend
+ * completion).
+ */
+void sim_usb_raise_isr(void);
+
+/*
+ * Drop the data pending on an IN endpoint, as done by the host reset
+ * recovery (CLEAR_FEATURE(ENDPOINT_HALT)).
+ */
+void sim_usb_clear_halt(uint8_t ep);
+
+/*
+ * Host OUT transfer of len bytes on the given endpoint. The data is split
+ * into the successive receive FIFOs armed by the device. The number of bytes
+ * sent is returned in actual.
+ * If abort_ep is not 0 and the device gives data on this IN endpoint while
+ * the host waits for a receive FIFO, the device is considered as having
+ * ended the data phase (as with a stall) and MBED_ERROR_INTR is returned.
+ */
+mbed_error_t sim_host_out(uint8_t ep, const uint8_t *data, uint32_t len,
+                          uint8_t abort_ep, uint32_t *actual);
+
+/*
+ * Host IN transfer of at most len bytes on the given endpoint. The transfer
+ * ends when len bytes are received or on a short packet. The number of bytes
+ * received is returned in actual.
+ * If abort_ep is not 0 and the device gives data on this other IN endpoint
+ * while the host waits for data, MBED_ERROR_INTR is returned.
+ */
+mbed_error_t sim_host_in(uint8_t ep, uint8_t *data, uint32_t len, uint8_t abort_ep,
+                         uint32_t *actual);
+
+/*
+ * Host control request, with an optional IN data stage of at most len
+ * bytes. Returns MBED_ERROR_UNSUPORTED_CMD if the request is stalled.
+ * Standard requests are answered as libusbctrl does: only GET_DESCRIPTOR
+ * (CONFIGURATION) is supported.
+ */
+mbed_error_t sim_host_control(const usbctrl_setup_pkt_t *pkt, uint8_t *data,
+                              uint32_t len, uint32_t *actual);
+
+#endif /* SIM_USB_H */
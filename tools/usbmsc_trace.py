@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+#
+# Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+#   - Ryad     Benadjila
+#   - Arnauld  Michelizza
+#   - Mathieu  Renard
+#   - Philippe Thierry
+#   - Philippe Trebuchet
+#
+# This package is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published
+# the Free Software Foundation; either version 2.1 of the License, or (at
+# ur option) any later version.
+#
+# This package is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+# PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License along
+# with this package; if not, write to the Free Software Foundation, Inc., 51
+# Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+#
+"""Decoder of the libusbmsc binary event trace.
+
+The input is a sequence of usbmsc_trace_record_t records, as copied by
+usbmsc_trace_read(), in the target byte order (little endian by default).
+Each record is printed with its time, relative to the first record, and
+the time elapsed since the previous one. With --commands, one line per
+command is printed instead, from its CBW to its CSW.
+
+usage: usbmsc_trace.py [-f HZ] [-b] [-c] FILE
+"""
+
+import argparse
+import struct
+import sys
+
+# usbmsc_trace_record_t: seq, stamp, event, arg8, arg16, arg32
+RECORD = struct.Struct("<IIBBHI")
+
+EVENTS = {
+    1: "CBW",
+    2: "CSW",
+    3: "SENSE",
+    4: "DATA_IN",
+    5: "DATA_OUT",
+    6: "DATA_SENT",
+    7: "DATA_RECEIVED",
+    8: "BACKEND_READ",
+    9: "BACKEND_WRITE",
+    10: "BACKEND_DONE",
+    11: "STATE",
+    12: "RESET",
+    13: "DROP",
+}
+
+OPCODES = {
+    0x00: "TEST_UNIT_READY", 0x03: "REQUEST_SENSE", 0x04: "FORMAT_UNIT",
+    0x08: "READ_6", 0x0a: "WRITE_6", 0x12: "INQUIRY", 0x15: "MODE_SELECT_6",
+    0x1a: "MODE_SENSE_6", 0x1b: "START_STOP_UNIT", 0x1d: "SEND_DIAGNOSTIC",
+    0x1e: "PREVENT_ALLOW_MEDIUM_REMOVAL", 0x23: "READ_FORMAT_CAPACITIES",
+    0x25: "READ_CAPACITY_10", 0x28: "READ_10", 0x2a: "WRITE_10",
+    0x2f: "VERIFY_10", 0x35: "SYNCHRONIZE_CACHE_10", 0x41: "WRITE_SAME_10",
+    0x42: "UNMAP", 0x55: "MODE_SELECT_10", 0x5a: "MODE_SENSE_10",
+    0x88: "READ_16", 0x8a: "WRITE_16", 0x8f: "VERIFY_16",
+    0x91: "SYNCHRONIZE_CACHE_16", 0x93: "WRITE_SAME_16",
+    0x9e: "READ_CAPACITY_16", 0xa0: "REPORT_LUNS", 0xa8: "READ_12",
+    0xaa: "WRITE_12",
+}
+
+STATES = {0: "IDLE", 1: "ERROR"}
+
+SENSE_KEYS = {
+    0x0: "NO_SENSE", 0x1: "RECOVERED_ERROR", 0x2: "NOT_READY",
+    0x3: "MEDIUM_ERROR", 0x4: "HARDWARE_ERROR", 0x5: "ILLEGAL_REQUEST",
+    0x6: "UNIT_ATTENTION", 0x7: "DATA_PROTECT", 0xb: "ABORTED_COMMAND",
+    0xe: "MISCOMPARE",
+}
+
+
+def opcode_name(opcode):
+    return OPCODES.get(opcode, "0x%02x" % opcode)
+
+
+def describe(event, arg8, arg16, arg32):
+    """Human readable arguments of an event."""
+    if event == 1:
+        return "%s lun %u len/tag %u" % (opcode_name(arg8), arg16, arg32)
+    if event == 2:
+        return "status %u residue %u" % (arg8, arg32)
+    if event == 3:
+        return "%s asc 0x%02x ascq 0x%02x" % (SENSE_KEYS.get(arg8, "0x%x" % arg8),
+                                              arg16 >> 8, arg16 & 0xff)
+    if event in (4, 5, 6, 7):
+        return "%u bytes" % arg32
+    if event in (8, 9):
+        return "lba %u sectors %u%s" % (arg32, arg16, "+" if arg16 == 0xffff else "")
+    if event == 10:
+        return "status %u" % arg32
+    if event == 11:
+        return "%s -> %s" % (STATES.get(arg16, str(arg16)), STATES.get(arg8, str(arg8)))
+    if event == 13:
+        return opcode_name(arg8)
+    return ""
+
+
+def load(path, byteorder):
+    record = RECORD if byteorder == "<" else struct.Struct(">IIBBHI")
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) % record.size:
+        sys.stderr.write("%s: %u trailing bytes ignored\n" % (path, len(data) % record.size))
+    return [record.unpack_from(data, off)
+            for off in range(0, len(data) - record.size + 1, record.size)]
+
+
+def print_events(records, hz):
+    prev_seq = None
+    first = prev = None
+    for seq, stamp, event, arg8, arg16, arg32 in records:
+        if prev_seq is not None and seq != prev_seq + 1:
+            print("-- %u records lost --" % (seq - prev_seq - 1))
+        if first is None:
+            first = prev = stamp
+        # the stamps are the low 32 bits of the cycle counter
+        elapsed = ((stamp - first) & 0xffffffff) * 1e6 / hz
+        delta = ((stamp - prev) & 0xffffffff) * 1e6 / hz
+        print("%8u %12.3f %+10.3f  %-14s %s" % (seq, elapsed, delta,
+                                               EVENTS.get(event, "EVENT_%u" % event),
+                                               describe(event, arg8, arg16, arg32)))
+        prev_seq = seq
+        prev = stamp
+
+
+def print_commands(records, hz):
+    cbw = None
+    for seq, stamp, event, arg8, arg16, arg32 in records:
+        if event == 1:
+            if cbw is not None:
+                print("%8u %-30s no status" % (cbw[0], opcode_name(cbw[2])))
+            cbw = (seq, stamp, arg8, 0, None)
+        elif event in (6, 7) and cbw is not None:
+            cbw = (cbw[0], cbw[1], cbw[2], cbw[3] + arg32, cbw[4])
+        elif event == 3 and cbw is not None:
+            cbw = (cbw[0], cbw[1], cbw[2], cbw[3], SENSE_KEYS.get(arg8, "0x%x" % arg8))
+        elif event == 2 and cbw is not None:
+            duration = ((stamp - cbw[1]) & 0xffffffff) * 1e6 / hz
+            print("%8u %-30s %10.3f us %10u bytes  status %u%s" %
+                  (cbw[0], opcode_name(cbw[2]), duration, cbw[3], arg8,
+                   (" " + cbw[4]) if cbw[4] else ""))
+            cbw = None
+        elif event == 12:
+            print("%8u RESET" % seq)
+            cbw = None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="libusbmsc trace decoder")
+    parser.add_argument("file", help="binary trace, as read by usbmsc_trace_read()")
+    parser.add_argument("-f", "--frequency", type=float, default=1e9,
+                        help="cycle counter frequency in Hz (default 1e9: "
+                             "nanoseconds, as in the host simulation)")
+    parser.add_argument("-b", "--big-endian", action="store_true",
+                        help="records in big endian byte order")
+    parser.add_argument("-c", "--commands", action="store_true",
+                        help="one line per command: duration, data, status")
+    args = parser.parse_args()
+
+    records = load(args.file, ">" if args.big_endian else "<")
+    if args.commands:
+        print_commands(records, args.frequency)
+    else:
+        print_events(records, args.frequency)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
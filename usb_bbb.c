@@ -31,10 +31,16 @@
 #include "libc/sync.h"
 #include "api/libusbmsc.h"
 #include "usb_control_mass_storage.h"
+#include "scsi_latency.h"
+#include "scsi_trace.h"
 #ifdef __FRAMAC__
 # include "usbmsc_framac_private.h"
 #endif
 
+/* with the UAS transport, the entry points of usb_bbb.h are implemented
+ * by usb_uas.c */
+#if !CONFIG_USR_LIB_MASSSTORAGE_UAS
+
 #define BBB_DEBUG CONFIG_USR_LIB_MASSSTORAGE_BBB_DEBUG
 
 #if BBB_DEBUG
@@ -43,6 +49,13 @@
 # define log_printf(...)
 #endif
 
+/* messages of the per-transfer paths, replaced by trace events */
+#if BBB_DEBUG && !CONFIG_USR_LIB_MASSSTORAGE_TRACE
+# define log_transfer_printf(...) printf(__VA_ARGS__)
+#else
+# define log_transfer_printf(...)
+#endif
+
 
 
 #ifndef __FRAMAC__
@@ -104,9 +117,6 @@ struct scsi_cbw cbw;
 #endif
 
 #ifdef __FRAMAC__
-/* required for ACSL */
-extern bool reset_requested;
-
 
 /*@
   @ assigns \nothing;
@@ -134,7 +144,7 @@ void read_next_cmd(void)
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates);
   @ requires \valid_read(bbb_ctx.iface.eps + (0 .. 1));
-  @ assigns GHOST_opaque_drv_privates, bbb_ctx.tag, bbb_ctx.state, scsi_ctx.queue_empty, queued_cdb, reset_requested;
+  @ assigns GHOST_opaque_drv_privates, bbb_ctx.tag, bbb_ctx.state, scsi_ctx.queue.head, cdb_queue[0 .. SCSI_CMD_QUEUE_DEPTH-1], lun_queue[0 .. SCSI_CMD_QUEUE_DEPTH-1];
 
   @ behavior invinput:
   @    assumes (size != sizeof(cbw) || cbw.sig != USB_BBB_CBW_SIG || cbw.flags.reserved != 0 || cbw.lun.reserved != 0 || cbw.cdb_len.reserved != 0 || cbw.lun.lun >= CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS);
@@ -159,7 +169,7 @@ static
 mbed_error_t usb_bbb_cmd_received(uint32_t size)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    log_printf("[USB BBB] %s: %dB\n", __func__, size);
+    log_transfer_printf("[USB BBB] %s: %dB\n", __func__, size);
 
     if (size != sizeof(struct scsi_cbw)) {
 	    log_printf("[USB BBB] %s: CBW not valid, size %d, should be %d\n", __func__ , size, sizeof(struct scsi_cbw));
@@ -187,6 +197,7 @@ mbed_error_t usb_bbb_cmd_received(uint32_t size)
     }
     set_u32_with_membarrier(&bbb_ctx.tag, cbw.tag);
     set_u8_with_membarrier(&bbb_ctx.state, USB_BBB_STATE_CMD);
+    scsi_trace(USBMSC_TRACE_CBW, cbw.cdb[0], cbw.lun.lun, cbw.transfer_len);
 #ifndef __FRAMAC__
     if(handler_sanity_check_with_panic((physaddr_t)bbb_ctx.cb_cmd_received)){
         goto err;
@@ -194,7 +205,7 @@ mbed_error_t usb_bbb_cmd_received(uint32_t size)
 #endif
     /*@ assert bbb_ctx.cb_cmd_received \in {scsi_parse_cdb} ;*/
     /*@ calls scsi_parse_cdb ; */
-    bbb_ctx.cb_cmd_received(cbw.cdb, cbw.cdb_len.cdb_len);
+    bbb_ctx.cb_cmd_received(cbw.cdb, cbw.cdb_len.cdb_len, cbw.lun.lun);
 err:
     return errcode;
 }
@@ -202,8 +213,8 @@ err:
 /*@
   @ requires \separated(&cbw, &bbb_ctx,&GHOST_opaque_drv_privates);
   @ requires \valid_read(bbb_ctx.iface.eps + (0 .. 1));
-  @ assigns GHOST_opaque_drv_privates, bbb_ctx.tag, bbb_ctx.state, scsi_ctx.queue_empty, scsi_ctx.size_to_process,
-        scsi_ctx.line_state, queued_cdb, scsi_ctx.state, reset_requested, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state,
+  @ assigns GHOST_opaque_drv_privates, bbb_ctx.tag, bbb_ctx.state, scsi_ctx.queue.head, scsi_ctx.size_to_process,
+        scsi_ctx.line_state, cdb_queue[0 .. SCSI_CMD_QUEUE_DEPTH-1], lun_queue[0 .. SCSI_CMD_QUEUE_DEPTH-1], scsi_ctx.state, GHOST_in_eps[bbb_ctx.iface.eps[1].ep_num].state,
         scsi_ctx.direction;
   */
 #ifndef __FRAMAC__
@@ -215,7 +226,7 @@ mbed_error_t usb_bbb_data_received(uint32_t dev_id __attribute__((unused)),
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
 
-    log_printf("[USB BBB] %s (state: %x)\n", __func__, bbb_ctx.state);
+    log_transfer_printf("[USB BBB] %s (state: %x)\n", __func__, bbb_ctx.state);
     switch (bbb_ctx.state) {
         case USB_BBB_STATE_READY:
             errcode = usb_bbb_cmd_received(size);
@@ -229,6 +240,7 @@ mbed_error_t usb_bbb_data_received(uint32_t dev_id __attribute__((unused)),
                 goto err;
             }
 #endif
+            scsi_trace(USBMSC_TRACE_DATA_RECEIVED, 0, 0, size);
             /*@ assert bbb_ctx.cb_data_received \in {scsi_data_available} ;*/
             /*@ calls scsi_data_available ; */
             bbb_ctx.cb_data_received(size);
@@ -250,10 +262,10 @@ err:
 static
 #endif
 mbed_error_t usb_bbb_data_sent(uint32_t dev_id __attribute__((unused)),
-                               uint32_t size __attribute__((unused)),
+                               uint32_t size,
                                uint8_t ep __attribute__((unused)))
 {
-    log_printf("[USB BBB] %s (state: %x)\n", __func__, bbb_ctx.state);
+    log_transfer_printf("[USB BBB] %s (state: %x)\n", __func__, bbb_ctx.state);
     switch (bbb_ctx.state) {
 	    case USB_BBB_STATE_STATUS:
             read_next_cmd();
@@ -264,6 +276,7 @@ mbed_error_t usb_bbb_data_sent(uint32_t dev_id __attribute__((unused)),
                 goto err;
             }
 #endif
+            scsi_trace(USBMSC_TRACE_DATA_SENT, 0, 0, size);
             /*@ assert bbb_ctx.cb_data_sent \in {scsi_data_sent} ;*/
             /*@ calls scsi_data_sent ; */
             bbb_ctx.cb_data_sent();
@@ -399,7 +412,7 @@ predicate valid_iface_handlers(usbctrl_interface_t *iface) =
   */
 void usb_bbb_send_csw(uint8_t status, uint32_t data_residue)
 {
-    log_printf("[USB BBB] %s: status %d\n", __func__, status);
+    log_transfer_printf("[USB BBB] %s: status %d\n", __func__, status);
     mbed_error_t errcode = MBED_ERROR_NONE;
     struct scsi_csw csw = {
         .sig = USB_BBB_CSW_SIG,
@@ -409,7 +422,11 @@ void usb_bbb_send_csw(uint8_t status, uint32_t data_residue)
     };
 
     set_u8_with_membarrier(&bbb_ctx.state, USB_BBB_STATE_STATUS);
-    log_printf("[USB BBB] %s: Sending CSW (%x, %x, %x, %x)\n", __func__, csw.sig,
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+    scsi_latency_end();
+#endif
+    scsi_trace(USBMSC_TRACE_CSW, status, 0, data_residue);
+    log_transfer_printf("[USB BBB] %s: Sending CSW (%x, %x, %x, %x)\n", __func__, csw.sig,
             csw.tag, csw.data_residue, csw.status);
     errcode = usb_backend_drv_send_data((uint8_t *) & csw, sizeof(csw), bbb_ctx.iface.eps[1].ep_num);
     if (errcode != MBED_ERROR_NONE) {
@@ -425,8 +442,12 @@ void usb_bbb_send_csw(uint8_t status, uint32_t data_residue)
   */
 void usb_bbb_send(const uint8_t * src, uint32_t size)
 {
-    log_printf("[USB BBB] %s: %dB\n", __func__, size);
+    log_transfer_printf("[USB BBB] %s: %dB\n", __func__, size);
     set_u8_with_membarrier(&bbb_ctx.state, USB_BBB_STATE_DATA);
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+    scsi_latency_data();
+#endif
+    scsi_trace(USBMSC_TRACE_DATA_IN, 0, 0, size);
     usb_backend_drv_send_data((uint8_t *)src, size, bbb_ctx.iface.eps[1].ep_num);
 }
 
@@ -437,8 +458,14 @@ void usb_bbb_send(const uint8_t * src, uint32_t size)
   */
 void usb_bbb_recv(uint8_t *dst, uint32_t size)
 {
-    log_printf("[USB BBB] %s: %dB\n", __func__, size);
+    log_transfer_printf("[USB BBB] %s: %dB\n", __func__, size);
     set_u8_with_membarrier(&bbb_ctx.state, USB_BBB_STATE_DATA);
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+    scsi_latency_data();
+#endif
+    scsi_trace(USBMSC_TRACE_DATA_OUT, 0, 0, size);
     usb_backend_drv_set_recv_fifo(dst, size, bbb_ctx.iface.eps[0].ep_num);
     usb_backend_drv_activate_endpoint(bbb_ctx.iface.eps[0].ep_num, USB_BACKEND_DRV_EP_DIR_OUT);
 }
+
+#endif/*!CONFIG_USR_LIB_MASSSTORAGE_UAS*/
@@ -33,7 +33,13 @@
 #define BBB_OUT_EP 2
 #endif
 
-typedef void (*usb_bbb_cb_cmd_received_t)(uint8_t *cdb, uint8_t cdb_len);
+/*
+ * Transport entry points used by the SCSI stack. They are implemented by the
+ * Bulk-Only transport (usb_bbb.c), or by the USB Attached SCSI one
+ * (usb_uas.c) when CONFIG_USR_LIB_MASSSTORAGE_UAS is set.
+ */
+
+typedef void (*usb_bbb_cb_cmd_received_t)(uint8_t *cdb, uint8_t cdb_len, uint8_t lun);
 typedef void (*usb_bbb_cb_data_received_t)(uint32_t size);
 typedef void (*usb_bbb_cb_data_sent_t)(void);
 
@@ -42,7 +48,7 @@ typedef void (*usb_bbb_cb_data_sent_t)(void);
 /**
  * usb_bbb_init - Initialize the bulk only layer
  * @cmd_received: callback called when a command is received. Parameters are the
- * command block and its size.
+ * command block, its size and the addressed LUN.
  * @data_received: callback called when data is received. The parameter is the
  * size of received data.
  * @data_sent: callback called when data has been sent
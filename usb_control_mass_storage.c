@@ -38,6 +38,7 @@
 #include "usb_bbb.h"
 #include "usb_control_mass_storage.h"
 #include "usbmass_desc.h"
+#include "scsi.h"
 #include "libc/syscall.h"
 #include "libc/sanhandlers.h"
 #include "libusbctrl.h"
@@ -49,7 +50,7 @@ static mass_storage_reset_trigger_t ms_reset_trigger = usbmsc_reset_stack;
  * Enumeration phase MS_RESET
  */
 /*@
-  @ assigns \nothing;
+  @ assigns scsi_ctx.queue.reset_mark, scsi_ctx.queue.reset_seq;
   */
 #ifndef __FRAMAC__
 static
@@ -57,6 +58,8 @@ static
 void mass_storage_reset(void)
 {
     log_printf("Bulk-Only Mass Storage Reset\n");
+    /* commands received from now on belong to the new session */
+    scsi_queue_mark_reset();
     if (ms_reset_trigger != NULL) {
         /* Sanity check our callback before calling it */
 #ifndef __FRAMAC__
@@ -89,7 +92,8 @@ void mass_storage_reset(void)
 mbed_error_t mass_storage_class_rqst_handler(uint32_t usbdci_handler __attribute__((unused)),
                                              usbctrl_setup_pkt_t *packet)
 {
-    uint8_t max_lun = 0;
+    /* LUNs are numbered from 0, see usbmsc_get_lun() */
+    uint8_t max_lun = CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS - 1;
     mbed_error_t errcode = MBED_ERROR_NONE;
 
     log_printf("[classRqst] handling MSS class rqst\n");
@@ -0,0 +1,804 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "autoconf.h"
+#include "libc/types.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "libc/nostd.h"
+#include "libc/regutils.h"
+#include "libc/arpa/inet.h"
+#include "libc/syscall.h"
+#include "libc/sanhandlers.h"
+#include "libc/sync.h"
+#include "libusbctrl.h"
+
+#include "api/libusbmsc.h"
+#include "usb_bbb.h"
+#include "usb_uas.h"
+#include "usb_control_mass_storage.h"
+#include "scsi_latency.h"
+#include "scsi_trace.h"
+#include "scsi.h"
+#include "scsi_log.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UAS
+
+/* the Pipe Usage descriptors must follow their endpoint descriptor, which
+ * libusbctrl only supports with the class specific endpoint descriptors (see
+ * the UAS option in Kconfig) */
+#if !CONFIG_USR_LIB_USBCTRL_EP_CLASS_DESC
+# error "the UAS transport requires the class specific endpoint descriptors of libusbctrl"
+#endif
+
+#define UAS_DEBUG CONFIG_USR_LIB_MASSSTORAGE_BBB_DEBUG
+
+#if UAS_DEBUG
+# define log_printf(...) printf(__VA_ARGS__)
+#else
+# define log_printf(...)
+#endif
+
+/* messages of the per-transfer paths, replaced by trace events */
+#if UAS_DEBUG && !CONFIG_USR_LIB_MASSSTORAGE_TRACE
+# define log_transfer_printf(...) printf(__VA_ARGS__)
+#else
+# define log_transfer_printf(...)
+#endif
+
+/* accepted commands, whose SENSE IU has not been sent yet */
+#define UAS_QUEUE_DEPTH  CONFIG_USR_LIB_MASSSTORAGE_CMD_QUEUE_DEPTH
+
+/*
+ * Status IUs of the executed commands waiting for the status pipe: one SENSE
+ * IU per accepted command, and the READ READY or WRITE READY IU of the
+ * command being executed. One slot is kept empty to tell a full ring from an
+ * empty one.
+ */
+#define UAS_STATUS_SLOTS (UAS_QUEUE_DEPTH + 2)
+
+/* biggest IU sent on the status pipe */
+#define UAS_STATUS_IU_MAXLEN sizeof(usb_uas_sense_iu_t)
+
+/* COMMAND IUs with additional CDB bytes are received and rejected */
+#define UAS_CMD_IU_MAXLEN    64
+
+/* endpoints index in the interface */
+#define UAS_EP_COMMAND  0
+#define UAS_EP_STATUS   1
+#define UAS_EP_DATA_IN  2
+#define UAS_EP_DATA_OUT 3
+
+typedef struct {
+    uint8_t  len;
+    bool     ends_cmd;
+    uint8_t  iu[UAS_STATUS_IU_MAXLEN];
+} usb_uas_status_slot_t;
+
+/*
+ * UAS transport context.
+ *
+ * The tags of the accepted commands are kept in the order of their execution
+ * by the SCSI stack. tag_head is written by the command pipe handler (ISR),
+ * tag_exec is the command being executed, and moves to the next one when its
+ * SENSE IU is queued. Both run in [0, 2 * UAS_QUEUE_DEPTH[, as the indexes of
+ * the SCSI commands queue.
+ *
+ * The IUs of the executed commands are queued in the status ring by the
+ * SCSI stack (main thread or ISR, one command at a time), and the RESPONSE
+ * IUs in a single slot by the command pipe handler. They are sent by the
+ * owner of status_lock, i.e. the context which found the status pipe idle,
+ * then by the status pipe completion handler.
+ * outstanding counts the accepted commands whose SENSE IU has not been
+ * sent yet. It is only accessed in ISR context.
+ */
+typedef struct {
+    usbctrl_interface_t         iface;
+    usb_bbb_cb_cmd_received_t   cb_cmd_received;
+    usb_bbb_cb_data_received_t  cb_data_received;
+    usb_bbb_cb_data_sent_t      cb_data_sent;
+    uint16_t                    tags[UAS_QUEUE_DEPTH];
+    uint32_t                    tag_head;
+    uint32_t                    tag_exec;
+    uint32_t                    outstanding;
+    bool                        data_started;
+    bool                        cmd_armed;
+    usb_uas_status_slot_t       status[UAS_STATUS_SLOTS];
+    uint32_t                    status_head;
+    uint32_t                    status_tail;
+    usb_uas_response_iu_t       response;
+    bool                        response_pending;
+    volatile uint32_t           status_lock;
+    bool                        inflight_ends_cmd;
+    uint8_t                     status_tx[UAS_STATUS_IU_MAXLEN] __attribute__((aligned(4)));
+    uint8_t                     cmd_rx[UAS_CMD_IU_MAXLEN] __attribute__((aligned(4)));
+} usb_uas_context_t;
+
+static usb_uas_context_t uas_ctx = { 0 };
+
+static const usb_uas_pipe_usage_desc_t uas_pipe_usage[] = {
+    { sizeof(usb_uas_pipe_usage_desc_t), USB_UAS_DT_PIPE_USAGE, USB_UAS_PIPE_COMMAND, 0 },
+    { sizeof(usb_uas_pipe_usage_desc_t), USB_UAS_DT_PIPE_USAGE, USB_UAS_PIPE_STATUS, 0 },
+    { sizeof(usb_uas_pipe_usage_desc_t), USB_UAS_DT_PIPE_USAGE, USB_UAS_PIPE_DATA_IN, 0 },
+    { sizeof(usb_uas_pipe_usage_desc_t), USB_UAS_DT_PIPE_USAGE, USB_UAS_PIPE_DATA_OUT, 0 },
+};
+
+/*********************************************************************
+ * Tags and status pipe
+ ********************************************************************/
+
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+uint32_t usb_uas_tag_next(uint32_t idx)
+{
+    return (idx + 1) % (2 * UAS_QUEUE_DEPTH);
+}
+
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+uint32_t usb_uas_status_next(uint32_t idx)
+{
+    return (idx + 1) % UAS_STATUS_SLOTS;
+}
+
+/*
+ * The status pipe is shared by the main thread and the USB ISR: it belongs to
+ * the context which sends an IU on it, until the transfer completes.
+ */
+/*@
+  @ assigns uas_ctx.status_lock;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+bool usb_uas_status_trylock(void)
+{
+    return __atomic_exchange_n(&uas_ctx.status_lock, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+/*@
+  @ assigns uas_ctx.status_lock;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+void usb_uas_status_unlock(void)
+{
+    __atomic_store_n(&uas_ctx.status_lock, 0, __ATOMIC_RELEASE);
+}
+
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static inline
+#endif
+bool usb_uas_status_queued(void)
+{
+    request_data_membarrier();
+    return uas_ctx.response_pending || uas_ctx.status_head != uas_ctx.status_tail;
+}
+
+/*
+ * Send the next queued IU, the status pipe being owned by the caller.
+ * RESPONSE IUs go first. Returns false if there is nothing to send.
+ */
+/*@
+  @ assigns uas_ctx.status_tx[0 .. UAS_STATUS_IU_MAXLEN-1], uas_ctx.status_tail,
+            uas_ctx.response_pending, uas_ctx.inflight_ends_cmd;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+bool usb_uas_status_send_next(void)
+{
+    usb_uas_status_slot_t *slot;
+    uint32_t len;
+
+    request_data_membarrier();
+    if (uas_ctx.response_pending) {
+        len = sizeof(usb_uas_response_iu_t);
+        memcpy(uas_ctx.status_tx, &uas_ctx.response, len);
+        uas_ctx.inflight_ends_cmd = false;
+        set_bool_with_membarrier(&uas_ctx.response_pending, false);
+    } else if (uas_ctx.status_head != uas_ctx.status_tail) {
+        slot = &uas_ctx.status[uas_ctx.status_tail];
+        len = slot->len;
+        memcpy(uas_ctx.status_tx, slot->iu, len);
+        uas_ctx.inflight_ends_cmd = slot->ends_cmd;
+        set_u32_with_membarrier(&uas_ctx.status_tail,
+                                usb_uas_status_next(uas_ctx.status_tail));
+    } else {
+        return false;
+    }
+    usb_backend_drv_send_data(uas_ctx.status_tx, len,
+                              uas_ctx.iface.eps[UAS_EP_STATUS].ep_num);
+    return true;
+}
+
+/*
+ * Start the status pipe if it is idle. The emptiness of the queues is checked
+ * again once the pipe is released, as an IU may have been queued by an ISR
+ * in the meantime.
+ */
+/*@
+  @ assigns uas_ctx.status_lock, uas_ctx.status_tx[0 .. UAS_STATUS_IU_MAXLEN-1],
+            uas_ctx.status_tail, uas_ctx.response_pending, uas_ctx.inflight_ends_cmd;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void usb_uas_status_kick(void)
+{
+    do {
+        if (!usb_uas_status_trylock()) {
+            /* the owner sends the queued IUs */
+            return;
+        }
+        if (usb_uas_status_send_next()) {
+            return;
+        }
+        usb_uas_status_unlock();
+    } while (usb_uas_status_queued());
+}
+
+/*
+ * Queue an IU of the command being executed. There is at most one READ READY
+ * or WRITE READY IU and one SENSE IU per accepted command in the ring, which
+ * can't be full.
+ */
+/*@
+  @ requires \valid_read(iu + (0 .. len-1));
+  @ requires len <= UAS_STATUS_IU_MAXLEN;
+  @ assigns uas_ctx.status[0 .. UAS_STATUS_SLOTS-1], uas_ctx.status_head;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void usb_uas_status_push(const void *iu, uint8_t len, bool ends_cmd)
+{
+    usb_uas_status_slot_t *slot;
+    uint32_t head = uas_ctx.status_head;
+
+    if (usb_uas_status_next(head) == uas_ctx.status_tail) {
+        log_printf("[USB UAS] %s: status ring full, IU dropped\n", __func__);
+        return;
+    }
+    slot = &uas_ctx.status[head];
+    memcpy(slot->iu, iu, len);
+    slot->len = len;
+    slot->ends_cmd = ends_cmd;
+    /* the slot content must be visible before it is published */
+    request_data_membarrier();
+    set_u32_with_membarrier(&uas_ctx.status_head, usb_uas_status_next(head));
+    usb_uas_status_kick();
+}
+
+/*
+ * Answer an IU received on the command pipe with a RESPONSE IU, in ISR
+ * context. The command pipe is armed again once it has been sent.
+ */
+/*@
+  @ assigns uas_ctx.response, uas_ctx.response_pending;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void usb_uas_send_response(uint16_t tag, uint8_t code)
+{
+    uas_ctx.response.iu_id = USB_UAS_IU_RESPONSE;
+    uas_ctx.response.reserved1 = 0;
+    uas_ctx.response.tag = tag;
+    uas_ctx.response.additional_response_info[0] = 0;
+    uas_ctx.response.additional_response_info[1] = 0;
+    uas_ctx.response.additional_response_info[2] = 0;
+    uas_ctx.response.response_code = code;
+    set_bool_with_membarrier(&uas_ctx.response_pending, true);
+    usb_uas_status_kick();
+}
+
+/*
+ * Arm the command pipe, unless a RESPONSE IU is pending or all the command
+ * slots are used. Executed in ISR context, or before the first command.
+ */
+/*@
+  @ assigns uas_ctx.cmd_armed;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+void usb_uas_arm_cmd(void)
+{
+    uint8_t ep = uas_ctx.iface.eps[UAS_EP_COMMAND].ep_num;
+
+    if (uas_ctx.cmd_armed || uas_ctx.response_pending ||
+        uas_ctx.outstanding >= UAS_QUEUE_DEPTH) {
+        return;
+    }
+    uas_ctx.cmd_armed = true;
+    usb_backend_drv_set_recv_fifo(uas_ctx.cmd_rx, sizeof(uas_ctx.cmd_rx), ep);
+    usb_backend_drv_activate_endpoint(ep, USB_BACKEND_DRV_EP_DIR_OUT);
+}
+
+/*
+ * Convert a SAM LUN (peripheral device addressing, bus 0) to a LUN number.
+ * Returns false if it doesn't designate one of the exposed LUNs.
+ */
+/*@
+  @ requires \valid_read(lun + (0 .. 7));
+  @ requires \valid(num);
+  @ assigns *num;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+bool usb_uas_decode_lun(const uint8_t *lun, uint8_t *num)
+{
+    uint8_t i;
+
+    if (lun[0] != 0 || lun[1] >= CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS) {
+        return false;
+    }
+    for (i = 2; i < 8; i++) {
+        if (lun[i] != 0) {
+            return false;
+        }
+    }
+    *num = lun[1];
+    return true;
+}
+
+/*
+ * Check that a new tag doesn't designate an accepted command (SAM-5, 5.9:
+ * OVERLAPPED COMMANDS ATTEMPTED).
+ */
+/*@
+  @ assigns \nothing;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+bool usb_uas_tag_in_use(uint16_t tag)
+{
+    uint32_t idx;
+
+    request_data_membarrier();
+    for (idx = uas_ctx.tag_exec; idx != uas_ctx.tag_head; idx = usb_uas_tag_next(idx)) {
+        if (uas_ctx.tags[idx % UAS_QUEUE_DEPTH] == tag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*********************************************************************
+ * Endpoints handlers
+ ********************************************************************/
+
+/*
+ * Command pipe: COMMAND and TASK MANAGEMENT IUs, in ISR context.
+ * Task management functions are not supported: the host falls back to a
+ * device reset to recover from a failed command.
+ */
+/*@
+  @ assigns uas_ctx, GHOST_opaque_drv_privates;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usb_uas_cmd_received(uint32_t dev_id __attribute__((unused)),
+                                         uint32_t size,
+                                         uint8_t ep __attribute__((unused)))
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usb_uas_command_iu_t *cmd = (usb_uas_command_iu_t*)uas_ctx.cmd_rx;
+    uint8_t lun = 0;
+
+    uas_ctx.cmd_armed = false;
+    if (size < sizeof(usb_uas_ready_iu_t)) {
+        log_printf("[USB UAS] %s: IU too short\n", __func__);
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    log_transfer_printf("[USB UAS] %s: IU %x, tag %x\n", __func__, cmd->iu_id, ntohs(cmd->tag));
+    switch (cmd->iu_id) {
+        case USB_UAS_IU_COMMAND:
+            if (size < sizeof(usb_uas_command_iu_t) || cmd->additional_cdb_length != 0) {
+                usb_uas_send_response(cmd->tag, USB_UAS_RC_INVALID_IU);
+                errcode = MBED_ERROR_INVPARAM;
+                goto end;
+            }
+            if (!usb_uas_decode_lun(cmd->lun, &lun)) {
+                usb_uas_send_response(cmd->tag, USB_UAS_RC_INCORRECT_LUN);
+                errcode = MBED_ERROR_INVPARAM;
+                goto end;
+            }
+            if (usb_uas_tag_in_use(cmd->tag)) {
+                usb_uas_send_response(cmd->tag, USB_UAS_RC_OVERLAPPED_TAG);
+                errcode = MBED_ERROR_INVPARAM;
+                goto end;
+            }
+            uas_ctx.tags[uas_ctx.tag_head % UAS_QUEUE_DEPTH] = cmd->tag;
+            request_data_membarrier();
+            set_u32_with_membarrier(&uas_ctx.tag_head, usb_uas_tag_next(uas_ctx.tag_head));
+            uas_ctx.outstanding++;
+            scsi_trace(USBMSC_TRACE_CBW, cmd->cdb[0], lun, ntohs(cmd->tag));
+#ifndef __FRAMAC__
+            if (handler_sanity_check_with_panic((physaddr_t)uas_ctx.cb_cmd_received)) {
+                goto end;
+            }
+#endif
+            /*@ assert uas_ctx.cb_cmd_received \in {scsi_parse_cdb} ;*/
+            /*@ calls scsi_parse_cdb ; */
+            uas_ctx.cb_cmd_received(cmd->cdb, sizeof(cmd->cdb), lun);
+            break;
+        case USB_UAS_IU_TASK_MANAGEMENT:
+            usb_uas_send_response(cmd->tag, USB_UAS_RC_TMF_NOT_SUPPORTED);
+            break;
+        default:
+            usb_uas_send_response(cmd->tag, USB_UAS_RC_INVALID_IU);
+            errcode = MBED_ERROR_INVPARAM;
+            break;
+    }
+end:
+    usb_uas_arm_cmd();
+    return errcode;
+}
+
+/*
+ * Status pipe: an IU has been sent, in ISR context.
+ */
+/*@
+  @ assigns uas_ctx, GHOST_opaque_drv_privates;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usb_uas_status_sent(uint32_t dev_id __attribute__((unused)),
+                                        uint32_t size __attribute__((unused)),
+                                        uint8_t ep __attribute__((unused)))
+{
+    if (uas_ctx.inflight_ends_cmd && uas_ctx.outstanding > 0) {
+        /* the command slot is given back to the host */
+        uas_ctx.outstanding--;
+    }
+    uas_ctx.inflight_ends_cmd = false;
+    usb_uas_status_unlock();
+    usb_uas_status_kick();
+    usb_uas_arm_cmd();
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * Data-in pipe: a chunk has been sent, in ISR context.
+ */
+/*@
+  @ assigns GHOST_opaque_drv_privates, scsi_ctx;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usb_uas_data_sent(uint32_t dev_id __attribute__((unused)),
+                                      uint32_t size,
+                                      uint8_t ep __attribute__((unused)))
+{
+#ifndef __FRAMAC__
+    if (handler_sanity_check((physaddr_t)uas_ctx.cb_data_sent)) {
+        goto err;
+    }
+#endif
+    scsi_trace(USBMSC_TRACE_DATA_SENT, 0, 0, size);
+    /*@ assert uas_ctx.cb_data_sent \in {scsi_data_sent} ;*/
+    /*@ calls scsi_data_sent ; */
+    uas_ctx.cb_data_sent();
+err:
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * Data-out pipe: a chunk has been received, in ISR context.
+ */
+/*@
+  @ assigns GHOST_opaque_drv_privates, scsi_ctx;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usb_uas_data_received(uint32_t dev_id __attribute__((unused)),
+                                          uint32_t size,
+                                          uint8_t ep __attribute__((unused)))
+{
+#ifndef __FRAMAC__
+    if (handler_sanity_check((physaddr_t)uas_ctx.cb_data_received)) {
+        goto err;
+    }
+#endif
+    scsi_trace(USBMSC_TRACE_DATA_RECEIVED, 0, 0, size);
+    /*@ assert uas_ctx.cb_data_received \in {scsi_data_available} ;*/
+    /*@ calls scsi_data_available ; */
+    uas_ctx.cb_data_received(size);
+err:
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * Pipe Usage descriptor of an endpoint. Hosts look for it among the
+ * descriptors following the endpoint descriptor, so it is given to
+ * libusbctrl as a class specific endpoint descriptor, and not as one of the
+ * interface.
+ */
+/*@
+  @ assigns buf[0 .. sizeof(usb_uas_pipe_usage_desc_t)-1], *desc_size;
+  */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usb_uas_ep_class_desc(uint8_t iface_id __attribute__((unused)),
+                                          uint8_t ep_id,
+                                          uint8_t *buf,
+                                          uint32_t *desc_size,
+                                          uint32_t usbdci_handler __attribute__((unused)))
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (buf == NULL || desc_size == NULL || ep_id > UAS_EP_DATA_OUT) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (*desc_size < sizeof(usb_uas_pipe_usage_desc_t)) {
+        errcode = MBED_ERROR_NOMEM;
+        goto err;
+    }
+    memcpy(buf, &uas_pipe_usage[ep_id], sizeof(usb_uas_pipe_usage_desc_t));
+    *desc_size = sizeof(usb_uas_pipe_usage_desc_t);
+err:
+    return errcode;
+}
+
+/*********************************************************************
+ * Transport entry points (see usb_bbb.h)
+ ********************************************************************/
+
+/*
+ * Arm the command pipe, at startup and after a reset.
+ */
+void read_next_cmd(void)
+{
+    log_printf("[USB UAS] %s\n", __func__);
+    usb_uas_arm_cmd();
+}
+
+/*
+ * Queue the SENSE IU of the command being executed. CSW_STATUS_SUCCESS gives
+ * the GOOD status, any other value a CHECK CONDITION with the current sense
+ * data (autosense). The data residue is not reported by UAS.
+ */
+void usb_bbb_send_csw(uint8_t status, uint32_t data_residue __attribute__((unused)))
+{
+    usb_uas_sense_iu_t iu = { 0 };
+    scsi_context_t *ctx = scsi_get_context();
+    uint32_t exec = uas_ctx.tag_exec;
+
+    log_transfer_printf("[USB UAS] %s: status %d\n", __func__, status);
+    if (exec == uas_ctx.tag_head) {
+        /* no command being executed */
+        log_printf("[USB UAS] %s: no command, status dropped\n", __func__);
+        return;
+    }
+    iu.iu_id = USB_UAS_IU_SENSE;
+    iu.tag = uas_ctx.tags[exec % UAS_QUEUE_DEPTH];
+    if (status == CSW_STATUS_SUCCESS) {
+        iu.status = SCSI_STATUS_GOOD;
+        iu.length = 0;
+    } else {
+        iu.status = SCSI_STATUS_CHECK_CONDITION;
+        iu.length = htons(sizeof(request_sense_parameter_data_t));
+        iu.sense.error_code = (ctx->error & SCSI_ERROR_DEFERRED) ? 0x71 : 0x70;
+        iu.sense.sense_key = scsi_error_get_sense_key(ctx->error);
+        iu.sense.additional_sense_length = 0x0a;
+        iu.sense.asc = scsi_error_get_asc(ctx->error);
+        iu.sense.ascq = scsi_error_get_ascq(ctx->error);
+        /* the sense data is delivered with the status */
+        ctx->error = 0;
+    }
+    scsi_trace(USBMSC_TRACE_CSW, status, 0, 0);
+    uas_ctx.data_started = false;
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+    scsi_latency_end();
+#endif
+    set_u32_with_membarrier(&uas_ctx.tag_exec, usb_uas_tag_next(exec));
+    usb_uas_status_push(&iu, sizeof(iu) - ((iu.length == 0) ? sizeof(iu.sense) : 0), true);
+}
+
+/*
+ * Send a data-in chunk. The first chunk of a command is announced by a
+ * READ READY IU.
+ */
+void usb_bbb_send(const uint8_t * src, uint32_t size)
+{
+    usb_uas_ready_iu_t iu = { 0 };
+
+    log_transfer_printf("[USB UAS] %s: %dB\n", __func__, size);
+    if (!uas_ctx.data_started) {
+        uas_ctx.data_started = true;
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+        scsi_latency_data();
+#endif
+        iu.iu_id = USB_UAS_IU_READ_READY;
+        iu.tag = uas_ctx.tags[uas_ctx.tag_exec % UAS_QUEUE_DEPTH];
+        usb_uas_status_push(&iu, sizeof(iu), false);
+    }
+    scsi_trace(USBMSC_TRACE_DATA_IN, 0, 0, size);
+    usb_backend_drv_send_data((uint8_t *)src, size,
+                              uas_ctx.iface.eps[UAS_EP_DATA_IN].ep_num);
+}
+
+/*
+ * Receive a data-out chunk. The first chunk of a command is requested with a
+ * WRITE READY IU, once the data-out pipe is armed.
+ */
+void usb_bbb_recv(uint8_t *dst, uint32_t size)
+{
+    usb_uas_ready_iu_t iu = { 0 };
+    uint8_t ep = uas_ctx.iface.eps[UAS_EP_DATA_OUT].ep_num;
+
+    log_transfer_printf("[USB UAS] %s: %dB\n", __func__, size);
+    scsi_trace(USBMSC_TRACE_DATA_OUT, 0, 0, size);
+    usb_backend_drv_set_recv_fifo(dst, size, ep);
+    usb_backend_drv_activate_endpoint(ep, USB_BACKEND_DRV_EP_DIR_OUT);
+    if (!uas_ctx.data_started) {
+        uas_ctx.data_started = true;
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+        scsi_latency_data();
+#endif
+        iu.iu_id = USB_UAS_IU_WRITE_READY;
+        iu.tag = uas_ctx.tags[uas_ctx.tag_exec % UAS_QUEUE_DEPTH];
+        usb_uas_status_push(&iu, sizeof(iu), false);
+    }
+}
+
+void usb_bbb_declare(usb_bbb_cb_cmd_received_t cmd_received,
+                     usb_bbb_cb_data_received_t data_received,
+                     usb_bbb_cb_data_sent_t data_sent)
+{
+    log_printf("[USB UAS] %s\n", __func__);
+    if (cmd_received == NULL || data_received == NULL) {
+        log_printf("[USB UAS] invalid callbacks value\n");
+        goto err;
+    }
+    uas_ctx.cb_cmd_received = cmd_received;
+    uas_ctx.cb_data_received = data_received;
+    uas_ctx.cb_data_sent = data_sent;
+    request_data_membarrier();
+err:
+    return;
+}
+
+/*
+ * Declare the UAS interface: command (OUT), status (IN), data-in (IN) and
+ * data-out (OUT) pipes.
+ * XXX: the Bulk-Only interface is to be declared as its alternate setting 0,
+ * for the hosts without UAS support, once libusbctrl supports them.
+ */
+mbed_error_t usb_bbb_configure(uint32_t usbdci_handler)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    log_printf("[USB UAS] %s\n", __func__);
+#ifndef __FRAMAC__
+    ADD_LOC_HANDLER(usb_uas_cmd_received)
+    ADD_LOC_HANDLER(usb_uas_status_sent)
+    ADD_LOC_HANDLER(usb_uas_data_sent)
+    ADD_LOC_HANDLER(usb_uas_data_received)
+    ADD_LOC_HANDLER(usb_uas_ep_class_desc)
+    ADD_LOC_HANDLER(mass_storage_class_rqst_handler)
+#endif
+
+    uas_ctx.iface.usb_class = USB_CLASS_MSC_UMS;
+    uas_ctx.iface.usb_subclass = 0x6; /* SCSI transparent cmd set */
+    uas_ctx.iface.usb_protocol = USB_UAS_PROTOCOL;
+    uas_ctx.iface.dedicated = false;
+    uas_ctx.iface.rqst_handler = mass_storage_class_rqst_handler;
+    uas_ctx.iface.class_desc_handler = NULL;
+    uas_ctx.iface.usb_ep_number = 4;
+
+    uas_ctx.iface.eps[UAS_EP_COMMAND].type        = USB_EP_TYPE_BULK;
+    uas_ctx.iface.eps[UAS_EP_COMMAND].dir         = USB_EP_DIR_OUT;
+    uas_ctx.iface.eps[UAS_EP_COMMAND].attr        = USB_EP_ATTR_NO_SYNC;
+    uas_ctx.iface.eps[UAS_EP_COMMAND].usage       = USB_EP_USAGE_DATA;
+    uas_ctx.iface.eps[UAS_EP_COMMAND].pkt_maxsize = 512;
+    uas_ctx.iface.eps[UAS_EP_COMMAND].ep_num      = 1; /* this may be updated by libctrl */
+    uas_ctx.iface.eps[UAS_EP_COMMAND].handler     = usb_uas_cmd_received;
+    uas_ctx.iface.eps[UAS_EP_COMMAND].class_desc_handler = usb_uas_ep_class_desc;
+
+    uas_ctx.iface.eps[UAS_EP_STATUS].type         = USB_EP_TYPE_BULK;
+    uas_ctx.iface.eps[UAS_EP_STATUS].dir          = USB_EP_DIR_IN;
+    uas_ctx.iface.eps[UAS_EP_STATUS].attr         = USB_EP_ATTR_NO_SYNC;
+    uas_ctx.iface.eps[UAS_EP_STATUS].usage        = USB_EP_USAGE_DATA;
+    uas_ctx.iface.eps[UAS_EP_STATUS].pkt_maxsize  = 512;
+    uas_ctx.iface.eps[UAS_EP_STATUS].ep_num       = 2; /* this may be updated by libctrl */
+    uas_ctx.iface.eps[UAS_EP_STATUS].handler      = usb_uas_status_sent;
+    uas_ctx.iface.eps[UAS_EP_STATUS].class_desc_handler = usb_uas_ep_class_desc;
+
+    uas_ctx.iface.eps[UAS_EP_DATA_IN].type        = USB_EP_TYPE_BULK;
+    uas_ctx.iface.eps[UAS_EP_DATA_IN].dir         = USB_EP_DIR_IN;
+    uas_ctx.iface.eps[UAS_EP_DATA_IN].attr        = USB_EP_ATTR_NO_SYNC;
+    uas_ctx.iface.eps[UAS_EP_DATA_IN].usage       = USB_EP_USAGE_DATA;
+    uas_ctx.iface.eps[UAS_EP_DATA_IN].pkt_maxsize = 512;
+    uas_ctx.iface.eps[UAS_EP_DATA_IN].ep_num      = 3; /* this may be updated by libctrl */
+    uas_ctx.iface.eps[UAS_EP_DATA_IN].handler     = usb_uas_data_sent;
+    uas_ctx.iface.eps[UAS_EP_DATA_IN].class_desc_handler = usb_uas_ep_class_desc;
+
+    uas_ctx.iface.eps[UAS_EP_DATA_OUT].type        = USB_EP_TYPE_BULK;
+    uas_ctx.iface.eps[UAS_EP_DATA_OUT].dir         = USB_EP_DIR_OUT;
+    uas_ctx.iface.eps[UAS_EP_DATA_OUT].attr        = USB_EP_ATTR_NO_SYNC;
+    uas_ctx.iface.eps[UAS_EP_DATA_OUT].usage       = USB_EP_USAGE_DATA;
+    uas_ctx.iface.eps[UAS_EP_DATA_OUT].pkt_maxsize = 512;
+    uas_ctx.iface.eps[UAS_EP_DATA_OUT].ep_num      = 4; /* this may be updated by libctrl */
+    uas_ctx.iface.eps[UAS_EP_DATA_OUT].handler     = usb_uas_data_received;
+    uas_ctx.iface.eps[UAS_EP_DATA_OUT].class_desc_handler = usb_uas_ep_class_desc;
+
+    errcode = usbctrl_declare_interface(usbdci_handler, (usbctrl_interface_t*)&(uas_ctx.iface));
+    request_data_membarrier();
+
+    return errcode;
+}
+
+/*
+ * USB reset: all the accepted commands are forgotten, and dropped from the
+ * SCSI commands queue by the following scsi_reset_context().
+ */
+void usb_bbb_reconfigure(void)
+{
+    uint32_t i;
+
+    log_printf("[USB UAS] %s\n", __func__);
+    scsi_queue_mark_reset();
+    uas_ctx.tag_head = 0;
+    uas_ctx.tag_exec = 0;
+    uas_ctx.outstanding = 0;
+    uas_ctx.data_started = false;
+    uas_ctx.cmd_armed = false;
+    uas_ctx.status_head = 0;
+    uas_ctx.status_tail = 0;
+    uas_ctx.response_pending = false;
+    uas_ctx.inflight_ends_cmd = false;
+    for (i = 0; i < UAS_QUEUE_DEPTH; i++) {
+        uas_ctx.tags[i] = 0;
+    }
+    usb_uas_status_unlock();
+    request_data_membarrier();
+    /* there is no Mass Storage Reset request with UAS: the host sends its
+     * commands as soon as the device is configured again */
+    usb_uas_arm_cmd();
+}
+
+#endif/*!CONFIG_USR_LIB_MASSSTORAGE_UAS*/
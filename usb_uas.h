@@ -0,0 +1,142 @@
+/*
+ *
+ * Copyright 2018 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef USB_UAS_H
+#define USB_UAS_H
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "scsi_resp.h"
+
+#if CONFIG_USR_LIB_MASSSTORAGE_UAS
+
+/*
+ * USB Attached SCSI transport (UAS, T10/2095-D), High Speed variant: no
+ * streams, the data phases are announced by READ READY and WRITE READY IUs
+ * on the status pipe.
+ *
+ * This transport implements the entry points of usb_bbb.h in place of the
+ * Bulk-Only one, so that the SCSI stack is unchanged. Up to
+ * CONFIG_USR_LIB_MASSSTORAGE_CMD_QUEUE_DEPTH tagged commands are queued,
+ * then executed in order by usbmsc_exec_automaton(). When the queue is
+ * full, the command pipe is not armed and the host is flow controlled by
+ * the USB controller (NAK).
+ */
+
+/* interface protocol */
+#define USB_UAS_PROTOCOL             0x62
+
+/* Information Unit identifiers */
+#define USB_UAS_IU_COMMAND           0x01
+#define USB_UAS_IU_SENSE             0x03
+#define USB_UAS_IU_RESPONSE          0x04
+#define USB_UAS_IU_TASK_MANAGEMENT   0x05
+#define USB_UAS_IU_READ_READY        0x06
+#define USB_UAS_IU_WRITE_READY       0x07
+
+/* RESPONSE IU codes */
+#define USB_UAS_RC_TMF_COMPLETE      0x00
+#define USB_UAS_RC_INVALID_IU        0x02
+#define USB_UAS_RC_TMF_NOT_SUPPORTED 0x04
+#define USB_UAS_RC_TMF_FAILED        0x05
+#define USB_UAS_RC_TMF_SUCCEEDED     0x08
+#define USB_UAS_RC_INCORRECT_LUN     0x09
+#define USB_UAS_RC_OVERLAPPED_TAG    0x0a
+
+/* Pipe Usage class specific endpoint descriptor */
+#define USB_UAS_DT_PIPE_USAGE        0x24
+
+typedef enum {
+    USB_UAS_PIPE_COMMAND  = 1,
+    USB_UAS_PIPE_STATUS   = 2,
+    USB_UAS_PIPE_DATA_IN  = 3,
+    USB_UAS_PIPE_DATA_OUT = 4,
+} usb_uas_pipe_id_t;
+
+typedef struct __packed {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bPipeID;
+    uint8_t reserved;
+} usb_uas_pipe_usage_desc_t;
+
+/* all multi-bytes fields of the IUs are big endian */
+
+/* COMMAND IU, with a 16 bytes CDB (no additional CDB bytes) */
+typedef struct __packed {
+    uint8_t  iu_id;
+    uint8_t  reserved1;
+    uint16_t tag;
+    uint8_t  task_attribute:3;
+    uint8_t  task_priority:4;
+    uint8_t  reserved4:1;
+    uint8_t  reserved5;
+    uint8_t  reserved6:2;
+    uint8_t  additional_cdb_length:6;
+    uint8_t  reserved7;
+    uint8_t  lun[8];
+    uint8_t  cdb[16];
+} usb_uas_command_iu_t;
+
+/* TASK MANAGEMENT IU */
+typedef struct __packed {
+    uint8_t  iu_id;
+    uint8_t  reserved1;
+    uint16_t tag;
+    uint8_t  function;
+    uint8_t  reserved5;
+    uint16_t managed_tag;
+    uint8_t  lun[8];
+} usb_uas_task_management_iu_t;
+
+/* SENSE IU, with fixed format sense data */
+typedef struct __packed {
+    uint8_t  iu_id;
+    uint8_t  reserved1;
+    uint16_t tag;
+    uint16_t status_qualifier;
+    uint8_t  status;
+    uint8_t  reserved7[7];
+    uint16_t length;
+    request_sense_parameter_data_t sense;
+} usb_uas_sense_iu_t;
+
+/* RESPONSE IU */
+typedef struct __packed {
+    uint8_t  iu_id;
+    uint8_t  reserved1;
+    uint16_t tag;
+    uint8_t  additional_response_info[3];
+    uint8_t  response_code;
+} usb_uas_response_iu_t;
+
+/* READ READY and WRITE READY IUs */
+typedef struct __packed {
+    uint8_t  iu_id;
+    uint8_t  reserved1;
+    uint16_t tag;
+} usb_uas_ready_iu_t;
+
+#endif
+
+#endif /* USB_UAS_H */
@@ -23,8 +23,10 @@
  */
 #ifndef USBMSC_FRAMAC_PRIVATE_H_
 #define USBMSC_FRAMAC_PRIVATE_H_
+#include "autoconf.h"
 #include "libc/types.h"
 #include "libusbotghs.h"
+#include "api/libusbmsc.h"
 
 #ifdef __FRAMAC__
 /*
@@ -51,7 +53,7 @@ typedef enum bbb_state {
     USB_BBB_STATE_STATUS,
 } usb_bbb_state_t;
 
-typedef void (*usb_bbb_cb_cmd_received_t)(uint8_t cdb[], uint8_t cdb_len);
+typedef void (*usb_bbb_cb_cmd_received_t)(uint8_t cdb[], uint8_t cdb_len, uint8_t lun);
 typedef void (*usb_usb_cb_data_received_t)(uint32_t size);
 typedef void (*usb_usb_cb_data_sent_t)(void);
 
@@ -134,8 +136,8 @@ typedef struct __attribute__((packed)) {
     uint8_t LLBAA:2;
     uint8_t DBD:2;
     uint8_t reserved2:1;
-    uint8_t PC:2;
     uint8_t page_code:6;
+    uint8_t PC:2;
     uint8_t sub_page_code;
     uint16_t reserved3;
     uint16_t allocation_length;
@@ -173,8 +175,9 @@ typedef struct __attribute__((packed)) {
 
 /* READ 6 / WRITE 6 */
 typedef struct __attribute__((packed)) {
-    uint32_t reserved:3;
-    uint32_t logical_block:21;
+    uint8_t logical_block_msb:5;   /* LBA bits 20 to 16 */
+    uint8_t reserved:3;
+    uint16_t logical_block;        /* LBA bits 15 to 0 */
     uint8_t transfer_blocks;
     uint8_t control;
 } cdb6_t;
@@ -190,14 +193,32 @@ typedef struct __attribute__((packed)) {
     uint8_t control;
 } cdb10_t;
 
+/* READ 12 / WRITE 12 */
+typedef struct __attribute__((packed)) {
+    uint8_t misc1;
+    uint32_t logical_block;
+    uint32_t transfer_blocks;
+    uint8_t misc2;
+    uint8_t control;
+} cdb12_t;
+
+/* READ 16 / WRITE 16 */
+typedef struct __attribute__((packed)) {
+    uint8_t misc1;
+    uint64_t logical_block;
+    uint32_t transfer_blocks;
+    uint8_t misc2;
+    uint8_t control;
+} cdb16_t;
+
 /* MODE SENSE 6 */
 typedef struct __attribute__((packed)) {
     uint8_t LUN:3;
     uint8_t reserved4:1;
     uint8_t DBD:1;
     uint8_t reserved3:3;
-    uint8_t PC:2;
     uint8_t page_code:6;
+    uint8_t PC:2;
     uint8_t reserved2;
     uint8_t allocation_length;
     uint8_t vendor_specific:2;
@@ -221,14 +242,29 @@ typedef struct __attribute__((packed)) {
 
 /* INQUIRY 6 */
 typedef struct __attribute__((packed)) {
-    uint8_t reserved:6;
-    uint8_t CMDDT:1;            /* obsolete */
     uint8_t EVPD:1;
+    uint8_t CMDDT:1;            /* obsolete */
+    uint8_t reserved:6;
     uint8_t page_code;
     uint16_t allocation_length;
     uint8_t control;
 } cdb6_inquiry_t;
 
+/* START STOP UNIT */
+typedef struct __attribute__((packed)) {
+    uint8_t immed:1;
+    uint8_t reserved1:7;
+    uint8_t reserved2;
+    uint8_t power_condition_modifier:4;
+    uint8_t reserved3:4;
+    uint8_t start:1;
+    uint8_t loej:1;
+    uint8_t no_flush:1;
+    uint8_t reserved4:1;
+    uint8_t power_condition:4;
+    uint8_t control;
+} cdb6_start_stop_unit_t;
+
 /* MODE SELECT 10 */
 typedef struct __attribute__((packed)) {
     uint8_t reserved3:3;
@@ -241,6 +277,59 @@ typedef struct __attribute__((packed)) {
     uint8_t control;
 } cdb10_mode_select_t;
 
+/* WRITE SAME 10 */
+typedef struct __attribute__((packed)) {
+    uint8_t reserved1:1;
+    uint8_t lbdata:1;           /* obsolete */
+    uint8_t pbdata:1;           /* obsolete */
+    uint8_t unmap:1;
+    uint8_t anchor:1;
+    uint8_t wrprotect:3;
+    uint32_t logical_block;
+    uint8_t group_number:5;
+    uint8_t reserved2:3;
+    uint16_t num_blocks;
+    uint8_t control;
+} cdb10_write_same_t;
+
+/* VERIFY 10 */
+typedef struct __attribute__((packed)) {
+    uint8_t reserved1:1;        /* obsolete */
+    uint8_t bytchk:2;
+    uint8_t reserved2:1;
+    uint8_t dpo:1;
+    uint8_t vrprotect:3;
+    uint32_t logical_block;
+    uint8_t group_number:5;
+    uint8_t reserved3:3;
+    uint16_t verification_length;
+    uint8_t control;
+} cdb10_verify_t;
+
+/* UNMAP */
+typedef struct __attribute__((packed)) {
+    uint8_t anchor:1;
+    uint8_t reserved1:7;
+    uint32_t reserved2;
+    uint8_t group_number:5;
+    uint8_t reserved3:3;
+    uint16_t parameter_list_length;
+    uint8_t control;
+} cdb10_unmap_t;
+
+/* UNMAP parameter list: a header followed by block descriptors */
+typedef struct __attribute__((packed)) {
+    uint16_t unmap_data_length;
+    uint16_t block_descriptor_data_length;
+    uint32_t reserved;
+} unmap_parameter_list_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t logical_block_address;
+    uint32_t num_blocks;
+    uint32_t reserved;
+} unmap_block_descriptor_t;
+
 /* REPORT LUNS */
 typedef struct __attribute__((packed)) {
     uint8_t reserved3;
@@ -264,6 +353,35 @@ typedef struct __attribute__((packed)) {
     uint8_t control;
 } cdb16_read_capacity_16_t;
 
+/* WRITE SAME 16 */
+typedef struct __attribute__((packed)) {
+    uint8_t ndob:1;
+    uint8_t lbdata:1;           /* obsolete */
+    uint8_t pbdata:1;           /* obsolete */
+    uint8_t unmap:1;
+    uint8_t anchor:1;
+    uint8_t wrprotect:3;
+    uint64_t logical_block;
+    uint32_t num_blocks;
+    uint8_t group_number:5;
+    uint8_t reserved:3;
+    uint8_t control;
+} cdb16_write_same_t;
+
+/* VERIFY 16 */
+typedef struct __attribute__((packed)) {
+    uint8_t reserved1:1;
+    uint8_t bytchk:2;
+    uint8_t reserved2:1;
+    uint8_t dpo:1;
+    uint8_t vrprotect:3;
+    uint64_t logical_block;
+    uint32_t verification_length;
+    uint8_t group_number:5;
+    uint8_t reserved3:3;
+    uint8_t control;
+} cdb16_verify_t;
+
 /*
  * polymorphic SCSI command content, using a C union
  * type.
@@ -278,17 +396,25 @@ typedef union {
     cdb6_mode_sense_t cdb6_mode_sense;
     cdb6_mode_select_t cdb6_mode_select;
     cdb6_inquiry_t cdb6_inquiry;
+    cdb6_start_stop_unit_t cdb6_start_stop_unit;
     /* CDB 10 bytes length */
     cdb10_t cdb10;              /* read and write */
     cdb10_mode_sense_t cdb10_mode_sense;
     cdb10_mode_select_t cdb10_mode_select;
+    cdb10_unmap_t cdb10_unmap;
+    cdb10_write_same_t cdb10_write_same;
+    cdb10_verify_t cdb10_verify;
     cdb10_prevent_allow_removal_t cdb10_prevent_allow_removal;
     cdb10_request_sense_t cdb10_request_sense;
     /* CDB 12 bytes length */
+    cdb12_t cdb12;              /* read and write */
     cdb12_report_luns_t cdb12_report_luns;
     cdb12_read_format_capacities_t cdb12_read_format_capacities;
     /* CDB 16 bytes length */
+    cdb16_t cdb16;              /* read and write */
     cdb16_read_capacity_16_t cdb16_read_capacity;
+    cdb16_write_same_t cdb16_write_same;
+    cdb16_verify_t cdb16_verify;
 } u_cdb_payload;
 
 /*
@@ -318,24 +444,81 @@ typedef enum {
 
 
 
+/* depth of the received commands queue */
+#define SCSI_CMD_QUEUE_DEPTH CONFIG_USR_LIB_MASSSTORAGE_CMD_QUEUE_DEPTH
+
+/*
+ * Received commands queue indexes. head is only written by the producer
+ * (scsi_parse_cdb(), ISR context) and tail by the consumer (main thread).
+ * Both run in [0, 2 * SCSI_CMD_QUEUE_DEPTH[ so that a full queue can be
+ * told from an empty one without overflowing.
+ * reset_mark is the head value when the last Bulk-Only Mass Storage Reset
+ * has been received. reset_seq is incremented by the producer at each
+ * reset and reset_ack is its last value handled by the consumer.
+ */
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t reset_mark;
+    uint8_t  reset_seq;
+    uint8_t  reset_ack;
+} scsi_cmd_queue_t;
+
+/* number of exposed Logical Units */
+#define SCSI_MAX_LUNS CONFIG_USR_LIB_MASSSTORAGE_SCSI_MAX_LUNS
+
+/*
+ * Per-LUN state. The geometry, sense data and unit attention of the LUN
+ * being addressed are loaded in the SCSI context by scsi_select_lun(), and
+ * saved back here when another LUN is addressed. media_changed is set by
+ * usbmsc_media_changed() from any context and is never loaded.
+ * deferred_error is the sense of a write acknowledged to the host which
+ * failed later, reported with the next command of the LUN. It is never
+ * loaded either.
+ * The read-ahead, sector and write caches hold the blocks of a single LUN,
+ * media_lun in the SCSI context, which is only changed by the commands
+ * accessing the media (see scsi_select_media_lun()).
+ */
+typedef struct {
+    uint32_t error;
+    uint32_t deferred_error;
+    uint32_t block_size;
+    usbmsc_lba_t storage_size;
+    bool     capacity_cached;
+    bool     media_changed;
+    bool     unit_attention;
+} scsi_lun_context_t;
+
 typedef struct {
     uint8_t  direction;
     uint8_t  line_state;
     uint32_t size_to_process;
+    uint32_t transfer_size;
     uint32_t addr;
     uint32_t error;
-    bool     queue_empty;
+    scsi_cmd_queue_t queue;
     uint8_t *global_buf;
-    uint16_t global_buf_len;
+    uint32_t global_buf_len;
     uint32_t block_size;
-    uint32_t storage_size;
+    usbmsc_lba_t storage_size;
+    bool     capacity_cached;
+    bool     unit_attention;
     uint8_t  state;
+    uint8_t  lun;
+    uint8_t  media_lun;
+    scsi_lun_context_t luns[SCSI_MAX_LUNS];
 } scsi_context_t;
 
 
 scsi_context_t scsi_ctx;
 
-cdb_t queued_cdb = { 0 };
+cdb_t cdb_queue[SCSI_CMD_QUEUE_DEPTH] = { 0 };
+
+uint8_t lun_queue[SCSI_CMD_QUEUE_DEPTH] = { 0 };
+
+#if CONFIG_USR_LIB_MASSSTORAGE_LATENCY
+uint32_t recv_stamp_queue[SCSI_CMD_QUEUE_DEPTH] = { 0 };
+#endif
 
 /* INFO: this variable is usually an application-scope variable, instead of libMSC local one. Although, for the FramaC sake of globals check, it has been set here, to be seen correclty from
  * both scsi and bbb scopes, as framaC doesn't handle link-level resolution of variable address */
@@ -345,7 +528,7 @@ void scsi_data_sent(void);
 
 void scsi_data_available(uint32_t size);
 
-void scsi_parse_cdb(uint8_t cdb[], uint8_t cdb_len);
+void scsi_parse_cdb(uint8_t cdb[], uint8_t cdb_len, uint8_t lun);
 
 /* FramaC specific */
 scsi_context_t *scsi_get_context(void);